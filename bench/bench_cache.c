@@ -0,0 +1,71 @@
+/*
+ * Microbenchmark: bcal_eval() of repeated expressions with the result cache
+ *
+ * Rows cycle through a few distinct expressions, as generated input
+ * does. Each is timed without a cache, with one that holds them all and
+ * with one too small for them, where every lookup misses.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include "bcal.h"
+
+#define ROUNDS 200000
+
+static const char *const exprs[] = {
+	"4 kib * 12",
+	"(2 gib * 2) / 2 kib",
+	"1,500 mb + 0x18 kb",
+	"12.5 gib - 512 mib",
+	"0x400 kb / 4",
+	"3 tib >> 10",
+};
+
+#define NELEMS (sizeof(exprs) / sizeof(exprs[0]))
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(bcal_ctx *ctx, unsigned entries, bcal_uint *sum)
+{
+	bcal_result res;
+	double start;
+
+	if (bcal_set_cache(ctx, entries) != BCAL_OK)
+		return -1;
+
+	start = now();
+	for (int r = 0; r < ROUNDS; ++r)
+		for (size_t i = 0; i < NELEMS; ++i) {
+			if (bcal_eval(ctx, exprs[i], &res) != BCAL_OK)
+				return -1;
+			*sum += res.value;
+		}
+
+	return (now() - start) * 1e9 / ((double)ROUNDS * NELEMS);
+}
+
+int main(void)
+{
+	bcal_ctx *ctx = bcal_ctx_new();
+	bcal_uint sum[3] = {0};
+	size_t hits, misses;
+
+	if (!ctx)
+		return 1;
+
+	printf("%-16s %10s\n", "cache", "ns");
+	printf("%-16s %10.1f\n", "off", run(ctx, 0, &sum[0]));
+	printf("%-16s %10.1f\n", "all hit", run(ctx, NELEMS, &sum[1]));
+	bcal_cache_stats(ctx, &hits, &misses);
+	printf("%-16s %10.1f\n", "all miss", run(ctx, NELEMS - 1, &sum[2]));
+	printf("hits %zu, misses %zu with all hit\n", hits, misses);
+
+	bcal_ctx_free(ctx);
+	return !(sum[0] == sum[1] && sum[1] == sum[2]);
+}
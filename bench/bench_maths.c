@@ -0,0 +1,109 @@
+/*
+ * Microbenchmark: maths mode evaluation of short expressions
+ *
+ * Decimal expressions are evaluated exactly, those with functions in
+ * long double. Both kinds are timed through bcal_eval_maths(), lexing
+ * and formatting included. Expressions with r are then timed parsed on
+ * each round against compiled once with bcal_compile_maths(), r is reset
+ * first in both.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include "bcal.h"
+
+#define ROUNDS 100000
+
+static const char *exact[] = {
+	"0.1 + 0.2",
+	"1,500 * 1.2 - 300",
+	"(2.5 + 3.75) * 4 / 5",
+	"22 / 7",
+	"1234.5678 * 0.3",
+	"sum(1 2 3 4.5)",
+};
+
+static const char *floating[] = {
+	"exp(1) * 2",
+	"ln(10) + 1",
+	"pow(1.5, 3) / 2",
+	"root(2, 2) - 1",
+};
+
+static const char *reused[] = {
+	"r * 1.5 + 2 * 3 / 4",
+	"sum(r 1 2 3) / 4",
+	"ln(10) * r + 1",
+	"(r - 0.5) * (2.5 + 3.75)",
+};
+
+#define NELEMS(a) (sizeof(a) / sizeof((a)[0]))
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(bcal_ctx *ctx, const char **exprs, size_t n, size_t *sink)
+{
+	char buf[BCAL_UINT_BUF_LEN];
+	double start = now();
+
+	for (int r = 0; r < ROUNDS; ++r)
+		for (size_t i = 0; i < n; ++i) {
+			if (bcal_eval_maths(ctx, exprs[i], buf, sizeof(buf)))
+				return -1;
+			*sink += (size_t)buf[0];
+		}
+
+	return (now() - start) * 1e9 / ((double)ROUNDS * n);
+}
+
+static double run_reused(bcal_ctx *ctx, bool compiled, size_t *sink)
+{
+	bcal_maths *progs[NELEMS(reused)];
+	char buf[BCAL_UINT_BUF_LEN];
+	double start;
+	size_t i;
+
+	for (i = 0; i < NELEMS(reused); ++i)
+		if (bcal_compile_maths(ctx, reused[i], &progs[i]))
+			return -1;
+
+	start = now();
+	for (int r = 0; r < ROUNDS; ++r)
+		for (i = 0; i < NELEMS(reused); ++i) {
+			bcal_set_last(ctx, 3, 0);
+			if (compiled ? bcal_run_maths(ctx, progs[i], buf, sizeof(buf)) :
+				       bcal_eval_maths(ctx, reused[i], buf, sizeof(buf)))
+				return -1;
+			*sink += (size_t)buf[0];
+		}
+	start = (now() - start) * 1e9 / ((double)ROUNDS * NELEMS(reused));
+
+	for (i = 0; i < NELEMS(reused); ++i)
+		bcal_maths_free(progs[i]);
+	return start;
+}
+
+int main(void)
+{
+	bcal_ctx *ctx = bcal_ctx_new();
+	size_t sink = 0;
+
+	if (!ctx)
+		return 1;
+
+	printf("%-16s %10s\n", "expressions", "ns");
+	printf("%-16s %10.1f\n", "decimal", run(ctx, exact, NELEMS(exact), &sink));
+	printf("%-16s %10.1f\n", "functions", run(ctx, floating, NELEMS(floating), &sink));
+	printf("%-16s %10.1f\n", "r, parsed", run_reused(ctx, false, &sink));
+	printf("%-16s %10.1f\n", "r, compiled", run_reused(ctx, true, &sink));
+
+	bcal_ctx_free(ctx);
+	return sink == 0;
+}
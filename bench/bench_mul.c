@@ -0,0 +1,129 @@
+/*
+ * Microbenchmark: exact decimal products in maths mode on long operands
+ *
+ * "A * B" with A and B of 1k to 100k digits is timed through
+ * bcal_eval_maths(), parsing and formatting included, against the
+ * schoolbook product on one digit per int it replaced. The two are
+ * checked to agree first, the old one is skipped where it takes too long.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bcal.h"
+
+#define OLD_MAX 20000 /* digits */
+
+static const size_t sizes[] = {1000, 2000, 5000, 10000, 20000, 50000, 100000};
+
+#define NSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The former mul_digits(), digits most significant first */
+static char *old_mul(const char *a, size_t la, const char *b, size_t lb)
+{
+	size_t n = la + lb, start = 0;
+	int *acc = calloc(n, sizeof(int));
+	char *digits = malloc(n + 1);
+
+	if (!acc || !digits)
+		exit(1);
+
+	for (size_t i = 0; i < la; ++i) {
+		int da = a[la - 1 - i] - '0';
+
+		for (size_t j = 0; j < lb; ++j)
+			acc[n - 1 - (i + j)] += da * (b[lb - 1 - j] - '0');
+	}
+
+	for (size_t k = n - 1; k > 0; --k) {
+		if (acc[k] >= 10) {
+			acc[k - 1] += acc[k] / 10;
+			acc[k] %= 10;
+		}
+	}
+
+	while (start + 1 < n && acc[start] == 0)
+		++start;
+
+	for (size_t i = start; i < n; ++i)
+		digits[i - start] = (char)('0' + acc[i]);
+	digits[n - start] = '\0';
+
+	free(acc);
+	return digits;
+}
+
+static void random_digits(char *p, size_t n, unsigned long long *seed)
+{
+	for (size_t i = 0; i < n; ++i) {
+		*seed ^= *seed << 13;
+		*seed ^= *seed >> 7;
+		*seed ^= *seed << 17;
+		p[i] = (char)('0' + *seed % 10);
+	}
+
+	p[0] = (char)('1' + *seed % 9);
+}
+
+int main(void)
+{
+	bcal_ctx *ctx = bcal_ctx_new();
+	unsigned long long seed = 88172645463325252ULL;
+	char buf[2];
+
+	if (!ctx)
+		return 1;
+
+	printf("%-10s %12s %12s %8s\n", "digits", "limbs ms", "digits ms", "speedup");
+	for (size_t s = 0; s < NSIZES; ++s) {
+		size_t n = sizes[s];
+		char *expr = malloc(2 * n + 4), *a = expr, *b = expr + n + 3;
+		char *old = NULL;
+		double start, t_new, t_old = 0;
+		int rounds = n <= 10000 ? 20 : 3;
+
+		if (!expr)
+			return 1;
+
+		random_digits(a, n, &seed);
+		memcpy(a + n, " * ", 3);
+		random_digits(b, n, &seed);
+		b[n] = '\0';
+
+		start = now();
+		for (int r = 0; r < rounds; ++r)
+			if (bcal_eval_maths(ctx, expr, buf, sizeof(buf)))
+				return 1;
+		t_new = (now() - start) * 1e3 / rounds;
+
+		if (n <= OLD_MAX) {
+			start = now();
+			old = old_mul(a, n, b, n);
+			t_old = (now() - start) * 1e3;
+
+			if (strcmp(old, bcal_last(ctx, NULL))) {
+				fprintf(stderr, "mismatch at %zu digits\n", n);
+				return 1;
+			}
+			free(old);
+
+			printf("%-10zu %12.3f %12.3f %7.1fx\n", n, t_new, t_old, t_old / t_new);
+		} else {
+			printf("%-10zu %12.3f %12s %8s\n", n, t_new, "-", "-");
+		}
+
+		free(expr);
+	}
+
+	bcal_ctx_free(ctx);
+	return 0;
+}
@@ -0,0 +1,170 @@
+/*
+ * Microbenchmark: bcal_parse_uint() against char at a time parsing
+ *
+ * Random binary, decimal and hex numbers that fit in bcal_uint are
+ * parsed by both and checked to agree before timing. Values just past
+ * the maximum must be rejected.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "bcal.h"
+
+#define NVALS 4096
+#define ROUNDS 200
+#define MAXLEN 132
+
+static char strs[NVALS][MAXLEN];
+
+/* The parser bcal used before, one digit at a time */
+static bool ischarvalid(char ch, unsigned int base, unsigned int *val)
+{
+	if (base == 2) {
+		if (ch == '0' || ch == '1') {
+			*val = ch - '0';
+			return true;
+		}
+	} else if (base == 16) {
+		if (ch >= '0' && ch <= '9') {
+			*val = ch - '0';
+			return true;
+		}
+		if (ch >= 'a' && ch <= 'f') {
+			*val = (ch - 'a') + 10;
+			return true;
+		}
+		if (ch >= 'A' && ch <= 'F') {
+			*val = (ch - 'A') + 10;
+			return true;
+		}
+	} else if (ch >= '0' && ch <= '9') {
+		*val = ch - '0';
+		return true;
+	}
+
+	return false;
+}
+
+static int parse_ref(const char *token, bcal_uint *out)
+{
+	bcal_uint val = 0, prevval = 0;
+	unsigned int base = 10, shift = 0, digit, used = 0;
+	const char *ptr = token;
+
+	if (token[0] == '0' && (token[1] == 'b' || token[1] == 'B'))
+		base = 2, shift = 1, ptr += 2;
+	else if (token[0] == '0' && (token[1] == 'x' || token[1] == 'X'))
+		base = 16, shift = 4, ptr += 2;
+
+	while (*ptr == '0')
+		++ptr;
+
+	for (; *ptr; ++ptr) {
+		if (!ischarvalid(*ptr, base, &digit))
+			return -1;
+		if (base == 10) {
+			val = val * 10 + digit;
+			if (val < prevval)
+				return -1;
+			prevval = val;
+		} else {
+			if (used++ == sizeof(bcal_uint) * 8)
+				return -1;
+			val = (val << shift) + digit;
+		}
+	}
+
+	*out = val;
+	return 0;
+}
+
+static uint64_t xorshift(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Print v in base with its prefix */
+static void format(bcal_uint v, unsigned int base, char *buf)
+{
+	char tmp[MAXLEN], *p = tmp + MAXLEN - 1;
+
+	*p = '\0';
+	do {
+		*--p = "0123456789abcdef"[v % base];
+		v /= base;
+	} while (v);
+
+	sprintf(buf, "%s%s", base == 2 ? "0b" : (base == 16 ? "0x" : ""), p);
+}
+
+static double run(int (*fn)(const char *, bcal_uint *), bcal_uint *sink)
+{
+	bcal_uint v = 0;
+	double start = now();
+
+	for (int r = 0; r < ROUNDS; ++r)
+		for (int i = 0; i < NVALS; ++i) {
+			fn(strs[i], &v);
+			*sink += v;
+		}
+
+	return (now() - start) * 1e9 / ((double)ROUNDS * NVALS);
+}
+
+int main(void)
+{
+	static const unsigned int bases[] = {2, 10, 16};
+	static const char *const over[] = {
+		"340282366920938463463374607431768211456",
+		"999999999999999999999999999999999999999",
+		"0x100000000000000000000000000000000",
+		"0x1ffffffffffffffffffffffffffffffff",
+	};
+	int bits = sizeof(bcal_uint) * 8;
+	uint64_t seed = 88172645463325252ULL;
+	bcal_uint a = 0, b = 0, sink = 0;
+
+	if (bits == 128)
+		for (size_t i = 0; i < sizeof(over) / sizeof(over[0]); ++i)
+			if (bcal_parse_uint(over[i], &a) == BCAL_OK) {
+				fprintf(stderr, "overflow not detected: %s\n", over[i]);
+				return 1;
+			}
+
+	printf("%-6s %12s %12s %8s\n", "base", "ref ns", "bcal ns", "speedup");
+	for (size_t k = 0; k < sizeof(bases) / sizeof(bases[0]); ++k) {
+		for (int i = 0; i < NVALS; ++i) {
+			int w = 1 + i % bits;
+			bcal_uint v = ((bcal_uint)xorshift(&seed) << 63 << 1) | xorshift(&seed);
+
+			v = (w == bits) ? v : v & (((bcal_uint)1 << w) - 1);
+			format(v, bases[k], strs[i]);
+
+			if (bcal_parse_uint(strs[i], &a) != BCAL_OK || parse_ref(strs[i], &b) || a != b || a != v) {
+				fprintf(stderr, "mismatch: %s\n", strs[i]);
+				return 1;
+			}
+		}
+
+		double ref = run(parse_ref, &sink);
+		double fast = run(bcal_parse_uint, &sink);
+
+		printf("%-6u %12.1f %12.1f %7.1fx\n", bases[k], ref, fast, ref / fast);
+	}
+
+	return sink == 0;
+}
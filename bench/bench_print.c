@@ -0,0 +1,138 @@
+/*
+ * Microbenchmark: buffered emitters against printf(3) for the unit
+ * conversion table printed for a size
+ *
+ * ob_sci() is first checked to match "%#*.10Le" on random and edge
+ * case values, then both ways of printing a table are timed.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "outbuf.h"
+
+#define NVALS 4096
+#define ROUNDS 50
+#define CHECKS 2000000
+
+static const char *units[] = {"KiB", "MiB", "GiB", "TiB", "kB", "MB", "GB", "TB"};
+static const long double factor[] = {1024.0L, 1048576.0L, 1073741824.0L, 1099511627776.0L,
+				     1e3L, 1e6L, 1e9L, 1e12L};
+static bcal_uint vals[NVALS];
+
+static uint64_t xorshift(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int check(long double val)
+{
+	static outbuf_t ob;
+	char ref[OUTBUF_FIELD];
+	int n = snprintf(ref, sizeof(ref), "%#*.10Le", 40, val);
+
+	ob.len = 0;
+	ob_sci(&ob, val, 40);
+	if (ob.len != (size_t)n || memcmp(ob.buf, ref, ob.len)) {
+		fprintf(stderr, "mismatch: %.*s != %s\n", (int)ob.len, ob.buf, ref);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* The table as bcal printed it before */
+static void table_ref(FILE *fp, bcal_uint bytes)
+{
+	char buf[BCAL_UINT_BUF_LEN];
+
+	fprintf(fp, "%40s B\n", bcal_utoa(bytes, buf));
+	for (int i = 0; i < 8; ++i) {
+		long double val = (long double)bytes / factor[i];
+
+		if (val - (bcal_uint)val == 0)
+			fprintf(fp, "%40s %s\n", bcal_utoa((bcal_uint)val, buf), units[i]);
+		else
+			fprintf(fp, "%#*.10Le %s\n", 40, val, units[i]);
+	}
+}
+
+static void table_ob(outbuf_t *ob, bcal_uint bytes)
+{
+	ob_uint(ob, bytes, 40);
+	ob_puts(ob, " B\n");
+	for (int i = 0; i < 8; ++i) {
+		long double val = (long double)bytes / factor[i];
+
+		if (val - (bcal_uint)val == 0)
+			ob_uint(ob, (bcal_uint)val, 40);
+		else
+			ob_sci(ob, val, 40);
+		ob_putc(ob, ' ');
+		ob_puts(ob, units[i]);
+		ob_putc(ob, '\n');
+	}
+	ob_flush(ob);
+}
+
+int main(void)
+{
+	uint64_t seed = 88172645463325252ULL;
+	static outbuf_t ob;
+	FILE *fp = fopen("/dev/null", "w");
+	double start, ref, fast;
+
+	if (!fp)
+		return 1;
+
+	/* Random values over the whole fast path range */
+	for (int i = 0; i < CHECKS; ++i) {
+		long double m = (long double)xorshift(&seed) / 18446744073709551616.0L;
+
+		if (check(m * ob_pow10[xorshift(&seed) % 29] / 1e10L))
+			return 1;
+	}
+
+	/* Sizes divided by unit factors, and ties near rounding */
+	for (int i = 0; i < CHECKS; ++i) {
+		bcal_uint bytes = xorshift(&seed) >> (xorshift(&seed) % 64);
+
+		if (check((long double)bytes / factor[i & 7]) ||
+		    check((long double)(xorshift(&seed) % 100000000000ULL * 10 + 5) / 1e11L))
+			return 1;
+	}
+
+	for (int i = 0; i < NVALS; ++i)
+		vals[i] = xorshift(&seed) >> (i % 64);
+
+	ob_init(&ob, fp);
+	start = now();
+	for (int r = 0; r < ROUNDS; ++r)
+		for (int i = 0; i < NVALS; ++i)
+			table_ref(fp, vals[i]);
+	ref = (now() - start) * 1e9 / ((double)ROUNDS * NVALS);
+
+	start = now();
+	for (int r = 0; r < ROUNDS; ++r)
+		for (int i = 0; i < NVALS; ++i)
+			table_ob(&ob, vals[i]);
+	fast = (now() - start) * 1e9 / ((double)ROUNDS * NVALS);
+
+	printf("%-12s %12s %12s %8s\n", "table", "printf ns", "buffer ns", "speedup");
+	printf("%-12s %12.1f %12.1f %7.1fx\n", "9 lines", ref, fast, ref / fast);
+
+	fclose(fp);
+	return 0;
+}
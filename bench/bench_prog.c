@@ -0,0 +1,66 @@
+/*
+ * Microbenchmark: bcal_run() of a compiled program against bcal_eval()
+ *
+ * Both iterate an expression on its own result through r.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include "bcal.h"
+
+#define ROUNDS 1000000
+
+static const char *const exprs[] = {
+	"r + 4kib",
+	"(r * 3 + 2 kib) / 2",
+	"r & 0xffff0 | 0x10 b",
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+	bcal_ctx *ctx = bcal_ctx_new();
+	bcal_result a, b;
+	bcal_prog *prog;
+
+	if (!ctx)
+		return 1;
+
+	printf("%-24s %10s %10s %8s\n", "expression", "eval ns", "run ns", "speedup");
+	for (size_t k = 0; k < sizeof(exprs) / sizeof(exprs[0]); ++k) {
+		if (bcal_compile(ctx, exprs[k], &prog) != BCAL_OK) {
+			fprintf(stderr, "%s: %s\n", exprs[k], bcal_errmsg(ctx));
+			return 1;
+		}
+
+		double start = now();
+		bcal_set_last(ctx, 1, 1);
+		for (int i = 0; i < ROUNDS; ++i)
+			bcal_eval(ctx, exprs[k], &a);
+		double eval = (now() - start) * 1e9 / ROUNDS;
+
+		start = now();
+		bcal_set_last(ctx, 1, 1);
+		for (int i = 0; i < ROUNDS; ++i)
+			bcal_run(ctx, prog, &b);
+		double run = (now() - start) * 1e9 / ROUNDS;
+
+		if (a.value != b.value || a.unit != b.unit) {
+			fprintf(stderr, "%s: results differ\n", exprs[k]);
+			return 1;
+		}
+
+		printf("%-24s %10.1f %10.1f %7.1fx\n", exprs[k], eval, run, eval / run);
+		bcal_prog_free(prog);
+	}
+
+	bcal_ctx_free(ctx);
+	return 0;
+}
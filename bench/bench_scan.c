@@ -0,0 +1,112 @@
+/*
+ * Microbenchmark: bcal_scan_size() over generated df/du-like reports
+ *
+ * The text is scanned whole, then in chunks as from a pipe, carrying
+ * the unfinished token, and both must find the same sizes. Sparse text
+ * is mostly words, dense text has a number in every few bytes.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bcal.h"
+
+#define TEXT_SIZE (64 << 20)
+#define CHUNK (1 << 16)
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t fill(char *text, int dense)
+{
+	static const char *const units[] = {"GiB", " kb", "mb", " MiB", "B"};
+	size_t len = 0;
+	unsigned seed = 1;
+
+	while (len < TEXT_SIZE - 256) {
+		seed = seed * 1103515245 + 12345;
+		if (dense)
+			len += (size_t)sprintf(text + len, "%u\t/var/lib/x%u %u.%u%s used\n", seed % 99991,
+					       seed >> 8, (seed >> 4) % 4096, seed % 10, units[seed % 5]);
+		else
+			len += (size_t)sprintf(text + len, "kernel: usb %s device %s, %u%s total memory\n",
+					       "reset high-speed", "descriptor read error",
+					       (seed >> 4) % 4096, units[seed % 5]);
+	}
+
+	return len;
+}
+
+static double scan(const char *text, size_t len, size_t chunk, size_t *count, bcal_uint *sum)
+{
+	static char buf[CHUNK + 256];
+	size_t off = 0, have = 0, pos = 0, keep;
+	double start = now();
+	bcal_size m;
+
+	*count = 0;
+	*sum = 0;
+	if (chunk >= len) {
+		while (bcal_scan_size(text, len, &pos, 1, &m) == 1) {
+			++*count;
+			*sum += m.bytes;
+		}
+		return len / (now() - start) / 1e9;
+	}
+
+	while (true) {
+		size_t n = len - off < chunk ? len - off : chunk;
+		int final = off + n == len;
+
+		memcpy(buf + have, text + off, n);
+		have += n;
+		off += n;
+
+		while (bcal_scan_size(buf, have, &pos, final, &m) == 1) {
+			++*count;
+			*sum += m.bytes;
+		}
+
+		if (final)
+			break;
+
+		keep = pos ? pos - 1 : 0;
+		memmove(buf, buf + keep, have - keep);
+		have -= keep;
+		pos -= keep;
+	}
+
+	return len / (now() - start) / 1e9;
+}
+
+int main(void)
+{
+	char *text = malloc(TEXT_SIZE);
+	size_t len, count[2];
+	bcal_uint sum[2];
+	int ret = 0;
+
+	if (!text)
+		return 1;
+
+	printf("%-16s %10s %10s\n", "text", "whole GB/s", "piped GB/s");
+	for (int dense = 0; dense < 2; ++dense) {
+		double whole, piped;
+
+		len = fill(text, dense);
+		whole = scan(text, len, len, &count[0], &sum[0]);
+		piped = scan(text, len, CHUNK, &count[1], &sum[1]);
+		printf("%-16s %10.2f %10.2f\n", dense ? "dense" : "sparse", whole, piped);
+		ret |= count[0] != count[1] || sum[0] != sum[1] || !count[0];
+	}
+
+	free(text);
+	return ret;
+}
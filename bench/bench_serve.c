@@ -0,0 +1,172 @@
+/*
+ * Microbenchmark: requests to bcal --serve against a process per request
+ *
+ * Also a minimal client of the socket protocol. With a socket path the
+ * server listening there is used, else ./bcal is started on a temporary
+ * one. Requests are sent one per round trip, then pipelined in batches,
+ * and every reply is checked.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define SPAWNS 200
+#define ROUNDS 20000
+#define BATCH 256
+#define PIPELINED (BATCH * 800)
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_to(const char *path)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Send count requests for i kib + i b from i = first and check the replies */
+static int exchange(int fd, int first, int count)
+{
+	static char buf[BATCH * 64];
+	char expect[64];
+	size_t len = 0, off = 0;
+	ssize_t n;
+	int i;
+
+	for (i = first; i < first + count; ++i)
+		len += (size_t)snprintf(buf + len, sizeof(buf) - len, "%d kib + %d b\n", i, i);
+	if (write(fd, buf, len) != (ssize_t)len)
+		return -1;
+
+	/* Replies are shorter than the requests */
+	len = 0;
+	for (i = first; i < first + count;) {
+		char *nl = memchr(buf + off, '\n', len - off);
+
+		if (!nl) {
+			memmove(buf, buf + off, len - off);
+			len -= off;
+			off = 0;
+			n = read(fd, buf + len, sizeof(buf) - len);
+			if (n <= 0)
+				return -1;
+			len += (size_t)n;
+			continue;
+		}
+
+		snprintf(expect, sizeof(expect), "%d B", i * 1025);
+		*nl = '\0';
+		if (strcmp(buf + off, expect)) {
+			fprintf(stderr, "got \"%s\", expected \"%s\"\n", buf + off, expect);
+			return -1;
+		}
+		off = (size_t)(nl + 1 - buf);
+		++i;
+	}
+
+	return 0;
+}
+
+/* A bcal process per request, what the server saves */
+static double spawn(void)
+{
+	double start = now();
+
+	for (int i = 0; i < SPAWNS; ++i) {
+		pid_t pid = fork();
+		int status;
+
+		if (pid == 0) {
+			if (!freopen("/dev/null", "w", stdout))
+				_exit(1);
+			execl("./bcal", "bcal", "-m", "12 kib + 12 b", (char *)NULL);
+			_exit(1);
+		}
+
+		if (pid == -1 || waitpid(pid, &status, 0) == -1 || status)
+			return -1;
+	}
+
+	return (now() - start) * 1e9 / SPAWNS;
+}
+
+int main(int argc, char **argv)
+{
+	char path[64];
+	pid_t server = 0;
+	double start, single, pipelined, process;
+	int fd = -1, ret = 1;
+
+	if (argc > 1)
+		snprintf(path, sizeof(path), "%s", argv[1]);
+	else {
+		snprintf(path, sizeof(path), "/tmp/bench_serve.%d", (int)getpid());
+		server = fork();
+		if (server == 0) {
+			execl("./bcal", "bcal", "--serve", path, (char *)NULL);
+			_exit(1);
+		}
+	}
+
+	for (int i = 0; i < 100 && fd == -1; ++i) {
+		fd = connect_to(path);
+		if (fd == -1)
+			usleep(10000);
+	}
+
+	if (fd == -1) {
+		fprintf(stderr, "cannot connect to %s\n", path);
+		goto out;
+	}
+
+	start = now();
+	for (int i = 0; i < ROUNDS; ++i)
+		if (exchange(fd, i, 1))
+			goto out;
+	single = (now() - start) * 1e9 / ROUNDS;
+
+	start = now();
+	for (int i = 0; i < PIPELINED; i += BATCH)
+		if (exchange(fd, i, BATCH))
+			goto out;
+	pipelined = (now() - start) * 1e9 / PIPELINED;
+
+	/* Before any output, the children would flush it again */
+	process = spawn();
+
+	printf("%-16s %12s\n", "requests", "ns");
+	printf("%-16s %12.1f\n", "process each", process);
+	printf("%-16s %12.1f\n", "round trip", single);
+	printf("%-16s %12.1f\n", "pipelined", pipelined);
+	ret = 0;
+
+out:
+	if (fd != -1)
+		close(fd);
+	if (server > 0) {
+		kill(server, SIGTERM);
+		waitpid(server, NULL, 0);
+	}
+	return ret;
+}
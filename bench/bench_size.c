@@ -0,0 +1,116 @@
+/*
+ * Microbenchmark: bcal_parse_size() of fractional sizes against the
+ * long double conversion bcal used before
+ *
+ * Random "I.F unit" sizes are checked against the exact bytes before
+ * timing. The old conversion is timed and its wrong results counted.
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bcal.h"
+
+#define NVALS 4096
+#define ROUNDS 200
+#define MAXLEN 48
+
+static char strs[NVALS][MAXLEN];
+static bcal_uint exact[NVALS];
+
+/* The conversion bcal used before, on a copy split at the unit */
+static int parse_ref(const char *str, bcal_uint *out)
+{
+	const bcal_unit_info *u;
+	char *val = strdup(str), *end;
+	size_t len = strlen(val);
+	long double num;
+
+	if (!val)
+		return -1;
+
+	while (len && isalpha((unsigned char)val[len - 1]))
+		--len;
+	u = bcal_unit(bcal_unit_lookup(val + len));
+	val[len] = '\0';
+
+	num = strtold(val, &end);
+	if (u)
+		*out = (bcal_uint)(num * u->num / u->den);
+
+	free(val);
+	return u ? 0 : -1;
+}
+
+static uint64_t xorshift(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(int (*fn)(const char *, bcal_uint *), bcal_uint *sink)
+{
+	bcal_uint v = 0;
+	double start = now();
+
+	for (int r = 0; r < ROUNDS; ++r)
+		for (int i = 0; i < NVALS; ++i) {
+			fn(strs[i], &v);
+			*sink += v;
+		}
+
+	return (now() - start) * 1e9 / ((double)ROUNDS * NVALS);
+}
+
+int main(void)
+{
+	uint64_t seed = 88172645463325252ULL;
+	bcal_uint v, sink = 0;
+	int wrong = 0;
+
+	for (int i = 0; i < NVALS; ++i) {
+		/* Up to 12 significant digits keep m * num within 128 bits */
+		int unit = BCAL_KIB + (int)(xorshift(&seed) % (BCAL_BIT - BCAL_KIB));
+		int fdigits = 1 + (int)(xorshift(&seed) % 6);
+		uint64_t ip = xorshift(&seed) % 1000000, fp = xorshift(&seed), pow = 1;
+		const bcal_unit_info *u = bcal_unit(unit);
+
+		for (int k = 0; k < fdigits; ++k)
+			pow *= 10;
+		fp %= pow;
+
+		snprintf(strs[i], MAXLEN, "%llu.%0*llu %s", (unsigned long long)ip, fdigits,
+			 (unsigned long long)fp, u->name);
+		exact[i] = ((bcal_uint)ip * pow + fp) * u->num / (u->den * pow);
+
+		if (sizeof(bcal_uint) > 8 && (bcal_parse_size(strs[i], &v) != BCAL_OK || v != exact[i])) {
+			fprintf(stderr, "mismatch: %s\n", strs[i]);
+			return 1;
+		}
+
+		parse_ref(strs[i], &v);
+		wrong += (v != exact[i]);
+	}
+
+	double ref = run(parse_ref, &sink);
+	double fast = run(bcal_parse_size, &sink);
+
+	printf("%-10s %12s %12s %8s\n", "sizes", "ref ns", "bcal ns", "speedup");
+	printf("%-10s %12.1f %12.1f %7.1fx\n", "I.F unit", ref, fast, ref / fast);
+	printf("long double results off: %d of %d\n", wrong, NVALS);
+
+	return sink == 0;
+}
@@ -0,0 +1,84 @@
+/*
+ * Microbenchmark: bcal_stats_add() and bcal_parse_size() per line of -a
+ *
+ * Sizes spread over many powers of 2 are added to one aggregate, then
+ * to four merged at the end, which must agree. Parsing the same sizes
+ * as text is timed apart, it is what bounds -a.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "bcal.h"
+
+#define NVALS (1 << 20)
+#define ROUNDS 20
+#define PARTS 4
+
+static const char *const units[] = {"b", "kib", "kb", "mib", "MB", "GiB"};
+
+static bcal_uint vals[NVALS];
+static char strs[NVALS][32];
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+	bcal_stats *whole = bcal_stats_new(), *part[PARTS];
+	double start, add, merged, parse;
+	bcal_uint bytes, sum = 0;
+	unsigned seed = 1;
+	int ret = 0;
+
+	for (int i = 0; i < NVALS; ++i) {
+		seed = seed * 1103515245 + 12345;
+		snprintf(strs[i], sizeof(strs[i]), "%u %s", (seed >> 8) % 99991, units[seed % 6]);
+		if (bcal_parse_size(strs[i], &vals[i]) != BCAL_OK)
+			return 1;
+	}
+
+	for (int p = 0; p < PARTS; ++p)
+		part[p] = bcal_stats_new();
+
+	start = now();
+	for (int r = 0; r < ROUNDS; ++r)
+		for (int i = 0; i < NVALS; ++i)
+			bcal_stats_add(whole, vals[i]);
+	add = (now() - start) * 1e9 / ((double)ROUNDS * NVALS);
+
+	start = now();
+	for (int r = 0; r < ROUNDS; ++r)
+		for (int i = 0; i < NVALS; ++i)
+			bcal_stats_add(part[i % PARTS], vals[i]);
+	for (int p = 1; p < PARTS; ++p)
+		bcal_stats_merge(part[0], part[p]);
+	merged = (now() - start) * 1e9 / ((double)ROUNDS * NVALS);
+
+	start = now();
+	for (int i = 0; i < NVALS; ++i) {
+		bcal_parse_size(strs[i], &bytes);
+		sum += bytes;
+	}
+	parse = (now() - start) * 1e9 / NVALS;
+
+	printf("%-16s %10s\n", "per size", "ns");
+	printf("%-16s %10.1f\n", "add", add);
+	printf("%-16s %10.1f\n", "add and merge", merged);
+	printf("%-16s %10.1f\n", "parse", parse);
+
+	ret |= bcal_stats_summary(whole)->sum != bcal_stats_summary(part[0])->sum;
+	ret |= bcal_stats_summary(whole)->sum != sum * ROUNDS;
+	for (double q = 0; q <= 1; q += 0.125)
+		ret |= bcal_stats_quantile(whole, q) != bcal_stats_quantile(part[0], q);
+
+	for (int p = 0; p < PARTS; ++p)
+		bcal_stats_free(part[p]);
+	bcal_stats_free(whole);
+	return ret;
+}
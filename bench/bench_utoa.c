@@ -0,0 +1,95 @@
+/*
+ * Microbenchmark: bcal_utoa() against digit at a time conversion
+ *
+ * Values are spread evenly over bit widths 1 to 128 and both
+ * conversions are checked to agree before timing.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "bcal.h"
+
+#define NVALS 4096
+#define ROUNDS 200
+#define BUCKETS 4
+
+static bcal_uint vals[BUCKETS][NVALS];
+
+/* The conversion bcal used before, one 128-bit division per digit */
+static char *utoa_ref(bcal_uint n, char *buf)
+{
+	char *loc = buf + BCAL_UINT_BUF_LEN - 1;
+
+	*loc = '\0';
+	do {
+		*--loc = "0123456789"[n % 10];
+		n /= 10;
+	} while (n);
+
+	return loc;
+}
+
+static uint64_t xorshift(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(char *(*fn)(bcal_uint, char *), bcal_uint *v, size_t *sink)
+{
+	char buf[BCAL_UINT_BUF_LEN];
+	double start = now();
+
+	for (int r = 0; r < ROUNDS; ++r)
+		for (int i = 0; i < NVALS; ++i)
+			*sink += (size_t)fn(v[i], buf)[0];
+
+	return (now() - start) * 1e9 / ((double)ROUNDS * NVALS);
+}
+
+int main(void)
+{
+	char a[BCAL_UINT_BUF_LEN], b[BCAL_UINT_BUF_LEN];
+	int bits = sizeof(bcal_uint) * 8;
+	uint64_t seed = 88172645463325252ULL;
+	size_t sink = 0;
+
+	for (int k = 0; k < BUCKETS; ++k)
+		for (int i = 0; i < NVALS; ++i) {
+			/* Bit width within this bucket */
+			int w = k * bits / BUCKETS + 1 + i % (bits / BUCKETS);
+			bcal_uint v = ((bcal_uint)xorshift(&seed) << 63 << 1) | xorshift(&seed);
+
+			v = (w == bits) ? v : v & (((bcal_uint)1 << w) - 1);
+			v |= (bcal_uint)1 << (w - 1);
+			vals[k][i] = v;
+
+			if (strcmp(bcal_utoa(v, a), utoa_ref(v, b))) {
+				fprintf(stderr, "mismatch: %s != %s\n", a, b);
+				return 1;
+			}
+		}
+
+	printf("%-12s %12s %12s %8s\n", "bits", "ref ns", "bcal ns", "speedup");
+	for (int k = 0; k < BUCKETS; ++k) {
+		double ref = run(utoa_ref, vals[k], &sink);
+		double fast = run(bcal_utoa, vals[k], &sink);
+
+		printf("%4d - %-5d %12.1f %12.1f %7.1fx\n", k * bits / BUCKETS + 1,
+		       (k + 1) * bits / BUCKETS, ref, fast, ref / fast);
+	}
+
+	return sink == 0;
+}
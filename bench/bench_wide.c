@@ -0,0 +1,127 @@
+/*
+ * Microbenchmark: wide integer evaluation of expressions that fit in
+ * 64 bits, against bcal_eval() on the native 128-bit type
+ *
+ * The results of both are checked to agree before timing, then the
+ * wide mode is timed at 256 and 1024 bits. Formatting with
+ * bcal_wide_str() is timed against bcal_utoa() the same way.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "bcal.h"
+
+#define ROUNDS 20000
+
+static const char *exprs[] = {
+	"2 kib * 3 + 0x10 b",
+	"1 tib / 4 kib << 3",
+	"0xff & 0x0f | 0x100",
+	"5 tb / 12",
+	"2kb+3mb/4*5+5*56mb",
+	"1,024 kib * 2",
+	"((2giB)*1)/(2/2)",
+	"0.5 mib - 12 kb + 3 b",
+};
+
+#define NEXPRS (sizeof(exprs) / sizeof(exprs[0]))
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run_narrow(bcal_ctx *ctx, size_t *sink)
+{
+	bcal_result res;
+	double start = now();
+
+	for (int r = 0; r < ROUNDS; ++r)
+		for (size_t i = 0; i < NEXPRS; ++i) {
+			bcal_eval(ctx, exprs[i], &res);
+			*sink += (size_t)res.value;
+		}
+
+	return (now() - start) * 1e9 / ((double)ROUNDS * NEXPRS);
+}
+
+static double run_wide(bcal_ctx *ctx, size_t *sink)
+{
+	bcal_wide res;
+	double start = now();
+	int unit;
+
+	for (int r = 0; r < ROUNDS; ++r)
+		for (size_t i = 0; i < NEXPRS; ++i) {
+			bcal_eval_wide(ctx, exprs[i], &res, &unit);
+			*sink += (size_t)res.limb[0];
+		}
+
+	return (now() - start) * 1e9 / ((double)ROUNDS * NEXPRS);
+}
+
+static double run_str(bool wide, size_t *sink)
+{
+	char buf[BCAL_WIDE_BUF_LEN];
+	bcal_wide w = {1, {0}};
+	double start = now();
+	uint64_t v = 88172645463325252ULL;
+
+	for (int r = 0; r < ROUNDS * 10; ++r) {
+		v ^= v << 13;
+		v ^= v >> 7;
+		v ^= v << 17;
+		w.limb[0] = v;
+		*sink += (size_t)(wide ? bcal_wide_str(&w, 10, buf) : bcal_utoa(v, buf))[0];
+	}
+
+	return (now() - start) * 1e9 / (ROUNDS * 10.0);
+}
+
+int main(void)
+{
+	bcal_ctx *ctx = bcal_ctx_new();
+	char a[BCAL_UINT_BUF_LEN], b[BCAL_WIDE_BUF_LEN];
+	bcal_result res;
+	bcal_wide w;
+	size_t sink = 0;
+	int unit;
+
+	if (!ctx)
+		return 1;
+
+	for (size_t i = 0; i < NEXPRS; ++i) {
+		if (bcal_eval(ctx, exprs[i], &res) || bcal_eval_wide(ctx, exprs[i], &w, &unit) ||
+		    strcmp(bcal_utoa(res.value, a), bcal_wide_str(&w, 10, b)) || unit != res.unit) {
+			fprintf(stderr, "mismatch: %s\n", exprs[i]);
+			return 1;
+		}
+	}
+
+	double narrow = run_narrow(ctx, &sink);
+
+	printf("%-16s %10s %8s\n", "eval", "ns", "ratio");
+	printf("%-16s %10.1f %8s\n", "128-bit", narrow, "1.0x");
+	for (unsigned bits = 256; bits <= BCAL_WIDE_BITS_MAX; bits *= 4) {
+		double t;
+
+		bcal_set_width(ctx, bits);
+		t = run_wide(ctx, &sink);
+		printf("%4u-bit wide    %10.1f %7.2fx\n", bits, t, t / narrow);
+	}
+
+	double utoa = run_str(false, &sink), wstr = run_str(true, &sink);
+
+	printf("\n%-16s %10s %8s\n", "64-bit values", "ns", "ratio");
+	printf("%-16s %10.1f %8s\n", "bcal_utoa", utoa, "1.0x");
+	printf("%-16s %10.1f %7.2fx\n", "bcal_wide_str", wstr, wstr / utoa);
+
+	bcal_ctx_free(ctx);
+	return sink == 0;
+}
@@ -0,0 +1,265 @@
+/*
+ * libbcal: the bcal unit parser and expression evaluator as a library
+ *
+ * Author: Arun Prakash Jana <engineerarun@gmail.com>
+ * Copyright (C) 2016 by Arun Prakash Jana <engineerarun@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bcal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The library keeps no global state and never prints. All state lives
+ * in a bcal_ctx, so different threads can evaluate concurrently as long
+ * as each uses its own context. Errors are kept in the context and can
+ * be read with bcal_errmsg(), other messages go to an optional callback.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef __SIZEOF_INT128__
+typedef __uint128_t bcal_uint;
+#else
+typedef unsigned long long bcal_uint;
+#endif
+
+#define BCAL_UINT_BUF_LEN 40 /* log10(1 << 128) + '\0' */
+
+/* Wide integers, see bcal_set_width() */
+#define BCAL_WIDE_BITS 256 /* default width */
+#define BCAL_WIDE_BITS_MAX 1024
+#define BCAL_WIDE_LIMBS (BCAL_WIDE_BITS_MAX / 64)
+#define BCAL_WIDE_BUF_LEN (BCAL_WIDE_BITS_MAX + 1) /* binary digits + '\0' */
+
+/* Digits after the point of exact maths results, see bcal_set_scale() */
+#define BCAL_SCALE 10 /* default */
+#define BCAL_SCALE_MAX 1000
+
+/* Results kept by the cache of bcal_eval(), see bcal_set_cache() */
+#define BCAL_CACHE_MAX (1 << 20)
+
+/* Return codes */
+#define BCAL_OK 0
+#define BCAL_EINVAL -1 /* invalid expression */
+#define BCAL_EUNIT -2 /* unknown unit */
+#define BCAL_EMALFORMED -3 /* malformed operand */
+#define BCAL_ENOMEM -4 /* out of memory */
+#define BCAL_EOVERFLOW -5 /* result doesn't fit in the width */
+
+/* Message levels passed to the log callback */
+#define BCAL_LOG_ERROR 0
+#define BCAL_LOG_WARNING 1
+#define BCAL_LOG_INFO 2
+#define BCAL_LOG_DEBUG 3
+
+/* Flags */
+#define BCAL_FLAG_HEX 0x1 /* integral maths results in hex */
+
+/* Storage units, in the order they are printed */
+enum bcal_unit {
+	BCAL_B,
+	BCAL_KIB,
+	BCAL_MIB,
+	BCAL_GIB,
+	BCAL_TIB,
+	BCAL_PIB,
+	BCAL_EIB,
+	BCAL_KB,
+	BCAL_MB,
+	BCAL_GB,
+	BCAL_TB,
+	BCAL_PB,
+	BCAL_EB,
+	BCAL_BIT,
+	BCAL_UNITS /* number of units */
+};
+
+typedef struct bcal_ctx bcal_ctx;
+typedef struct bcal_prog bcal_prog;
+typedef struct bcal_maths bcal_maths;
+typedef struct bcal_stats bcal_stats;
+
+typedef struct {
+	bcal_uint value;    /* in bytes if unit is set */
+	int unit;           /* result is a storage size */
+	int single;         /* expression is a single operand (set on failure too) */
+	int in_unit;        /* unit of a single operand */
+	long double in_val; /* value of a single operand in in_unit */
+	int inexact;        /* value was rounded down from a fraction of a byte */
+} bcal_result;
+
+typedef struct {
+	bcal_uint bytes; /* rounded down */
+	size_t pos, len; /* span of the size in the text */
+	int unit;
+	int inexact;     /* a fraction of a byte was dropped */
+} bcal_size;
+
+typedef struct {
+	bcal_uint sum;      /* exact */
+	bcal_uint min, max; /* if count isn't 0 */
+	unsigned long long count;
+} bcal_summary;
+
+typedef struct {
+	const char *name; /* as printed, matched ignoring case */
+	bcal_uint num;    /* a unit is num / den bytes */
+	unsigned den;
+	int base;         /* 2 for IEC, 10 for SI units, 0 otherwise */
+} bcal_unit_info;
+
+typedef struct {
+	unsigned len;                             /* significant limbs, 0 for zero */
+	unsigned long long limb[BCAL_WIDE_LIMBS]; /* least significant first */
+} bcal_wide;
+
+typedef void (*bcal_log_fn)(void *arg, int level, const char *func, const char *msg);
+
+bcal_ctx *bcal_ctx_new(void);
+void bcal_ctx_free(bcal_ctx *ctx);
+
+/* Messages up to level (warnings and above, errors excluded) go to fn */
+void bcal_set_log(bcal_ctx *ctx, int level, bcal_log_fn fn, void *arg);
+void bcal_set_flags(bcal_ctx *ctx, int flags);
+
+/* Last error of ctx, "" if the last call succeeded */
+const char *bcal_errmsg(const bcal_ctx *ctx);
+const char *bcal_strerror(int err);
+
+/*
+ * Evaluate a storage expression, e.g. "(2 gib * 2) / 2 kib" or "0x18mb".
+ * 'r' in the expression refers to the last result stored in ctx.
+ * "name = expression" also assigns the result to a variable of ctx,
+ * which later expressions of any kind can use by name. Operands and
+ * results that don't fit in bcal_uint fail with BCAL_EOVERFLOW, they
+ * never wrap.
+ */
+int bcal_eval(bcal_ctx *ctx, const char *expr, bcal_result *res);
+
+/*
+ * Compile a storage expression once to run it many times, e.g. with a
+ * different r each time. Variables are read when it runs too, it has
+ * no assignment. A program is read-only and can be shared by
+ * contexts in different threads. It doesn't depend on the context used
+ * to compile it, which only receives errors.
+ */
+int bcal_compile(bcal_ctx *ctx, const char *expr, bcal_prog **prog);
+int bcal_run(bcal_ctx *ctx, const bcal_prog *prog, bcal_result *res);
+void bcal_prog_free(bcal_prog *prog);
+
+/*
+ * Keep the results of up to entries storage expressions for bcal_eval(),
+ * the least recently used goes first, 0 (the default) turns it off.
+ * Expressions are matched as they are lexed, without spaces and commas.
+ * Those with r, variables or an assignment are always evaluated.
+ */
+int bcal_set_cache(bcal_ctx *ctx, unsigned entries);
+void bcal_cache_stats(const bcal_ctx *ctx, size_t *hits, size_t *misses);
+
+/* Convert value in unit ("kib", "MB"...) or a single operand if unit is NULL */
+int bcal_convert(bcal_ctx *ctx, const char *value, const char *unit, bcal_result *res);
+
+/*
+ * Evaluate a maths expression, the formatted result is written to buf
+ * Decimal operands are added, subtracted, multiplied and divided
+ * exactly, functions other than sum() give long doubles. Exact results
+ * and quotients are rounded half up to the scale set for ctx and can be
+ * of any length, bcal_last() has the result if buf is short.
+ */
+int bcal_eval_maths(bcal_ctx *ctx, const char *expr, char *buf, size_t buflen);
+int bcal_set_scale(bcal_ctx *ctx, unsigned digits);
+
+/*
+ * Compile a maths expression once to run it many times. Parts that
+ * don't depend on r or variables are evaluated when compiling,
+ * quotients among them are rounded for the scale of ctx then. A program
+ * is read-only and can be shared by contexts in different threads.
+ */
+int bcal_compile_maths(bcal_ctx *ctx, const char *expr, bcal_maths **prog);
+int bcal_run_maths(bcal_ctx *ctx, const bcal_maths *prog, char *buf, size_t buflen);
+void bcal_maths_free(bcal_maths *prog);
+
+/*
+ * Integers of the width set for ctx, a multiple of 64 bits up to
+ * BCAL_WIDE_BITS_MAX, BCAL_WIDE_BITS by default. bcal_eval_wide() takes
+ * the expressions bcal_eval() does, results that don't fit in the width
+ * fail with BCAL_EOVERFLOW.
+ */
+int bcal_set_width(bcal_ctx *ctx, unsigned bits);
+int bcal_eval_wide(bcal_ctx *ctx, const char *expr, bcal_wide *res, int *unit);
+
+/* n in base 2, 10 or 16 without a prefix, written backwards from the end of buf */
+char *bcal_wide_str(const bcal_wide *n, int base, char buf[BCAL_WIDE_BUF_LEN]);
+
+/*
+ * Last result stored in ctx, NULL if none; *unit is set if it's in bytes
+ * A wide result is only there if it fits in bcal_uint, bcal_last_wide()
+ * has it in any case.
+ */
+const char *bcal_last(const bcal_ctx *ctx, int *unit);
+const bcal_wide *bcal_last_wide(const bcal_ctx *ctx, int *unit);
+void bcal_set_last(bcal_ctx *ctx, bcal_uint value, int unit);
+void bcal_clear_last(bcal_ctx *ctx);
+void bcal_clear_vars(bcal_ctx *ctx);
+
+/* Context free helpers */
+int bcal_parse_size(const char *str, bcal_uint *bytes);
+int bcal_parse_uint(const char *str, bcal_uint *val);
+int bcal_unit_lookup(const char *name);
+const bcal_unit_info *bcal_unit(int unit); /* NULL if out of range */
+
+/*
+ * Find the next size in text from *pos, a number of a unit written as a
+ * word of its own like "12.5GiB", "0x400 kb" or "(1,500 mb)". Returns 1 with
+ * the size in *m and *pos after it, BCAL_EOVERFLOW if its bytes don't
+ * fit, 0 if there are no more. The char before *pos is read to tell a
+ * word apart, so text split into chunks is scanned as a whole if each
+ * is passed with the char before it: unless final, a size that may go
+ * on past len is left for the next chunk, *pos stops at its start.
+ */
+int bcal_scan_size(const char *text, size_t len, size_t *pos, int final, bcal_size *m);
+
+/*
+ * Aggregate sizes in fixed memory: count, sum, min and max, and quantiles
+ * of the nearest rank from a histogram of the top 8 bits of each size.
+ * A quantile is exact if the size has 8 significant bits or fewer, else
+ * it's rounded down by less than 1/128, the first and last are exact.
+ * Adding a size that would overflow the sum fails with BCAL_EOVERFLOW
+ * and leaves it out. Merging two aggregates gives what adding the sizes
+ * of both to one would, in any order.
+ */
+bcal_stats *bcal_stats_new(void);
+void bcal_stats_free(bcal_stats *st);
+int bcal_stats_add(bcal_stats *st, bcal_uint bytes);
+int bcal_stats_merge(bcal_stats *st, const bcal_stats *from);
+const bcal_summary *bcal_stats_summary(const bcal_stats *st);
+bcal_uint bcal_stats_quantile(const bcal_stats *st, double q); /* q from 0 to 1, clamped, 0 if empty */
+
+/*
+ * Value of a result in unit, computed from its byte count. An inexact
+ * single operand is converted from its input value instead, so
+ * "0.3 mib" stays 0.3 MiB.
+ */
+long double bcal_unit_value(const bcal_result *res, int unit);
+int bcal_has_units(const char *expr);
+char *bcal_utoa(bcal_uint n, char *buf);
+
+#ifdef __cplusplus
+}
+#endif
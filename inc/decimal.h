@@ -0,0 +1,662 @@
+/*
+ * Arbitrary precision decimal magnitudes on base 10^9 limbs
+ *
+ * Author: Arun Prakash Jana <engineerarun@gmail.com>
+ * Copyright (C) 2016 by Arun Prakash Jana <engineerarun@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bcal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A limb holds 9 decimal digits, so converting from and to strings is
+ * linear and a limb product with carries fits in 64 bits. Limbs are
+ * little endian, len is 0 for zero. Operands of DEC_KARATSUBA limbs and
+ * more are multiplied with Karatsuba's method, smaller ones digit row
+ * by digit row.
+ *
+ * Up to DEC_SMALL limbs live in the struct itself, so short values are
+ * never allocated. A decimal_t starts zeroed and must not be copied by
+ * assignment, see dec_move().
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEC_BASE 1000000000U
+#define DEC_DIGITS 9
+#define DEC_KARATSUBA 48 /* limbs, see bench/bench_mul */
+#define DEC_SMALL 4 /* limbs kept inline, 36 digits */
+
+typedef struct {
+	uint32_t *d; /* small or allocated */
+	size_t len;
+	size_t cap;
+	uint32_t small[DEC_SMALL];
+} decimal_t;
+
+static const uint32_t dec_pow10[DEC_DIGITS + 1] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000,
+};
+
+static inline void dec_free(decimal_t *x)
+{
+	if (x->d && x->d != x->small)
+		free(x->d);
+	x->d = NULL;
+	x->len = x->cap = 0;
+}
+
+/* Make room for n limbs, the value is kept */
+static inline bool dec_reserve(decimal_t *x, size_t n)
+{
+	uint32_t *d;
+
+	if (n <= x->cap)
+		return true;
+
+	if (!x->d && n <= DEC_SMALL) {
+		x->d = x->small;
+		x->cap = DEC_SMALL;
+		return true;
+	}
+
+	if (x->d == x->small || !x->d) {
+		d = (uint32_t *)malloc(n * sizeof(uint32_t));
+		if (d && x->len)
+			memcpy(d, x->small, x->len * sizeof(uint32_t));
+	} else {
+		d = (uint32_t *)realloc(x->d, n * sizeof(uint32_t));
+	}
+
+	if (!d)
+		return false;
+
+	x->d = d;
+	x->cap = n;
+	return true;
+}
+
+/* Move the value of src to dst, src is left zero */
+static inline void dec_move(decimal_t *dst, decimal_t *src)
+{
+	dec_free(dst);
+	if (src->d == src->small) {
+		memcpy(dst->small, src->small, src->len * sizeof(uint32_t));
+		dst->d = dst->small;
+	} else {
+		dst->d = src->d;
+	}
+
+	dst->len = src->len;
+	dst->cap = src->cap;
+	src->d = NULL;
+	src->len = src->cap = 0;
+}
+
+static inline bool dec_copy(decimal_t *dst, const decimal_t *src)
+{
+	if (!dec_reserve(dst, src->len))
+		return false;
+
+	if (src->len)
+		memcpy(dst->d, src->d, src->len * sizeof(uint32_t));
+	dst->len = src->len;
+	return true;
+}
+
+static inline bool dec_set_u64(decimal_t *x, uint64_t v)
+{
+	if (!dec_reserve(x, 3))
+		return false;
+
+	for (x->len = 0; v; v /= DEC_BASE)
+		x->d[x->len++] = (uint32_t)(v % DEC_BASE);
+
+	return true;
+}
+
+/* x as a uint64_t, false if it doesn't fit */
+static inline bool dec_get_u64(const decimal_t *x, uint64_t *v)
+{
+	*v = 0;
+	for (size_t i = x->len; i--;) {
+		if (*v > (UINT64_MAX - x->d[i]) / DEC_BASE)
+			return false;
+		*v = *v * DEC_BASE + x->d[i];
+	}
+
+	return true;
+}
+
+/* -1, 0 or 1 as a is less than, equal to or greater than b */
+static inline int dec_cmp(const decimal_t *a, const decimal_t *b)
+{
+	if (a->len != b->len)
+		return a->len < b->len ? -1 : 1;
+
+	for (size_t i = a->len; i--;)
+		if (a->d[i] != b->d[i])
+			return a->d[i] < b->d[i] ? -1 : 1;
+
+	return 0;
+}
+
+static inline void dec_norm(decimal_t *x)
+{
+	while (x->len && !x->d[x->len - 1])
+		--x->len;
+}
+
+/* Number of decimal digits, 0 for zero */
+static inline size_t dec_ndigits(const decimal_t *x)
+{
+	size_t n;
+	uint32_t top;
+
+	if (!x->len)
+		return 0;
+
+	top = x->d[x->len - 1];
+	for (n = 1; n < DEC_DIGITS && top >= dec_pow10[n]; ++n)
+		;
+
+	return (x->len - 1) * DEC_DIGITS + n;
+}
+
+/* Decimal digit i, counted from the least significant one */
+static inline uint32_t dec_digit(const decimal_t *x, size_t i)
+{
+	if (i / DEC_DIGITS >= x->len)
+		return 0;
+
+	return x->d[i / DEC_DIGITS] / dec_pow10[i % DEC_DIGITS] % 10;
+}
+
+/*
+ * Set x from the digits in s[0, n), other chars are skipped
+ * ndigits is the number of digits among them.
+ */
+static inline bool dec_set_digits(decimal_t *x, const char *s, size_t n, size_t ndigits)
+{
+	size_t k = 0;
+	uint32_t limb = 0;
+
+	if (!dec_reserve(x, ndigits / DEC_DIGITS + 1))
+		return false;
+
+	x->len = 0;
+	for (const char *p = s + n; p-- > s;) {
+		if ((unsigned)(*p - '0') > 9)
+			continue;
+
+		limb += (uint32_t)(*p - '0') * dec_pow10[k];
+		if (++k == DEC_DIGITS) {
+			x->d[x->len++] = limb;
+			limb = 0;
+			k = 0;
+		}
+	}
+
+	if (k)
+		x->d[x->len++] = limb;
+
+	dec_norm(x);
+	return true;
+}
+
+/* Write the digits of x backwards from end, at least one */
+static inline char *dec_digits(const decimal_t *x, char *end)
+{
+	for (size_t i = 0; i < x->len; ++i) {
+		uint32_t v = x->d[i];
+		int k = 0;
+
+		/* Lower limbs are zero padded */
+		do {
+			*--end = (char)('0' + v % 10);
+			v /= 10;
+			++k;
+		} while (v || (i + 1 < x->len && k < DEC_DIGITS));
+	}
+
+	if (!x->len)
+		*--end = '0';
+
+	return end;
+}
+
+/* r[0, na + nb) = a * b */
+static inline void dec_mul_basic(uint32_t *r, const uint32_t *a, size_t na,
+				 const uint32_t *b, size_t nb)
+{
+	memset(r, 0, (na + nb) * sizeof(uint32_t));
+
+	for (size_t i = 0; i < na; ++i) {
+		uint64_t carry = 0, ai = a[i];
+
+		if (!ai)
+			continue;
+
+		for (size_t j = 0; j < nb; ++j) {
+			uint64_t t = ai * b[j] + r[i + j] + carry;
+
+			r[i + j] = (uint32_t)(t % DEC_BASE);
+			carry = t / DEC_BASE;
+		}
+
+		r[i + nb] = (uint32_t)carry;
+	}
+}
+
+/* r[0, n] = a[0, na) + b[0, nb), na >= nb, n = na */
+static inline void dec_add_limbs(uint32_t *r, const uint32_t *a, size_t na,
+				 const uint32_t *b, size_t nb)
+{
+	uint32_t carry = 0;
+	size_t i;
+
+	for (i = 0; i < na; ++i) {
+		uint32_t t = a[i] + (i < nb ? b[i] : 0) + carry;
+
+		carry = t >= DEC_BASE;
+		r[i] = carry ? t - DEC_BASE : t;
+	}
+
+	r[na] = carry;
+}
+
+/* r[0, nr) += a[0, na), the sum must fit */
+static inline void dec_add_to(uint32_t *r, size_t nr, const uint32_t *a, size_t na)
+{
+	uint32_t carry = 0;
+	size_t i;
+
+	for (i = 0; i < na; ++i) {
+		uint32_t t = r[i] + a[i] + carry;
+
+		carry = t >= DEC_BASE;
+		r[i] = carry ? t - DEC_BASE : t;
+	}
+
+	for (; carry && i < nr; ++i) {
+		carry = ++r[i] == DEC_BASE;
+		if (carry)
+			r[i] = 0;
+	}
+}
+
+/* r[0, nr) -= a[0, na), r must not be less than a */
+static inline void dec_sub_from(uint32_t *r, size_t nr, const uint32_t *a, size_t na)
+{
+	uint32_t borrow = 0;
+	size_t i;
+
+	for (i = 0; i < na; ++i) {
+		uint32_t s = a[i] + borrow;
+
+		borrow = r[i] < s;
+		r[i] = borrow ? r[i] + DEC_BASE - s : r[i] - s;
+	}
+
+	for (; borrow && i < nr; ++i) {
+		borrow = r[i] == 0;
+		r[i] = borrow ? DEC_BASE - 1 : r[i] - 1;
+	}
+}
+
+/* r = a + b, r may be a or b */
+static inline bool dec_add(decimal_t *r, const decimal_t *a, const decimal_t *b)
+{
+	size_t n = a->len > b->len ? a->len : b->len;
+	uint32_t carry = 0;
+
+	if (!dec_reserve(r, n + 1))
+		return false;
+
+	for (size_t i = 0; i < n; ++i) {
+		uint32_t t = (i < a->len ? a->d[i] : 0) + (i < b->len ? b->d[i] : 0) + carry;
+
+		carry = t >= DEC_BASE;
+		r->d[i] = carry ? t - DEC_BASE : t;
+	}
+
+	r->d[n] = carry;
+	r->len = n + carry;
+	return true;
+}
+
+/* r = a - b with a >= b, r may be a or b */
+static inline bool dec_sub(decimal_t *r, const decimal_t *a, const decimal_t *b)
+{
+	uint32_t borrow = 0;
+
+	if (!dec_reserve(r, a->len))
+		return false;
+
+	for (size_t i = 0; i < a->len; ++i) {
+		uint32_t s = (i < b->len ? b->d[i] : 0) + borrow, x = a->d[i];
+
+		borrow = x < s;
+		r->d[i] = borrow ? x + DEC_BASE - s : x - s;
+	}
+
+	r->len = a->len;
+	dec_norm(r);
+	return true;
+}
+
+/* x = x * m + add with m and add below DEC_BASE */
+static inline bool dec_mul_small(decimal_t *x, uint32_t m, uint32_t add)
+{
+	uint64_t carry = add;
+
+	for (size_t i = 0; i < x->len; ++i) {
+		uint64_t t = (uint64_t)x->d[i] * m + carry;
+
+		x->d[i] = (uint32_t)(t % DEC_BASE);
+		carry = t / DEC_BASE;
+	}
+
+	if (carry) {
+		if (!dec_reserve(x, x->len + 1))
+			return false;
+		x->d[x->len++] = (uint32_t)carry;
+	}
+
+	dec_norm(x);
+	return true;
+}
+
+/* x *= 10^k */
+static inline bool dec_shl10(decimal_t *x, size_t k)
+{
+	size_t q = k / DEC_DIGITS;
+
+	if (!x->len)
+		return true;
+
+	if (q) {
+		if (!dec_reserve(x, x->len + q + 1))
+			return false;
+		memmove(x->d + q, x->d, x->len * sizeof(uint32_t));
+		memset(x->d, 0, q * sizeof(uint32_t));
+		x->len += q;
+	}
+
+	return dec_mul_small(x, dec_pow10[k % DEC_DIGITS], 0);
+}
+
+/* x /= m for m below DEC_BASE, returns the remainder */
+static inline uint32_t dec_div_small(decimal_t *x, uint32_t m)
+{
+	uint64_t rem = 0;
+
+	for (size_t i = x->len; i--;) {
+		uint64_t cur = rem * DEC_BASE + x->d[i];
+
+		x->d[i] = (uint32_t)(cur / m);
+		rem = cur % m;
+	}
+
+	dec_norm(x);
+	return (uint32_t)rem;
+}
+
+/*
+ * q = a / b and rem = a % b if rem isn't NULL, b must not be zero
+ * q and rem must not alias a, b or each other. Knuth's algorithm D
+ * on 10^9 limbs, the divisor is scaled for its top limb to be at
+ * least DEC_BASE / 2 so each quotient limb guess is at most 2 off.
+ */
+static inline bool dec_divmod(decimal_t *q, decimal_t *rem, const decimal_t *a, const decimal_t *b)
+{
+	decimal_t u = {0}, v = {0};
+	size_t n = b->len, m;
+	uint32_t f;
+	bool ok = false;
+
+	if (dec_cmp(a, b) < 0) {
+		q->len = 0;
+		return rem ? dec_copy(rem, a) : true;
+	}
+
+	if (n == 1) {
+		uint32_t r;
+
+		if (!dec_copy(q, a))
+			return false;
+		r = dec_div_small(q, b->d[0]);
+		return rem ? dec_set_u64(rem, r) : true;
+	}
+
+	m = a->len - n;
+	f = DEC_BASE / (b->d[n - 1] + 1);
+	if (!dec_copy(&u, a) || !dec_reserve(&u, a->len + 1) || !dec_copy(&v, b) ||
+	    !dec_mul_small(&u, f, 0) || !dec_mul_small(&v, f, 0) || !dec_reserve(q, m + 1))
+		goto out;
+
+	/* u keeps a top limb even if it's 0 */
+	if (u.len == a->len)
+		u.d[u.len++] = 0;
+
+	for (size_t j = m + 1; j--;) {
+		uint64_t num = (uint64_t)u.d[j + n] * DEC_BASE + u.d[j + n - 1];
+		uint64_t qhat = num / v.d[n - 1], rhat = num % v.d[n - 1];
+		uint64_t carry = 0;
+		int64_t borrow = 0, s;
+
+		while (qhat >= DEC_BASE || qhat * v.d[n - 2] > rhat * DEC_BASE + u.d[j + n - 2]) {
+			--qhat;
+			rhat += v.d[n - 1];
+			if (rhat >= DEC_BASE)
+				break;
+		}
+
+		/* u[j, j + n] -= qhat * v */
+		for (size_t i = 0; i < n; ++i) {
+			uint64_t p = qhat * v.d[i] + carry;
+
+			carry = p / DEC_BASE;
+			s = (int64_t)u.d[i + j] - (int64_t)(p % DEC_BASE) + borrow;
+			borrow = s < 0 ? -1 : 0;
+			u.d[i + j] = (uint32_t)(s < 0 ? s + DEC_BASE : s);
+		}
+
+		s = (int64_t)u.d[j + n] - (int64_t)carry + borrow;
+		if (s < 0) {
+			/* qhat was one too many, add v back */
+			uint32_t c = 0;
+
+			--qhat;
+			for (size_t i = 0; i < n; ++i) {
+				uint32_t t = u.d[i + j] + v.d[i] + c;
+
+				c = t >= DEC_BASE;
+				u.d[i + j] = c ? t - DEC_BASE : t;
+			}
+			s += c;
+		}
+
+		u.d[j + n] = (uint32_t)s;
+		q->d[j] = (uint32_t)qhat;
+	}
+
+	q->len = m + 1;
+	dec_norm(q);
+
+	if (rem) {
+		u.len = n;
+		dec_norm(&u);
+		dec_div_small(&u, f);
+		if (!dec_copy(rem, &u))
+			goto out;
+	}
+
+	ok = true;
+out:
+	dec_free(&u);
+	dec_free(&v);
+	return ok;
+}
+
+/* Scratch limbs dec_kmul() needs for n limb operands */
+static inline size_t dec_kmul_scratch(size_t n)
+{
+	return 4 * n + 16 * (sizeof(size_t) * 8);
+}
+
+/*
+ * r[0, 2n) = a[0, n) * b[0, n) with scratch t of dec_kmul_scratch(n)
+ * (a1 B + a0)(b1 B + b0) = z2 B^2 + ((a0 + a1)(b0 + b1) - z2 - z0) B + z0
+ */
+static void dec_kmul(uint32_t *r, const uint32_t *a, const uint32_t *b, size_t n, uint32_t *t)
+{
+	size_t m = n / 2, h = n - m;
+	uint32_t *sa = t, *sb = t + h + 1, *z1 = t + 2 * (h + 1);
+
+	if (n < DEC_KARATSUBA) {
+		dec_mul_basic(r, a, n, b, n);
+		return;
+	}
+
+	/* z0 in the low half of r, z2 in the high one */
+	dec_kmul(r, a, b, m, t);
+	dec_kmul(r + 2 * m, a + m, b + m, h, t);
+
+	dec_add_limbs(sa, a + m, h, a, m);
+	dec_add_limbs(sb, b + m, h, b, m);
+	dec_kmul(z1, sa, sb, h + 1, t + 4 * (h + 1));
+
+	dec_sub_from(z1, 2 * (h + 1), r, 2 * m);
+	dec_sub_from(z1, 2 * (h + 1), r + 2 * m, 2 * h);
+
+	/* z1 < 2 B^n, its limbs above 2n - m are 0 */
+	dec_add_to(r + m, 2 * n - m, z1, 2 * (h + 1) < 2 * n - m ? 2 * (h + 1) : 2 * n - m);
+}
+
+/*
+ * r = a * b, r must not alias a or b
+ * Unbalanced operands are multiplied a slice of the shorter length at
+ * a time, so Karatsuba always sees operands of the same size.
+ */
+static inline bool dec_mul(decimal_t *r, const decimal_t *a, const decimal_t *b)
+{
+	const decimal_t *s = a->len >= b->len ? b : a, *l = a->len >= b->len ? a : b;
+	size_t ns = s->len, nl = l->len;
+	uint32_t *t, *prod, *slice;
+
+	if (!ns) {
+		r->len = 0;
+		return true;
+	}
+
+	if (!dec_reserve(r, ns + nl))
+		return false;
+
+	if (ns < DEC_KARATSUBA) {
+		dec_mul_basic(r->d, l->d, nl, s->d, ns);
+		r->len = ns + nl;
+		dec_norm(r);
+		return true;
+	}
+
+	t = (uint32_t *)malloc((3 * ns + dec_kmul_scratch(ns)) * sizeof(uint32_t));
+	if (!t)
+		return false;
+
+	prod = t + dec_kmul_scratch(ns);
+	slice = prod + 2 * ns;
+	memset(r->d, 0, (ns + nl) * sizeof(uint32_t));
+
+	for (size_t i = 0; i < nl; i += ns) {
+		const uint32_t *p = l->d + i;
+
+		/* The last slice is zero padded */
+		if (nl - i < ns) {
+			memcpy(slice, p, (nl - i) * sizeof(uint32_t));
+			memset(slice + nl - i, 0, (ns - nl + i) * sizeof(uint32_t));
+			p = slice;
+		}
+
+		dec_kmul(prod, p, s->d, ns, t);
+		dec_add_to(r->d + i, ns + nl - i, prod, 2 * ns < ns + nl - i ? 2 * ns : ns + nl - i);
+	}
+
+	free(t);
+	r->len = ns + nl;
+	dec_norm(r);
+	return true;
+}
+
+/* x /= 10^k, the digits dropped are truncated */
+static inline void dec_shr10(decimal_t *x, size_t k)
+{
+	size_t q = k / DEC_DIGITS, i;
+	uint32_t lo, hi;
+
+	if (q >= x->len) {
+		x->len = 0;
+		return;
+	}
+
+	lo = dec_pow10[k % DEC_DIGITS];
+	hi = dec_pow10[DEC_DIGITS - k % DEC_DIGITS];
+
+	/* Shift down q limbs and k % 9 digits */
+	for (i = 0; i + q < x->len; ++i) {
+		uint32_t v = x->d[i + q] / lo;
+
+		if (i + q + 1 < x->len && lo > 1)
+			v += x->d[i + q + 1] % lo * hi;
+		x->d[i] = v;
+	}
+
+	x->len -= q;
+	dec_norm(x);
+}
+
+/*
+ * Drop the k low digits of x in place, rounding half up on the first
+ * digit dropped. x needs a spare limb for the carry.
+ */
+static inline bool dec_round(decimal_t *x, size_t k)
+{
+	uint32_t rd;
+	size_t i;
+
+	if (!k)
+		return true;
+
+	rd = dec_digit(x, k - 1);
+	dec_shr10(x, k);
+
+	if (rd < 5)
+		return true;
+
+	for (i = 0; i < x->len && x->d[i] == DEC_BASE - 1; ++i)
+		x->d[i] = 0;
+
+	if (i == x->len) {
+		if (!dec_reserve(x, x->len + 1))
+			return false;
+		x->d[x->len++] = 1;
+	} else
+		++x->d[i];
+
+	return true;
+}
@@ -1,156 +1,181 @@
 #pragma once
 
+#include<stdbool.h>
 #include<stdio.h>
 #include<stdlib.h>
 #include<string.h>
+#include "bcal.h"
 
 #define NUM_LEN 63
+#define DS_MIN_CAP 16
+
+typedef bcal_uint maxuint_t;
 
 typedef struct data {
 	char p[NUM_LEN];
 	char unit;
 } Data;
 
+/* Postfix token: an operator or a number with its unit flag */
+typedef struct token {
+	maxuint_t n;
+	char op; /* operator, '\0' for a number */
+	char unit;
+} Token;
+
+/*
+ * Array backed stack and queue
+ * Storage is kept when emptied so it is reused by the next expression.
+ * Zero initialize before first use, release with freestack()/freequeue().
+ */
 typedef struct stack {
-	Data d;
-	struct stack *link;
+	Token *d;
+	size_t len;
+	size_t cap;
 } stack;
 
 typedef struct queue {
-	Data d;
-	struct queue *link;
+	Token *d;
+	size_t head;
+	size_t tail;
+	size_t cap;
 } queue;
 
-static void push(stack **top, Data d)
+/* Grow the array at *d to hold at least n tokens */
+static bool reserve(Token **d, size_t *cap, size_t n)
 {
-	stack *new = (stack *)malloc(sizeof(stack));
+	size_t newcap = *cap ? *cap : DS_MIN_CAP;
+	Token *tmp;
 
-	new->d = d;
-	new->link = NULL;
+	if (n <= *cap)
+		return true;
 
-	if (*top == NULL)
-		*top = new;
-	else {
-		new->link = *top;
-		*top = new;
-	}
+	while (newcap < n)
+		newcap <<= 1;
+
+	tmp = (Token *)realloc(*d, newcap * sizeof(Token));
+	if (!tmp)
+		return false;
+
+	*d = tmp;
+	*cap = newcap;
+	return true;
 }
 
-static void pop(stack **top, Data *d)
+static bool stack_reserve(stack *s, size_t n)
 {
-	d->p[0] = '\0';
-	d->unit = 0;
-
-	if (*top != NULL) {
-		stack *tmp = *top;
-		*top = (*top)->link;
-		*d = tmp->d;
-		free(tmp);
-	}
+	return reserve(&s->d, &s->cap, n);
 }
 
-static void enqueue(queue **front, queue **rear, Data d)
+static bool queue_reserve(queue *q, size_t n)
 {
-	queue *new = (queue *)malloc(sizeof(queue));
+	return reserve(&q->d, &q->cap, q->tail + n);
+}
 
-	new->d = d;
-	new->link = NULL;
+static bool push(stack *s, Token d)
+{
+	if (s->len == s->cap && !stack_reserve(s, s->len + 1))
+		return false;
 
-	if (*front == NULL)
-		*front = *rear = new;
-	else {
-		(*rear)->link = new;
-		*rear = new;
-	}
+	s->d[s->len] = d;
+	++s->len;
+	return true;
 }
 
-static void dequeue(queue **front, queue **rear, Data *d)
+static void pop(stack *s, Token *d)
 {
-	d->p[0] = '\0';
+	d->n = 0;
+	d->op = '\0';
 	d->unit = 0;
 
-	if (*front != NULL) {
-		queue *tmp;
-
-		if (*front == *rear) {
-			tmp = *front;
-			*d = tmp->d;
-			free(tmp);
-			*front = *rear = NULL;
-		} else {
-			tmp = *front;
-			*front = (*front)->link;
-			*d = tmp->d;
-			free(tmp);
-		}
+	if (s->len) {
+		--s->len;
+		*d = s->d[s->len];
 	}
 }
 
-static int isempty(stack *top)
+static bool enqueue(queue *q, Token d)
 {
-	if (top == NULL)
+	if (q->tail == q->cap && !queue_reserve(q, 1))
+		return false;
+
+	q->d[q->tail] = d;
+	++q->tail;
+	return true;
+}
+
+static size_t queuelen(queue *q)
+{
+	return q->tail - q->head;
+}
+
+static int isempty(stack *s)
+{
+	if (s->len == 0)
 		return 1;
 
 	return 0;
 }
 
-static char *top(stack *top)
+static Token *top(stack *s)
 {
-	if (top == NULL)
+	if (s->len == 0)
 		return NULL;
 
-	return top->d.p;
+	return &s->d[s->len - 1];
 }
 
-static void emptystack(stack **top)
+static void emptystack(stack *s)
 {
-	stack *tmp;
+	s->len = 0;
+}
 
-	while (*top != NULL) {
-		tmp = *top;
-		*top = (*top)->link;
-		free(tmp);
-	}
+static void cleanqueue(queue *q)
+{
+	q->head = q->tail = 0;
 }
 
-static void cleanqueue(queue **front)
+static void freestack(stack *s)
 {
-	queue *tmp;
+	free(s->d);
+	s->d = NULL;
+	s->len = s->cap = 0;
+}
 
-	while (*front != NULL) {
-		tmp = *front;
-		*front = (*front)->link;
-		free(tmp);
-	}
+static void freequeue(queue *q)
+{
+	free(q->d);
+	q->d = NULL;
+	q->head = q->tail = q->cap = 0;
 }
 
 /*
-static void printstack(stack *top)
+static void printstack(stack *s)
 {
-	stack *i;
+	size_t i;
 
 	printf("\nStack: ");
 
-	if (top == NULL)
+	if (s->len == 0)
 		printf("Empty");
 
-	for (i = top; i != NULL; i = i->link)
-		printf(" %s ", i->d.p);
+	for (i = s->len; i > 0; --i)
+		printf(" %c ", s->d[i - 1].op ? s->d[i - 1].op : '#');
 
 	printf("\n");
 }
 
-static void printqueue(queue *front)
+static void printqueue(queue *q)
 {
-	queue *i;
+	size_t i;
 
 	printf("\nQueue: ");
 
-	if (front == NULL)
+	if (q->head == q->tail)
 		printf("Empty");
 
-	for (i = front; i != NULL; i = i->link)
-		printf(" %s ", i->d.p);
+	for (i = q->head; i < q->tail; ++i)
+		printf(" %c ", q->d[i].op ? q->d[i].op : '#');
 
 	printf("\n");
 }
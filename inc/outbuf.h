@@ -0,0 +1,213 @@
+/*
+ * Buffered result output
+ *
+ * Author: Arun Prakash Jana <engineerarun@gmail.com>
+ * Copyright (C) 2016 by Arun Prakash Jana <engineerarun@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bcal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Results are assembled field by field in a buffer which is written to
+ * its stream, or handed to a sink, when full or on ob_flush(). The
+ * emitters produce the same bytes as the printf(3) conversions noted
+ * against each of them.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "bcal.h"
+
+#define OUTBUF_LEN 4096
+#define OUTBUF_FIELD 64 /* room reserved for a single formatted field */
+
+/* Takes the output in place of a stream, e.g. to queue it for a socket */
+typedef void (*ob_sink_fn)(void *arg, const char *s, size_t n);
+
+typedef struct {
+	FILE *fp;
+	ob_sink_fn sink;
+	void *arg;
+	size_t len;
+	char buf[OUTBUF_LEN];
+} outbuf_t;
+
+/* 10^0 to 10^28, exact up to 10^27 */
+static const long double ob_pow10[] = {
+	1e0L, 1e1L, 1e2L, 1e3L, 1e4L, 1e5L, 1e6L, 1e7L, 1e8L, 1e9L,
+	1e10L, 1e11L, 1e12L, 1e13L, 1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L,
+	1e20L, 1e21L, 1e22L, 1e23L, 1e24L, 1e25L, 1e26L, 1e27L, 1e28L,
+};
+
+static inline void ob_init(outbuf_t *ob, FILE *fp)
+{
+	ob->fp = fp;
+	ob->sink = NULL;
+	ob->len = 0;
+}
+
+static inline void ob_init_sink(outbuf_t *ob, ob_sink_fn sink, void *arg)
+{
+	ob->fp = NULL;
+	ob->sink = sink;
+	ob->arg = arg;
+	ob->len = 0;
+}
+
+static inline void ob_out(outbuf_t *ob, const char *s, size_t n)
+{
+	if (ob->sink)
+		ob->sink(ob->arg, s, n);
+	else
+		fwrite(s, 1, n, ob->fp);
+}
+
+static inline void ob_flush(outbuf_t *ob)
+{
+	if (ob->len) {
+		ob_out(ob, ob->buf, ob->len);
+		ob->len = 0;
+	}
+}
+
+/* Make room for n bytes, n must not exceed OUTBUF_LEN */
+static inline char *ob_reserve(outbuf_t *ob, size_t n)
+{
+	if (ob->len + n > OUTBUF_LEN)
+		ob_flush(ob);
+	return ob->buf + ob->len;
+}
+
+static inline void ob_write(outbuf_t *ob, const char *s, size_t n)
+{
+	if (n > OUTBUF_LEN) {
+		ob_flush(ob);
+		ob_out(ob, s, n);
+		return;
+	}
+
+	memcpy(ob_reserve(ob, n), s, n);
+	ob->len += n;
+}
+
+/* "%s" */
+static inline void ob_puts(outbuf_t *ob, const char *s)
+{
+	ob_write(ob, s, strlen(s));
+}
+
+/* "%c" */
+static inline void ob_putc(outbuf_t *ob, char c)
+{
+	*ob_reserve(ob, 1) = c;
+	++ob->len;
+}
+
+/* Spaces to right align a field of len bytes in width */
+static inline void ob_pad(outbuf_t *ob, size_t len, size_t width)
+{
+	if (len < width) {
+		memset(ob_reserve(ob, width - len), ' ', width - len);
+		ob->len += width - len;
+	}
+}
+
+/* "%*s" of the decimal string of n */
+static inline void ob_uint(outbuf_t *ob, bcal_uint n, int width)
+{
+	char buf[BCAL_UINT_BUF_LEN];
+	char *p = bcal_utoa(n, buf);
+	size_t len = (size_t)(buf + BCAL_UINT_BUF_LEN - 1 - p);
+
+	ob_pad(ob, len, (size_t)width);
+	ob_write(ob, p, len);
+}
+
+/* "%llx" */
+static inline void ob_hex(outbuf_t *ob, unsigned long long n)
+{
+	char buf[sizeof(n) * 2];
+	char *p = buf + sizeof(buf);
+
+	do {
+		*--p = "0123456789abcdef"[n & 0xf];
+		n >>= 4;
+	} while (n);
+
+	ob_write(ob, p, (size_t)(buf + sizeof(buf) - p));
+}
+
+/*
+ * "%#*.10Le"
+ * Values from 1e-10 to 1e18 are scaled to an 18 digit integer with a
+ * single rounding, far below the 7 digits dropped from it. When those
+ * digits are too close to a tie to round safely, or the value is out
+ * of range, printf(3) is used instead.
+ */
+static inline void ob_sci(outbuf_t *ob, long double val, int width)
+{
+	char buf[16], *p = buf + sizeof(buf);
+	long double scaled, rem;
+	uint64_t q, hi;
+	int k = 0, top = 28, e10;
+
+	if (!(val >= 1e-10L && val < 1e18L))
+		goto slow;
+
+	/* Smallest k with val * 10^k >= 10^17 */
+	while (k < top) {
+		int mid = (k + top) >> 1;
+
+		if (val * ob_pow10[mid] >= 1e17L)
+			top = mid;
+		else
+			k = mid + 1;
+	}
+
+	scaled = val * ob_pow10[k];
+	if (scaled < 1e17L || scaled >= 1e18L)
+		goto slow;
+
+	q = (uint64_t)scaled;
+	rem = (long double)(q % 10000000) + (scaled - (long double)q);
+	hi = q / 10000000;
+	if (rem > 4999999.0L && rem < 5000001.0L)
+		goto slow;
+
+	e10 = 17 - k;
+	if (rem > 5000000.0L && ++hi == 100000000000ULL) {
+		hi = 10000000000ULL;
+		++e10;
+	}
+
+	*--p = (char)('0' + (e10 < 0 ? -e10 : e10) % 10);
+	*--p = (char)('0' + (e10 < 0 ? -e10 : e10) / 10);
+	*--p = e10 < 0 ? '-' : '+';
+	*--p = 'e';
+	for (int i = 0; i < 10; ++i, hi /= 10)
+		*--p = (char)('0' + hi % 10);
+	*--p = '.';
+	*--p = (char)('0' + hi);
+
+	ob_pad(ob, (size_t)(buf + sizeof(buf) - p), (size_t)width);
+	ob_write(ob, p, (size_t)(buf + sizeof(buf) - p));
+	return;
+
+slow:
+	ob->len += (size_t)snprintf(ob_reserve(ob, OUTBUF_FIELD), OUTBUF_FIELD,
+				    "%#*.10Le", width, val);
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <ctype.h>
+#include <string.h>
+
+#define ALIGNMENT_MASK_4BIT 0xF
+
+/* Case insensitive string comparison */
+static inline int bstricmp(const char *s1, const char *s2)
+{
+	while ((int)*s1 && (tolower((int)*s1) == tolower((int)*s2))) {
+		++s1;
+		++s2;
+	}
+	return *(const unsigned char *)s1 - *(const unsigned char *)s2;
+}
+
+/*
+ * Just a safe strncpy(3)
+ * Always null ('\0') terminates if both src and dest are valid pointers.
+ * Returns the number of bytes copied including terminating null byte.
+ */
+static inline size_t bstrlcpy(char *dest, const char *src, size_t n)
+{
+	unsigned long *s, *d;
+	size_t len, blocks;
+	const unsigned int lsize = sizeof(unsigned long);
+	const unsigned int WORD_SHIFT = (sizeof(unsigned long) == 8) ? 3 : 2;
+
+	if (!src || !dest || !n)
+		return 0;
+
+	len = strlen(src) + 1;
+	if (n > len)
+		n = len;
+	else if (len > n)
+		/* Save total number of bytes to copy in len */
+		len = n;
+
+	/*
+	 * To enable -O3 ensure src and dest are 16-byte aligned
+	 * More info: http://www.felixcloutier.com/x86/MOVDQA.html
+	 */
+	if ((n >= lsize) && (((unsigned long)src & ALIGNMENT_MASK_4BIT) == 0
+	    && ((unsigned long)dest & ALIGNMENT_MASK_4BIT) == 0)) {
+		s = (unsigned long *)src;
+		d = (unsigned long *)dest;
+		blocks = n >> WORD_SHIFT;
+		n &= lsize - 1;
+
+		while (blocks) {
+			*d = *s;
+			++d, ++s;
+			--blocks;
+		}
+
+		if (!n) {
+			dest = (char *)d;
+			*--dest = '\0'; // NOLINT
+			return len;
+		}
+
+		src = (char *)s;
+		dest = (char *)d;
+	}
+
+	while (--n && (*dest = *src))
+		++dest, ++src;
+
+	if (!n)
+		*dest = '\0';
+
+	return len;
+}
+
+/* Trim ending newline and whitespace from both ends, in place */
+static inline void strstrip(char *s)
+{
+	if (!s || !*s)
+		return;
+
+	int len = (int)strlen(s) - 1;
+
+	if (s[len] == '\n')
+		--len;
+	while (len >= 0 && (isspace((int)s[len]) || s[len] == '\"' || s[len] == '\''))
+		--len;
+	s[len + 1] = '\0';
+
+	len = 0;
+	while (s[len] && (isspace((int)s[len]) || s[len] == '\"' || s[len] == '\''))
+		++len;
+
+	if (len) {
+		while (s[len]) {
+			*s = s[len];
+			++s;
+		}
+
+		*s = '\0';
+	}
+}
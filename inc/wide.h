@@ -0,0 +1,433 @@
+/*
+ * Wide integer arithmetic on 64-bit limbs
+ *
+ * Author: Arun Prakash Jana <engineerarun@gmail.com>
+ * Copyright (C) 2016 by Arun Prakash Jana <engineerarun@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bcal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Numbers are little endian limbs modulo 2^(64 * n), n being the width
+ * in limbs passed to the operations that can carry out of it. Only the
+ * len low limbs are significant, len is 0 for zero and the limbs above
+ * it are never read. Every loop stops at len, so values that fit in a
+ * limb or two cost about as much as the native types.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "bcal.h"
+
+typedef bcal_wide wide_t;
+
+/* Low 64 bits of a * b, the high ones in *hi */
+static inline uint64_t w_mul64(uint64_t a, uint64_t b, uint64_t *hi)
+{
+#ifdef __SIZEOF_INT128__
+	__uint128_t p = (__uint128_t)a * b;
+
+	*hi = (uint64_t)(p >> 64);
+	return (uint64_t)p;
+#else
+	uint64_t al = a & 0xffffffff, ah = a >> 32;
+	uint64_t bl = b & 0xffffffff, bh = b >> 32;
+	uint64_t ll = al * bl, lh = al * bh, hl = ah * bl, hh = ah * bh;
+	uint64_t mid = (ll >> 32) + (lh & 0xffffffff) + (hl & 0xffffffff);
+
+	*hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+	return (mid << 32) | (ll & 0xffffffff);
+#endif
+}
+
+/* (hi:lo) / d with hi < d, the remainder in *rem */
+static inline uint64_t w_div128(uint64_t hi, uint64_t lo, uint64_t d, uint64_t *rem)
+{
+#ifdef __SIZEOF_INT128__
+	__uint128_t n = ((__uint128_t)hi << 64) | lo;
+
+	*rem = (uint64_t)(n % d);
+	return (uint64_t)(n / d);
+#else
+	uint64_t q = 0;
+
+	for (int i = 63; i >= 0; --i) {
+		bool top = hi >> 63;
+
+		hi = (hi << 1) | (lo >> 63);
+		lo <<= 1;
+		if (top || hi >= d) {
+			hi -= d;
+			q |= 1ULL << i;
+		}
+	}
+
+	*rem = hi;
+	return q;
+#endif
+}
+
+/* Drop the zero limbs at the top */
+static inline void w_norm(wide_t *r)
+{
+	while (r->len && !r->limb[r->len - 1])
+		--r->len;
+}
+
+/* r = a, only the significant limbs are copied */
+static inline void w_copy(wide_t *r, const wide_t *a)
+{
+	r->len = a->len;
+	memcpy(r->limb, a->limb, a->len * sizeof(uint64_t));
+}
+
+static inline void w_set(wide_t *r, uint64_t v)
+{
+	r->limb[0] = v;
+	r->len = v ? 1 : 0;
+}
+
+static inline void w_set_uint(wide_t *r, bcal_uint v)
+{
+	r->len = 0;
+	while (v) {
+		r->limb[r->len++] = (uint64_t)v;
+		v = (sizeof(v) > 8) ? v >> 32 >> 32 : 0;
+	}
+}
+
+/* a as a bcal_uint, false if it doesn't fit */
+static inline bool w_get_uint(const wide_t *a, bcal_uint *v)
+{
+	if (a->len * sizeof(uint64_t) > sizeof(bcal_uint))
+		return false;
+
+	*v = 0;
+	for (unsigned i = a->len; i--;)
+		*v = (*v << 32 << 32) | a->limb[i];
+
+	return true;
+}
+
+static inline bool w_iszero(const wide_t *a)
+{
+	return !a->len;
+}
+
+/* Number of significant bits */
+static inline unsigned w_bits(const wide_t *a)
+{
+	if (!a->len)
+		return 0;
+
+	return (a->len << 6) - (unsigned)__builtin_clzll(a->limb[a->len - 1]);
+}
+
+static inline int w_cmp(const wide_t *a, const wide_t *b)
+{
+	if (a->len != b->len)
+		return a->len < b->len ? -1 : 1;
+
+	for (unsigned i = a->len; i--;)
+		if (a->limb[i] != b->limb[i])
+			return a->limb[i] < b->limb[i] ? -1 : 1;
+
+	return 0;
+}
+
+/* r = a + b, true if it carried out of n limbs. r may alias a or b. */
+static inline bool w_add(wide_t *r, const wide_t *a, const wide_t *b, unsigned n)
+{
+	const wide_t *s = a->len >= b->len ? a : b, *t = a->len >= b->len ? b : a;
+	unsigned len = s->len, i;
+	uint64_t carry = 0;
+
+	for (i = 0; i < t->len; ++i) {
+		uint64_t x = s->limb[i] + t->limb[i];
+		uint64_t c = x < s->limb[i];
+
+		r->limb[i] = x + carry;
+		carry = c | (r->limb[i] < x);
+	}
+
+	for (; i < len; ++i) {
+		r->limb[i] = s->limb[i] + carry;
+		carry = carry && !r->limb[i];
+	}
+
+	r->len = len;
+	if (carry) {
+		if (len == n) {
+			w_norm(r);
+			return true;
+		}
+		r->limb[r->len++] = 1;
+	}
+
+	return false;
+}
+
+/* r += v, true if it carried out of n limbs */
+static inline bool w_add_u64(wide_t *r, uint64_t v, unsigned n)
+{
+	unsigned i;
+
+	for (i = 0; v && i < r->len; ++i) {
+		r->limb[i] += v;
+		v = r->limb[i] < v;
+	}
+
+	if (v) {
+		if (r->len == n)
+			return true;
+		r->limb[r->len++] = v;
+	}
+
+	return false;
+}
+
+/* r = a - b, a must not be less than b. r may alias a or b. */
+static inline void w_sub(wide_t *r, const wide_t *a, const wide_t *b)
+{
+	uint64_t borrow = 0;
+	unsigned i;
+
+	for (i = 0; i < b->len; ++i) {
+		uint64_t x = a->limb[i] - b->limb[i];
+		uint64_t c = a->limb[i] < b->limb[i];
+
+		r->limb[i] = x - borrow;
+		borrow = c | (x < borrow);
+	}
+
+	for (; i < a->len; ++i) {
+		uint64_t x = a->limb[i];
+
+		r->limb[i] = x - borrow;
+		borrow = borrow && !x;
+	}
+
+	r->len = a->len;
+	w_norm(r);
+}
+
+/* r = a * m, true if it overflowed n limbs. r may alias a. */
+static inline bool w_mul_u64(wide_t *r, const wide_t *a, uint64_t m, unsigned n)
+{
+	uint64_t carry = 0, hi;
+	unsigned i;
+
+	if (!m) {
+		r->len = 0;
+		return false;
+	}
+
+	for (i = 0; i < a->len; ++i) {
+		uint64_t lo = w_mul64(a->limb[i], m, &hi);
+
+		r->limb[i] = lo + carry;
+		carry = hi + (r->limb[i] < lo);
+	}
+
+	r->len = a->len;
+	if (carry) {
+		if (r->len == n) {
+			w_norm(r);
+			return true;
+		}
+		r->limb[r->len++] = carry;
+	}
+
+	return false;
+}
+
+/* r = a * b, true if it overflowed n limbs. r must not alias a or b. */
+static inline bool w_mul(wide_t *r, const wide_t *a, const wide_t *b, unsigned n)
+{
+	bool over = false;
+	unsigned i, j;
+
+	if (!a->len || !b->len) {
+		r->len = 0;
+		return false;
+	}
+
+	if (b->len == 1)
+		return w_mul_u64(r, a, b->limb[0], n);
+	if (a->len == 1)
+		return w_mul_u64(r, b, a->limb[0], n);
+
+	r->len = a->len + b->len > n ? n : a->len + b->len;
+	memset(r->limb, 0, r->len * sizeof(uint64_t));
+
+	for (i = 0; i < a->len; ++i) {
+		uint64_t carry = 0, hi;
+
+		for (j = 0; j < b->len && i + j < n; ++j) {
+			uint64_t lo = w_mul64(a->limb[i], b->limb[j], &hi);
+
+			lo += carry;
+			hi += lo < carry;
+			r->limb[i + j] += lo;
+			carry = hi + (r->limb[i + j] < lo);
+		}
+
+		if (i + j < n)
+			r->limb[i + j] = carry;
+		else if (carry)
+			over = true;
+
+		/* The products that would land above n limbs */
+		for (; j < b->len && !over; ++j)
+			over = a->limb[i] && b->limb[j];
+	}
+
+	w_norm(r);
+	return over;
+}
+
+/* q = a / d, returns the remainder. q may alias a. */
+static inline uint64_t w_divmod_u64(wide_t *q, const wide_t *a, uint64_t d)
+{
+	uint64_t rem = 0;
+
+	for (unsigned i = a->len; i--;)
+		q->limb[i] = w_div128(rem, a->limb[i], d, &rem);
+
+	q->len = a->len;
+	w_norm(q);
+	return rem;
+}
+
+/* r = a << s in n limbs, r may alias a */
+static inline void w_shl(wide_t *r, const wide_t *a, unsigned s, unsigned n)
+{
+	unsigned words = s >> 6, bits = s & 63, len;
+
+	if (!a->len || s >= n << 6) {
+		r->len = 0;
+		return;
+	}
+
+	len = a->len + words + 1 > n ? n : a->len + words + 1;
+	for (unsigned i = len; i-- > words;) {
+		uint64_t v = (i - words < a->len) ? a->limb[i - words] << bits : 0;
+
+		if (bits && i - words >= 1 && i - words - 1 < a->len)
+			v |= a->limb[i - words - 1] >> (64 - bits);
+		r->limb[i] = v;
+	}
+	memset(r->limb, 0, words * sizeof(uint64_t));
+
+	r->len = len;
+	w_norm(r);
+}
+
+/* r = a >> s, r may alias a */
+static inline void w_shr(wide_t *r, const wide_t *a, unsigned s)
+{
+	unsigned words = s >> 6, bits = s & 63, len;
+
+	if (words >= a->len) {
+		r->len = 0;
+		return;
+	}
+
+	len = a->len - words;
+	for (unsigned i = 0; i < len; ++i) {
+		uint64_t v = a->limb[i + words] >> bits;
+
+		if (bits && i + words + 1 < a->len)
+			v |= a->limb[i + words + 1] << (64 - bits);
+		r->limb[i] = v;
+	}
+
+	r->len = len;
+	w_norm(r);
+}
+
+/*
+ * q = a / b and r = a % b, b must not be 0. Divisors of a limb take
+ * the short path, others are shifted and subtracted a bit at a time.
+ * q and r must not alias a or b.
+ */
+static inline void w_divmod(wide_t *q, wide_t *r, const wide_t *a, const wide_t *b)
+{
+	wide_t d;
+	int shift;
+
+	if (b->len == 1) {
+		w_set(r, w_divmod_u64(q, a, b->limb[0]));
+		return;
+	}
+
+	w_copy(r, a);
+	q->len = 0;
+	if (w_cmp(a, b) < 0)
+		return;
+
+	shift = (int)w_bits(a) - (int)w_bits(b);
+	w_shl(&d, b, (unsigned)shift, BCAL_WIDE_LIMBS);
+	q->len = (unsigned)(shift >> 6) + 1;
+	memset(q->limb, 0, q->len * sizeof(uint64_t));
+
+	for (; shift >= 0; --shift) {
+		if (w_cmp(r, &d) >= 0) {
+			w_sub(r, r, &d);
+			q->limb[shift >> 6] |= 1ULL << (shift & 63);
+		}
+		w_shr(&d, &d, 1);
+	}
+
+	w_norm(q);
+}
+
+/* Bitwise ops, r may alias a or b */
+static inline void w_and(wide_t *r, const wide_t *a, const wide_t *b)
+{
+	unsigned len = a->len < b->len ? a->len : b->len;
+
+	for (unsigned i = 0; i < len; ++i)
+		r->limb[i] = a->limb[i] & b->limb[i];
+
+	r->len = len;
+	w_norm(r);
+}
+
+static inline void w_orx(wide_t *r, const wide_t *a, const wide_t *b, bool x)
+{
+	const wide_t *s = a->len >= b->len ? a : b, *t = a->len >= b->len ? b : a;
+	unsigned i;
+
+	for (i = 0; i < t->len; ++i)
+		r->limb[i] = x ? s->limb[i] ^ t->limb[i] : s->limb[i] | t->limb[i];
+	for (; i < s->len; ++i)
+		r->limb[i] = s->limb[i];
+
+	r->len = s->len;
+	w_norm(r);
+}
+
+/* r = ~a in n limbs */
+static inline void w_not(wide_t *r, const wide_t *a, unsigned n)
+{
+	for (unsigned i = 0; i < n; ++i)
+		r->limb[i] = ~(i < a->len ? a->limb[i] : 0);
+
+	r->len = n;
+	w_norm(r);
+}
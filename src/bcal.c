@@ -27,43 +27,55 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <signal.h>
 #include <getopt.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 #ifndef NORL
 #include <readline/history.h>
 #include <readline/readline.h>
 #else
 #include <termios.h>
-#include <sys/stat.h>
 #endif
-#include "dslib.h"
+#include "bcal.h"
 #include "log.h"
+#include "outbuf.h"
+#include "strutil.h"
 
 #define SECTOR_SIZE 512 /* 0x200 */
 #define MAX_HEAD 16 /* 0x10 */
 #define MAX_SECTOR 63 /* 0x3f */
-#define UINT_BUF_LEN 40 /* log10(1 << 128) + '\0' */
-#define FLOAT_BUF_LEN 128
+#define UINT_BUF_LEN BCAL_UINT_BUF_LEN
 #define FLOAT_WIDTH 40
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 #define MAX_BITS 128
-#define ALIGNMENT_MASK_4BIT 0xF
 #define ELEMENTS(x) (sizeof(x) / sizeof(*(x)))
 #define BIT_VALUE_1_COLOR_DEFAULT "\033[1;97m"
+#define BATCH_SHARD_LINES 16384 /* lines per worker in a round */
+#define THREADS_PER_CPU 4 /* most -j threads per online CPU */
+#define THREADS_MIN_CPUS 16 /* CPUs assumed by the -j limit on smaller machines */
+#define SERVE_LINE_MAX 65536 /* longest request line of --serve */
+#define SERVE_OUT_MAX (1 << 20) /* queued replies that stop reading a client */
+#define SERVE_EVENTS 64
+#define EXTRACT_CHUNK (1 << 20) /* bytes read at a time by -x from a stream */
+#define AGG_LINE_MAX 256 /* longest size on a line of -a input */
+#define AGG_PART_MIN (1 << 20) /* least -a input worth a thread */
 
 typedef unsigned char uchar;
 typedef unsigned int uint;
 typedef unsigned long ulong;
 typedef unsigned long long ull;
 typedef long double maxfloat_t;
-
-#ifdef __SIZEOF_INT128__
-typedef __uint128_t maxuint_t;
-#else
-typedef __uint64_t maxuint_t;
-#endif
+typedef bcal_uint maxuint_t;
 
 /* CHS representation */
 typedef struct {
@@ -78,28 +90,36 @@ typedef struct {
 	uchar minimal : 1;
 	uchar repl    : 1;
 	uchar hexout  : 1;
-	uchar rsvd    : 2; /* Reserved for future usage */
+	uchar wide    : 1;
+	uchar total   : 1; /* running totals of -x matches */
 	uchar loglvl  : 2;
 } settings;
 
+/*
+ * Evaluation context
+ * Pairs a library context with the stream its results are printed to,
+ * independent contexts can be used concurrently from different threads.
+ */
+typedef struct {
+	bcal_ctx *bc;
+	const bcal_prog *prog; /* -e program, run for each batch line */
+	const bcal_maths *mprog; /* the same in maths mode */
+	outbuf_t out; /* results are printed here */
+} ctx_t;
+
 static char *VERSION = "2.5";
-static char *units[] = {"b", "kib", "mib", "gib", "tib", "kb", "mb", "gb", "tb"};
 static char *logarr[] = {"ERROR", "WARNING", "INFO", "DEBUG"};
 static const char *PROMPT_BYTES = "bytes> ";
 static const char *PROMPT_MATHS = "maths> ";
 
-static char *FAILED = "1";
-static char *PASSED = "\0";
-static char *curexpr = NULL;
 static char prompt[9] = "bytes> ";
 
 static const char *bit_value_1_code = BIT_VALUE_1_COLOR_DEFAULT;
 
-static char uint_buf[UINT_BUF_LEN];
-static char float_buf[FLOAT_BUF_LEN];
-
-static Data lastres = {"\0", 0};
-static settings cfg = {0, 0, 0, 0, 0, INFO};
+static settings cfg = {0, 0, 0, 0, 0, 0, INFO};
+static uint widebits = BCAL_WIDE_BITS; /* storage expressions with -w */
+static uint mathscale = BCAL_SCALE; /* digits after the point with -P */
+static uint cachesize; /* results of storage expressions kept with -C */
 
 static void get_bit_value_1_code(void)
 {
@@ -396,6 +416,8 @@ static void debug_log(const char *func, int level, const char *format, ...)
 	va_start(ap, format);
 
 	if (level <= cfg.loglvl) {
+		/* Keep a message from a batch worker thread in one piece */
+		flockfile(stderr);
 		if (cfg.loglvl == DEBUG) {
 			fprintf(stderr, "%s(), %s: ", func, logarr[level]);
 			vfprintf(stderr, format, ap);
@@ -403,67 +425,46 @@ static void debug_log(const char *func, int level, const char *format, ...)
 			fprintf(stderr, "%s: ", logarr[level]);
 			vfprintf(stderr, format, ap);
 		}
+		funlockfile(stderr);
 	}
 
 	va_end(ap);
 }
 
-/*
- * Just a safe strncpy(3)
- * Always null ('\0') terminates if both src and dest are valid pointers.
- * Returns the number of bytes copied including terminating null byte.
- */
-static size_t bstrlcpy(char *dest, const char *src, size_t n)
+/* Library messages are printed like our own */
+static void lib_log(void *arg, int level, const char *func, const char *msg)
 {
-	static ulong *s, *d;
-	static size_t len, blocks;
-	static const uint lsize = sizeof(ulong);
-	static const uint WORD_SHIFT = (sizeof(ulong) == 8) ? 3 : 2;
-
-	if (!src || !dest || !n)
-		return 0;
-
-	len = strlen(src) + 1;
-	if (n > len)
-		n = len;
-	else if (len > n)
-		/* Save total number of bytes to copy in len */
-		len = n;
-
-	/*
-	 * To enable -O3 ensure src and dest are 16-byte aligned
-	 * More info: http://www.felixcloutier.com/x86/MOVDQA.html
-	 */
-	if ((n >= lsize) && (((ulong)src & ALIGNMENT_MASK_4BIT) == 0
-	    && ((ulong)dest & ALIGNMENT_MASK_4BIT) == 0)) {
-		s = (ulong *)src;
-		d = (ulong *)dest;
-		blocks = n >> WORD_SHIFT;
-		n &= lsize - 1;
-
-		while (blocks) {
-			*d = *s;
-			++d, ++s;
-			--blocks;
-		}
+	debug_log(func, level, "%s", msg);
+}
 
-		if (!n) {
-			dest = (char *)d;
-			*--dest = '\0'; // NOLINT
-			return len;
-		}
+/* Apply the current settings to a context */
+static void ctx_config(ctx_t *ctx)
+{
+	bcal_set_log(ctx->bc, cfg.loglvl, lib_log, NULL);
+	bcal_set_flags(ctx->bc, cfg.hexout ? BCAL_FLAG_HEX : 0);
+	bcal_set_width(ctx->bc, widebits);
+	bcal_set_scale(ctx->bc, mathscale);
+	bcal_set_cache(ctx->bc, cachesize);
+}
 
-		src = (char *)s;
-		dest = (char *)d;
+static bool ctx_init(ctx_t *ctx, FILE *out)
+{
+	ob_init(&ctx->out, out);
+	ctx->bc = bcal_ctx_new();
+	if (!ctx->bc) {
+		log(ERROR, "out of memory\n");
+		return false;
 	}
 
-	while (--n && (*dest = *src))
-		++dest, ++src;
-
-	if (!n)
-		*dest = '\0';
+	ctx_config(ctx);
+	return true;
+}
 
-	return len;
+/* Release the storage held by a context */
+static void ctx_free(ctx_t *ctx)
+{
+	bcal_ctx_free(ctx->bc);
+	ctx->bc = NULL;
 }
 
 static bool program_exit(const char *str)
@@ -487,1667 +488,340 @@ static void remove_commas(char *str)
 	*iter1 = '\0';
 }
 
-static bool has_function_call(const char *str)
+/* Evaluate a maths expression and print the result */
+static int evaluate_maths(ctx_t *ctx, const char *expr)
 {
-	if (!str || !*str)
-		return false;
+	char res[UINT_BUF_LEN];
 
-	for (size_t i = 0; str[i] != '\0'; ++i) {
-		if (isalpha((unsigned char)str[i])) {
-			size_t j = i + 1;
-			while (isalnum((unsigned char)str[j]))
-				++j;
-			while (isspace((unsigned char)str[j]))
-				++j;
-			if (str[j] == '(')
-				return true;
-			i = j;
-		}
+	if (bcal_eval_maths(ctx->bc, expr, res, UINT_BUF_LEN) != BCAL_OK) {
+		log(ERROR, "%s\n", bcal_errmsg(ctx->bc));
+		return -1;
 	}
 
-	return false;
+	/* Exact products can be longer than res */
+	ob_puts(&ctx->out, bcal_last(ctx->bc, NULL));
+	ob_putc(&ctx->out, '\n');
+	return 0;
 }
 
-static void remove_thousands_commas(char *str)
+static void printbin(ctx_t *ctx, maxuint_t n)
 {
-	if (!str || !*str)
-		return;
+	int count = MAX_BITS - 1;
+	int pos = MAX_BITS + (MAX_BITS >> 2) - 1;
+	char binstr[MAX_BITS + (MAX_BITS >> 2) + 1] = {0};
 
-	size_t read = 0;
-	size_t write = 0;
-	int func_paren_depth = 0;
-
-	while (str[read] != '\0') {
-		if (str[read] == '(') {
-			/* Check if this is a function call by looking back for an identifier */
-			int is_function = 0;
-			if (write > 0) {
-				size_t j = write - 1;
-				/* Skip back over alphanumeric characters */
-				while (j > 0 && isalnum((unsigned char)str[j]))
-					j--;
-				/* If we found alphanumeric chars right before '(', it's likely a function */
-				if ((j < write - 1 && isalpha((unsigned char)str[j + 1])) ||
-				    (write > 0 && isalpha((unsigned char)str[write - 1])))
-					is_function = 1;
-			}
-			if (is_function)
-				func_paren_depth++;
-			str[write++] = str[read++];
-		} else if (str[read] == ')') {
-			if (func_paren_depth > 0)
-				func_paren_depth--;
-			str[write++] = str[read++];
-		} else if (str[read] == ',') {
-			/* Don't process comma if we're inside a function call */
-			if (func_paren_depth > 0) {
-				str[write++] = str[read++];
-			} else {
-				/* Check if this is a thousands separator */
-				if (read > 0 && isdigit((unsigned char)str[read - 1]) &&
-				    isdigit((unsigned char)str[read + 1])) {
-					size_t k = read + 1;
-					int digits = 0;
-
-					while (isdigit((unsigned char)str[k])) {
-						++digits;
-						++k;
-						if (digits > 3)
-							break;
-					}
+	if (!n) {
+		ob_putc(&ctx->out, '0');
+		return;
+	}
 
-					if (digits == 3) {
-						++read;
-						continue;
-					}
-				}
-				str[write++] = str[read++];
-			}
-		} else {
-			str[write++] = str[read++];
+	while (n && count >= 0) {
+		binstr[pos] = "01"[n & 1];
+		--pos;
+		n >>= 1;
+		if (n && count && !(count & 7)) {
+			binstr[pos] = ' ';
+			--pos;
 		}
+		--count;
 	}
 
-	str[write] = '\0';
-}
+	++pos;
 
-typedef struct {
-	char *digits;
-	size_t len;
-	int scale;
-	bool negative;
-} decnum_t;
+	ob_write(&ctx->out, binstr + pos, sizeof(binstr) - 1 - pos);
+}
 
-static bool parse_decimal_token(const char *start, size_t len, decnum_t *out)
+static void printbin_positions(ctx_t *ctx, maxuint_t n)
 {
-	if (!start || !out || len == 0)
-		return false;
+	if (!n) {
+		ob_putc(&ctx->out, '0');
+		return;
+	}
 
-	bool negative = false;
-	bool seen_dot = false;
-	bool seen_digit = false;
-	int scale = 0;
-	size_t i = 0;
+	ob_putc(&ctx->out, '\n');
 
-	if (start[i] == '+' || start[i] == '-') {
-		negative = (start[i] == '-');
-		++i;
-		if (i >= len)
-			return false;
+	/* Find the highest bit position */
+	int highest_bit = 0;
+	maxuint_t temp = n;
+	while (temp) {
+		highest_bit++;
+		temp >>= 1;
 	}
+	highest_bit--; /* Adjust to 0-based */
 
-	char *digits = (char *)malloc(len + 1);
-	if (!digits)
-		return false;
+	/* Print positions 0-31, 32-63, etc. Always print all positions in each row */
+	for (int start_bit = 0; start_bit <= 127; start_bit += 32) {
+		int end_bit = start_bit + 31;
 
-	size_t dpos = 0;
-	for (; i < len; ++i) {
-		unsigned char ch = (unsigned char)start[i];
-		if (isdigit(ch)) {
-			digits[dpos++] = (char)ch;
-			seen_digit = true;
-			if (seen_dot)
-				++scale;
-		} else if (ch == '.' && !seen_dot) {
-			seen_dot = true;
-		} else {
-			free(digits);
-			return false;
-		}
-	}
+		/* Skip rows where no bits exist in the value */
+		if (start_bit > highest_bit)
+			break;
 
-	if (!seen_digit) {
-		free(digits);
-		return false;
-	}
+		/* Print bit positions for this row (MSB to LSB) */
+		for (int bit = end_bit; bit >= start_bit; --bit) {
+			maxuint_t bit_value = (bit <= highest_bit) ? ((n >> bit) & 1) : 0;
+			if (bit_value == 1 && bit_value_1_code && bit_value_1_code[0] != '\0') {
+				ob_puts(&ctx->out, "\033[7m");
+				ob_uint(&ctx->out, (maxuint_t)bit, 3);
+				ob_puts(&ctx->out, "\033[0m ");
+			} else {
+				ob_uint(&ctx->out, (maxuint_t)bit, 3);
+				ob_putc(&ctx->out, ' ');
+			}
+		}
+		ob_putc(&ctx->out, '\n');
 
-	/* Trim leading zeros, but keep at least one digit */
-	size_t first = 0;
-	while (first + 1 < dpos && digits[first] == '0')
-		++first;
-	if (first > 0) {
-		memmove(digits, digits + first, dpos - first);
-		dpos -= first;
+		/* Print bit values for this row (MSB to LSB) - only if bit exists in value */
+		for (int bit = end_bit; bit >= start_bit; --bit) {
+			if (bit <= highest_bit) {
+				int bit_value = (int)(n >> bit) & 1;
+				if (bit_value == 1 && bit_value_1_code && bit_value_1_code[0] != '\0') {
+					ob_puts(&ctx->out, "  ");
+					ob_puts(&ctx->out, bit_value_1_code);
+					ob_puts(&ctx->out, "1\033[0m ");
+				} else
+					ob_puts(&ctx->out, bit_value ? "  1 " : "  0 ");
+			} else
+				ob_puts(&ctx->out, "    ");  /* Leave blank for bits beyond the value */
+		}
+		ob_puts(&ctx->out, "\n\n");
 	}
+}
 
-	digits[dpos] = '\0';
+static void printval(ctx_t *ctx, maxfloat_t val, const char *unit)
+{
+	if (val - (maxuint_t)val == 0) // NOLINT
+		ob_uint(&ctx->out, (maxuint_t)val, FLOAT_WIDTH);
+	else
+		ob_sci(&ctx->out, val, FLOAT_WIDTH);
 
-	out->digits = digits;
-	out->len = dpos;
-	out->scale = scale;
-	out->negative = negative;
-	return true;
+	ob_putc(&ctx->out, ' ');
+	ob_puts(&ctx->out, unit);
+	ob_putc(&ctx->out, '\n');
 }
 
-static char *mul_digits(const char *a, size_t la, const char *b, size_t lb, size_t *out_len)
+static void printhex_u128(ctx_t *ctx, maxuint_t n)
 {
-	if (!a || !b || la == 0 || lb == 0)
-		return NULL;
+	ull high = (ull)(n >> (sizeof(maxuint_t) << 2));
 
-	size_t n = la + lb;
-	int *acc = (int *)calloc(n, sizeof(int));
-	if (!acc)
-		return NULL;
+	ob_puts(&ctx->out, "0x");
+	if (high)
+		ob_hex(&ctx->out, high);
+	ob_hex(&ctx->out, (ull)n);
+}
 
-	for (size_t i = 0; i < la; ++i) {
-		int da = a[la - 1 - i] - '0';
-		for (size_t j = 0; j < lb; ++j) {
-			int db = b[lb - 1 - j] - '0';
-			acc[n - 1 - (i + j)] += da * db;
-		}
-	}
+/* "%*s" of a wide integer in base 10 or 16 */
+static void printwide(ctx_t *ctx, const bcal_wide *n, int base, int width)
+{
+	char buf[BCAL_WIDE_BUF_LEN];
+	char *p = bcal_wide_str(n, base, buf);
+	size_t len = (size_t)(buf + BCAL_WIDE_BUF_LEN - 1 - p);
 
-	for (size_t k = n - 1; k > 0; --k) {
-		if (acc[k] >= 10) {
-			acc[k - 1] += acc[k] / 10;
-			acc[k] %= 10;
-		}
-	}
+	ob_pad(&ctx->out, len, (size_t)width);
+	ob_write(&ctx->out, p, len);
+}
 
-	size_t start = 0;
-	while (start + 1 < n && acc[start] == 0)
-		++start;
+/* Binary of a wide integer, grouped in bytes like printbin() */
+static void printbin_wide(ctx_t *ctx, const bcal_wide *n)
+{
+	char buf[BCAL_WIDE_BUF_LEN];
+	char *p = bcal_wide_str(n, 2, buf);
+	size_t len = (size_t)(buf + BCAL_WIDE_BUF_LEN - 1 - p);
+	size_t head = (len & 7) ? (len & 7) : 8;
 
-	size_t len = n - start;
-	char *digits = (char *)malloc(len + 1);
-	if (!digits) {
-		free(acc);
-		return NULL;
+	ob_write(&ctx->out, p, head);
+	for (p += head, len -= head; len; p += 8, len -= 8) {
+		ob_putc(&ctx->out, ' ');
+		ob_write(&ctx->out, p, 8);
 	}
-
-	for (size_t i = 0; i < len; ++i)
-		digits[i] = (char)('0' + acc[start + i]);
-	digits[len] = '\0';
-
-	free(acc);
-	if (out_len)
-		*out_len = len;
-	return digits;
 }
 
-static bool round_digits(char **digits, size_t *len, int *scale, int desired_scale)
+/* Print a size in bytes, right aligned in the conversion table */
+static void printsize(ctx_t *ctx, maxuint_t bytes, int width)
 {
-	if (!digits || !*digits || !len || !scale)
-		return false;
+	ob_uint(&ctx->out, bytes, width);
+	ob_puts(&ctx->out, " B\n");
+}
 
-	if (*len <= (size_t)(*scale)) {
-		size_t pad = (size_t)(*scale) - *len + 1;
-		char *tmp = (char *)malloc(*len + pad + 1);
-		if (!tmp)
-			return false;
-		memset(tmp, '0', pad);
-		memcpy(tmp + pad, *digits, *len + 1);
-		free(*digits);
-		*digits = tmp;
-		*len += pad;
-	}
-
-	if (*scale > desired_scale) {
-		int drop = *scale - desired_scale;
-		size_t keep_len = *len - (size_t)drop;
-		char round_digit = (*digits)[keep_len];
-
-		if (round_digit >= '5') {
-			size_t idx = keep_len;
-			while (idx > 0) {
-				--idx;
-				if ((*digits)[idx] < '9') {
-					(*digits)[idx]++;
-					break;
-				}
-				(*digits)[idx] = '0';
-			}
+/* This function adds check for binary input to strtoul() */
+static ulong strtoul_b(char *token)
+{
+	int base = 0;
 
-			if (idx == 0 && (*digits)[0] == '0') {
-				char *tmp = (char *)malloc(*len + 2);
-				if (!tmp)
-					return false;
-				tmp[0] = '1';
-				memcpy(tmp + 1, *digits, *len + 1);
-				free(*digits);
-				*digits = tmp;
-				++*len;
-				++keep_len;
-			}
-		}
+	/* NOTE: no NULL check here! */
 
-		(*digits)[keep_len] = '\0';
-		*len = keep_len;
-		*scale = desired_scale;
-	} else if (*scale < desired_scale) {
-		size_t pad = (size_t)(desired_scale - *scale);
-		char *tmp = (char *)malloc(*len + pad + 1);
-		if (!tmp)
-			return false;
-		memcpy(tmp, *digits, *len);
-		memset(tmp + *len, '0', pad);
-		tmp[*len + pad] = '\0';
-		free(*digits);
-		*digits = tmp;
-		*len += pad;
-		*scale = desired_scale;
+	if (strlen(token) > 2 && token[0] == '0' &&
+	    (token[1] == 'b' || token[1] == 'B')) {
+		base = 2;
 	}
 
-	return true;
+	return strtoul(token + base, NULL, base);
 }
 
-static void trim_trailing_zeros(char *buf)
+/*
+ * Threads for -j N, 0 is one per online CPU
+ * More than a few per CPU only cost memory, so N is capped.
+ * Returns -1 if N isn't a decimal number up to the cap.
+ */
+static int parse_threads(const char *str)
 {
-	char *dot = strchr(buf, '.');
-	if (!dot)
-		return;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	long max = (cpus > THREADS_MIN_CPUS ? cpus : THREADS_MIN_CPUS) * THREADS_PER_CPU;
+	ulong n = strtoul(str, NULL, 10);
 
-	char *end = buf + strlen(buf) - 1;
-	while (end > dot && *end == '0')
-		--end;
+	if (!*str || str[strspn(str, "0123456789")] || n > (ulong)max) {
+		log(ERROR, "threads must be 0 to %ld\n", max);
+		return -1;
+	}
 
-	if (end == dot)
-		*dot = '\0';
-	else
-		*(end + 1) = '\0';
+	if (n)
+		return (int)n;
+	return cpus > 0 ? (int)cpus : 1;
 }
 
-static bool format_decimal_result(char *digits, size_t len, int scale, bool negative,
-				 char *buf, size_t buflen)
+/* This function adds check for binary input to strtoull() */
+static ull strtoull_b(char *token)
 {
-	if (!digits || !buf || buflen == 0)
-		return false;
+	int base = 0;
 
-	if (len == 1 && digits[0] == '0')
-		negative = false;
+	/* NOTE: no NULL check here! */
 
-	size_t int_len = len - (size_t)scale;
-	size_t needed = len + (scale ? 1 : 0) + (negative ? 1 : 0) + 1;
-	if (needed > buflen)
-		return false;
+	if (strlen(token) > 2 && token[0] == '0' &&
+	    (token[1] == 'b' || token[1] == 'B')) {
+		base = 2;
+	}
+
+	return strtoull(token + base, NULL, base);
+}
 
-	size_t pos = 0;
-	if (negative)
-		buf[pos++] = '-';
+/* Print a size in all units, each standard in its own section */
+static void printbytes(ctx_t *ctx, const bcal_result *res)
+{
+	static const struct {
+		int base;
+		const char *title;
+	} sections[] = {
+		{2, "\n            IEC standard (base 2)\n\n"},
+		{10, "\n            SI standard (base 10)\n\n"},
+	};
 
-	memcpy(buf + pos, digits, int_len);
-	pos += int_len;
-	if (scale) {
-		buf[pos++] = '.';
-		memcpy(buf + pos, digits + int_len, (size_t)scale);
-		pos += (size_t)scale;
+	if (cfg.minimal) {
+		printsize(ctx, res->value, 0);
+		return;
 	}
-	buf[pos] = '\0';
 
-	trim_trailing_zeros(buf);
-	return true;
+	printsize(ctx, res->value, FLOAT_WIDTH);
+
+	for (size_t i = 0; i < ELEMENTS(sections); ++i) {
+		ob_puts(&ctx->out, sections[i].title);
+		for (int unit = 0; unit < BCAL_UNITS; ++unit)
+			if (bcal_unit(unit)->base == sections[i].base)
+				printval(ctx, bcal_unit_value(res, unit), bcal_unit(unit)->name);
+	}
 }
 
-static bool eval_decimal_multiply(const char *expr, char *out, size_t out_len)
+static bool chs2lba(char *chs, maxuint_t *lba)
 {
-	if (!expr || !out || out_len == 0)
-		return false;
+	int token_no = 0;
+	char *ptr, *token;
+	ulong param[5] = {0, 0, 0, MAX_HEAD, MAX_SECTOR};
 
-	const char *p = expr;
-	while (isspace((unsigned char)*p))
-		++p;
+	ptr = token = chs;
 
-	const char *a_start = p;
-	while (*p && (isdigit((unsigned char)*p) || *p == '.' || *p == '+' || *p == '-'))
-		++p;
-	size_t a_len = (size_t)(p - a_start);
-	if (a_len == 0)
-		return false;
+	while (*ptr && token_no < 5) {
+		if (*ptr == '-') {
+			/* Replace '-' with NULL and get the token */
+			*ptr = '\0';
+			param[token_no] = strtoul_b(token);
+			++token_no;
+			/* Restore the '-' */
+			*ptr = '-';
+			++ptr;
+			/* Point to start of next token */
+			token = ptr;
 
-	while (isspace((unsigned char)*p))
-		++p;
-	if (*p != '*')
-		return false;
-	++p;
-
-	while (isspace((unsigned char)*p))
-		++p;
-	const char *b_start = p;
-	while (*p && (isdigit((unsigned char)*p) || *p == '.' || *p == '+' || *p == '-'))
-		++p;
-	size_t b_len = (size_t)(p - b_start);
-	if (b_len == 0)
-		return false;
+			if (*ptr == '\0' && token_no < 5) {
+				param[token_no] = strtoul_b(token);
+				++token_no;
+			}
 
-	while (isspace((unsigned char)*p))
-		++p;
-	if (*p != '\0')
-		return false;
+			continue;
+		}
+
+		++ptr;
+
+		if (*ptr == '\0' && token_no < 5) {
+			param[token_no] = strtoul_b(token);
+			++token_no;
+		}
+	}
 
-	decnum_t a = {0};
-	decnum_t b = {0};
-	if (!parse_decimal_token(a_start, a_len, &a))
+	/* Fail if CHS is omitted */
+	if (token_no < 3) {
+		log(ERROR, "CHS missing\n");
 		return false;
-	if (!parse_decimal_token(b_start, b_len, &b)) {
-		free(a.digits);
+	}
+
+	if (!param[3]) {
+		log(ERROR, "MAX_HEAD = 0\n");
 		return false;
 	}
 
-	size_t prod_len = 0;
-	char *prod = mul_digits(a.digits, a.len, b.digits, b.len, &prod_len);
-	if (!prod) {
-		free(a.digits);
-		free(b.digits);
+	if (!param[4]) {
+		log(ERROR, "MAX_SECTOR = 0\n");
 		return false;
 	}
 
-	int scale = a.scale + b.scale;
-	bool negative = (a.negative != b.negative);
+	if (!param[2]) {
+		log(ERROR, "S = 0\n");
+		return false;
+	}
 
-	if (!round_digits(&prod, &prod_len, &scale, 10)) {
-		free(a.digits);
-		free(b.digits);
-		free(prod);
+	if (param[1] > param[3]) {
+		log(ERROR, "H > MAX_HEAD\n");
 		return false;
 	}
 
-	bool ok = format_decimal_result(prod, prod_len, scale, negative, out, out_len);
+	if (param[2] > param[4]) {
+		log(ERROR, "S > MAX_SECTOR\n");
+		return false;
+	}
 
-	free(a.digits);
-	free(b.digits);
-	free(prod);
-	return ok;
-}
+	*lba = (maxuint_t)param[3] * param[4] * param[0]; /* MH * MS * C */
+	*lba += (maxuint_t)param[4] * param[1]; /* MS * H */
 
-/* Evaluate arithmetic expression */
-static int eval_expr(char *expr_str, maxfloat_t *result);
+	*lba += param[2] - 1; /* S - 1 */
 
-/* Forward declarations for recursive descent parser */
-static int parse_expr(const char *expr, int *pos, maxfloat_t *result);
-static int parse_factor(const char *expr, int *pos, maxfloat_t *result);
-static int parse_term(const char *expr, int *pos, maxfloat_t *result);
-static char *fixexpr(char *exp, int *unitless);
+	printf("\033[1mCHS2LBA\033[0m\n");
+	printf("  C:%lu  H:%lu  S:%lu  MAX_HEAD:%lu  MAX_SECTOR:%lu\n",
+		param[0], param[1], param[2], param[3], param[4]);
 
-/* Skip whitespace */
-static void skip_space(const char *expr, int *pos)
-{
-	while (expr[*pos] && isspace(expr[*pos]))
-		(*pos)++;
+	return true;
 }
 
-/* Parse primary expression: numbers, parentheses, functions */
-static int parse_factor(const char *expr, int *pos, maxfloat_t *result)
+static bool lba2chs(ctx_t *ctx, char *lba, t_chs *p_chs)
 {
-	skip_space(expr, pos);
+	int token_no = 0;
+	char *ptr, *token;
+	ull param[3] = {0, MAX_HEAD, MAX_SECTOR};
 
-	if (expr[*pos] == '(') {
-		(*pos)++;
-		if (parse_expr(expr, pos, result) == -1)
-			return -1;
-		skip_space(expr, pos);
-		if (expr[*pos] != ')') {
-			log(ERROR, "missing closing parenthesis\n");
-			return -1;
-		}
-		(*pos)++;
-		return 0;
-	}
+	ptr = token = lba;
 
+	while (*ptr && token_no < 3) {
+		if (*ptr == '-') {
+			*ptr = '\0';
+			param[token_no] = strtoull_b(token);
+			++token_no;
+			*ptr = '-';
+			++ptr;
+			token = ptr;
 
+			if (*ptr == '\0' && token_no < 3) {
+				param[token_no] = strtoull_b(token);
+				++token_no;
+			}
 
-	/* exp */
-	if (strncmp(&expr[*pos], "exp", 3) == 0 && !isalnum(expr[*pos + 3])) {
-		*pos += 3;
-		skip_space(expr, pos);
-		if (expr[*pos] != '(') {
-			log(ERROR, "exp requires parenthesis\n");
-			return -1;
-		}
-		(*pos)++;
-		if (parse_expr(expr, pos, result) == -1)
-			return -1;
-		skip_space(expr, pos);
-		if (expr[*pos] != ')') {
-			log(ERROR, "missing closing parenthesis\n");
-			return -1;
-		}
-		(*pos)++;
-		*result = expl(*result);
-		return 0;
-	}
-
-	/* log base */
-	if (strncmp(&expr[*pos], "log", 3) == 0 && !isalnum(expr[*pos + 3])) {
-		maxfloat_t base;
-		maxfloat_t num;
-		*pos += 3;
-		skip_space(expr, pos);
-		if (expr[*pos] != '(') {
-			log(ERROR, "log requires parenthesis\n");
-			return -1;
-		}
-		(*pos)++;
-		if (parse_expr(expr, pos, &base) == -1)
-			return -1;
-		skip_space(expr, pos);
-		if (expr[*pos] != ',') {
-			log(ERROR, "log requires two arguments\n");
-			return -1;
-		}
-		(*pos)++;
-		if (parse_expr(expr, pos, &num) == -1)
-			return -1;
-		skip_space(expr, pos);
-		if (expr[*pos] != ')') {
-			log(ERROR, "missing closing parenthesis\n");
-			return -1;
-		}
-		(*pos)++;
-		if (base <= 0 || base == 1) {
-			log(ERROR, "log base must be positive and not 1\n");
-			return -1;
-		}
-		if (num <= 0) {
-			log(ERROR, "log of non-positive number\n");
-			return -1;
-		}
-		*result = logl(num) / logl(base);
-		return 0;
-	}
-
-	/* ln natural logarithm */
-	if (strncmp(&expr[*pos], "ln", 2) == 0 && !isalnum(expr[*pos + 2])) {
-		*pos += 2;
-		skip_space(expr, pos);
-		if (expr[*pos] != '(') {
-			log(ERROR, "ln requires parenthesis\n");
-			return -1;
-		}
-		(*pos)++;
-		if (parse_expr(expr, pos, result) == -1)
-			return -1;
-		skip_space(expr, pos);
-		if (expr[*pos] != ')') {
-			log(ERROR, "missing closing parenthesis\n");
-			return -1;
-		}
-		(*pos)++;
-		if (*result <= 0) {
-			log(ERROR, "ln of non-positive number\n");
-			return -1;
-		}
-		*result = logl(*result);
-		return 0;
-	}
-
-	/* sum over whitespace/comma separated arguments */
-	if (strncmp(&expr[*pos], "sum", 3) == 0 && !isalnum(expr[*pos + 3])) {
-		maxfloat_t total = 0.0L;
-		maxfloat_t arg;
-		int args = 0;
-
-		*pos += 3;
-		skip_space(expr, pos);
-		if (expr[*pos] != '(') {
-			log(ERROR, "sum requires parenthesis\n");
-			return -1;
-		}
-
-		(*pos)++;
-		skip_space(expr, pos);
-		if (expr[*pos] == ')') {
-			log(ERROR, "sum requires at least one argument\n");
-			return -1;
-		}
-
-		while (expr[*pos] && expr[*pos] != ')') {
-			if (parse_expr(expr, pos, &arg) == -1)
-				return -1;
-			total += arg;
-			++args;
-
-			skip_space(expr, pos);
-			if (expr[*pos] == ',') {
-				(*pos)++;
-				skip_space(expr, pos);
-			}
-		}
-
-		if (args == 0) {
-			log(ERROR, "sum requires at least one argument\n");
-			return -1;
-		}
-
-		if (expr[*pos] != ')') {
-			log(ERROR, "missing closing parenthesis\n");
-			return -1;
-		}
-
-		(*pos)++;
-		*result = total;
-		return 0;
-	}
-
-
-	/* root */
-	if (strncmp(&expr[*pos], "root", 4) == 0 && !isalnum(expr[*pos + 4])) {
-		*pos += 4;
-		skip_space(expr, pos);
-		if (expr[*pos] != '(') {
-			log(ERROR, "root requires parenthesis\n");
-			return -1;
-		}
-		(*pos)++;
-		maxfloat_t n, x;
-		if (parse_expr(expr, pos, &n) == -1)
-			return -1;
-		skip_space(expr, pos);
-		if (expr[*pos] != ',') {
-			log(ERROR, "root requires two arguments\n");
-			return -1;
-		}
-		(*pos)++;
-		if (parse_expr(expr, pos, &x) == -1)
-			return -1;
-		skip_space(expr, pos);
-		if (expr[*pos] != ')') {
-			log(ERROR, "missing closing parenthesis\n");
-			return -1;
-		}
-		(*pos)++;
-		if (n == 0) {
-			log(ERROR, "root index cannot be zero\n");
-			return -1;
-		}
-		*result = powl(x, 1.0L / n);
-		return 0;
-	}
-
-	/* pow */
-	if (strncmp(&expr[*pos], "pow", 3) == 0 && !isalnum(expr[*pos + 3])) {
-		*pos += 3;
-		skip_space(expr, pos);
-		if (expr[*pos] != '(') {
-			log(ERROR, "pow requires parenthesis\n");
-			return -1;
-		}
-		(*pos)++;
-		maxfloat_t left, right;
-		if (parse_expr(expr, pos, &left) == -1)
-			return -1;
-		skip_space(expr, pos);
-		if (expr[*pos] != ',') {
-			log(ERROR, "pow requires two arguments\n");
-			return -1;
-		}
-		(*pos)++;
-		if (parse_expr(expr, pos, &right) == -1)
-			return -1;
-		skip_space(expr, pos);
-		if (expr[*pos] != ')') {
-			log(ERROR, "missing closing parenthesis\n");
-			return -1;
-		}
-		(*pos)++;
-		*result = powl(left, right);
-		return 0;
-	}
-
-	/* Check for 'r' - reference to last result */
-	if (expr[*pos] == 'r' && !isalnum(expr[*pos + 1])) {
-		(*pos)++;
-		if (lastres.p[0] == '\0') {
-			log(ERROR, "no result stored\n");
-			return -1;
-		}
-		*result = strtold(lastres.p, NULL);
-		return 0;
-	}
-
-	/* Parse number (decimal or hex) */
-	char *endptr;
-	maxfloat_t val = strtold(&expr[*pos], &endptr);
-	if (endptr == &expr[*pos]) {
-		log(ERROR, "invalid operand or unit\n");
-		return -1;
-	}
-	*pos = (int)(endptr - expr);
-	*result = val;
-	return 0;
-}
-
-	/* Parse multiplication and division */
-static int parse_term(const char *expr, int *pos, maxfloat_t *result)
-{
-	if (parse_factor(expr, pos, result) == -1)
-		return -1;
-
-	while (1) {
-		skip_space(expr, pos);
-		if (expr[*pos] == '*') {
-			(*pos)++;
-			maxfloat_t right;
-			if (parse_factor(expr, pos, &right) == -1)
-				return -1;
-			*result = *result * right;
-		} else if (expr[*pos] == '/') {
-			(*pos)++;
-			maxfloat_t right;
-			if (parse_factor(expr, pos, &right) == -1)
-				return -1;
-			if (right == 0) {
-				log(ERROR, "division by zero\n");
-				return -1;
-			}
-			*result = *result / right;
-		} else {
-			break;
-		}
-	}
-
-	return 0;
-}
-
-/* Parse addition and subtraction */
-static int parse_expr(const char *expr, int *pos, maxfloat_t *result)
-{
-	if (parse_term(expr, pos, result) == -1)
-		return -1;
-
-	while (1) {
-		skip_space(expr, pos);
-		if (expr[*pos] == '+') {
-			(*pos)++;
-			maxfloat_t right;
-			if (parse_term(expr, pos, &right) == -1)
-				return -1;
-			*result = *result + right;
-		} else if (expr[*pos] == '-') {
-			(*pos)++;
-			maxfloat_t right;
-			if (parse_term(expr, pos, &right) == -1)
-				return -1;
-			*result = *result - right;
-		} else {
-			break;
-		}
-	}
-
-	return 0;
-}
-
-/* Evaluate arithmetic expression */
-static int eval_expr(char *expr_str, maxfloat_t *result)
-{
-	int pos = 0;
-
-	if (!expr_str || !*expr_str) {
-		log(ERROR, "empty expression\n");
-		return -1;
-	}
-
-	if (parse_expr(expr_str, &pos, result) == -1)
-		return -1;
-
-	skip_space(expr_str, &pos);
-	if (expr_str[pos] != '\0') {
-		log(ERROR, "unexpected character in expression\n");
-		return -1;
-	}
-
-	return 0;
-}
-
-/* Format long double removing trailing zeros */
-static void format_result(maxfloat_t result, char *buf, size_t buflen)
-{
-	snprintf(buf, buflen, "%.10Lf", result);
-
-	/* Find decimal point */
-	char *dot = strchr(buf, '.');
-	if (!dot)
-		return;
-
-	/* Find last non-zero digit after decimal point */
-	char *end = buf + strlen(buf) - 1;
-	while (end > dot && *end == '0')
-		end--;
-
-	/* If we stopped at the decimal point, remove it too */
-	if (end == dot) {
-		*dot = '\0';
-	} else {
-		*(end + 1) = '\0';
-	}
-}
-
-static int is_integral_result(maxfloat_t value, long long *out)
-{
-	long double intpart;
-
-	if (modfl(value, &intpart) != 0.0L)
-		return 0;
-
-	if (intpart < (long double)LLONG_MIN || intpart > (long double)LLONG_MAX)
-		return 0;
-
-	*out = (long long)intpart;
-	return 1;
-}
-
-static void print_and_store_int_result(long long int_result)
-{
-	if (cfg.hexout) {
-		printf("0x%llx\n", (unsigned long long)int_result);
-		snprintf(lastres.p, UINT_BUF_LEN, "0x%llx", (unsigned long long)int_result);
-	} else {
-		printf("%lld\n", int_result);
-		snprintf(lastres.p, UINT_BUF_LEN, "%lld", int_result);
-	}
-}
-
-/* Evaluate expression and print result */
-static int evaluate_expr(char *expr)
-{
-	if (!expr) {
-		if (curexpr)
-			expr = curexpr;
-		else
-			return -1;
-	}
-
-	maxfloat_t result;
-	if (eval_expr(expr, &result) == 0) {
-		long long int_result;
-		if (is_integral_result(result, &int_result)) {
-			printf("%lld\n", int_result);
-			snprintf(lastres.p, UINT_BUF_LEN, "%lld", int_result);
-		} else {
-			format_result(result, lastres.p, UINT_BUF_LEN);
-			printf("%s\n", lastres.p);
-		}
-		lastres.unit = 0;
-		return 0;
-	}
-	return -1;
-}
-
-static void printbin(maxuint_t n)
-{
-	int count = MAX_BITS - 1;
-	int pos = MAX_BITS + (MAX_BITS >> 2) - 1;
-	char binstr[MAX_BITS + (MAX_BITS >> 2) + 1] = {0};
-
-	if (!n) {
-		printf("0");
-		return;
-	}
-
-	while (n && count >= 0) {
-		binstr[pos] = "01"[n & 1];
-		--pos;
-		n >>= 1;
-		if (n && count && !(count & 7)) {
-			binstr[pos] = ' ';
-			--pos;
-		}
-		--count;
-	}
-
-	++pos;
-
-	printf("%s", binstr + pos);
-}
-
-static void printbin_positions(maxuint_t n)
-{
-	if (!n) {
-		printf("0");
-		return;
-	}
-
-	printf("\n");
-
-	/* Find the highest bit position */
-	int highest_bit = 0;
-	maxuint_t temp = n;
-	while (temp) {
-		highest_bit++;
-		temp >>= 1;
-	}
-	highest_bit--; /* Adjust to 0-based */
-
-	/* Print positions 0-31, 32-63, etc. Always print all positions in each row */
-	for (int start_bit = 0; start_bit <= 127; start_bit += 32) {
-		int end_bit = start_bit + 31;
-
-		/* Skip rows where no bits exist in the value */
-		if (start_bit > highest_bit)
-			break;
-
-		/* Print bit positions for this row (MSB to LSB) */
-		for (int bit = end_bit; bit >= start_bit; --bit) {
-			maxuint_t bit_value = (bit <= highest_bit) ? ((n >> bit) & 1) : 0;
-			if (bit_value == 1) {
-				if (bit_value_1_code && bit_value_1_code[0] != '\0')
-					printf("\033[7m%3d\033[0m ", bit);
-				else
-					printf("%3d ", bit);
-			} else
-				printf("%3d ", bit);
-		}
-		printf("\n");
-
-		/* Print bit values for this row (MSB to LSB) - only if bit exists in value */
-		for (int bit = end_bit; bit >= start_bit; --bit) {
-			if (bit <= highest_bit) {
-				int bit_value = (int)(n >> bit) & 1;
-				if (bit_value == 1) {
-					if (bit_value_1_code && bit_value_1_code[0] != '\0')
-						printf("  %s%d\033[0m ", bit_value_1_code, bit_value);
-					else
-						printf("  %d ", bit_value);
-				} else
-					printf("  %d ", bit_value);
-			} else
-				printf("    ");  /* Leave blank for bits beyond the value */
-		}
-		printf("\n\n");
-	}
-}
-
-static char *getstr_u128(maxuint_t n, char *buf)
-{
-	if (n == 0) {
-		buf[0] = '0';
-		buf[1] = '\0';
-		return buf;
-	}
-
-	memset(buf, 0, UINT_BUF_LEN);
-	char *loc = buf + UINT_BUF_LEN - 1; /* start at the end */
-
-	while (n != 0) {
-		if (loc == buf)
-			return NULL; /* should not happen */
-
-		*--loc = "0123456789"[n % 10]; /* save the last digit */
-		n /= 10; /* drop the last digit */
-	}
-
-	return loc;
-}
-
-static char *getstr_f128(maxfloat_t val, char *buf)
-{
-	int n = snprintf(buf, FLOAT_BUF_LEN, "%#*.10Le", FLOAT_WIDTH, val);
-
-	buf[n] = '\0';
-	return buf;
-}
-
-static void printval(maxfloat_t val, char *unit)
-{
-	if (val - (maxuint_t)val == 0) // NOLINT
-		printf("%40s %s\n", getstr_u128((maxuint_t)val, uint_buf), unit);
-	else
-		printf("%s %s\n", getstr_f128(val, float_buf), unit);
-}
-
-static void printhex_u128(maxuint_t n)
-{
-	ull high = (ull)(n >> (sizeof(maxuint_t) << 2));
-
-	if (high)
-		printf("0x%llx%llx", high, (ull)n);
-	else
-		printf("0x%llx", (ull)n);
-}
-
-/* This function adds check for binary input to strtoul() */
-static ulong strtoul_b(char *token)
-{
-	int base = 0;
-
-	/* NOTE: no NULL check here! */
-
-	if (strlen(token) > 2 && token[0] == '0' &&
-	    (token[1] == 'b' || token[1] == 'B')) {
-		base = 2;
-	}
-
-	return strtoul(token + base, NULL, base);
-}
-
-/* This function adds check for binary input to strtoull() */
-static ull strtoull_b(char *token)
-{
-	int base = 0;
-
-	/* NOTE: no NULL check here! */
-
-	if (strlen(token) > 2 && token[0] == '0' &&
-	    (token[1] == 'b' || token[1] == 'B')) {
-		base = 2;
-	}
-
-	return strtoull(token + base, NULL, base);
-}
-
-/* Converts a char to unsigned int according to base */
-static bool ischarvalid(char ch, uint base, uint *val)
-{
-	if (base == 2)
-	{
-		if (ch == '0' || ch == '1') {
-			*val = ch - '0';
-			return true;
-		}
-	} else if (base == 16) {
-		if (ch >= '0' && ch <= '9') {
-			*val = ch - '0';
-			return true;
-		}
-
-		if (ch >= 'a' && ch <= 'f') {
-			*val = (ch - 'a') + 10;
-			return true;
-		}
-
-		if (ch >= 'A' && ch <= 'F') {
-			*val = (ch - 'A') + 10;
-			return true;
-		}
-	} else if (base == 10) {
-		if (ch >= '0' && ch <= '9') {
-			*val = ch - '0';
-			return true;
-		}
-	}
-
-	return false;
-}
-
-/*
- * Converts a non-floating representing string to maxuint_t
- */
-static maxuint_t strtouquad(char *token, char **pch)
-{
-	*pch = PASSED;
-
-	if (!token || !*token) {
-		*pch = FAILED;
-		return 0;
-	}
-
-	char *ptr;
-	maxuint_t val = 0, prevval = 0;
-	uint base = 10, multiplier = 0, digit, bits_used = 0;
-	uint max_bit_len = sizeof(maxuint_t) << 3;
-
-	if (token[0] == '0') {
-		if (token[1] == 'b' || token[1] == 'B') { /* binary */
-			base = 2;
-			multiplier = 1;
-		} else if (token[1] == 'x' || token[1] == 'X') { /* hex */
-			base = 16;
-			multiplier = 4;
-		}
-	}
-
-	if (base == 2 || base == 16) {
-		ptr = token + 2;
-
-		if (!*ptr) {
-			*pch = FAILED;
-			return 0;
-		}
-
-		while (*ptr && *ptr == '0')
-			++ptr;
-
-		if (!*ptr)
-			return 0;
-
-		while (*ptr) {
-			if (bits_used == max_bit_len || !ischarvalid(*ptr, base, &digit)) {
-				*pch = FAILED;
-				return 0;
-			}
-
-			val = (val << multiplier) + digit;
-
-			++bits_used;
-			++ptr;
-		}
-
-		return val;
-	}
-
-	/* Try base 10 for any other pattern */
-	ptr = token;
-	while (*ptr && *ptr == '0')
-		++ptr;
-
-	if (!*ptr)
-		return 0;
-
-	while (*ptr) {
-		if (!ischarvalid(*ptr, base, &digit)) {
-			*pch = FAILED;
-			return 0;
-		}
-
-		val = (val * 10) + digit;
-
-		/* Try to to detect overflow */
-		if (val < prevval) {
-			*pch = FAILED;
-			return 0;
-		}
-
-		prevval = val;
-		++ptr;
-	}
-
-	return val;
-}
-
-static bool parse_prefixed_uint(const char *token, maxuint_t *val, char **endptr)
-{
-	if (!token || !*token || !val || !endptr)
-		return false;
-
-	uint base = 10, multiplier = 0, digit = 0, bits_used = 0;
-	uint max_bit_len = sizeof(maxuint_t) << 3;
-
-	if (token[0] == '0') {
-		if (token[1] == 'b' || token[1] == 'B') {
-			base = 2;
-			multiplier = 1;
-		} else if (token[1] == 'x' || token[1] == 'X') {
-			base = 16;
-			multiplier = 4;
-		}
-	}
-
-	if (base != 2 && base != 16)
-		return false;
-
-	const char *ptr = token + 2;
-	if (!*ptr) {
-		*endptr = (char *)ptr;
-		return false;
-	}
-
-	maxuint_t res = 0;
-	bool seen_digit = false;
-	while (*ptr && ischarvalid(*ptr, base, &digit)) {
-		seen_digit = true;
-		if (bits_used == max_bit_len)
-			return false;
-		res = (res << multiplier) + digit;
-		++bits_used;
-		++ptr;
-	}
-
-	if (!seen_digit)
-		return false;
-
-	*val = res;
-	*endptr = (char *)ptr;
-	return true;
-}
-
-static maxuint_t convertbyte(char *buf, int *ret)
-{
-	maxfloat_t val;
-	char *pch;
-	/* Convert and print in bytes (cannot be in float) */
-	maxuint_t bytes = strtouquad(buf, &pch);
-	if (*pch) {
-		*ret = -1;
-		return 0;
-	}
-
-	*ret = 0;
-
-	if (cfg.minimal) {
-		printf("%s B\n", getstr_u128(bytes, uint_buf));
-		return bytes;
-	}
-
-	printf("%40s B\n", getstr_u128(bytes, uint_buf));
-
-	/* Convert and print in IEC standard units */
-
-	printf("\n            IEC standard (base 2)\n\n");
-	val = (maxfloat_t)bytes / 1024;
-	printval(val, "KiB");
-
-	val = (maxfloat_t)bytes / (1 << 20);
-	printval(val, "MiB");
-
-	val = (maxfloat_t)bytes / (1 << 30);
-	printval(val, "GiB");
-
-	val = (maxfloat_t)bytes / ((unsigned long long)1 << 40);
-	printval(val, "TiB");
-
-	/* Convert and print in SI standard values */
-
-	printf("\n            SI standard (base 10)\n\n");
-	val = (maxfloat_t)bytes / 1000;
-	printval(val, "kB");
-
-	val = (maxfloat_t)bytes / 1000000;
-	printval(val, "MB");
-
-	val = (maxfloat_t)bytes / 1000000000;
-	printval(val, "GB");
-
-	val = (maxfloat_t)bytes / 1000000000000;
-	printval(val, "TB");
-
-	return bytes;
-}
-
-static maxuint_t convertkib(char *buf, int *ret)
-{
-	char *pch;
-	maxfloat_t val, kib = strtold(buf, &pch);
-	if (*pch) {
-		*ret = -1;
-		return 0;
-	}
-
-	*ret = 0;
-
-	maxuint_t bytes = (maxuint_t)(kib * 1024);
-
-	if (cfg.minimal) {
-		printf("%s B\n", getstr_u128(bytes, uint_buf));
-		return bytes;
-	}
-
-	printf("%40s B\n", getstr_u128(bytes, uint_buf));
-
-	printf("\n            IEC standard (base 2)\n\n");
-	printval(kib, "KiB");
-
-	val = kib / 1024;
-	printval(val, "MiB");
-
-	val = kib / (1 << 20);
-	printval(val, "GiB");
-
-	val = kib / (1 << 30);
-	printval(val, "TiB");
-
-	printf("\n            SI standard (base 10)\n\n");
-	val = kib * 1024 / 1000;
-	printval(val, "kB");
-
-	val = kib * 1024 / 1000000;
-	printval(val, "MB");
-
-	val = kib * 1024 / 1000000000;
-	printval(val, "GB");
-
-	val = kib * 1024 / 1000000000000;
-	printval(val, "TB");
-
-	return bytes;
-}
-
-static maxuint_t convertmib(char *buf, int *ret)
-{
-	char *pch;
-	maxfloat_t val, mib = strtold(buf, &pch);
-	if (*pch) {
-		*ret = -1;
-		return 0;
-	}
-
-	*ret = 0;
-
-	maxuint_t bytes = (maxuint_t)(mib * (1 << 20));
-
-	if (cfg.minimal) {
-		printf("%s B\n", getstr_u128(bytes, uint_buf));
-		return bytes;
-	}
-
-	printf("%40s B\n", getstr_u128(bytes, uint_buf));
-
-	printf("\n            IEC standard (base 2)\n\n");
-	val = mib * 1024;
-	printval(val, "KiB");
-
-	printval(mib, "MiB");
-
-	val = mib / 1024;
-	printval(val, "GiB");
-
-	val = mib / (1 << 20);
-	printval(val, "TiB");
-
-	printf("\n            SI standard (base 10)\n\n");
-	val = mib * (1 << 20) / 1000;
-	printval(val, "kB");
-
-	val = mib * (1 << 20) / 1000000;
-	printval(val, "MB");
-
-	val = mib * (1 << 20) / 1000000000;
-	printval(val, "GB");
-
-	val = mib * (1 << 20) / 1000000000000;
-	printval(val, "TB");
-
-	return bytes;
-}
-
-static maxuint_t convertgib(char *buf, int *ret)
-{
-	char *pch;
-	maxfloat_t val, gib = strtold(buf, &pch);
-	if (*pch) {
-		*ret = -1;
-		return 0;
-	}
-
-	*ret = 0;
-
-	maxuint_t bytes = (maxuint_t)(gib * (1 << 30));
-
-	if (cfg.minimal) {
-		printf("%s B\n", getstr_u128(bytes, uint_buf));
-		return bytes;
-	}
-
-	printf("%40s B\n", getstr_u128(bytes, uint_buf));
-
-	printf("\n            IEC standard (base 2)\n\n");
-	val = gib * (1 << 20);
-	printval(val, "KiB");
-
-	val = gib * 1024;
-	printval(val, "MiB");
-
-	printval(gib, "GiB");
-
-	val = gib / 1024;
-	printval(val, "TiB");
-
-	printf("\n            SI standard (base 10)\n\n");
-	val = gib * (1 << 30) / 1000;
-	printval(val, "kB");
-
-	val = gib * (1 << 30) / 1000000;
-	printval(val, "MB");
-
-	val = gib * (1 << 30) / 1000000000;
-	printval(val, "GB");
-
-	val = gib * (1 << 30) / 1000000000000;
-	printval(val, "TB");
-
-	return bytes;
-}
-
-static maxuint_t converttib(char *buf, int *ret)
-{
-	char *pch;
-	maxfloat_t val, tib = strtold(buf, &pch);
-	if (*pch) {
-		*ret = -1;
-		return 0;
-	}
-
-	*ret = 0;
-
-	maxuint_t bytes = (maxuint_t)(tib * ((maxuint_t)1 << 40));
-
-	if (cfg.minimal) {
-		printf("%s B\n", getstr_u128(bytes, uint_buf));
-		return bytes;
-	}
-
-	printf("%40s B\n", getstr_u128(bytes, uint_buf));
-
-	printf("\n            IEC standard (base 2)\n\n");
-	val = tib * (1 << 30);
-	printval(val, "KiB");
-
-	val = tib * (1 << 20);
-	printval(val, "MiB");
-
-	val = tib * 1024;
-	printval(val, "GiB");
-
-	printval(tib, "TiB");
-
-	printf("\n            SI standard (base 10)\n\n");
-	val = tib * ((maxuint_t)1 << 40) / 1000;
-	printval(val, "kB");
-
-	val = tib * ((maxuint_t)1 << 40) / 1000000;
-	printval(val, "MB");
-
-	val = tib * ((maxuint_t)1 << 40) / 1000000000;
-	printval(val, "GB");
-
-	val = tib * ((maxuint_t)1 << 40) / 1000000000000;
-	printval(val, "TB");
-
-	return bytes;
-}
-
-static maxuint_t convertkb(char *buf, int *ret)
-{
-	char *pch;
-	maxfloat_t val, kb = strtold(buf, &pch);
-	if (*pch) {
-		*ret = -1;
-		return 0;
-	}
-
-	*ret = 0;
-
-	maxuint_t bytes = (maxuint_t)(kb * 1000);
-
-	if (cfg.minimal) {
-		printf("%s B\n", getstr_u128(bytes, uint_buf));
-		return bytes;
-	}
-
-	printf("%40s B\n", getstr_u128(bytes, uint_buf));
-
-	printf("\n            IEC standard (base 2)\n\n");
-	val = kb * 1000 / 1024;
-	printval(val, "KiB");
-
-	val = kb * 1000 / (1 << 20);
-	printval(val, "MiB");
-
-	val = kb * 1000 / (1 << 30);
-	printval(val, "GiB");
-
-	val = kb * 1000 / ((maxuint_t)1 << 40);
-	printval(val, "TiB");
-
-	printf("\n            SI standard (base 10)\n\n");
-	printval(kb, "kB");
-
-	val = kb / 1000;
-	printval(val, "MB");
-
-	val = kb / 1000000;
-	printval(val, "GB");
-
-	val = kb / 1000000000;
-	printval(val, "TB");
-
-	return bytes;
-}
-
-static maxuint_t convertmb(char *buf, int *ret)
-{
-	char *pch;
-	maxfloat_t val, mb = strtold(buf, &pch);
-	if (*pch) {
-		*ret = -1;
-		return 0;
-	}
-
-	*ret = 0;
-
-	maxuint_t bytes = (maxuint_t)(mb * 1000000);
-
-	if (cfg.minimal) {
-		printf("%s B\n", getstr_u128(bytes, uint_buf));
-		return bytes;
-	}
-
-	printf("%40s B\n", getstr_u128(bytes, uint_buf));
-
-	printf("\n            IEC standard (base 2)\n\n");
-	val = mb * 1000000 / 1024;
-	printval(val, "KiB");
-
-	val = mb * 1000000 / (1 << 20);
-	printval(val, "MiB");
-
-	val = mb * 1000000 / (1 << 30);
-	printval(val, "GiB");
-
-	val = mb * 1000000 / ((maxuint_t)1 << 40);
-	printval(val, "TiB");
-
-	printf("\n            SI standard (base 10)\n\n");
-	val = mb * 1000;
-	printval(val, "kB");
-
-	printval(mb, "MB");
-
-	val = mb / 1000;
-	printval(val, "GB");
-
-	val = mb / 1000000;
-	printval(val, "TB");
-
-	return bytes;
-}
-
-static maxuint_t convertgb(char *buf, int *ret)
-{
-	char *pch;
-	maxfloat_t val, gb = strtold(buf, &pch);
-	if (*pch) {
-		*ret = -1;
-		return 0;
-	}
-
-	*ret = 0;
-
-	maxuint_t bytes = (maxuint_t)(gb * 1000000000);
-
-	if (cfg.minimal) {
-		printf("%s B\n", getstr_u128(bytes, uint_buf));
-		return bytes;
-	}
-
-	printf("%40s B\n", getstr_u128(bytes, uint_buf));
-
-	printf("\n            IEC standard (base 2)\n\n");
-	val = gb * 1000000000 / 1024;
-	printval(val, "KiB");
-
-	val = gb * 1000000000 / (1 << 20);
-	printval(val, "MiB");
-
-	val = gb * 1000000000 / (1 << 30);
-	printval(val, "GiB");
-
-	val = gb * 1000000000 / ((maxuint_t)1 << 40);
-	printval(val, "TiB");
-
-	printf("\n            SI standard (base 10)\n\n");
-	val = gb * 1000000;
-	printval(val, "kB");
-
-	val = gb * 1000;
-	printval(val, "MB");
-
-	printval(gb, "GB");
-
-	val = gb / 1000;
-	printval(val, "TB");
-
-	return bytes;
-}
-
-static maxuint_t converttb(char *buf, int *ret)
-{
-	char *pch;
-	maxfloat_t val, tb = strtold(buf, &pch);
-	if (*pch) {
-		*ret = -1;
-		return 0;
-	}
-
-	*ret = 0;
-
-	maxuint_t bytes = (__uint128_t)(tb * 1000000000000);
-
-	if (cfg.minimal) {
-		printf("%s B\n", getstr_u128(bytes, uint_buf));
-		return bytes;
-	}
-
-	printf("%40s B\n", getstr_u128(bytes, uint_buf));
-
-	printf("\n            IEC standard (base 2)\n\n");
-	val = tb * 1000000000000 / 1024;
-	printval(val, "KiB");
-
-	val = tb * 1000000000000 / (1 << 20);
-	printval(val, "MiB");
-
-	val = tb * 1000000000000 / (1 << 30);
-	printval(val, "GiB");
-
-	val = tb * 1000000000000 / ((maxuint_t)1 << 40);
-	printval(val, "TiB");
-
-	printf("\n            SI standard (base 10)\n\n");
-	val = tb * 1000000000;
-	printval(val, "kB");
-
-	val = tb * 1000000;
-	printval(val, "MB");
-
-	val = tb * 1000;
-	printval(val, "GB");
-
-	printval(tb, "TB");
-
-	return bytes;
-}
-
-static bool chs2lba(char *chs, maxuint_t *lba)
-{
-	int token_no = 0;
-	char *ptr, *token;
-	ulong param[5] = {0, 0, 0, MAX_HEAD, MAX_SECTOR};
-
-	ptr = token = chs;
-
-	while (*ptr && token_no < 5) {
-		if (*ptr == '-') {
-			/* Replace '-' with NULL and get the token */
-			*ptr = '\0';
-			param[token_no] = strtoul_b(token);
-			++token_no;
-			/* Restore the '-' */
-			*ptr = '-';
-			++ptr;
-			/* Point to start of next token */
-			token = ptr;
-
-			if (*ptr == '\0' && token_no < 5) {
-				param[token_no] = strtoul_b(token);
-				++token_no;
-			}
-
-			continue;
-		}
-
-		++ptr;
-
-		if (*ptr == '\0' && token_no < 5) {
-			param[token_no] = strtoul_b(token);
-			++token_no;
-		}
-	}
-
-	/* Fail if CHS is omitted */
-	if (token_no < 3) {
-		log(ERROR, "CHS missing\n");
-		return false;
-	}
-
-	if (!param[3]) {
-		log(ERROR, "MAX_HEAD = 0\n");
-		return false;
-	}
-
-	if (!param[4]) {
-		log(ERROR, "MAX_SECTOR = 0\n");
-		return false;
-	}
-
-	if (!param[2]) {
-		log(ERROR, "S = 0\n");
-		return false;
-	}
-
-	if (param[1] > param[3]) {
-		log(ERROR, "H > MAX_HEAD\n");
-		return false;
-	}
-
-	if (param[2] > param[4]) {
-		log(ERROR, "S > MAX_SECTOR\n");
-		return false;
-	}
-
-	*lba = (maxuint_t)param[3] * param[4] * param[0]; /* MH * MS * C */
-	*lba += (maxuint_t)param[4] * param[1]; /* MS * H */
-
-	*lba += param[2] - 1; /* S - 1 */
-
-	printf("\033[1mCHS2LBA\033[0m\n");
-	printf("  C:%lu  H:%lu  S:%lu  MAX_HEAD:%lu  MAX_SECTOR:%lu\n",
-		param[0], param[1], param[2], param[3], param[4]);
-
-	return true;
-}
-
-static bool lba2chs(char *lba, t_chs *p_chs)
-{
-	int token_no = 0;
-	char *ptr, *token;
-	ull param[3] = {0, MAX_HEAD, MAX_SECTOR};
-
-	ptr = token = lba;
-
-	while (*ptr && token_no < 3) {
-		if (*ptr == '-') {
-			*ptr = '\0';
-			param[token_no] = strtoull_b(token);
-			++token_no;
-			*ptr = '-';
-			++ptr;
-			token = ptr;
-
-			if (*ptr == '\0' && token_no < 3) {
-				param[token_no] = strtoull_b(token);
-				++token_no;
-			}
-
-			continue;
+			continue;
 		}
 
 		++ptr;
@@ -2190,14 +864,32 @@ static bool lba2chs(char *lba, t_chs *p_chs)
 		return false;
 	}
 
-	printf("\033[1mLBA2CHS\033[0m\n  LBA:%s  ",
-		getstr_u128(param[0], uint_buf));
-	printf("MAX_HEAD:%s  ", getstr_u128(param[1], uint_buf));
-	printf("MAX_SECTOR:%s\n", getstr_u128(param[2], uint_buf));
+	ob_puts(&ctx->out, "\033[1mLBA2CHS\033[0m\n  LBA:");
+	ob_uint(&ctx->out, param[0], 0);
+	ob_puts(&ctx->out, "  MAX_HEAD:");
+	ob_uint(&ctx->out, param[1], 0);
+	ob_puts(&ctx->out, "  MAX_SECTOR:");
+	ob_uint(&ctx->out, param[2], 0);
+	ob_putc(&ctx->out, '\n');
 
 	return true;
 }
 
+static void printchs(ctx_t *ctx, const t_chs *chs, bool hex)
+{
+	const ulong val[] = {chs->c, chs->h, chs->s};
+
+	for (size_t i = 0; i < ELEMENTS(val); ++i) {
+		if (i)
+			ob_putc(&ctx->out, ' ');
+		if (hex) {
+			ob_puts(&ctx->out, "0x");
+			ob_hex(&ctx->out, val[i]);
+		} else
+			ob_uint(&ctx->out, val[i], 0);
+	}
+}
+
 static void show_basic_sizes()
 {
 	printf("---------------\ntype       size\n---------------\n"
@@ -2232,6 +924,7 @@ static void prompt_help()
  c N        convert N to binary, decimal, hex\n\
  p N        print N as bit position/value pairs\n\
  r          result from last operation\n\
+ x = expr   assign to variable x, used by name\n\
  s          sizes of storage types\n\
  ?          help\n\
  q/double ↵ quit\n");
@@ -2239,25 +932,48 @@ static void prompt_help()
 
 static void usage()
 {
-	printf("usage: bcal [-b [expr]] [-c N] [-p N] [-f loc]\n\
-	    [-s bytes] [expr] [N [unit]] [-m] [-H] [-d] [-h]\n\n\
+	printf("usage: bcal [-b [expr]] [-B file [-j N]] [-C N] [-e expr] [-c N]\n\
+	    [-p N] [-f loc] [-s bytes] [-w bits] [expr] [N [unit]] [-m]\n\
+	    [-H] [-P N] [-x file [-t]] [-a file] [--serve sock]\n\
+	    [-d] [-h]\n\n\
 Bits, bytes and general-purpose calculator.\n\n\
 positional arguments:\n\
  expr       expression in decimal/hex operands\n\
- N [unit]   capacity in B/KiB/MiB/GiB/TiB/kB/MB/GB/TB\n\
+ N [unit]   capacity in B/KiB/MiB/GiB/TiB/PiB/EiB,\n\
+            kB/MB/GB/TB/PB/EB or bit\n\
             https://en.wikipedia.org/wiki/Binary_prefix\n\
             default unit is B (byte), case is ignored\n\
             N can be decimal or '0x' prefixed hex value\n\n\
 optional arguments:\n\
  -b [expr]  start in general-purpose REPL mode\n\
             or, evaluate expression and quit\n\
+ -B file    evaluate an expression per line of file\n\
+            ('-' for stdin), print minimal results\n\
+ -j N       use N threads in batch mode and -a of a\n\
+            regular file [0: all CPUs, max 4 per CPU]\n\
+ -C N       cache results of up to N repeated storage\n\
+            expressions [default 0: off]\n\
+ -e expr    compile expr once, evaluate it per line of\n\
+            -B file or stdin with r as the line's value\n\
  -c N       convert N to binary, decimal, hex\n\
  -p N       print N as bit position/value pairs\n\
  -f loc     convert CHS to LBA or LBA to CHS\n\
             refer to the operational notes in man page\n\
  -s bytes   sector size [default 512]\n\
+ -w bits    evaluate storage expressions and -c in\n\
+            integers of bits (64 to 1024, step 64)\n\
  -m         minimal output (e.g. decimal bytes)\n\
  -H         show integral maths results in hex\n\
+ -P N       digits after the point in maths results\n\
+            [default 10, up to 1000]\n\
+ -x file    print the bytes of each size with a unit in\n\
+            file ('-' for stdin), e.g. 12.5GiB in logs\n\
+ -t         print running totals of -x sizes instead\n\
+ -a file    count, sum, min, max, mean and percentiles\n\
+            of a size per line of file ('-' for stdin)\n\
+ --serve sock\n\
+            answer an expression per line from clients\n\
+            of Unix socket sock, each with its own r\n\
  -d         enable debug information and logs\n\
  -h         show this help\n\n");
 
@@ -2269,1031 +985,1369 @@ License: GPLv3\n\
 Webpage: https://github.com/jarun/bcal\n", VERSION);
 }
 
-static int bstricmp(const char *s1, const char *s2)
+static bool has_bitwise_ops(const char *expr)
+{
+	if (!expr)
+		return false;
+
+	for (size_t i = 0; expr[i] != '\0'; ++i) {
+		switch (expr[i]) {
+		case '&':
+		case '|':
+		case '^':
+		case '~':
+			return true;
+		case '<':
+			if (expr[i + 1] == '<')
+				return true;
+			break;
+		case '>':
+			if (expr[i + 1] == '>')
+				return true;
+			break;
+		default:
+			break;
+		}
+	}
+
+	return false;
+}
+
+/* Print n in binary, decimal and hex */
+static void printbases(ctx_t *ctx, maxuint_t n)
+{
+	ob_puts(&ctx->out, " (b) ");
+	printbin(ctx, n);
+	ob_puts(&ctx->out, "\n (d) ");
+	ob_uint(&ctx->out, n, 0);
+	ob_puts(&ctx->out, "\n (h) ");
+	printhex_u128(ctx, n);
+	ob_putc(&ctx->out, '\n');
+}
+
+/* Print a wide n in binary, decimal and hex */
+static void printbases_wide(ctx_t *ctx, const bcal_wide *n)
+{
+	ob_puts(&ctx->out, " (b) ");
+	printbin_wide(ctx, n);
+	ob_puts(&ctx->out, "\n (d) ");
+	printwide(ctx, n, 10, 0);
+	ob_puts(&ctx->out, "\n (h) 0x");
+	printwide(ctx, n, 16, 0);
+	ob_putc(&ctx->out, '\n');
+}
+
+static int eval_bitwise_expr(ctx_t *ctx, char *expr)
+{
+	bcal_result res;
+
+	if (cfg.wide) {
+		bcal_wide n;
+		int unit;
+
+		if (bcal_eval_wide(ctx->bc, expr, &n, &unit) != BCAL_OK) {
+			log(ERROR, "%s\n", bcal_errmsg(ctx->bc));
+			return -1;
+		}
+
+		if (cfg.minimal) {
+			printwide(ctx, &n, 10, 0);
+			ob_putc(&ctx->out, '\n');
+		} else
+			printbases_wide(ctx, &n);
+
+		return 0;
+	}
+
+	if (bcal_eval(ctx->bc, expr, &res) != BCAL_OK) {
+		log(ERROR, "%s\n", bcal_errmsg(ctx->bc));
+		return -1;
+	}
+
+	/* Print result based on minimal mode setting */
+	if (cfg.minimal) {
+		ob_uint(&ctx->out, res.value, 0);
+		ob_putc(&ctx->out, '\n');
+	} else
+		/* Print result in binary, decimal, and hex formats */
+		printbases(ctx, res.value);
+
+	return 0;
+}
+
+/* Check if valid storage arithmetic expression */
+/*
+static int checkexp(char *exp)
+{
+	while (*exp) {
+		if (*exp == 'b' || *exp == 'B')
+			return 1;
+
+		++exp;
+	}
+
+	return 0;
+}
+*/
+
+static void printaddress(ctx_t *ctx, maxuint_t bytes)
+{
+	ob_puts(&ctx->out, "\nADDRESS\n (d) ");
+	ob_uint(&ctx->out, bytes, 0);
+	ob_puts(&ctx->out, "\n (h) ");
+	printhex_u128(ctx, bytes);
+}
+
+/* Print a converted single operand in all units, with its address */
+static void printconversion(ctx_t *ctx, const bcal_result *res, ulong sectorsz)
+{
+	maxuint_t bytes = res->value, lba = 0, offset = 0;
+
+	if (cfg.minimal) {
+		printsize(ctx, bytes, 0);
+		return;
+	}
+
+	printbytes(ctx, res);
+	printaddress(ctx, bytes);
+
+	/* Calculate LBA and offset */
+	lba = bytes / sectorsz;
+	offset = bytes % sectorsz;
+
+	ob_puts(&ctx->out, "\n\nLBA:OFFSET (sector size: 0x");
+	ob_hex(&ctx->out, sectorsz);
+	ob_puts(&ctx->out, ")\n (d) ");
+	ob_uint(&ctx->out, lba, 0);
+	ob_putc(&ctx->out, ':');
+	ob_uint(&ctx->out, offset, 0);
+	ob_puts(&ctx->out, "\n (h) ");
+	printhex_u128(ctx, lba);
+	ob_putc(&ctx->out, ':');
+	printhex_u128(ctx, offset);
+	ob_putc(&ctx->out, '\n');
+}
+
+static int convertunit(ctx_t *ctx, char *value, char *unit, ulong sectorsz)
+{
+	bcal_result res;
+
+	if (bcal_convert(ctx->bc, value, unit, &res) != BCAL_OK) {
+		log(ERROR, "%s\n", bcal_errmsg(ctx->bc));
+		return -1;
+	}
+
+	if (!cfg.minimal)
+		ob_puts(&ctx->out, "\033[1mUNIT CONVERSION\033[0m\n");
+
+	printconversion(ctx, &res, sectorsz);
+	return 0;
+}
+
+/*
+ * Evaluate a storage expression with -w, sizes are printed in bytes
+ * as the units would need more digits than a long double has
+ */
+static int evaluate_wide(ctx_t *ctx, char *exp)
 {
-	while ((int)*s1 && (tolower((int)*s1) == tolower((int)*s2))) {
-		++s1;
-		++s2;
+	bcal_wide n;
+	int unit;
+
+	if (bcal_eval_wide(ctx->bc, exp, &n, &unit) != BCAL_OK) {
+		log(ERROR, "%s\n", bcal_errmsg(ctx->bc));
+		return -1;
 	}
-	return *(const unsigned char *)s1 - *(const unsigned char *)s2;
-}
 
-/* Convert any unit in bytes
- * Failure if out parameter holds -1
- */
-static maxuint_t unitconv(Data bunit, char *isunit, int *out)
-{
-	/* Data is a C structure containing a string p and a char
-	 * indicating if the string is a unit or a plain number
-	 */
-	char *numstr = bunit.p, *punit = NULL;
-	int  count;
-	maxfloat_t byte_metric = 0;
-
-	if (numstr == NULL || *numstr == '\0') {
-		log(ERROR, "invalid token\n");
-		*out = -1;
+	if (!unit || cfg.minimal) {
+		printwide(ctx, &n, 10, 0);
+		ob_puts(&ctx->out, unit ? " B\n" : "\n");
 		return 0;
 	}
 
-	log(DEBUG, "numstr: %s\n", numstr);
-	*out = 0;
+	if (!cfg.repl)
+		ob_puts(&ctx->out, "\033[1mRESULT\033[0m\n");
 
-	/* ensure this is not the result of a previous operation */
-	if (*isunit != 1)
-		*isunit = 0;
+	printwide(ctx, &n, 10, FLOAT_WIDTH);
+	ob_puts(&ctx->out, " B\n\nADDRESS\n (d) ");
+	printwide(ctx, &n, 10, 0);
+	ob_puts(&ctx->out, "\n (h) 0x");
+	printwide(ctx, &n, 16, 0);
+	ob_putc(&ctx->out, '\n');
+	return 0;
+}
 
-	if (numstr[0] == '0' &&
-	    (numstr[1] == 'x' || numstr[1] == 'X' ||
-	     numstr[1] == 'b' || numstr[1] == 'B')) {
-		char *pch = NULL;
-		maxuint_t val = 0;
-		if (!parse_prefixed_uint(numstr, &val, &pch)) {
-			log(ERROR, "invalid token\n");
-			*out = -1;
-			return 0;
-		}
-		if (*pch == '\0')
-			return val;
-		if (!isalpha((unsigned char)*pch)) {
-			log(ERROR, "invalid token\n");
-			*out = -1;
-			return 0;
-		}
-		byte_metric = (maxfloat_t)val;
-		punit = pch;
-		goto parse_unit;
-	}
+static int evaluate(ctx_t *ctx, char *exp, ulong sectorsz)
+{
+	bcal_result res;
+	int ret;
 
-	byte_metric = strtold(numstr, &punit);
-	log(DEBUG, "byte_metric: %Lf\n", byte_metric);
-	if (*numstr != '\0' && *punit == '\0')
-		return (maxuint_t)byte_metric;
+	if (cfg.wide)
+		return evaluate_wide(ctx, exp);
 
-parse_unit:
-	log(DEBUG, "punit: %s\n", punit);
+	ret = bcal_eval(ctx->bc, exp, &res);
 
-	count = ARRAY_SIZE(units);
-	while (--count >= 0)
-		if (!bstricmp(units[count], punit))
-			break;
+	if (ret != BCAL_OK) {
+		/*
+		 * Not a storage expression, try it as a maths expression
+		 * unless the output is minimal (for running python test cases)
+		 */
+		if (!cfg.minimal && (ret == BCAL_EMALFORMED || (ret == BCAL_EUNIT && !res.single)))
+			return evaluate_maths(ctx, exp);
 
-	if (count == -1) {
-		if (cfg.minimal)
-			log(ERROR, "unknown unit\n");
-		else
-			evaluate_expr(NULL);
+		log(ERROR, "%s\n", bcal_errmsg(ctx->bc));
+		return -1;
+	}
 
-		*out = -1;
+	if (res.single) {
+		printconversion(ctx, &res, sectorsz);
 		return 0;
 	}
 
-	*isunit = 1;
-
-	switch (count) {
-	case 0:
-		return (maxuint_t)byte_metric;
-	case 1: /* Kibibyte */
-		return (maxuint_t)(byte_metric * 1024);
-	case 2: /* Mebibyte */
-		return (maxuint_t)(byte_metric * (1 << 20));
-	case 3: /* Gibibyte */
-		return (maxuint_t)(byte_metric * (1 << 30));
-	case 4: /* Tebibyte */
-		return (maxuint_t)(byte_metric * ((maxuint_t)1 << 40));
-	case 5: /* Kilobyte */
-		return (maxuint_t)(byte_metric * 1000);
-	case 6: /* Megabyte */
-		return (maxuint_t)(byte_metric * 1000000);
-	case 7: /* Gigabyte */
-		return (maxuint_t)(byte_metric * 1000000000);
-	case 8: /* Terabyte */
-		return (maxuint_t)(byte_metric * 1000000000000);
-	default:
-		log(ERROR, "unknown unit\n");
-		*out = -1;
+	if (!res.unit) {
+		ob_uint(&ctx->out, res.value, 0);
+		ob_putc(&ctx->out, '\n');
 		return 0;
 	}
-}
 
-/* Get the priority of operators.
- * Higher priority, higher value.
- */
-static int priority(char sign) /* Get the priority of operators, higher priprity */
-{
-	switch (sign) {
-	case '|': return 1;
-	case '^': return 2;
-	case '&': return 3;
-	case '>':
-	case '<': return 4;
-	case '-':
-	case '+': return 5;
-	case '%':
-	case '/':
-	case '*': return 6;
-	case '~': return 7;
-	default : return 0;
-	}
+	if (!(cfg.minimal || cfg.repl))
+		ob_puts(&ctx->out, "\033[1mRESULT\033[0m\n");
+
+	printbytes(ctx, &res);
+
+	if (cfg.minimal)
+		return 0;
+
+	printaddress(ctx, res.value);
+	ob_putc(&ctx->out, '\n');
 
 	return 0;
 }
 
-/* Convert Infix mathematical expression to Postfix */
-static int infix2postfix(char *exp, queue **resf, queue **resr)
+static int convertbase(ctx_t *ctx, char *arg, bool bitposition)
 {
-	stack *op = NULL;  /* Operator Stack */
-	char *token = strtok(exp, " ");
-	static Data tokenData, ct;
-	int balanced = 0;
-	bool tokenize = true;
+	remove_commas(arg);
+	strstrip(arg);
 
-	tokenData.p[0] = '\0';
-	tokenData.unit = 0;
+	if (*arg == '\0') {
+		log(ERROR, "empty input\n");
+		return -1;
+	}
 
-	log(DEBUG, "exp: %s\n", exp);
-	log(DEBUG, "token: %s\n", token);
+	if (*arg == '-') {
+		log(ERROR, "N must be >= 0\n");
+		return -1;
+	}
 
-	while (token) {
-		/* Copy argument to string part of the structure */
-		bstrlcpy(tokenData.p, token, NUM_LEN);
+	if (cfg.wide && !bitposition) {
+		bcal_wide n;
+		int unit;
 
-		switch (token[0]) {
-		case '+':
-		case '-':
-		case '*':
-		case '/':
-		case '%':
-		case '>':
-		case '<':
-		case '&':
-		case '|':
-		case '^':
-		case '~':
-			if (token[1] != '\0') {
-				log(ERROR, "invalid token terminator\n");
-				emptystack(&op);
-				cleanqueue(resf);
-				return -1;
-			}
+		/* A lone operand, or r */
+		if (bcal_eval_wide(ctx->bc, arg, &n, &unit) != BCAL_OK) {
+			log(ERROR, "invalid input\n");
+			return -1;
+		}
 
-			while (!isempty(op) && top(op)[0] != '(' &&
-				       ((token[0] == '~' && priority(token[0]) < priority(top(op)[0])) ||
-				        (token[0] != '~' && priority(token[0]) <= priority(top(op)[0])))) {
-				/* Pop from operator stack */
-				pop(&op, &ct);
-				/* Insert to Queue */
-				enqueue(resf, resr, ct);
-			}
+		printbases_wide(ctx, &n);
+		return 0;
+	}
 
-			push(&op, tokenData);
-			break;
-		case '(':
-			++balanced;
-			push(&op, tokenData);
-			break;
-		case ')':
-			while (!isempty(op) && top(op)[0] != '(') {
-				pop(&op, &ct);
-				enqueue(resf, resr, ct);
-			}
+	if (cfg.repl && arg[0] == 'r' && arg[1] == '\0' && bcal_last(ctx->bc, NULL))
+		arg = (char *)bcal_last(ctx->bc, NULL);
 
-			pop(&op, &ct);
-			--balanced;
-			break;
-		case 'r':
-			if (lastres.p[0] == '\0') {
-				log(ERROR, "no result stored\n");
-				emptystack(&op);
-				cleanqueue(resf);
-				return -1;
-			}
+	maxuint_t val;
+	if (bcal_parse_uint(arg, &val) != BCAL_OK) {
+		log(ERROR, "invalid input\n");
+		return -1;
+	}
 
-			enqueue(resf, resr, lastres);
-			break;
-		default:
-			/*
-			 * Check if unit is specified
-			 * This also guards against a case of 0xn b
-			 */
-			token = strtok(NULL, " ");
-			if (token) {
-				int unit_idx = ARRAY_SIZE(units);
-
-				while (--unit_idx >= 0)
-					if (!bstricmp(units[unit_idx], token))
-						break;
+	if (bitposition)
+		printbin_positions(ctx, val);
+	else
+		printbases(ctx, val);
 
-				if (unit_idx == 0) {
-					/*
-					 * Single byte unit 'b'/'B' after a number:
-					 * mark as unit without appending the letter,
-					 * to avoid ambiguity with hex digits (0xDb).
-					 */
-					tokenData.unit = 1;
-					log(DEBUG, "unit found\n");
-				} else if (unit_idx > 0) {
-					/*
-					 * Multi-char unit (e.g. KiB, MiB): append to
-					 * the number string so unitconv can parse it.
-					 */
-					size_t len = strlen(tokenData.p);
-
-					bstrlcpy(tokenData.p + len, token, NUM_LEN - len);
-					log(DEBUG, "unit found\n");
-				} else {
-					tokenize = false; /* We already tokenized here */
-				}
-			} else {
-				tokenize = false;
-			}
+	return 0;
+}
 
-			/* Enqueue operands */
-			log(DEBUG, "tokenData: %s %d\n", tokenData.p, tokenData.unit);
-			enqueue(resf, resr, tokenData);
-			if (tokenize)
-				tokenData.unit = 0;
-		}
+/* Evaluate a single expression in the current mode */
+static int evaluate_line(ctx_t *ctx, char *exp, ulong sectorsz)
+{
+	strstrip(exp);
 
-		if (tokenize)
-			token = strtok(NULL, " ");
-		else
-			tokenize = true;
+	/* Check for bitwise operations first, but only if no units are present */
+	if (has_bitwise_ops(exp) && !bcal_has_units(exp))
+		return eval_bitwise_expr(ctx, exp);
 
-		log(DEBUG, "token: %s\n", token);
-	}
+	if (cfg.maths)
+		return evaluate_maths(ctx, exp);
 
-	while (!isempty(op)) {
-		/* Put remaining elements into the queue */
-		pop(&op, &ct);
-		enqueue(resf, resr, ct);
+	return evaluate(ctx, exp, sectorsz);
+}
+
+/* Run the -e program with r set to the value of an expression */
+static int evaluate_prog_line(ctx_t *ctx, char *exp)
+{
+	char buf[UINT_BUF_LEN];
+	bcal_result res;
+
+	if (ctx->mprog) {
+		if (bcal_eval_maths(ctx->bc, exp, buf, UINT_BUF_LEN) != BCAL_OK ||
+		    bcal_run_maths(ctx->bc, ctx->mprog, buf, UINT_BUF_LEN) != BCAL_OK) {
+			log(ERROR, "%s\n", bcal_errmsg(ctx->bc));
+			return -1;
+		}
+
+		ob_puts(&ctx->out, bcal_last(ctx->bc, NULL));
+		ob_putc(&ctx->out, '\n');
+		return 0;
 	}
 
-	if (balanced != 0) {
-		log(ERROR, "unbalanced expression\n");
-		cleanqueue(resf);
+	if (bcal_eval(ctx->bc, exp, &res) != BCAL_OK ||
+	    bcal_run(ctx->bc, ctx->prog, &res) != BCAL_OK) {
+		log(ERROR, "%s\n", bcal_errmsg(ctx->bc));
 		return -1;
 	}
 
+	ob_uint(&ctx->out, res.value, 0);
+	ob_puts(&ctx->out, res.unit ? " B\n" : "\n");
+
 	return 0;
 }
 
-/*
- * Checks for underflow in division
- * Returns:
- *  0 - no issues
- * -1 - underflow
- */
-static int validate_div(maxuint_t dividend, maxuint_t divisor, maxuint_t quotient)
+/* Evaluate a line of batch input, a failed or empty line prints an empty line */
+static int evaluate_batch_line(ctx_t *ctx, char *line, ulong sectorsz)
 {
-	if (divisor * quotient < dividend) {
-		log(WARNING, "result truncated\n");
+	int ret;
 
-		if (cfg.loglvl == DEBUG) {
-			printhex_u128(dividend);
-			printf(" (dividend)\n");
-			printhex_u128(divisor);
-			printf(" (divisor)\n");
-			printhex_u128(quotient);
-			printf(" (quotient)\n");
-		}
+	strstrip(line);
+	if (line[0] == '\0') {
+		ob_putc(&ctx->out, '\n');
+		return 0;
+	}
+
+	if (ctx->prog || ctx->mprog)
+		ret = evaluate_prog_line(ctx, line);
+	else
+		ret = evaluate_line(ctx, line, sectorsz);
 
+	if (ret == -1) {
+		ob_putc(&ctx->out, '\n');
 		return -1;
 	}
 
 	return 0;
 }
 
-/* Evaluates Postfix Expression
- * Numeric result if out parameter holds 1
- * Failure if out parameter holds -1
- */
-static maxuint_t eval(queue **front, queue **rear, int *out)
+/* A batch worker evaluates a contiguous shard of lines into its own buffer */
+typedef struct {
+	pthread_t tid;
+	ctx_t ctx;
+	char **lines;
+	size_t count;
+	ulong sectorsz;
+	char *buf;
+	size_t buflen;
+	int ret;
+} worker_t;
+
+static void *batch_worker(void *arg)
 {
-	stack *est = NULL;
-	Data res, arg, raw_a, raw_b, raw_c;
-	*out = 0;
-	maxuint_t a, b, c;
+	worker_t *w = (worker_t *)arg;
 
-	/* Check if queue is empty */
-	if (*front == NULL)
-		return 0;
+	for (size_t i = 0; i < w->count; ++i) {
+		/* Results must not depend on sharding, so r and variables are unavailable */
+		bcal_clear_last(w->ctx.bc);
+		bcal_clear_vars(w->ctx.bc);
+		if (evaluate_batch_line(&w->ctx, w->lines[i], w->sectorsz) == -1)
+			w->ret = -1;
+	}
 
-	/* Check if only one element in the queue */
-	if (*front == *rear) {
-		char unit = 0;
+	ob_flush(&w->ctx.out);
+	return NULL;
+}
 
-		dequeue(front, rear, &res);
-		return unitconv(res, &unit, out);
+/*
+ * Shard rounds of input lines across up to nthreads workers
+ * Each worker prints to a memory stream, the streams are written to
+ * stdout in worker order so the output follows the input order.
+ * A round starts a worker per BATCH_SHARD_LINES lines read, so line
+ * slots and worker contexts are only set up as the input needs them.
+ */
+static int evaluate_batch_parallel(ctx_t *ctx, FILE *fp, ulong sectorsz, int nthreads)
+{
+	size_t maxlines = (size_t)nthreads * BATCH_SHARD_LINES;
+	worker_t *workers = (worker_t *)calloc((size_t)nthreads, sizeof(worker_t));
+	char **lines = NULL, **newlines;
+	size_t *lens = NULL, *newlens;
+	size_t count, cap = 0, shard, i;
+	int ret = 0, t, started, nworkers, ninit = 0;
+	bool eof = false;
+
+	if (!workers) {
+		log(ERROR, "out of memory\n");
+		return -1;
 	}
 
-	while (*front) {
-		dequeue(front, rear, &arg);
-
-		/* Check if arg is an operator */
-		if (strlen(arg.p) == 1 && !isdigit((int)arg.p[0])) {
-			if (arg.p[0] == '~') {
-				pop(&est, &raw_a);
+	while (!eof) {
+		/* Line buffers are kept and reused by the next round */
+		for (count = 0; count < maxlines; ++count) {
+			if (count == cap) {
+				newlines = (char **)realloc(lines, (cap + BATCH_SHARD_LINES) * sizeof(char *));
+				if (newlines)
+					lines = newlines;
+				newlens = (size_t *)realloc(lens, (cap + BATCH_SHARD_LINES) * sizeof(size_t));
+				if (newlens)
+					lens = newlens;
+				if (!newlines || !newlens) {
+					log(ERROR, "out of memory\n");
+					ret = -1;
+					goto out;
+				}
 
-				a = unitconv(raw_a, &raw_a.unit, out);
-				if (*out == -1)
-					return 0;
+				memset(lines + cap, 0, BATCH_SHARD_LINES * sizeof(char *));
+				memset(lens + cap, 0, BATCH_SHARD_LINES * sizeof(size_t));
+				cap += BATCH_SHARD_LINES;
+			}
 
-				c = ~a;
-				raw_c.unit = raw_a.unit ? 1 : 0;
-				bstrlcpy(raw_c.p, getstr_u128(c, uint_buf), NUM_LEN);
-				push(&est, raw_c);
-				continue;
+			if (getline(&lines[count], &lens[count], fp) == -1) {
+				eof = true;
+				break;
 			}
+		}
 
-			pop(&est, &raw_b);
-			pop(&est, &raw_a);
+		if (!count)
+			break;
 
-			b = unitconv(raw_b, &raw_b.unit, out);
-			if (*out == -1)
-				return 0;
-			a = unitconv(raw_a, &raw_a.unit, out);
-			if (*out == -1)
-				return 0;
+		nworkers = (int)((count + BATCH_SHARD_LINES - 1) / BATCH_SHARD_LINES);
+		if (nworkers > nthreads)
+			nworkers = nthreads;
 
-			log(DEBUG, "(%s, %d) %c (%s, %d)\n",
-			    raw_a.p, raw_a.unit, arg.p[0], raw_b.p, raw_b.unit);
+		for (; ninit < nworkers; ++ninit) {
+			if (!ctx_init(&workers[ninit].ctx, NULL)) {
+				ret = -1;
+				goto out;
+			}
 
-			c = 0;
-			raw_c.unit = 0;
+			/* Programs are read-only, all workers share it */
+			workers[ninit].ctx.prog = ctx->prog;
+			workers[ninit].ctx.mprog = ctx->mprog;
+		}
+
+		shard = (count + (size_t)nworkers - 1) / (size_t)nworkers;
+		for (started = 0, i = 0; started < nworkers; ++started, i += shard) {
+			worker_t *w = &workers[started];
+
+			w->lines = lines + i;
+			w->count = (i >= count) ? 0 : ((count - i < shard) ? count - i : shard);
+			w->sectorsz = sectorsz;
+			ob_init(&w->ctx.out, open_memstream(&w->buf, &w->buflen));
+			if (!w->ctx.out.fp || pthread_create(&w->tid, NULL, batch_worker, w) != 0) {
+				log(ERROR, "cannot start worker\n");
+				if (w->ctx.out.fp)
+					fclose(w->ctx.out.fp);
+				free(w->buf);
+				w->buf = NULL;
+				ret = -1;
+				eof = true;
+				break;
+			}
+		}
 
-			switch (arg.p[0]) {
-			case '>':
-			case '<':
-				if (raw_b.unit) {
-					log(ERROR, "unit mismatch in %c%c\n", arg.p[0], arg.p[0]);
-					goto error;
-				}
+		/* All contexts are freed below, only the started workers are joined */
+		for (t = 0; t < started; ++t) {
+			worker_t *w = &workers[t];
 
-				if (arg.p[0] == '>')
-					c = a >> b;
-				else
-					c = a << b;
-				raw_c.unit = raw_a.unit;
-				break;
-			case '+':
-			case '&':
-			case '|':
-			case '^':
-				/* Check if the units match */
-				if (raw_a.unit == raw_b.unit) {
-					switch (arg.p[0]) {
-					case '+':
-						c = a + b;
-						break;
-					case '&':
-						c = a & b;
-						break;
-					case '|':
-						c = a | b;
-						break;
-					case '^':
-						c = a ^ b;
-						break;
-					default:
-						break;
-					}
+			pthread_join(w->tid, NULL);
+			fclose(w->ctx.out.fp);
+			fwrite(w->buf, 1, w->buflen, stdout);
+			free(w->buf);
+			w->buf = NULL;
+			if (w->ret == -1)
+				ret = -1;
+		}
+	}
 
-					if (raw_a.unit)
-						raw_c.unit = 1;
-					break;
-				}
+out:
+	for (t = 0; t < ninit; ++t)
+		ctx_free(&workers[t].ctx);
+	for (i = 0; i < cap; ++i)
+		free(lines[i]);
+	free(workers);
+	free(lens);
+	free(lines);
+	return ret;
+}
 
-				log(ERROR, "unit mismatch in %c\n", arg.p[0]);
-				goto error;
-			case '-':
-				/* Check if the units match */
-				if (raw_a.unit == raw_b.unit) {
-					if (b > a) {
-						log(ERROR, "negative result\n");
-						goto error;
-					}
+/*
+ * Evaluate one expression per line from a file, or stdin if path is "-"
+ * Results are printed in minimal format, one line per input line.
+ * A failed or empty line yields an empty output line.
+ * Lines are sharded across nthreads threads if more than one.
+ */
+static int evaluate_batch(ctx_t *ctx, const char *path, ulong sectorsz, int nthreads)
+{
+	FILE *fp = stdin;
+	char *line = NULL;
+	size_t len = 0;
+	int ret = 0;
+	bool tty = isatty(STDOUT_FILENO);
 
-					c = a - b;
-					if (raw_a.unit)
-						raw_c.unit = 1;
-					break;
-				}
+	if (strcmp(path, "-") != 0) {
+		fp = fopen(path, "r");
+		if (!fp) {
+			log(ERROR, "%s: %s\n", path, strerror(errno));
+			return -1;
+		}
+	}
 
-				log(ERROR, "unit mismatch in -\n");
-				goto error;
-			case '*':
-				/* Check if only one is unit */
-				if (!(raw_a.unit && raw_b.unit)) {
-					c = a * b;
-					if (raw_a.unit || raw_b.unit)
-						raw_c.unit = 1;
-					break;
-				}
+	cfg.minimal = 1;
 
-				log(ERROR, "unit mismatch in *\n");
-				goto error;
-			case '/':
-				if (b == 0) {
-					log(ERROR, "division by 0\n");
-					goto error;
-				}
+	if (nthreads > 1)
+		ret = evaluate_batch_parallel(ctx, fp, sectorsz, nthreads);
+	else
+		while (getline(&line, &len, fp) != -1) {
+			if (evaluate_batch_line(ctx, line, sectorsz) == -1)
+				ret = -1;
 
-				if (raw_a.unit && raw_b.unit) {
-					c = a / b;
+			/* Results are written when the buffer fills unless someone is watching */
+			if (tty)
+				ob_flush(&ctx->out);
+		}
 
-					validate_div(a, b, c);
-					break;
-				}
+	ob_flush(&ctx->out);
 
-				if (!raw_b.unit) {
-					c = a / b;
-					if (raw_a.unit)
-						raw_c.unit = 1;
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
 
-					validate_div(a, b, c);
-					break;
-				}
+	return ret;
+}
 
-				log(ERROR, "unit mismatch in /\n");
-				goto error;
-			case '%':
-				if (b == 0) {
-					log(ERROR, "division by 0\n");
-					goto error;
-				}
+/* Print a size found by -x, or the total so far with -t */
+static int extract_match(ctx_t *ctx, const char *text, const bcal_size *m, int ret, maxuint_t *total)
+{
+	if (ret == BCAL_EOVERFLOW) {
+		log(WARNING, "%.*s: too big, skipped\n", (int)m->len, text + m->pos);
+		return 0;
+	}
 
-				if (!(raw_a.unit || raw_b.unit)) {
-					c = a % b;
-					break;
-				}
+	if (cfg.total) {
+		if (__builtin_add_overflow(*total, m->bytes, total)) {
+			log(ERROR, "overflow in total\n");
+			return -1;
+		}
+		ob_uint(&ctx->out, *total, 0);
+	} else
+		ob_uint(&ctx->out, m->bytes, 0);
 
-				log(ERROR, "unit mismatch in modulo\n"); // fallthrough
-			default:
-				goto error;
-			}
+	ob_putc(&ctx->out, '\n');
+	return 0;
+}
 
-			/* Convert to string */
-			bstrlcpy(raw_c.p, getstr_u128(c, uint_buf), NUM_LEN);
-			log(DEBUG, "c: %s unit: %d\n", raw_c.p, raw_c.unit);
+/* Extract the sizes in text from *pos, up to the last that may not continue past it */
+static int extract_text(ctx_t *ctx, const char *text, size_t len, size_t *pos, bool final, maxuint_t *total)
+{
+	bcal_size m;
+	int ret;
 
-			/* Push to stack */
-			push(&est, raw_c);
+	while ((ret = bcal_scan_size(text, len, pos, final, &m)) != 0)
+		if (extract_match(ctx, text, &m, ret, total) == -1)
+			return -1;
 
-		} else {
-			log(DEBUG, "pushing (%s %d)\n", arg.p, arg.unit);
-			push(&est, arg);
+	return 0;
+}
+
+/*
+ * Print the bytes of every size with a unit in a file, or stdin if path
+ * is "-", one per line. Regular files are mapped whole, anything else is
+ * read in chunks that keep a partial token and the char before it.
+ */
+static int extract(ctx_t *ctx, const char *path)
+{
+	struct stat sb;
+	maxuint_t total = 0;
+	size_t len = 0, pos = 0, keep;
+	ssize_t n;
+	char *buf;
+	int fd = STDIN_FILENO, ret = 0;
+	bool tty = isatty(STDOUT_FILENO);
+
+	if (strcmp(path, "-") != 0) {
+		fd = open(path, O_RDONLY);
+		if (fd == -1) {
+			log(ERROR, "%s: %s\n", path, strerror(errno));
+			return -1;
 		}
 	}
 
-	pop(&est, &res);
+	if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+		buf = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf != MAP_FAILED) {
+			madvise(buf, (size_t)sb.st_size, MADV_SEQUENTIAL);
+			ret = extract_text(ctx, buf, (size_t)sb.st_size, &pos, true, &total);
+			munmap(buf, (size_t)sb.st_size);
+			goto out;
+		}
+	}
 
-	/* Stack must be empty at this point */
-	if (!isempty(est)) {
-		log(ERROR, "invalid expression\n");
-		goto error;
+	buf = malloc(EXTRACT_CHUNK);
+	if (!buf) {
+		log(ERROR, "out of memory\n");
+		ret = -1;
+		goto out;
 	}
 
-	if (res.unit == 0)
-		*out = 1;
+	while (true) {
+		n = read(fd, buf + len, EXTRACT_CHUNK - len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			log(ERROR, "%s: %s\n", path, strerror(errno));
+			ret = -1;
+			break;
+		}
+
+		len += (size_t)n;
+		if (extract_text(ctx, buf, len, &pos, !n, &total) == -1) {
+			ret = -1;
+			break;
+		}
+
+		if (!n)
+			break;
 
-	/* Convert string to integer */
-	char *pch = NULL;
-	maxuint_t val = strtouquad(res.p, &pch);
-	if (*pch) {
-		*out = -1;
-		return 0;
+		if (tty)
+			ob_flush(&ctx->out);
+
+		/* An unfinished token is far shorter than the buffer */
+		keep = pos ? pos - 1 : 0;
+		memmove(buf, buf + keep, len - keep);
+		len -= keep;
+		pos -= keep;
 	}
-	return val;
 
-error:
-	*out = -1;
-	emptystack(&est);
-	cleanqueue(front);
-	return 0;
+	free(buf);
+out:
+	ob_flush(&ctx->out);
+	if (fd != STDIN_FILENO)
+		close(fd);
+
+	return ret;
 }
 
-static bool has_bitwise_ops(const char *expr)
-{
-	if (!expr)
-		return false;
+/* Quantiles printed by -a */
+static const struct {
+	double q;
+	const char *name;
+} quantiles[] = {
+	{0.5, "p50"},
+	{0.9, "p90"},
+	{0.99, "p99"},
+	{0.999, "p99.9"},
+};
 
-	for (size_t i = 0; expr[i] != '\0'; ++i) {
-		switch (expr[i]) {
-		case '&':
-		case '|':
-		case '^':
-		case '~':
-			return true;
-		case '<':
-			if (expr[i + 1] == '<')
-				return true;
-			break;
-		case '>':
-			if (expr[i + 1] == '>')
-				return true;
-			break;
-		default:
-			break;
-		}
+/* An error on a line of -a input */
+typedef struct {
+	size_t line;
+	const char *msg;
+} agg_error;
+
+/* Whole lines of -a input added up by a thread, with their errors */
+typedef struct {
+	pthread_t tid;
+	const char *text;
+	size_t len;
+	size_t lines;
+	bcal_stats *st;
+	agg_error *err; /* line numbers count from the start of text */
+	size_t nerr;
+	size_t errcap;
+	bool nomem;     /* errors were dropped */
+} agg_part;
+
+/* Add the size on a line of -a input, blank lines are skipped. NULL or the error. */
+static const char *aggregate_line(bcal_stats *st, const char *line, size_t len)
+{
+	char buf[AGG_LINE_MAX];
+	bcal_uint bytes;
+	int ret;
+
+	while (len && isspace((uchar)line[len - 1]))
+		--len;
+	while (len && isspace((uchar)*line)) {
+		++line;
+		--len;
 	}
 
-	return false;
+	if (!len)
+		return NULL;
+
+	if (len >= AGG_LINE_MAX)
+		return bcal_strerror(BCAL_EMALFORMED);
+
+	memcpy(buf, line, len);
+	buf[len] = '\0';
+
+	ret = bcal_parse_size(buf, &bytes);
+	if (ret != BCAL_OK)
+		return bcal_strerror(ret);
+
+	if (bcal_stats_add(st, bytes) != BCAL_OK)
+		return "overflow in sum";
+
+	return NULL;
 }
 
-static bool has_units(const char *expr)
+/* Add the sizes on the lines of a part, keeping the errors */
+static void *aggregate_part(void *arg)
 {
-	if (!expr)
-		return false;
+	agg_part *part = (agg_part *)arg;
+	const char *text = part->text, *end = text + part->len, *nl;
+	const char *msg;
 
-	for (size_t i = 0; i < ARRAY_SIZE(units); ++i) {
-		/* Check if unit keyword exists in expression
-		 * Units must not be followed by alphanumeric characters */
-		size_t unit_len = strlen(units[i]);
-		const char *pos = expr;
-		while ((pos = strstr(pos, units[i])) != NULL) {
-			char after = *(pos + unit_len);
-			/* Unit found if it's not followed by alphanumeric */
-			if (!isalnum((unsigned char)after)) {
-				return true;
+	for (; text < end; text = nl + 1) {
+		nl = memchr(text, '\n', (size_t)(end - text));
+		if (!nl)
+			nl = end;
+
+		++part->lines;
+		msg = aggregate_line(part->st, text, (size_t)(nl - text));
+		if (!msg)
+			continue;
+
+		if (part->nerr == part->errcap) {
+			size_t cap = part->errcap ? part->errcap << 1 : 16;
+			agg_error *err = (agg_error *)realloc(part->err, cap * sizeof(agg_error));
+
+			if (!err) {
+				part->nomem = true;
+				continue;
 			}
-			pos++;
+			part->err = err;
+			part->errcap = cap;
 		}
+
+		part->err[part->nerr].line = part->lines;
+		part->err[part->nerr++].msg = msg;
 	}
 
-	return false;
+	return NULL;
 }
 
-static int eval_bitwise_expr(char *expr, char *out, size_t out_len)
+/*
+ * Add the sizes on the lines of mapped text to st, split in up to
+ * nthreads parts on line boundaries. Each part has its own aggregate,
+ * merged at the end, and errors are reported in line order, so the
+ * result doesn't depend on the threads.
+ */
+static int aggregate_mapped(bcal_stats *st, const char *text, size_t len, int nthreads)
 {
-	if (!expr || !out || out_len == 0)
-		return -1;
+	size_t nparts = len / AGG_PART_MIN + 1, off = 0, lines = 0, t;
+	agg_part *parts;
+	const char *nl;
+	int ret = 0;
 
-	int unitless = 0;
-	queue *front = NULL, *rear = NULL;
-	char *parsed = fixexpr(expr, &unitless);
-	if (!parsed)
-		return -1;
+	if (nparts > (size_t)nthreads)
+		nparts = (size_t)nthreads;
 
-	int ret = infix2postfix(parsed, &front, &rear);
-	free(parsed);
-	if (ret == -1)
+	parts = (agg_part *)calloc(nparts, sizeof(agg_part));
+	if (!parts) {
+		log(ERROR, "out of memory\n");
 		return -1;
+	}
 
-	int eval_ret = 0;
-	maxuint_t value = eval(&front, &rear, &eval_ret);
-	if (eval_ret == -1)
-		return -1;
+	for (t = 0; t < nparts; ++t) {
+		agg_part *part = &parts[t];
+		size_t stop = len;
 
-	/* Print result based on minimal mode setting */
-	if (cfg.minimal) {
-		printf("%s\n", getstr_u128(value, uint_buf));
-	} else {
-		/* Print result in binary, decimal, and hex formats */
-		printf(" (b) ");
-		printbin(value);
-		printf("\n (d) %s\n (h) ",
-			getstr_u128(value, uint_buf));
-		printhex_u128(value);
-		printf("\n");
+		/* Up to the end of the line at an even share of the text */
+		if (t + 1 < nparts && len / nparts * (t + 1) > off) {
+			nl = memchr(text + len / nparts * (t + 1), '\n', len - len / nparts * (t + 1));
+			stop = nl ? (size_t)(nl + 1 - text) : len;
+		} else if (t + 1 < nparts)
+			stop = off;
+
+		part->text = text + off;
+		part->len = stop - off;
+		off = stop;
+
+		part->st = t ? bcal_stats_new() : st;
+		if (!part->st) {
+			log(ERROR, "out of memory\n");
+			nparts = t;
+			ret = -1;
+			break;
+		}
+
+		/* The first part is done by this thread, a part without one too */
+		if (t && pthread_create(&part->tid, NULL, aggregate_part, part) != 0)
+			part->tid = pthread_self();
 	}
 
-	/* Store decimal value for lastres */
-	bstrlcpy(out, getstr_u128(value, uint_buf), out_len);
-	return 0;
+	if (nparts)
+		aggregate_part(&parts[0]);
+
+	for (t = 0; t < nparts; ++t) {
+		agg_part *part = &parts[t];
+
+		if (t) {
+			if (pthread_equal(part->tid, pthread_self()))
+				aggregate_part(part);
+			else
+				pthread_join(part->tid, NULL);
+		}
+
+		for (size_t i = 0; i < part->nerr; ++i)
+			log(ERROR, "line %zu: %s\n", lines + part->err[i].line, part->err[i].msg);
+		if (part->nomem)
+			log(ERROR, "out of memory\n");
+		if (part->nerr || part->nomem)
+			ret = -1;
+		lines += part->lines;
+
+		if (t) {
+			if (bcal_stats_merge(st, part->st) != BCAL_OK) {
+				log(ERROR, "overflow in sum\n");
+				ret = -1;
+			}
+			bcal_stats_free(part->st);
+		}
+		free(part->err);
+	}
+
+	free(parts);
+	return ret;
 }
 
-static int issign(char c)
-{
-	switch (c) {
-	case '+':
-	case '-':
-	case '*':
-	case '/':
-	case '%':
-	case '>':
-	case '<':
-	case '&':
-	case '|':
-	case '^':
-	case '~':
-		return 1;
-	default:
-		return 0;
+/* Print a statistic of -a, a size in all units unless the output is minimal */
+static void printstat(ctx_t *ctx, const char *name, const bcal_result *res)
+{
+	if (cfg.minimal) {
+		ob_puts(&ctx->out, name);
+		ob_putc(&ctx->out, ' ');
+		printsize(ctx, res->value, 0);
+		return;
 	}
+
+	ob_puts(&ctx->out, "\033[1m");
+	for (const char *c = name; *c; ++c)
+		ob_putc(&ctx->out, (char)toupper((uchar)*c));
+	ob_puts(&ctx->out, "\033[0m\n");
+	printbytes(ctx, res);
+	ob_putc(&ctx->out, '\n');
 }
 
-/* Check if a char is operator or not */
-static int isoperator(int c)
+static void printstats(ctx_t *ctx, const bcal_stats *st)
 {
-	switch (c) {
-	case '+':
-	case '-':
-	case '*':
-	case '/':
-	case '%':
-	case '>':
-	case '<':
-	case '&':
-	case '|':
-	case '^':
-	case '~':
-	case '(':
-	case ')': return 1;
-	default: return 0;
+	const bcal_summary *s = bcal_stats_summary(st);
+	bcal_result res = {.unit = 1};
+
+	ob_puts(&ctx->out, cfg.minimal ? "count " : "\033[1mCOUNT\033[0m\n ");
+	ob_uint(&ctx->out, s->count, 0);
+	ob_puts(&ctx->out, cfg.minimal ? "\n" : "\n\n");
+	if (!s->count)
+		return;
+
+	res.value = s->sum;
+	printstat(ctx, "sum", &res);
+	res.value = s->min;
+	printstat(ctx, "min", &res);
+	res.value = s->max;
+	printstat(ctx, "max", &res);
+
+	/* Other units show the fraction of a byte */
+	res.value = s->sum / s->count;
+	res.single = 1;
+	res.in_unit = BCAL_B;
+	res.in_val = (maxfloat_t)s->sum / s->count;
+	res.inexact = (res.value * s->count != s->sum);
+	printstat(ctx, "mean", &res);
+
+	res.single = 0;
+	for (size_t i = 0; i < ELEMENTS(quantiles); ++i) {
+		res.value = bcal_stats_quantile(st, quantiles[i].q);
+		printstat(ctx, quantiles[i].name, &res);
 	}
 }
 
-/* Check if valid storage arithmetic expression */
 /*
-static int checkexp(char *exp)
-{
-	while (*exp) {
-		if (*exp == 'b' || *exp == 'B')
-			return 1;
+ * Aggregate a size per line of a file, or stdin if path is "-", and
+ * print the statistics. Lines that aren't sizes are reported and left
+ * out. Regular files are mapped whole and split across nthreads
+ * threads, other input is read by this one.
+ */
+static int aggregate(ctx_t *ctx, const char *path, int nthreads)
+{
+	bcal_stats *st = bcal_stats_new();
+	FILE *fp = stdin;
+	struct stat sb;
+	char *text, *line = NULL;
+	const char *msg;
+	size_t cap = 0, lineno = 0;
+	ssize_t len;
+	int ret = 0;
 
-		++exp;
+	if (!st) {
+		log(ERROR, "out of memory\n");
+		return -1;
 	}
 
-	return 0;
-}
-*/
+	if (strcmp(path, "-") != 0) {
+		fp = fopen(path, "r");
+		if (!fp) {
+			log(ERROR, "%s: %s\n", path, strerror(errno));
+			bcal_stats_free(st);
+			return -1;
+		}
+	}
 
-/* Trim ending newline and whitespace from both ends, in place */
-static void strstrip(char *s)
-{
-	if (!s || !*s)
-		return;
+	if (fstat(fileno(fp), &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0 &&
+	    (text = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0)) != MAP_FAILED) {
+		madvise(text, (size_t)sb.st_size, MADV_SEQUENTIAL);
+		ret = aggregate_mapped(st, text, (size_t)sb.st_size, nthreads);
+		munmap(text, (size_t)sb.st_size);
+	} else
+		while ((len = getline(&line, &cap, fp)) != -1) {
+			++lineno;
+			msg = aggregate_line(st, line, (size_t)len);
+			if (msg) {
+				log(ERROR, "line %zu: %s\n", lineno, msg);
+				ret = -1;
+			}
+		}
 
-	int len = (int)strlen(s) - 1;
+	printstats(ctx, st);
+	ob_flush(&ctx->out);
 
-	if (s[len] == '\n')
-		--len;
-	while (len >= 0 && (isspace((int)s[len]) || s[len] == '\"' || s[len] == '\''))
-		--len;
-	s[len + 1] = '\0';
+	free(line);
+	bcal_stats_free(st);
+	if (fp != stdin)
+		fclose(fp);
 
-	len = 0;
-	while (s[len] && (isspace((int)s[len]) || s[len] == '\"' || s[len] == '\''))
-		++len;
+	return ret;
+}
 
-	if (len) {
-		while (s[len]) {
-			*s = s[len];
-			++s;
-		}
+#ifdef __linux__
+/* A client of --serve, with its own r and variables */
+typedef struct conn {
+	struct conn *prev, *next;
+	ctx_t ctx;
+	int fd;
+	uint32_t events; /* epoll interest */
+	bool eof;        /* no more requests */
+	bool broken;     /* out of memory or the socket failed */
+	bool skip;       /* dropping the rest of a line that's too long */
+	char *in;        /* request bytes, a partial line at the end */
+	size_t inlen, incap;
+	char *out;       /* replies not sent yet start at outoff */
+	size_t outoff, outlen, outcap;
+} conn_t;
 
-		*s = '\0';
-	}
+static volatile sig_atomic_t serving;
+
+static void serve_stop(int sig)
+{
+	serving = 0;
 }
 
-/* Replace consecutive inner whitespaces with a single space */
-static void removeinnerspaces(char *s)
+/* Replies are queued in the connection until the socket takes them */
+static void conn_sink(void *arg, const char *s, size_t n)
 {
-	char *p = s;
+	conn_t *c = (conn_t *)arg;
+	size_t cap = c->outcap ? c->outcap : OUTBUF_LEN;
+	char *p;
+
+	if (c->broken)
+		return;
+
+	if (c->outlen + n > c->outcap) {
+		while (cap < c->outlen + n)
+			cap <<= 1;
 
-	while (*s != '\0') {
-		/* We should not combine 0xn b/B (B is a valid hex digit) */
-		if (!isspace((int)*s) || (*(s + 1) == 'b') || (*(s + 1) == 'B')) {
-			*p = *s;
-			++p;
+		p = (char *)realloc(c->out, cap);
+		if (!p) {
+			c->broken = true;
+			return;
 		}
 
-		++s;
+		c->out = p;
+		c->outcap = cap;
 	}
 
-	*p = '\0';
+	memcpy(c->out + c->outlen, s, n);
+	c->outlen += n;
 }
 
-/* Make the expression compatible with parsing by
- * inserting/removing space between arguments
+/*
+ * Reply to a request line like -B does, but send a failure back as
+ * "ERROR: message" so every request gets a line of its own
  */
-static char *fixexpr(char *exp, int *unitless)
+static void serve_line(conn_t *c, char *line)
 {
-	*unitless = 0;
-
-	strstrip(exp);
-	removeinnerspaces(exp);
+	ctx_t *ctx = &c->ctx;
+	char buf[UINT_BUF_LEN];
+	bcal_result res;
+	bcal_wide n;
+	int ret, unit;
 
-	/*
-	if (!checkexp(exp)) {
-		log(DEBUG, "no unit in expression [%s]\n", exp);
-		*unitless = 1;
-		return NULL;
+	strstrip(line);
+	if (line[0] == '\0') {
+		ob_putc(&ctx->out, '\n');
+		return;
 	}
-	*/
-
-	int i = 0, j = 0;
-	char *parsed = (char *)calloc(1, 2 * strlen(exp) * sizeof(char));
-	char prev = '(';
 
-	log(DEBUG, "exp (%s)\n", exp);
-
-	while (exp[i] != '\0') {
-		if (exp[i] == '{' || exp[i] == '}' || exp[i] == '[' || exp[i] == ']') {
-			log(ERROR, "first brackets only\n");
-			free(parsed);
-			return NULL;
+	if (cfg.maths && !(has_bitwise_ops(line) && !bcal_has_units(line))) {
+		ret = bcal_eval_maths(ctx->bc, line, buf, UINT_BUF_LEN);
+		if (ret == BCAL_OK) {
+			ob_puts(&ctx->out, bcal_last(ctx->bc, NULL));
+			ob_putc(&ctx->out, '\n');
 		}
-
-		if (exp[i] == '-' && (issign(prev) || prev == '(')) {
-			log(ERROR, "negative token\n");
-			free(parsed);
-			return NULL;
+	} else if (cfg.wide) {
+		ret = bcal_eval_wide(ctx->bc, line, &n, &unit);
+		if (ret == BCAL_OK) {
+			printwide(ctx, &n, 10, 0);
+			ob_puts(&ctx->out, unit ? " B\n" : "\n");
 		}
-
-		if (isoperator((int)exp[i]) && isalpha((int)exp[i + 1]) && (exp[i + 1] != 'r')) {
-			log(ERROR, "invalid expression\n");
-			free(parsed);
-			return NULL;
+	} else {
+		ret = bcal_eval(ctx->bc, line, &res);
+		if (ret == BCAL_OK) {
+			ob_uint(&ctx->out, res.value, 0);
+			ob_puts(&ctx->out, (res.unit || res.single) ? " B\n" : "\n");
 		}
+	}
 
-		if ((isdigit((int)exp[i]) && isoperator((int)exp[i + 1])) ||
-		    (isoperator((int)exp[i]) && (isdigit((int)exp[i + 1]) ||
-		     isoperator((int)exp[i + 1]))) ||
-		    (isalpha((int)exp[i]) && isoperator((int)exp[i + 1])) ||
-		    (isoperator((int)exp[i]) && ((int)exp[i + 1] == 'r'))) {
-			if (exp[i] == '<' || exp[i] == '>') { /* handle shift operators << and >> */
-				if (prev != exp[i] && exp[i] != exp[i + 1]) {
-					log(ERROR, "invalid operator %c\n", exp[i]);
-					*unitless = 0;
-					free(parsed);
-					return NULL;
-				}
-
-				if (prev == exp[i + 1]) { /* handle <<< or >>> */
-					log(ERROR, "invalid sequence %c%c%c\n", prev, exp[i], exp[i + 1]);
-					*unitless = 0;
-					free(parsed);
-					return NULL;
-				}
+	if (ret != BCAL_OK) {
+		ob_puts(&ctx->out, "ERROR: ");
+		ob_puts(&ctx->out, bcal_errmsg(ctx->bc));
+		ob_putc(&ctx->out, '\n');
+	}
+}
 
-				if (exp[i] == exp[i + 1])
-					goto loop_end;
-			}
+static conn_t *conn_new(int fd)
+{
+	conn_t *c = (conn_t *)calloc(1, sizeof(conn_t));
 
-			parsed[j] = exp[i];
-			++j;
-			parsed[j] = ' ';
-			++j;
-			parsed[j] = exp[i + 1];
-		} else {
-			parsed[j] = exp[i];
-			++j;
-		}
+	if (!c)
+		return NULL;
 
-loop_end:
-		prev = exp[i];
-		++i;
+	if (!ctx_init(&c->ctx, NULL)) {
+		free(c);
+		return NULL;
 	}
 
-	if (parsed[j])
-		parsed[++j] = '\0';
+	ob_init_sink(&c->ctx.out, conn_sink, c);
+	c->fd = fd;
+	return c;
+}
+
+static void conn_free(conn_t *c)
+{
+	close(c->fd);
+	ctx_free(&c->ctx);
+	free(c->in);
+	free(c->out);
+	free(c);
+}
 
-	log(DEBUG, "parsed (%s)\n", parsed);
+/* Answer the complete lines read so far, the last one at EOF as well */
+static void conn_serve(conn_t *c)
+{
+	char *line = c->in, *end = c->in + c->inlen, *nl;
 
-	/* If there's no space, this is either
-	 * a number or malformed expression
-	 */
-	i = 0;
-	while (parsed[i] && parsed[i] != ' ')
-		++i;
+	while (line < end && (nl = (char *)memchr(line, '\n', (size_t)(end - line)))) {
+		*nl = '\0';
+		serve_line(c, line);
+		line = nl + 1;
+	}
 
-	if (!parsed[i]) {
-		log(DEBUG, "no operator in expression [%s]\n", parsed);
-		free(parsed);
-		*unitless = 1;
-		return NULL;
+	if (c->eof && line < end) {
+		/* There is room for the terminator, see conn_read() */
+		*end = '\0';
+		serve_line(c, line);
+		line = end;
 	}
 
-	return parsed;
+	c->inlen = (size_t)(end - line);
+	memmove(c->in, line, c->inlen);
+	ob_flush(&c->ctx.out);
 }
 
-static int convertunit(char *value, char *unit, ulong sectorsz)
+/* Drop the rest of a line that's too long, up to its newline */
+static void conn_skip(conn_t *c)
 {
-	int count = ARRAY_SIZE(units), ret;
-	maxuint_t bytes = 0, lba = 0, offset = 0;
+	char *nl = (char *)memchr(c->in, '\n', c->inlen);
 
-	strstrip(value);
-	if (value[0] == '\0') {
-		log(ERROR, "invalid value\n");
-		return -1;
+	if (!nl) {
+		c->inlen = 0;
+		return;
 	}
 
-	if (!unit) {
-		int unitchars = 0, len = (int)strlen(value);
-
-		while (len) {
-			if (!isalpha((int)value[len - 1]))
-				break;
+	c->skip = false;
+	c->inlen -= (size_t)(nl + 1 - c->in);
+	memmove(c->in, nl + 1, c->inlen);
+}
 
-			++unitchars;
-			--len;
-		}
+/* Read what the client sent, false if the connection must be dropped */
+static bool conn_read(conn_t *c)
+{
+	ssize_t n;
 
-		if (unitchars) {
-			while (--count >= 0)
-				if (!bstricmp(units[count], value + len))
-					break;
+	for (;;) {
+		if (c->incap - c->inlen < 2) {
+			size_t cap = c->incap ? c->incap << 1 : OUTBUF_LEN;
+			char *p;
 
-			if (count == -1) {
-				log(ERROR, "unknown unit\n");
-				return -1;
+			/* The reply is an error, the next line is answered as usual */
+			if (c->incap >= SERVE_LINE_MAX) {
+				ob_puts(&c->ctx.out, "ERROR: line too long\n");
+				ob_flush(&c->ctx.out);
+				c->skip = true;
+				c->inlen = 0;
+				continue;
 			}
 
-			value[len] = '\0';
-		} else
-			count = 0;
-	} else {
-		strstrip(unit);
-
-		while (--count >= 0)
-			if (!bstricmp(units[count], unit))
-				break;
+			p = (char *)realloc(c->in, cap);
+			if (!p)
+				return false;
 
-		if (count == -1) {
-			log(ERROR, "unknown unit\n");
-			return -1;
+			c->in = p;
+			c->incap = cap;
 		}
-	}
 
-	log(DEBUG, "%s %s\n", value, units[count]);
+		/* A byte is kept for the terminator of an unfinished last line */
+		n = read(c->fd, c->in + c->inlen, c->incap - c->inlen - 1);
+		if (n > 0) {
+			c->inlen += (size_t)n;
+			if (c->skip) {
+				conn_skip(c);
+				if (c->skip)
+					continue;
+			}
+			if (c->inlen < c->incap - 1)
+				break;
+			conn_serve(c);
+			continue;
+		}
 
-	if (!cfg.minimal && unit)
-		printf("\033[1mUNIT CONVERSION\033[0m\n");
+		if (n == 0)
+			c->eof = true;
+		else if (errno == EINTR)
+			continue;
+		else if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return false;
 
-	switch (count) {
-	case 0:
-		bytes = convertbyte(value, &ret);
-		break;
-	case 1:
-		bytes = convertkib(value, &ret);
-		break;
-	case 2:
-		bytes = convertmib(value, &ret);
-		break;
-	case 3:
-		bytes = convertgib(value, &ret);
-		break;
-	case 4:
-		bytes = converttib(value, &ret);
-		break;
-	case 5:
-		bytes = convertkb(value, &ret);
 		break;
-	case 6:
-		bytes = convertmb(value, &ret);
-		break;
-	case 7:
-		bytes = convertgb(value, &ret);
-		break;
-	case 8:
-		bytes = converttb(value, &ret);
-		break;
-	default:
-		log(ERROR, "unknown unit\n");
-		return -1;
 	}
 
-	if (ret == -1) {
-		if (cfg.minimal || unit) /* For running python test cases */
-			log(ERROR, "malformed input\n");
-		else
-			return evaluate_expr(NULL);
+	conn_serve(c);
+	return !c->broken;
+}
 
-		return -1;
-	}
+/* Send queued replies, false if the connection must be dropped */
+static bool conn_write(conn_t *c)
+{
+	ssize_t n;
 
-	bstrlcpy(lastres.p, getstr_u128(bytes, uint_buf), UINT_BUF_LEN);
-	lastres.unit = 1;
-	log(DEBUG, "result: %s %d\n", lastres.p, lastres.unit);
+	while (c->outoff < c->outlen) {
+		n = send(c->fd, c->out + c->outoff, c->outlen - c->outoff, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
 
-	if (cfg.minimal)
-		return 0;
+		c->outoff += (size_t)n;
+	}
+
+	c->outoff = c->outlen = 0;
+	return true;
+}
 
-	printf("\nADDRESS\n (d) %s\n (h) ",
-		getstr_u128(bytes, uint_buf));
-	printhex_u128(bytes);
+/* Wait for what the connection can do next, replies throttle reading */
+static bool conn_watch(int epfd, conn_t *c)
+{
+	struct epoll_event ev = {.data.ptr = c};
+	size_t queued = c->outlen - c->outoff;
 
-	/* Calculate LBA and offset */
-	lba = bytes / sectorsz;
-	offset = bytes % sectorsz;
+	if (!c->eof && queued < SERVE_OUT_MAX)
+		ev.events |= EPOLLIN;
+	if (queued)
+		ev.events |= EPOLLOUT;
 
-	printf("\n\nLBA:OFFSET (sector size: 0x%lx)\n", sectorsz);
-	/* We use a global buffer, so print decimal lba first, then offset */
-	printf(" (d) %s:", getstr_u128(lba, uint_buf));
-	printf("%s\n (h) ", getstr_u128(offset, uint_buf));
-	printhex_u128(lba);
-	printf(":");
-	printhex_u128(offset);
-	printf("\n");
+	if (ev.events == c->events)
+		return true;
 
-	return 0;
+	c->events = ev.events;
+	return epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) == 0;
 }
 
-static int evaluate(char *exp, ulong sectorsz)
+static int serve_listen(const char *path)
 {
-	int ret = 0;
-	maxuint_t bytes = 0;
-	queue *front = NULL, *rear = NULL;
-	char *expr = fixexpr(exp, &ret);  /* Make parsing compatible */
-	char *ptr;
-
-	if (expr)
-		log(DEBUG, "expr: %s\n", expr);
-
-	if (expr == NULL) {
-		if (ret)
-			return convertunit(exp, NULL, sectorsz);
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	struct stat sb;
+	int fd;
 
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		log(ERROR, "%s: socket path too long\n", path);
 		return -1;
 	}
+	strcpy(addr.sun_path, path);
 
-	ret = infix2postfix(expr, &front, &rear);
-	free(expr);
-	if (ret == -1)
-		return -1;
+	/* Replace the socket a previous server left behind */
+	if (lstat(path, &sb) == 0 && S_ISSOCK(sb.st_mode))
+		unlink(path);
 
-	bytes = eval(&front, &rear, &ret);  /* Evaluate Expression */
-	if (ret == -1)
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    listen(fd, SOMAXCONN) == -1) {
+		log(ERROR, "%s: %s\n", path, strerror(errno));
+		if (fd != -1)
+			close(fd);
 		return -1;
-
-	if (ret == 1) {
-		ptr = getstr_u128(bytes, uint_buf);
-		printf("%s\n", ptr);
-		bstrlcpy(lastres.p, getstr_u128(bytes, uint_buf), UINT_BUF_LEN);
-		lastres.unit = 0;
-		log(DEBUG, "result1: %s %d\n", lastres.p, lastres.unit);
-		return 0;
 	}
 
-	if (!(cfg.minimal || cfg.repl))
-		printf("\033[1mRESULT\033[0m\n");
+	return fd;
+}
 
-	convertbyte(getstr_u128(bytes, uint_buf), &ret);
-	if (ret == -1) {
-		log(ERROR, "malformed input\n");
+/*
+ * Serve expressions over a Unix socket until SIGINT or SIGTERM
+ * Clients send newline terminated expressions and get a line back for
+ * each, in order. Requests may be pipelined, r and variables are kept
+ * per connection. A single thread waits on all sockets with epoll(7).
+ */
+static int serve(const char *path)
+{
+	struct epoll_event ev = {.events = EPOLLIN}, events[SERVE_EVENTS];
+	struct sigaction sa = {.sa_handler = serve_stop};
+	conn_t *conns = NULL, *c;
+	int lfd, epfd, n, fd, ret = 0;
+	bool paused = false;
+
+	lfd = serve_listen(path);
+	if (lfd == -1)
 		return -1;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev) == -1) {
+		log(ERROR, "epoll: %s\n", strerror(errno));
+		ret = -1;
+		goto out;
 	}
 
-	ptr = getstr_u128(bytes, uint_buf);
-	bstrlcpy(lastres.p, ptr, UINT_BUF_LEN);
-	lastres.unit = 1;
-	log(DEBUG, "result2: %s %d\n", lastres.p, lastres.unit);
+	/* No SA_RESTART, epoll_wait() returns to check the flag */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	cfg.minimal = 1;
+	serving = 1;
 
-	if (cfg.minimal)
-		return 0;
+	log(DEBUG, "serving on %s\n", path);
 
-	printf("\nADDRESS\n (d) %s\n (h) ", ptr);
-	printhex_u128(bytes);
-	printf("\n");
+	while (serving) {
+		n = epoll_wait(epfd, events, SERVE_EVENTS, -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			log(ERROR, "epoll: %s\n", strerror(errno));
+			ret = -1;
+			break;
+		}
 
-	return 0;
-}
+		for (int i = 0; i < n; ++i) {
+			c = (conn_t *)events[i].data.ptr;
 
-static int convertbase(char *arg, bool bitposition)
-{
-	char *pch;
+			if (!c) {
+				while ((fd = accept(lfd, NULL, NULL)) != -1) {
+					fcntl(fd, F_SETFL, O_NONBLOCK);
+					fcntl(fd, F_SETFD, FD_CLOEXEC);
 
-	strstrip(arg);
+					c = conn_new(fd);
+					ev.events = EPOLLIN;
+					ev.data.ptr = c;
+					if (!c || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+						log(ERROR, "cannot serve client\n");
+						if (c)
+							conn_free(c);
+						else
+							close(fd);
+						continue;
+					}
 
-	if (*arg == '\0') {
-		log(ERROR, "empty input\n");
-		return -1;
-	}
+					c->events = EPOLLIN;
+					c->next = conns;
+					if (conns)
+						conns->prev = c;
+					conns = c;
+				}
 
-	if (*arg == '-') {
-		log(ERROR, "N must be >= 0\n");
-		return -1;
-	}
+				/* Out of descriptors, accept again once a client leaves */
+				if (errno == EMFILE || errno == ENFILE) {
+					log(WARNING, "accept: %s\n", strerror(errno));
+					epoll_ctl(epfd, EPOLL_CTL_DEL, lfd, NULL);
+					paused = true;
+				}
+				continue;
+			}
 
-	if (cfg.repl && arg[0] == 'r' && arg[1] == '\0')
-		arg = lastres.p;
+			if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !c->eof && !conn_read(c))
+				c->broken = true;
 
-	maxuint_t val = strtouquad(arg, &pch);
-	if (*pch) {
-		log(ERROR, "invalid input\n");
-		return -1;
+			if (!c->broken && !conn_write(c))
+				c->broken = true;
+
+			/* Done once the client has nothing more to say and heard it all */
+			if (c->broken || (c->eof && c->outoff == c->outlen) || !conn_watch(epfd, c)) {
+				if (c->prev)
+					c->prev->next = c->next;
+				else
+					conns = c->next;
+				if (c->next)
+					c->next->prev = c->prev;
+				conn_free(c);
+
+				if (paused) {
+					ev.events = EPOLLIN;
+					ev.data.ptr = NULL;
+					paused = epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev) == -1;
+				}
+			}
+		}
 	}
 
-	if (bitposition)
-		printbin_positions(val);
-	else {
-		printf(" (b) ");
-		printbin(val);
-		printf("\n (d) %s\n (h) ",
-			getstr_u128(val, uint_buf));
-		printhex_u128(val);
-		printf("\n");
+	log(DEBUG, "shutting down\n");
+
+	while (conns) {
+		c = conns->next;
+		conn_free(conns);
+		conns = c;
 	}
 
-	return 0;
+out:
+	if (epfd != -1)
+		close(epfd);
+	close(lfd);
+	unlink(path);
+	return ret;
+}
+#else
+static int serve(const char *path)
+{
+	log(ERROR, "--serve needs epoll(7), only on Linux\n");
+	return -1;
 }
+#endif
 
 int main(int argc, char **argv)
 {
 	int opt = 0, operation = 0;
 	ulong sectorsz = SECTOR_SIZE;
+	char *batchfile = NULL, *progexpr = NULL, *sockpath = NULL, *extractfile = NULL;
+	char *aggfile = NULL;
+	int nthreads = 1;
+	ctx_t mainctx = {0};
+	ctx_t *ctx = &mainctx;
+
+	if (!ctx_init(ctx, stdout))
+		return -1;
 
 	get_bit_value_1_code();
 
@@ -3302,15 +2356,47 @@ int main(int argc, char **argv)
 	rl_bind_key('\t', rl_insert);
 #endif
 
-	while ((opt = getopt(argc, argv, "Hbc:df:hmp:s:")) != -1) {
+	static const struct option longopts[] = {
+		{"serve", required_argument, NULL, 'S'},
+		{NULL, 0, NULL, 0},
+	};
+
+	while ((opt = getopt_long(argc, argv, "B:C:HP:a:bc:de:f:hj:mp:s:tw:x:", longopts, NULL)) != -1) {
 		switch (opt) {
+		case 'S':
+			sockpath = optarg;
+			break;
+		case 'B':
+			batchfile = optarg;
+			break;
+		case 'C':
+			cachesize = (uint)strtoul_b(optarg);
+			if (*optarg == '-' || bcal_set_cache(ctx->bc, cachesize) != BCAL_OK) {
+				log(ERROR, "cache must be up to %d entries\n", BCAL_CACHE_MAX);
+				return -1;
+			}
+			break;
 		case 'H':
 			cfg.hexout = 1;
 			break;
+		case 'P':
+			mathscale = (uint)strtoul_b(optarg);
+			if (*optarg == '-' || bcal_set_scale(ctx->bc, mathscale) != BCAL_OK) {
+				log(ERROR, "digits must be up to %d\n", BCAL_SCALE_MAX);
+				return -1;
+			}
+			break;
+		case 'a':
+			aggfile = optarg;
+			break;
+		case 'e':
+			progexpr = optarg;
+			break;
 		case 'c':
 			operation = 1;
-			convertbase(optarg, false);
-			printf("\n");
+			convertbase(ctx, optarg, false);
+			ob_putc(&ctx->out, '\n');
+			ob_flush(&ctx->out);
 			break;
 		case 'f':
 			operation = 1;
@@ -3319,22 +2405,26 @@ int main(int argc, char **argv)
 				maxuint_t lba = 0;
 
 				if (chs2lba(optarg + 1, &lba)) {
-					printf("  LBA: (d) %s, (h) ",
-						getstr_u128(lba, uint_buf));
-					printhex_u128(lba);
-					printf("\n\n");
+					ob_puts(&ctx->out, "  LBA: (d) ");
+					ob_uint(&ctx->out, lba, 0);
+					ob_puts(&ctx->out, ", (h) ");
+					printhex_u128(ctx, lba);
+					ob_puts(&ctx->out, "\n\n");
 				}
 			} else if (tolower((int)*optarg) == 'l') {
 				t_chs chs;
 
-				if (lba2chs(optarg + 1, &chs)) {
-					printf("  CHS: (d) %lu %lu %lu, ",
-						chs.c, chs.h, chs.s);
-					printf("(h) 0x%lx 0x%lx 0x%lx\n\n",
-						chs.c, chs.h, chs.s);
+				if (lba2chs(ctx, optarg + 1, &chs)) {
+					ob_puts(&ctx->out, "  CHS: (d) ");
+					printchs(ctx, &chs, false);
+					ob_puts(&ctx->out, ", (h) ");
+					printchs(ctx, &chs, true);
+					ob_puts(&ctx->out, "\n\n");
 				}
 			} else
 				log(ERROR, "invalid input\n");
+
+			ob_flush(&ctx->out);
 			break;
 		case 'm':
 			cfg.minimal = 1;
@@ -3357,12 +2447,32 @@ int main(int argc, char **argv)
 			break;
 		case 'p':
 			operation = 1;
-			convertbase(optarg, true);
-			printf("\n");
+			convertbase(ctx, optarg, true);
+			ob_putc(&ctx->out, '\n');
+			ob_flush(&ctx->out);
 			break;
 		case 'h':
 			usage();
 			return 0;
+		case 't':
+			cfg.total = 1;
+			break;
+		case 'w':
+			widebits = (uint)strtoul_b(optarg);
+			if (*optarg == '-' || bcal_set_width(ctx->bc, widebits) != BCAL_OK) {
+				log(ERROR, "bits must be a multiple of 64 up to %d\n", BCAL_WIDE_BITS_MAX);
+				return -1;
+			}
+			cfg.wide = 1;
+			break;
+		case 'x':
+			extractfile = optarg;
+			break;
+		case 'j':
+			nthreads = parse_threads(optarg);
+			if (nthreads == -1)
+				return -1;
+			break;
 		default:
 			log(ERROR, "invalid option \'%c\'\n\n", (char)optopt);
 			usage();
@@ -3372,6 +2482,65 @@ int main(int argc, char **argv)
 
 	log(DEBUG, "argc %d, optind %d\n", argc, optind);
 
+	ctx_config(ctx);
+
+	if (progexpr) {
+		bcal_prog *prog = NULL;
+		bcal_maths *mprog = NULL;
+		int ret = -1;
+
+		if (cfg.wide) {
+			log(ERROR, "-w doesn't apply to -e programs\n");
+			ctx_free(ctx);
+			return -1;
+		}
+
+		if (cfg.maths) {
+			if (bcal_compile_maths(ctx->bc, progexpr, &mprog) == BCAL_OK) {
+				ctx->mprog = mprog;
+				ret = evaluate_batch(ctx, batchfile ? batchfile : "-", sectorsz, nthreads);
+				bcal_maths_free(mprog);
+			} else
+				log(ERROR, "%s\n", bcal_errmsg(ctx->bc));
+		} else if (bcal_compile(ctx->bc, progexpr, &prog) == BCAL_OK) {
+			ctx->prog = prog;
+			ret = evaluate_batch(ctx, batchfile ? batchfile : "-", sectorsz, nthreads);
+			bcal_prog_free(prog);
+		} else
+			log(ERROR, "%s\n", bcal_errmsg(ctx->bc));
+
+		ctx_free(ctx);
+		return ret;
+	}
+
+	if (sockpath) {
+		int ret = serve(sockpath);
+
+		ctx_free(ctx);
+		return ret;
+	}
+
+	if (aggfile) {
+		int ret = aggregate(ctx, aggfile, nthreads);
+
+		ctx_free(ctx);
+		return ret;
+	}
+
+	if (extractfile) {
+		int ret = extract(ctx, extractfile);
+
+		ctx_free(ctx);
+		return ret;
+	}
+
+	if (batchfile) {
+		int ret = evaluate_batch(ctx, batchfile, sectorsz, nthreads);
+
+		ctx_free(ctx);
+		return ret;
+	}
+
 	if (!operation && (argc == optind)) {
 		char *ptr = NULL, *tmp = NULL;
 		cfg.repl = 1;
@@ -3381,6 +2550,9 @@ int main(int argc, char **argv)
 		read_history(NULL);
 
 		while (1) {
+			/* Show the result of the last input */
+			ob_flush(&ctx->out);
+
 			/* Manually print prompt for non-TTY mode (e.g., tests with pipes) */
 			if (!is_tty) {
 				printf("%s", prompt);
@@ -3421,32 +2593,35 @@ int main(int argc, char **argv)
 
 			add_history(tmp);
 
-			if (cfg.maths) {
-				if (has_function_call(tmp))
-					remove_thousands_commas(tmp);
-				else
-					remove_commas(tmp);
-			} else
-				remove_commas(tmp);
-
 			log(DEBUG, "ptr: [%s]\n", ptr);
 			log(DEBUG, "tmp: [%s]\n", ptr);
 
 			if ((strlen(tmp) == 1) && tmp[1] == '\0') {
 				switch (tmp[0]) {
 				case 'r':
+				{
 					/* Show the last stored result */
-					if (lastres.p[0] == '\0')
+					int unit = 0;
+					const char *last = bcal_last(ctx->bc, &unit);
+					const bcal_wide *wide = bcal_last_wide(ctx->bc, &unit);
+
+					if (!last && wide) {
+						/* Too wide for bcal_last() */
+						ob_puts(&ctx->out, "r = ");
+						printwide(ctx, wide, 10, 0);
+						ob_puts(&ctx->out, unit ? " B\n" : "\n");
+					} else if (!last)
 						printf("no result stored\n");
 					else {
-						printf("r = %s ", lastres.p);
-						if (lastres.unit)
+						printf("r = %s ", last);
+						if (unit)
 							printf("B");
 						printf("\n");
 					}
 
 					free(ptr);
 					continue;
+				}
 				case 'b':
 					cfg.maths ^= 1;
 					strncpy(prompt, cfg.maths ? PROMPT_MATHS : PROMPT_BYTES, 8);
@@ -3465,6 +2640,10 @@ int main(int argc, char **argv)
 					free(ptr);
 					continue;
 				default:
+					/* Other letters may be variables */
+					if (isalpha((unsigned char)tmp[0]) && tmp[0] != 'c' && tmp[0] != 'p')
+						break;
+
 					printf("invalid input\n");
 					free(ptr);
 					continue;
@@ -3473,62 +2652,37 @@ int main(int argc, char **argv)
 
 			/* Handle 'c' and 'p' switches in both storage and expression modes */
 			if (tmp[0] == 'c' && !isalpha(tmp[1])) {
-				convertbase(tmp + 1, false);
+				convertbase(ctx, tmp + 1, false);
 				free(ptr);
 				continue;
 			}
 
 			if (tmp[0] == 'p' && !isalpha(tmp[1])) {
-				convertbase(tmp + 1, true);
+				convertbase(ctx, tmp + 1, true);
 				free(ptr);
 				continue;
 			}
 
 			if (cfg.maths) {
-				if (has_bitwise_ops(tmp)) {
-					if (eval_bitwise_expr(tmp, lastres.p, UINT_BUF_LEN) == 0) {
-
-						continue;
-					}
-					free(ptr);
-					continue;
-				}
-
-				if (eval_decimal_multiply(tmp, lastres.p, UINT_BUF_LEN)) {
-					printf("%s\n", lastres.p);
-					lastres.unit = 0;
-					free(ptr);
-					continue;
-				}
+				if (has_bitwise_ops(tmp))
+					eval_bitwise_expr(ctx, tmp);
+				else
+					evaluate_maths(ctx, tmp);
 
-				maxfloat_t result;
-				if (eval_expr(tmp, &result) == 0) {
-					long long int_result;
-					if (is_integral_result(result, &int_result)) {
-						print_and_store_int_result(int_result);
-					} else {
-						format_result(result, lastres.p, UINT_BUF_LEN);
-						printf("%s\n", lastres.p);
-					}
-					/* Store result for next use */
-					lastres.unit = 0;
-				}
 				free(ptr);
 				continue;
 			}
 
 			/* Check for bitwise operations first */
 			if (has_bitwise_ops(tmp)) {
-				if (eval_bitwise_expr(tmp, lastres.p, UINT_BUF_LEN) == 0) {
+				if (eval_bitwise_expr(ctx, tmp) == 0) {
 					free(ptr);
 					continue;
 				}
 			}
 
-			curexpr = tmp;
-
 			/* Evaluate the expression */
-			evaluate(tmp, sectorsz);
+			evaluate(ctx, tmp, sectorsz);
 
 			free(ptr);
 		}
@@ -3538,59 +2692,24 @@ int main(int argc, char **argv)
 	}
 
 	/* Unit conversion */
-	if (argc - optind == 2)
-		if (convertunit(argv[optind], argv[optind + 1], sectorsz) == -1)
+	if (argc - optind == 2) {
+		int ret = convertunit(ctx, argv[optind], argv[optind + 1], sectorsz);
+
+		ob_flush(&ctx->out);
+		if (ret == -1)
 			return -1;
+	}
 
 	/* Arithmetic operation */
 	if (argc - optind == 1) {
 		char *tmp = strdup(argv[optind]);
 		if (!tmp)
 			return -1;
-		strstrip(tmp);
-		if (cfg.maths) {
-			if (has_function_call(tmp))
-				remove_thousands_commas(tmp);
-			else
-				remove_commas(tmp);
-		}
-
-		/* Check for bitwise operations first, but only if no units are present */
-		if (has_bitwise_ops(tmp) && !has_units(tmp)) {
-			int bitwise_ret = eval_bitwise_expr(tmp, lastres.p, UINT_BUF_LEN);
-			free(tmp);
-			return bitwise_ret;
-		}
-
-		if (cfg.maths) {
-			if (eval_decimal_multiply(tmp, lastres.p, UINT_BUF_LEN)) {
-				printf("%s\n", lastres.p);
-				lastres.unit = 0;
-				free(tmp);
-				return 0;
-			}
-
-			maxfloat_t result;
-			if (eval_expr(tmp, &result) == 0) {
-				long long int_result;
-				if (is_integral_result(result, &int_result)) {
-					print_and_store_int_result(int_result);
-				} else {
-					format_result(result, lastres.p, UINT_BUF_LEN);
-					printf("%s\n", lastres.p);
-				}
-				/* Store result for next use */
-				lastres.unit = 0;
-				free(tmp);
-				return 0;
-			}
-			free(tmp);
-			return -1;
-		}
 
-		curexpr = argv[optind];
+		int ret = evaluate_line(ctx, tmp, sectorsz);
+		ob_flush(&ctx->out);
 		free(tmp);
-		return evaluate(argv[optind], sectorsz);
+		return ret;
 	}
 
 	return -1;
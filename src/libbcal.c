@@ -0,0 +1,4495 @@
+/*
+ * libbcal: storage expression evaluation and unit conversion
+ *
+ * Author: Arun Prakash Jana <engineerarun@gmail.com>
+ * Copyright (C) 2016 by Arun Prakash Jana <engineerarun@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bcal.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bcal.h"
+#include "decimal.h"
+#include "dslib.h"
+#include "strutil.h"
+#include "wide.h"
+
+#define UINT_BUF_LEN BCAL_UINT_BUF_LEN
+#define ERR_LEN 128
+#define MSG_LEN 256
+#define UNIT_NAME_MAX 3 /* longest unit name */
+#define WORD_LEN 256 /* longest operand */
+#define WIDE_WORD_LEN (BCAL_WIDE_BITS_MAX + 8) /* longest wide operand, "0b" and a unit */
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+#define POW10_19 10000000000000000000ULL
+#define SWAR_ONES 0x0101010101010101ULL
+#define SWAR_HIGH 0x8080808080808080ULL
+#define SIZE_TOKEN_MAX 96 /* longest size bcal_scan_size() waits for the rest of */
+
+#define ERROR BCAL_LOG_ERROR
+#define WARNING BCAL_LOG_WARNING
+#define INFO BCAL_LOG_INFO
+#define DEBUG BCAL_LOG_DEBUG
+
+/*
+ * Messages are kept in or routed through the context, never printed
+ * Arguments of filtered out messages are not evaluated.
+ */
+#define log(level, format, ...) \
+	do { \
+		if ((level) == ERROR || (ctx->logfn && (level) <= ctx->loglvl)) \
+			ctx_log(ctx, __func__, level, format, ##__VA_ARGS__); \
+	} while (0)
+
+typedef unsigned int uint;
+typedef long double maxfloat_t;
+
+typedef struct {
+	decimal_t mag;
+	size_t scale; /* digits of mag after the point */
+	bool negative;
+} decnum_t;
+
+/* Extra digits of exact quotients, one limb */
+#define DIV_GUARD 9
+
+/* A maths value, exact unless a function or operand made it a long double */
+typedef struct {
+	decnum_t dec;
+	maxfloat_t val; /* if not exact */
+	bool exact;
+} mathnum_t;
+
+/* Kinds of mathnode other than operators, LEX_R and LEX_NAME */
+#define MATHS_NUM '0'
+#define MATHS_CALL 'f'
+
+/*
+ * A node of compiled maths, in postfix order: the operands of a node are
+ * the subtrees right before it. Constant subtrees are folded to a number.
+ */
+typedef struct {
+	char op;         /* '+', '-', '*', '/', MATHS_NUM, MATHS_CALL, LEX_R or LEX_NAME */
+	bool exact;      /* a number in limbs of the pool, else in val */
+	bool negative;
+	uint8_t fn;      /* slot in mathfns[] of a call */
+	uint32_t nargs;  /* operands */
+	size_t limb;     /* first limb of a number in the pool, a variable in the source */
+	size_t len;
+	size_t scale;
+	maxfloat_t val;
+} mathnode;
+
+/* A compiled maths expression, the last node is the result */
+struct bcal_maths {
+	size_t len;
+	size_t depth;         /* operands pending at most */
+	const uint32_t *pool; /* after the nodes */
+	const char *src;      /* the expression, it names the variables */
+	mathnode node[];
+};
+
+/* Lexeme kinds other than operators, '(', ')' and ',' */
+#define LEX_END '\0'
+#define LEX_NUM '0'
+#define LEX_NAME 'a'
+#define LEX_R 'r'
+
+/* Storage numbers followed by a unit */
+#define LEX_UNIT_B 'b'    /* "0xd b", the unit is not part of the span */
+#define LEX_UNIT_SPAN 'u' /* "2 bit", the span includes the unit */
+
+/* A token of an expression, a span of the source with its kind */
+typedef struct {
+	char kind;
+	char unit;      /* LEX_UNIT_* */
+	uint pos;
+	uint len;
+	maxfloat_t val; /* maths numbers */
+} lexeme;
+
+/* A compiled expression, postfix code or a single operand if len is 0 */
+struct bcal_prog {
+	bcal_result single;
+	size_t len;
+	const char *src; /* the expression, it names the variables */
+	Token code[];
+};
+
+/* Longest variable name */
+#define VAR_NAME_MAX 31
+
+/* A variable, its value is kept as a result string like r */
+typedef struct {
+	char name[VAR_NAME_MAX + 1]; /* "" in a free slot */
+	uint32_t hash;
+	char unit;
+	bool num;      /* val has the value as a storage operand */
+	maxuint_t val;
+	char *value;
+} variable;
+
+/* Longest expression the result cache keeps, as lexed */
+#define CACHE_KEY_LEN 64
+#define CACHE_NIL UINT32_MAX
+
+/* A result of the cache, in the chain of its bucket and in the LRU list */
+typedef struct {
+	char key[CACHE_KEY_LEN];
+	uint32_t len;
+	uint32_t hash;
+	uint32_t chain;
+	uint32_t prev; /* more recently used */
+	uint32_t next;
+	bcal_result res;
+} cache_entry;
+
+/* Results of bcal_eval() by expression, see bcal_set_cache() */
+typedef struct {
+	cache_entry *e;
+	uint32_t *bucket; /* first entry of each chain */
+	uint32_t cap;     /* 0 if off */
+	uint32_t len;
+	uint32_t mask;    /* buckets - 1 */
+	uint32_t head;    /* most recently used */
+	uint32_t tail;
+	size_t hits;
+	size_t misses;
+} result_cache;
+
+/*
+ * Histogram buckets of bcal_stats, 2^STATS_PRECISION to a power of 2.
+ * Sizes below 2^(STATS_PRECISION + 1) have one each.
+ */
+#define STATS_PRECISION 7
+#define STATS_BUCKETS (((sizeof(maxuint_t) << 3) + 1 - STATS_PRECISION) << STATS_PRECISION)
+
+/* Sizes added to an aggregate, see bcal_stats_new() */
+struct bcal_stats {
+	bcal_summary sum;
+	uint64_t bucket[STATS_BUCKETS];
+};
+
+/* All the state of an evaluator, see bcal.h */
+struct bcal_ctx {
+	Data lastres;
+	const char *lastlong; /* lastres in full if it didn't fit, else NULL */
+	char *longbuf;
+	maxuint_t lastval; /* lastres as an operand if lastnum is set */
+	char lastunit;
+	bool lastnum;
+	const char *src; /* expression being lexed */
+	lexeme *lex;     /* its tokens, terminated by LEX_END in maths */
+	size_t nlex;
+	size_t lexcap;
+	bool inexact;    /* an operand was rounded down to whole bytes */
+	bool wide;       /* infix2postfix() leaves operands to eval_wide() */
+	uint wlimbs;     /* width of wide integers */
+	struct wide_token *wstack; /* operands in eval_wide() */
+	size_t wcap;
+	wide_t lastw;    /* last wide result, lastres only has it if it fits */
+	bool lastwide;
+	stack opstack;   /* operators in infix2postfix() */
+	stack evalstack; /* operands in eval() */
+	queue postfix;
+	char uint_buf[UINT_BUF_LEN];
+	size_t scale;    /* digits of maths results after the point */
+	mathnode *node;  /* maths code being compiled */
+	size_t nnode;
+	size_t nodecap;
+	uint32_t *pool;  /* limbs of its numbers */
+	size_t npool;
+	size_t poolcap;
+	size_t depth;    /* operands pending after the last node */
+	size_t maxdepth;
+	mathnum_t *cval; /* its numbers until it's sealed */
+	size_t ncval;
+	size_t cvalcap;
+	mathnum_t *mstack; /* operands in run_maths() */
+	size_t mstackcap;
+	variable *vars;  /* open addressed, a power of 2 slots */
+	size_t nvars;
+	size_t varcap;
+	result_cache cache;
+	bool warned;     /* the result isn't cached so warnings are repeated */
+	int flags;
+	int loglvl;
+	bcal_log_fn logfn;
+	void *logarg;
+	int err;
+	char errmsg[ERR_LEN];
+};
+
+/* Indexed by enum bcal_unit, names are resolved by unit_index() */
+static const bcal_unit_info units[BCAL_UNITS] = {
+	{"B", 1, 1, 0},
+	{"KiB", (maxuint_t)1 << 10, 1, 2},
+	{"MiB", (maxuint_t)1 << 20, 1, 2},
+	{"GiB", (maxuint_t)1 << 30, 1, 2},
+	{"TiB", (maxuint_t)1 << 40, 1, 2},
+	{"PiB", (maxuint_t)1 << 50, 1, 2},
+	{"EiB", (maxuint_t)1 << 60, 1, 2},
+	{"kB", 1000, 1, 10},
+	{"MB", 1000000, 1, 10},
+	{"GB", 1000000000, 1, 10},
+	{"TB", 1000000000000, 1, 10},
+	{"PB", 1000000000000000, 1, 10},
+	{"EB", 1000000000000000000, 1, 10},
+	{"bit", 1, 8, 0},
+};
+
+static const char digit_pairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/* 10^0 to 10^19 */
+static const uint64_t pow10_u64[] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+	100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL,
+	1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+	1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+	1000000000000000000ULL, POW10_19,
+};
+
+static char *FAILED = "1";
+static char *PASSED = "\0";
+
+static void ctx_log(bcal_ctx *ctx, const char *func, int level, const char *format, ...) __attribute__((__format__(printf, 4, 5)));
+
+/*
+ * The first error of a call is saved in the context with its code
+ * defaulting to BCAL_EINVAL, other levels go to the log callback
+ */
+static void ctx_log(bcal_ctx *ctx, const char *func, int level, const char *format, ...)
+{
+	char msg[MSG_LEN];
+	va_list ap;
+
+	if (level == ERROR) {
+		if (ctx->err)
+			return;
+
+		va_start(ap, format);
+		vsnprintf(ctx->errmsg, ERR_LEN, format, ap);
+		va_end(ap);
+
+		size_t len = strlen(ctx->errmsg);
+		if (len && ctx->errmsg[len - 1] == '\n')
+			ctx->errmsg[len - 1] = '\0';
+
+		ctx->err = BCAL_EINVAL;
+		return;
+	}
+
+	va_start(ap, format);
+	vsnprintf(msg, MSG_LEN, format, ap);
+	va_end(ap);
+
+	ctx->logfn(ctx->logarg, level, func, msg);
+}
+
+static void reset_error(bcal_ctx *ctx)
+{
+	ctx->err = BCAL_OK;
+	ctx->errmsg[0] = '\0';
+}
+
+/* Error code of a failed call */
+static int failure(bcal_ctx *ctx)
+{
+	if (!ctx->err)
+		ctx->err = BCAL_EINVAL;
+
+	return ctx->err;
+}
+
+/* The last result string, lastres may only have its start */
+static const char *last_str(const bcal_ctx *ctx)
+{
+	return ctx->lastlong ? ctx->lastlong : ctx->lastres.p;
+}
+
+static void store_result(bcal_ctx *ctx, const char *res, int unit)
+{
+	size_t len = strlen(res);
+
+	bstrlcpy(ctx->lastres.p, res, NUM_LEN);
+	ctx->lastlong = NULL;
+	if (len >= NUM_LEN) {
+		/* Exact maths results can be of any length */
+		char *buf = (char *)realloc(ctx->longbuf, len + 1);
+
+		if (buf) {
+			memcpy(buf, res, len + 1);
+			ctx->longbuf = buf;
+			ctx->lastlong = buf;
+		}
+	}
+
+	ctx->lastres.unit = (char)unit;
+	ctx->lastnum = false;
+	ctx->lastwide = false;
+	log(DEBUG, "result: %s %d\n", last_str(ctx), ctx->lastres.unit);
+}
+
+/* FNV-1a hash of a variable name */
+static uint32_t var_hash(const char *s, size_t len)
+{
+	uint32_t h = 2166136261U;
+
+	while (len--)
+		h = (h ^ (unsigned char)*s++) * 16777619U;
+
+	return h;
+}
+
+/* Slot of the variable called name, or the free one it would take */
+static variable *var_slot(const variable *vars, size_t cap, const char *name, size_t len, uint32_t h)
+{
+	size_t i = h & (cap - 1);
+
+	while (vars[i].name[0] &&
+	       (vars[i].hash != h || strncmp(vars[i].name, name, len) || vars[i].name[len]))
+		i = (i + 1) & (cap - 1);
+
+	return (variable *)&vars[i];
+}
+
+/* The variable called name, NULL if there is none */
+static variable *var_find(const bcal_ctx *ctx, const char *name, size_t len)
+{
+	variable *v;
+
+	/* Expressions without variables don't hash */
+	if (!ctx->nvars || len > VAR_NAME_MAX)
+		return NULL;
+
+	v = var_slot(ctx->vars, ctx->varcap, name, len, var_hash(name, len));
+	return v->name[0] ? v : NULL;
+}
+
+/* Set the variable called name to a result string, adding it if it's new */
+static bool var_set(bcal_ctx *ctx, const char *name, size_t len, const char *value, int unit)
+{
+	size_t vlen = strlen(value);
+	uint32_t h = var_hash(name, len);
+	variable *v;
+	char *str;
+
+	/* Kept at most 3/4 full so probes end early */
+	if ((ctx->nvars + 1) * 4 > ctx->varcap * 3) {
+		size_t cap = ctx->varcap ? ctx->varcap * 2 : 16;
+		variable *vars = (variable *)calloc(cap, sizeof(variable));
+
+		if (!vars)
+			return false;
+
+		for (size_t i = 0; i < ctx->varcap; ++i)
+			if (ctx->vars[i].name[0])
+				*var_slot(vars, cap, ctx->vars[i].name, strlen(ctx->vars[i].name),
+					  ctx->vars[i].hash) = ctx->vars[i];
+
+		free(ctx->vars);
+		ctx->vars = vars;
+		ctx->varcap = cap;
+	}
+
+	v = var_slot(ctx->vars, ctx->varcap, name, len, h);
+	str = (char *)realloc(v->name[0] ? v->value : NULL, vlen + 1);
+	if (!str)
+		return false;
+
+	if (!v->name[0]) {
+		memcpy(v->name, name, len);
+		v->name[len] = '\0';
+		v->hash = h;
+		++ctx->nvars;
+	}
+
+	memcpy(str, value, vlen + 1);
+	v->value = str;
+	v->unit = (char)unit;
+	v->num = false;
+	return true;
+}
+
+/* Lowercase of an ASCII letter, other chars never turn into a letter */
+#define LOWER(c) ((c) | 0x20)
+
+/* IEC unit of a prefix letter, the SI unit is BCAL_KB - BCAL_KIB after it */
+static int unit_prefix(char c)
+{
+	switch (LOWER(c)) {
+	case 'k':
+		return BCAL_KIB;
+	case 'm':
+		return BCAL_MIB;
+	case 'g':
+		return BCAL_GIB;
+	case 't':
+		return BCAL_TIB;
+	case 'p':
+		return BCAL_PIB;
+	case 'e':
+		return BCAL_EIB;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Unit named by the len chars at s ignoring case, -1 if none
+ * Names are told apart by their length and letters without a scan.
+ */
+static int unit_index(const char *s, size_t len)
+{
+	int unit;
+
+	switch (len) {
+	case 1: /* b */
+		return LOWER(s[0]) == 'b' ? BCAL_B : -1;
+	case 2: /* kb, mb... */
+		if (LOWER(s[1]) != 'b' || (unit = unit_prefix(s[0])) == -1)
+			return -1;
+		return unit + BCAL_KB - BCAL_KIB;
+	case 3: /* kib, mib... and bit */
+		if (LOWER(s[0]) == 'b' && LOWER(s[1]) == 'i' && LOWER(s[2]) == 't')
+			return BCAL_BIT;
+		if (LOWER(s[1]) != 'i' || LOWER(s[2]) != 'b')
+			return -1;
+		return unit_prefix(s[0]);
+	default:
+		return -1;
+	}
+}
+
+static int lookup_unit(const char *name)
+{
+	return unit_index(name, strlen(name));
+}
+
+/* 5^e, false if it doesn't fit */
+static bool pow5(uint e, maxuint_t *out)
+{
+	maxuint_t res;
+
+	/* 5^e is 10^e / 2^e */
+	if (e < ARRAY_SIZE(pow10_u64)) {
+		*out = pow10_u64[e] >> e;
+		return true;
+	}
+
+	res = pow10_u64[19] >> 19;
+	for (e -= 19; e; --e)
+		if (__builtin_mul_overflow(res, 5, &res))
+			return false;
+
+	*out = res;
+	return true;
+}
+
+/* 2^e2 * 5^e5, false if it doesn't fit */
+static bool pow25(uint e2, uint e5, maxuint_t *out)
+{
+	if (e2 >= sizeof(maxuint_t) * CHAR_BIT || !pow5(e5, out) || *out > ((maxuint_t)-1 >> e2))
+		return false;
+
+	*out <<= e2;
+	return true;
+}
+
+/*
+ * Bytes in m / 10^scale of unit, rounded down. *frac is set if a
+ * fraction of a byte is dropped. Units are num / den = 2^i * 5^j and
+ * 10^scale is 2^scale * 5^scale, so with the common factors cancelled
+ * the bytes are m * a / b = q * a + r * a / b for q, r = m / b, m % b
+ * and r * a stays well within range. False if the bytes don't fit.
+ */
+static bool unit_bytes(maxuint_t m, uint scale, int unit, maxuint_t *bytes, bool *frac)
+{
+	const bcal_unit_info *u = &units[unit];
+	int twos = __builtin_ctzll((unsigned long long)u->num);
+	int e2 = twos - __builtin_ctzll(u->den) - (int)scale;
+	int e5 = (u->base == 10 ? twos : 0) - (int)scale;
+	maxuint_t a, b, q, r;
+
+	if (!pow25(e2 > 0 ? e2 : 0, e5 > 0 ? e5 : 0, &a) ||
+	    !pow25(e2 < 0 ? -e2 : 0, e5 < 0 ? -e5 : 0, &b))
+		return false;
+
+	*frac = false;
+	if (b == 1)
+		return !__builtin_mul_overflow(m, a, bytes);
+
+	/* Mostly 64-bit, only r * a / b needs the full width */
+	if ((uint64_t)m == m && (uint64_t)b == b) {
+		q = (uint64_t)m / (uint64_t)b;
+		r = (uint64_t)m % (uint64_t)b;
+	} else {
+		q = m / b;
+		r = m % b;
+	}
+
+	if (__builtin_mul_overflow(q, a, &q) || __builtin_mul_overflow(r, a, &r))
+		return false;
+
+	a = r / b;
+	*frac = (a * b != r);
+	return !__builtin_add_overflow(q, a, bytes);
+}
+
+/* Bytes of a long double, false if they don't fit */
+static bool float_bytes(maxfloat_t val, maxuint_t *bytes)
+{
+	if (!(val < ldexpl(1, sizeof(maxuint_t) << 3)))
+		return false;
+
+	*bytes = (maxuint_t)val;
+	return true;
+}
+
+/* Bytes in a val of unit that isn't handled exactly, truncated, false if they don't fit */
+static bool unit_bytes_f(maxfloat_t val, int unit, maxuint_t *bytes, bool *frac)
+{
+	maxfloat_t b = val * units[unit].num / units[unit].den;
+
+	*frac = (b != floorl(b));
+	return float_bytes(b, bytes);
+}
+
+/* An operand has more bytes than maxuint_t holds */
+static void too_big(bcal_ctx *ctx, const char *numstr)
+{
+	log(ERROR, "%s exceeds %u bits\n", numstr, (uint)(sizeof(maxuint_t) << 3));
+	ctx->err = BCAL_EOVERFLOW;
+}
+
+static int issign(char c)
+{
+	switch (c) {
+	case '+':
+	case '-':
+	case '*':
+	case '/':
+	case '%':
+	case '>':
+	case '<':
+	case '&':
+	case '|':
+	case '^':
+	case '~':
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* Check if a char is operator or not */
+static int isoperator(int c)
+{
+	switch (c) {
+	case '+':
+	case '-':
+	case '*':
+	case '/':
+	case '%':
+	case '>':
+	case '<':
+	case '&':
+	case '|':
+	case '^':
+	case '~':
+	case '(':
+	case ')': return 1;
+	default: return 0;
+	}
+}
+
+/* Append a lexeme of kind at p, NULL if out of memory */
+static lexeme *lex_push(bcal_ctx *ctx, char kind, const char *p)
+{
+	lexeme *t;
+
+	if (ctx->nlex == ctx->lexcap) {
+		size_t cap = ctx->lexcap ? ctx->lexcap * 2 : 32;
+
+		t = (lexeme *)realloc(ctx->lex, cap * sizeof(lexeme));
+		if (!t) {
+			log(ERROR, "out of memory\n");
+			ctx->err = BCAL_ENOMEM;
+			return NULL;
+		}
+
+		ctx->lex = t;
+		ctx->lexcap = cap;
+	}
+
+	t = &ctx->lex[ctx->nlex++];
+	t->kind = kind;
+	t->unit = 0;
+	t->pos = (uint)(p - ctx->src);
+	t->len = 1;
+	t->val = 0;
+	return t;
+}
+
+/*
+ * Whitespace and commas are dropped from storage expressions, except
+ * a space before b/B, which tells "0xd b" (13 B) from "0xdb"
+ */
+static bool lex_dropped(const char *p)
+{
+	return *p == ',' || (isspace((unsigned char)*p) && p[1] != 'b' && p[1] != 'B');
+}
+
+static const char *lex_skip(const char *p)
+{
+	while (*p && lex_dropped(p))
+		++p;
+
+	return p;
+}
+
+/* Copy the span of a storage lexeme without whitespace and commas */
+static bool lex_copy(bcal_ctx *ctx, const lexeme *t, char *buf, size_t size)
+{
+	const char *p = ctx->src + t->pos, *end = p + t->len;
+	size_t len = 0;
+
+	for (; p < end; ++p) {
+		if (*p == ',' || isspace((unsigned char)*p))
+			continue;
+
+		if (len == size - 1) {
+			log(ERROR, "operand too long\n");
+			return false;
+		}
+
+		buf[len++] = *p;
+	}
+
+	buf[len] = '\0';
+	return true;
+}
+
+/* Let the number before a spaced word take it if it's a unit, as in "2 b" */
+static void lex_unit(bcal_ctx *ctx)
+{
+	lexeme *word = &ctx->lex[ctx->nlex - 1], *num = word - 1;
+	const char *p = ctx->src + word->pos, *end = p + word->len;
+	char name[UNIT_NAME_MAX];
+	size_t len = 0;
+	int unit;
+
+	if (ctx->nlex < 2 || num->kind != LEX_NUM || num->unit || word->kind != LEX_NAME)
+		return;
+
+	for (; p < end; ++p) {
+		if (*p == ',' || isspace((unsigned char)*p))
+			continue;
+		if (len == UNIT_NAME_MAX)
+			return;
+		name[len++] = *p;
+	}
+
+	unit = unit_index(name, len);
+	if (unit == BCAL_B) {
+		/* Not appended, B is a hex digit */
+		num->unit = LEX_UNIT_B;
+		--ctx->nlex;
+	} else if (unit > 0) {
+		num->unit = LEX_UNIT_SPAN;
+		num->len = word->pos + word->len - num->pos;
+		--ctx->nlex;
+	}
+}
+
+/*
+ * Split a storage expression into ctx->lex in a single pass. Operands
+ * run up to the next operator or kept space, the dropped chars in them
+ * are skipped by lex_copy(). *single is set for a lone operand.
+ */
+static int lex_storage(bcal_ctx *ctx, const char *expr, bool *single)
+{
+	const char *p = expr, *next;
+	lexeme *word = NULL;
+	bool spaced = false;
+	char c, prev = '(';
+
+	ctx->src = expr;
+	ctx->nlex = 0;
+	*single = true;
+
+	while (isspace((unsigned char)*p))
+		++p;
+
+	for (; *p; ++p) {
+		if (lex_dropped(p))
+			continue;
+
+		c = *p;
+		if (isspace((unsigned char)c)) {
+			if (word && spaced)
+				lex_unit(ctx);
+			word = NULL;
+			*single = false;
+			prev = ' ';
+			continue;
+		}
+
+		if (c == '{' || c == '}' || c == '[' || c == ']') {
+			log(ERROR, "first brackets only\n");
+			return -1;
+		}
+
+		if (c == '-' && (issign(prev) || prev == '(')) {
+			log(ERROR, "negative token\n");
+			return -1;
+		}
+
+		if (!isoperator(c)) {
+			if (!word) {
+				word = lex_push(ctx, c == 'r' ? LEX_R : (isalpha((unsigned char)c) || c == '_') ? LEX_NAME : LEX_NUM, p);
+				if (!word)
+					return -1;
+				spaced = (prev == ' ');
+			} else if (word->kind == LEX_R)
+				word->kind = LEX_NAME;
+
+			word->len = (uint)(p - expr) + 1 - word->pos;
+			prev = c;
+			continue;
+		}
+
+		if (word && spaced)
+			lex_unit(ctx);
+		word = NULL;
+
+		next = lex_skip(p + 1);
+
+		/* Shifts are << and >>, kept as a single '<' or '>' */
+		if ((c == '<' || c == '>') && (isalnum((unsigned char)*next) || isoperator(*next) || *next == '_')) {
+			if (prev != c && *next != c) {
+				log(ERROR, "invalid operator %c\n", c);
+				return -1;
+			}
+
+			if (prev == *next) {
+				log(ERROR, "invalid sequence %c%c%c\n", prev, c, *next);
+				return -1;
+			}
+
+			if (*next == c) {
+				prev = c;
+				continue;
+			}
+		}
+
+		if (!lex_push(ctx, c, p))
+			return -1;
+		*single = false;
+		prev = c;
+	}
+
+	if (word && spaced)
+		lex_unit(ctx);
+
+	log(DEBUG, "lexemes: %zu\n", ctx->nlex);
+	return 0;
+}
+
+/* Parse the number at p with strtold(3), commas are skipped if grouped */
+static const char *lex_number(const char *p, bool grouped, maxfloat_t *val)
+{
+	char buf[WORD_LEN], *end;
+	const char *q = p;
+	bool commas = false;
+	size_t len = 0, n = 0;
+
+	/* The chars strtold() may take, a sign only after an exponent */
+	while (isalnum((unsigned char)*q) || *q == '.' || (grouped && *q == ',') ||
+	       ((*q == '+' || *q == '-') && (LOWER(q[-1]) == 'e' || LOWER(q[-1]) == 'p'))) {
+		commas |= (*q == ',');
+		++q;
+	}
+
+	if (!commas) {
+		*val = strtold(p, &end);
+		return end;
+	}
+
+	for (; p + n < q && len < WORD_LEN - 1; ++n)
+		if (p[n] != ',')
+			buf[len++] = p[n];
+	buf[len] = '\0';
+
+	*val = strtold(buf, &end);
+
+	/* Map the chars taken back to the expression */
+	for (n = (size_t)(end - buf); n; ++p)
+		if (*p != ',')
+			--n;
+
+	return p;
+}
+
+/*
+ * Split a maths expression into ctx->lex in a single pass. Commas group
+ * digits, except in function arguments where they separate arguments.
+ */
+static int lex_maths(bcal_ctx *ctx, const char *expr)
+{
+	const char *p = expr, *q;
+	uint64_t calls = 0; /* bit n is set if the paren at depth n is a call */
+	uint depth = 0;
+	maxfloat_t val;
+	lexeme *t;
+	char *end;
+	char kind;
+
+	ctx->src = expr;
+	ctx->nlex = 0;
+
+	while (*p) {
+		if (isspace((unsigned char)*p) || (*p == ',' && !calls)) {
+			++p;
+			continue;
+		}
+
+		q = p;
+		kind = LEX_NUM;
+		if (isdigit((unsigned char)*p) || *p == '.')
+			q = lex_number(p, !calls, &val);
+		else if (isalpha((unsigned char)*p) || *p == '_') {
+			while (isalnum((unsigned char)*q) || *q == '_')
+				++q;
+
+			/* inf and nan are numbers */
+			val = strtold(p, &end);
+			kind = (end == q) ? LEX_NUM : (q - p == 1 && *p == 'r') ? LEX_R : LEX_NAME;
+		}
+
+		if (q != p) {
+			t = lex_push(ctx, kind, p);
+			if (!t)
+				return -1;
+			t->len = (uint)(q - p);
+			t->val = val;
+			p = q;
+			continue;
+		}
+
+		t = lex_push(ctx, *p, p);
+		if (!t)
+			return -1;
+
+		if (*p == '(') {
+			if (depth < 64 && ctx->nlex > 1 && t[-1].kind == LEX_NAME)
+				calls |= 1ULL << depth;
+			++depth;
+		} else if (*p == ')' && depth) {
+			--depth;
+			if (depth < 64)
+				calls &= ~(1ULL << depth);
+		}
+
+		++p;
+	}
+
+	return lex_push(ctx, LEX_END, p) ? 0 : -1;
+}
+
+/* Parse a plain decimal, commas are skipped; out->mag is set on success */
+static bool parse_decimal_token(const char *start, size_t len, decnum_t *out)
+{
+	bool seen_dot = false;
+	size_t ndigits = 0, scale = 0, i = 0;
+
+	if (!start || !out || len == 0)
+		return false;
+
+	out->negative = false;
+	if (start[i] == '+' || start[i] == '-') {
+		out->negative = (start[i] == '-');
+		++i;
+	}
+
+	for (; i < len; ++i) {
+		unsigned char ch = (unsigned char)start[i];
+
+		if (isdigit(ch)) {
+			++ndigits;
+			if (seen_dot)
+				++scale;
+		} else if (ch == '.' && !seen_dot) {
+			seen_dot = true;
+		} else if (ch != ',') {
+			return false;
+		}
+	}
+
+	if (!ndigits || !dec_set_digits(&out->mag, start, len, ndigits))
+		return false;
+
+	out->scale = scale;
+	if (!out->mag.len)
+		out->negative = false;
+	return true;
+}
+
+/*
+ * Format a magnitude with scale digits after the point, dropping the
+ * zeros that end the fraction. The string is written to buf if it fits
+ * in buflen, else it's malloc()ed. NULL if out of memory.
+ */
+static char *format_decimal_result(const decimal_t *mag, size_t scale, bool negative,
+				   char *buf, size_t buflen)
+{
+	size_t nd = dec_ndigits(mag), width, frac;
+	char *end, *p;
+
+	if (!nd)
+		negative = false;
+
+	/* At least one digit before the point */
+	width = nd > scale ? nd : scale + 1;
+	if (width + 3 > buflen) {
+		buf = (char *)malloc(width + 3);
+		if (!buf)
+			return NULL;
+	}
+
+	/* Digits go right aligned after room for the sign and the point */
+	end = buf + width + 2;
+	p = dec_digits(mag, end);
+	while ((size_t)(end - p) < width)
+		*--p = '0';
+
+	for (frac = scale; frac && p[width - scale + frac - 1] == '0'; --frac)
+		;
+
+	if (frac) {
+		memmove(p - 1, p, width - scale);
+		--p;
+		p[width - scale] = '.';
+		p[width - scale + 1 + frac] = '\0';
+	} else {
+		p[width - scale] = '\0';
+	}
+
+	if (negative)
+		*--p = '-';
+
+	memmove(buf, p, strlen(p) + 1);
+	return buf;
+}
+
+/* A signed decimal operand at t, returns the lexeme after it or NULL */
+static const lexeme *decimal_operand(const bcal_ctx *ctx, const lexeme *t, decnum_t *out)
+{
+	uint pos = t->pos;
+
+	/* A sign is part of the number only right before it */
+	if ((t->kind == '+' || t->kind == '-') && t[1].kind == LEX_NUM && t[1].pos == pos + 1)
+		++t;
+
+	if (t->kind != LEX_NUM || !parse_decimal_token(ctx->src + pos, t->pos + t->len - pos, out))
+		return NULL;
+
+	return t + 1;
+}
+
+static int num_nomem(bcal_ctx *ctx)
+{
+	log(ERROR, "out of memory\n");
+	ctx->err = BCAL_ENOMEM;
+	return -1;
+}
+
+static void num_free(mathnum_t *n)
+{
+	dec_free(&n->dec.mag);
+}
+
+static void num_move(mathnum_t *dst, mathnum_t *src)
+{
+	dec_move(&dst->dec.mag, &src->dec.mag);
+	dst->dec.scale = src->dec.scale;
+	dst->dec.negative = src->dec.negative;
+	dst->val = src->val;
+	dst->exact = src->exact;
+}
+
+static void num_set_float(mathnum_t *n, maxfloat_t v)
+{
+	n->val = v;
+	n->exact = false;
+}
+
+/* Make n exact if it's a whole number that fits in 64 bits */
+static int num_exact(bcal_ctx *ctx, mathnum_t *n)
+{
+	maxfloat_t a = n->val < 0 ? -n->val : n->val;
+	uint64_t u = a < 0x1p64L ? (uint64_t)a : 0;
+
+	if (n->exact || (maxfloat_t)u != a)
+		return 0;
+
+	if (!dec_set_u64(&n->dec.mag, u))
+		return num_nomem(ctx);
+
+	n->dec.scale = 0;
+	n->dec.negative = n->val < 0;
+	n->exact = true;
+	return 0;
+}
+
+/* Turn n into a long double as strtold(3) would read its digits */
+static int num_to_float(bcal_ctx *ctx, mathnum_t *n)
+{
+	char buf[UINT_BUF_LEN], *str;
+	uint64_t v;
+
+	if (!n->exact)
+		return 0;
+
+	/* Both are exact in a long double, so the quotient rounds once */
+	if (n->dec.scale < 20 && dec_get_u64(&n->dec.mag, &v)) {
+		n->val = (maxfloat_t)v / pow10_u64[n->dec.scale];
+		if (n->dec.negative)
+			n->val = -n->val;
+		n->exact = false;
+		return 0;
+	}
+
+	str = format_decimal_result(&n->dec.mag, n->dec.scale, n->dec.negative, buf, sizeof(buf));
+	if (!str)
+		return num_nomem(ctx);
+
+	n->val = strtold(str, NULL);
+	n->exact = false;
+	if (str != buf)
+		free(str);
+	return 0;
+}
+
+/*
+ * Line up the kinds of a and b for an operation, it's exact if both are
+ * exact or one is exact and the other a whole number (hex, a function
+ * result...). Otherwise both are turned into long doubles.
+ */
+static int num_pair(bcal_ctx *ctx, mathnum_t *a, mathnum_t *b)
+{
+	if (a->exact != b->exact && (num_exact(ctx, a) == -1 || num_exact(ctx, b) == -1))
+		return -1;
+
+	if (a->exact && b->exact)
+		return 1;
+
+	return num_to_float(ctx, a) == -1 || num_to_float(ctx, b) == -1 ? -1 : 0;
+}
+
+/* Bring x to scale digits after the point, scale must not be lower */
+static bool num_rescale(decnum_t *x, size_t scale)
+{
+	if (!dec_shl10(&x->mag, scale - x->scale))
+		return false;
+
+	x->scale = scale;
+	return true;
+}
+
+/* a = a + b or a - b, b is clobbered */
+static int num_add(bcal_ctx *ctx, mathnum_t *a, mathnum_t *b, bool sub)
+{
+	decnum_t *x = &a->dec, *y = &b->dec;
+	bool ok;
+
+	switch (num_pair(ctx, a, b)) {
+	case -1:
+		return -1;
+	case 0:
+		a->val = sub ? a->val - b->val : a->val + b->val;
+		return 0;
+	}
+
+	if (sub)
+		y->negative = !y->negative;
+
+	if (!num_rescale(x, y->scale > x->scale ? y->scale : x->scale) ||
+	    !num_rescale(y, x->scale))
+		return num_nomem(ctx);
+
+	if (x->negative == y->negative) {
+		ok = dec_add(&x->mag, &x->mag, &y->mag);
+	} else if (dec_cmp(&x->mag, &y->mag) >= 0) {
+		ok = dec_sub(&x->mag, &x->mag, &y->mag);
+	} else {
+		ok = dec_sub(&x->mag, &y->mag, &x->mag);
+		x->negative = y->negative;
+	}
+
+	if (!ok)
+		return num_nomem(ctx);
+
+	if (!x->mag.len)
+		x->negative = false;
+	return 0;
+}
+
+/* a = a * b */
+static int num_mul(bcal_ctx *ctx, mathnum_t *a, mathnum_t *b)
+{
+	decimal_t prod = {0};
+
+	switch (num_pair(ctx, a, b)) {
+	case -1:
+		return -1;
+	case 0:
+		a->val *= b->val;
+		return 0;
+	}
+
+	if (!dec_mul(&prod, &a->dec.mag, &b->dec.mag)) {
+		dec_free(&prod);
+		return num_nomem(ctx);
+	}
+
+	dec_move(&a->dec.mag, &prod);
+	a->dec.scale += b->dec.scale;
+	a->dec.negative = a->dec.mag.len && a->dec.negative != b->dec.negative;
+	return 0;
+}
+
+/*
+ * a = a / b, b is clobbered. Exact quotients are rounded half up to
+ * DIV_GUARD digits past the scale of ctx, so (1 / 3) * 3 still comes
+ * out as 1 once the result is rounded to the scale.
+ */
+static int num_div(bcal_ctx *ctx, mathnum_t *a, mathnum_t *b)
+{
+	decnum_t *x = &a->dec, *y = &b->dec;
+	size_t digits = ctx->scale + DIV_GUARD;
+	decimal_t q = {0};
+	bool ok;
+
+	if ((b->exact && !y->mag.len) || (!b->exact && b->val == 0)) {
+		log(ERROR, "division by zero\n");
+		return -1;
+	}
+
+	switch (num_pair(ctx, a, b)) {
+	case -1:
+		return -1;
+	case 0:
+		a->val /= b->val;
+		return 0;
+	}
+
+	/* x / y * 10^(digits + 1) in whole numbers, the last digit rounds */
+	if (y->scale + digits + 1 >= x->scale)
+		ok = dec_shl10(&x->mag, y->scale + digits + 1 - x->scale);
+	else
+		ok = dec_shl10(&y->mag, x->scale - y->scale - digits - 1);
+
+	ok = ok && dec_divmod(&q, NULL, &x->mag, &y->mag) && dec_round(&q, 1);
+	if (!ok) {
+		dec_free(&q);
+		return num_nomem(ctx);
+	}
+
+	dec_move(&x->mag, &q);
+	x->scale = digits;
+	x->negative = x->mag.len && x->negative != y->negative;
+	return 0;
+}
+
+/* Compare a and b into cmp like strcmp(3), either may be rescaled */
+static int num_cmp(bcal_ctx *ctx, mathnum_t *a, mathnum_t *b, int *cmp)
+{
+	decnum_t *x = &a->dec, *y = &b->dec;
+
+	switch (num_pair(ctx, a, b)) {
+	case -1:
+		return -1;
+	case 0:
+		*cmp = (a->val > b->val) - (a->val < b->val);
+		return 0;
+	}
+
+	if (x->negative != y->negative) {
+		*cmp = x->negative ? -1 : 1;
+		return 0;
+	}
+
+	if (!num_rescale(x, y->scale > x->scale ? y->scale : x->scale) ||
+	    !num_rescale(y, x->scale))
+		return num_nomem(ctx);
+
+	*cmp = x->negative ? dec_cmp(&y->mag, &x->mag) : dec_cmp(&x->mag, &y->mag);
+	return 0;
+}
+
+/* Round n to a whole number, up if up is set or else down */
+static int num_whole(bcal_ctx *ctx, mathnum_t *n, bool up)
+{
+	decnum_t *x = &n->dec;
+	bool frac = false;
+
+	if (!n->exact) {
+		n->val = up ? ceill(n->val) : floorl(n->val);
+		return 0;
+	}
+
+	for (size_t k = 0; k < x->scale && !frac; ++k)
+		frac = dec_digit(&x->mag, k) != 0;
+
+	dec_shr10(&x->mag, x->scale);
+	x->scale = 0;
+
+	/* Truncation rounds towards zero, away from it is one more */
+	if (frac && up != x->negative && !dec_mul_small(&x->mag, 1, 1))
+		return num_nomem(ctx);
+
+	if (!x->mag.len)
+		x->negative = false;
+	return 0;
+}
+
+/*
+ * Functions of maths mode, args are long doubles in val unless the
+ * function is marked exact in mathfns[]
+ */
+
+static int fn_exp(bcal_ctx *ctx, mathnum_t *args, size_t n, mathnum_t *result)
+{
+	num_set_float(result, expl(args[0].val));
+	return 0;
+}
+
+static int fn_log(bcal_ctx *ctx, mathnum_t *args, size_t n, mathnum_t *result)
+{
+	if (args[0].val <= 0 || args[0].val == 1) {
+		log(ERROR, "log base must be positive and not 1\n");
+		return -1;
+	}
+	if (args[1].val <= 0) {
+		log(ERROR, "log of non-positive number\n");
+		return -1;
+	}
+
+	num_set_float(result, logl(args[1].val) / logl(args[0].val));
+	return 0;
+}
+
+static int fn_ln(bcal_ctx *ctx, mathnum_t *args, size_t n, mathnum_t *result)
+{
+	if (args[0].val <= 0) {
+		log(ERROR, "ln of non-positive number\n");
+		return -1;
+	}
+
+	num_set_float(result, logl(args[0].val));
+	return 0;
+}
+
+static int fn_log2(bcal_ctx *ctx, mathnum_t *args, size_t n, mathnum_t *result)
+{
+	if (args[0].val <= 0) {
+		log(ERROR, "log2 of non-positive number\n");
+		return -1;
+	}
+
+	num_set_float(result, log2l(args[0].val));
+	return 0;
+}
+
+static int fn_root(bcal_ctx *ctx, mathnum_t *args, size_t n, mathnum_t *result)
+{
+	if (args[0].val == 0) {
+		log(ERROR, "root index cannot be zero\n");
+		return -1;
+	}
+
+	num_set_float(result, powl(args[1].val, 1.0L / args[0].val));
+	return 0;
+}
+
+static int fn_pow(bcal_ctx *ctx, mathnum_t *args, size_t n, mathnum_t *result)
+{
+	num_set_float(result, powl(args[0].val, args[1].val));
+	return 0;
+}
+
+static int fn_sum(bcal_ctx *ctx, mathnum_t *args, size_t n, mathnum_t *result)
+{
+	num_move(result, &args[0]);
+	for (size_t i = 1; i < n; ++i)
+		if (num_add(ctx, result, &args[i], false) == -1)
+			return -1;
+
+	return 0;
+}
+
+static int fn_avg(bcal_ctx *ctx, mathnum_t *args, size_t n, mathnum_t *result)
+{
+	mathnum_t count = {0};
+	int ret;
+
+	if (fn_sum(ctx, args, n, result) == -1)
+		return -1;
+
+	num_set_float(&count, (maxfloat_t)n);
+	ret = num_div(ctx, result, &count);
+	num_free(&count);
+	return ret;
+}
+
+/* The first of args that compares as sign against all the others */
+static int pick(bcal_ctx *ctx, mathnum_t *args, size_t n, mathnum_t *result, int sign)
+{
+	size_t best = 0;
+	int cmp;
+
+	for (size_t i = 1; i < n; ++i) {
+		if (num_cmp(ctx, &args[i], &args[best], &cmp) == -1)
+			return -1;
+		if (cmp == sign)
+			best = i;
+	}
+
+	num_move(result, &args[best]);
+	return 0;
+}
+
+static int fn_min(bcal_ctx *ctx, mathnum_t *args, size_t n, mathnum_t *result)
+{
+	return pick(ctx, args, n, result, -1);
+}
+
+static int fn_max(bcal_ctx *ctx, mathnum_t *args, size_t n, mathnum_t *result)
+{
+	return pick(ctx, args, n, result, 1);
+}
+
+static int fn_ceil(bcal_ctx *ctx, mathnum_t *args, size_t n, mathnum_t *result)
+{
+	num_move(result, &args[0]);
+	return num_whole(ctx, result, true);
+}
+
+static int fn_floor(bcal_ctx *ctx, mathnum_t *args, size_t n, mathnum_t *result)
+{
+	num_move(result, &args[0]);
+	return num_whole(ctx, result, false);
+}
+
+/* The first multiple of args[1] not below args[0] */
+static int fn_align(bcal_ctx *ctx, mathnum_t *args, size_t n, mathnum_t *result)
+{
+	mathnum_t *a = &args[0], *b = &args[1];
+	decnum_t *x = &a->dec, *y = &b->dec;
+	decimal_t q = {0}, rem = {0};
+	bool ok;
+
+	if (b->exact ? !y->mag.len || y->negative : !(b->val > 0)) {
+		log(ERROR, "alignment must be positive\n");
+		return -1;
+	}
+
+	switch (num_pair(ctx, a, b)) {
+	case -1:
+		return -1;
+	case 0:
+		num_set_float(result, ceill(a->val / b->val) * b->val);
+		return 0;
+	}
+
+	/* |x| / y in whole numbers at the same scale, rounded up if positive */
+	ok = num_rescale(x, y->scale > x->scale ? y->scale : x->scale) &&
+	     num_rescale(y, x->scale) && dec_divmod(&q, &rem, &x->mag, &y->mag) &&
+	     (!rem.len || x->negative || dec_mul_small(&q, 1, 1)) &&
+	     dec_mul(&x->mag, &q, &y->mag);
+
+	dec_free(&q);
+	dec_free(&rem);
+	if (!ok)
+		return num_nomem(ctx);
+
+	x->negative = x->negative && x->mag.len;
+	num_move(result, a);
+	return 0;
+}
+
+/* A maths function, called once its arguments are parsed */
+typedef struct {
+	const char *name;
+	uint8_t len;
+	uint8_t nargs;  /* the least if variadic */
+	bool variadic;  /* any number of arguments, separated by commas or spaces */
+	bool exact;     /* args are passed as they are, else as long doubles */
+	int (*call)(bcal_ctx *ctx, mathnum_t *args, size_t n, mathnum_t *result);
+} mathfn;
+
+/* Slot of a name of len chars by its first and last ones */
+#define MATHFN_SLOTS 32
+#define MATHFN_HASH(first, last, len) (((first) + 2 * (last) + (len)) & (MATHFN_SLOTS - 1))
+#define MATHFN(first, last, len, name, ...) \
+	[MATHFN_HASH(first, last, len)] = {name, len, __VA_ARGS__}
+
+/* Names sharing a slot don't build, the initializer is overridden */
+static const mathfn mathfns[MATHFN_SLOTS] = {
+	MATHFN('a', 'n', 5, "align", 2, false, true, fn_align),
+	MATHFN('a', 'g', 3, "avg", 1, true, true, fn_avg),
+	MATHFN('c', 'l', 4, "ceil", 1, false, true, fn_ceil),
+	MATHFN('e', 'p', 3, "exp", 1, false, false, fn_exp),
+	MATHFN('f', 'r', 5, "floor", 1, false, true, fn_floor),
+	MATHFN('l', 'n', 2, "ln", 1, false, false, fn_ln),
+	MATHFN('l', 'g', 3, "log", 2, false, false, fn_log),
+	MATHFN('l', '2', 4, "log2", 1, false, false, fn_log2),
+	MATHFN('m', 'x', 3, "max", 1, true, true, fn_max),
+	MATHFN('m', 'n', 3, "min", 1, true, true, fn_min),
+	MATHFN('p', 'w', 3, "pow", 2, false, false, fn_pow),
+	MATHFN('r', 't', 4, "root", 2, false, false, fn_root),
+	MATHFN('s', 'm', 3, "sum", 1, true, true, fn_sum),
+};
+
+/* The function named by the len chars at s, NULL if none */
+static const mathfn *mathfn_lookup(const char *s, size_t len)
+{
+	const mathfn *fn = &mathfns[MATHFN_HASH((unsigned char)s[0], (unsigned char)s[len - 1], len)];
+
+	return fn->name && fn->len == len && !memcmp(fn->name, s, len) ? fn : NULL;
+}
+
+/* Check the len chars at s can name a variable: not r, a unit, a function or a number */
+static bool var_name_ok(const char *s, size_t len)
+{
+	char *end;
+
+	if (!len || len > VAR_NAME_MAX || isdigit((unsigned char)*s))
+		return false;
+
+	for (size_t i = 0; i < len; ++i)
+		if (!isalnum((unsigned char)s[i]) && s[i] != '_')
+			return false;
+
+	if ((len == 1 && *s == 'r') || unit_index(s, len) != -1 || mathfn_lookup(s, len))
+		return false;
+
+	/* inf and nan */
+	strtold(s, &end);
+	return end != s + len;
+}
+
+/* Consume a lexeme of kind at *pos */
+static bool accept(bcal_ctx *ctx, size_t *pos, char kind)
+{
+	if (ctx->lex[*pos].kind != kind)
+		return false;
+
+	++*pos;
+	return true;
+}
+
+/* Append a node popping nargs operands to the maths code of ctx */
+static mathnode *node_push(bcal_ctx *ctx, char op, uint32_t nargs)
+{
+	mathnode *n;
+
+	if (ctx->nnode == ctx->nodecap) {
+		size_t cap = ctx->nodecap ? ctx->nodecap * 2 : 32;
+
+		n = (mathnode *)realloc(ctx->node, cap * sizeof(mathnode));
+		if (!n) {
+			num_nomem(ctx);
+			return NULL;
+		}
+
+		ctx->node = n;
+		ctx->nodecap = cap;
+	}
+
+	/* Operands pending when the node runs */
+	ctx->depth = ctx->depth + 1 - nargs;
+	if (ctx->depth > ctx->maxdepth)
+		ctx->maxdepth = ctx->depth;
+
+	/* Other fields are set by the callers, those of numbers by seal() */
+	n = &ctx->node[ctx->nnode++];
+	n->op = op;
+	n->fn = 0;
+	n->nargs = nargs;
+	return n;
+}
+
+/* Append a number node, its value is kept in the slot returned until sealed */
+static mathnum_t *node_num(bcal_ctx *ctx)
+{
+	mathnode *n = node_push(ctx, MATHS_NUM, 0);
+
+	if (!n)
+		return NULL;
+
+	n->limb = ctx->ncval;
+	ctx->cval[ctx->ncval] = (mathnum_t){0};
+	return &ctx->cval[ctx->ncval++];
+}
+
+/*
+ * Apply the operator or call of node n to its operands in args, the
+ * result replaces args[0] and the other operands are freed
+ */
+static int apply(bcal_ctx *ctx, const mathnode *n, mathnum_t *args)
+{
+	const mathfn *fn = &mathfns[n->fn];
+	mathnum_t res;
+	int ret = -1;
+
+	switch (n->op) {
+	case '*':
+		ret = num_mul(ctx, &args[0], &args[1]);
+		break;
+	case '/':
+		ret = num_div(ctx, &args[0], &args[1]);
+		break;
+	case '+':
+	case '-':
+		ret = num_add(ctx, &args[0], &args[1], n->op == '-');
+		break;
+	default:
+		for (uint32_t k = 0; !fn->exact && k < n->nargs; ++k)
+			if (num_to_float(ctx, &args[k]) == -1)
+				goto out;
+
+		res = (mathnum_t){0};
+		ret = fn->call(ctx, args, n->nargs, &res);
+		num_move(&args[0], &res);
+	}
+
+out:
+
+	for (uint32_t k = 1; k < n->nargs; ++k)
+		num_free(&args[k]);
+	return ret;
+}
+
+/* The number of node n with its limbs in pool */
+static int load_num(bcal_ctx *ctx, const mathnode *n, const uint32_t *pool, mathnum_t *v)
+{
+	v->exact = n->exact;
+	if (!n->exact) {
+		v->val = n->val;
+		return 0;
+	}
+
+	if (!dec_reserve(&v->dec.mag, n->len))
+		return num_nomem(ctx);
+
+	if (n->len)
+		memcpy(v->dec.mag.d, pool + n->limb, n->len * sizeof(uint32_t));
+	v->dec.mag.len = n->len;
+	v->dec.scale = n->scale;
+	v->dec.negative = n->negative;
+	return 0;
+}
+
+/* A result string as an operand, exact if it's a plain decimal */
+static void load_str(const char *str, mathnum_t *v)
+{
+	v->exact = parse_decimal_token(str, strlen(str), &v->dec);
+	if (!v->exact)
+		num_set_float(v, strtold(str, NULL));
+}
+
+/* The last result as an operand */
+static int load_last(bcal_ctx *ctx, mathnum_t *v)
+{
+	const char *last = last_str(ctx);
+
+	if (last[0] == '\0') {
+		log(ERROR, "no result stored\n");
+		return -1;
+	}
+
+	load_str(last, v);
+	return 0;
+}
+
+/* The variable of node n as an operand, its name is in ctx->src */
+static int load_var(bcal_ctx *ctx, const mathnode *n, mathnum_t *v)
+{
+	const variable *var = var_find(ctx, ctx->src + n->limb, n->len);
+
+	if (!var) {
+		log(ERROR, "unknown variable %.*s\n", (int)n->len, ctx->src + n->limb);
+		return -1;
+	}
+
+	load_str(var->value, v);
+	return 0;
+}
+
+/*
+ * Run len nodes of sealed maths code with the limbs of their numbers in
+ * pool, at most depth operands are pending. They live in ctx->mstack.
+ */
+static int run_maths(bcal_ctx *ctx, const mathnode *code, size_t len, const uint32_t *pool,
+		     size_t depth, mathnum_t *result)
+{
+	mathnum_t *st;
+	size_t sp = 0;
+	int ret = -1;
+
+	/* Unused between runs, so the operands can be moved */
+	if (depth > ctx->mstackcap) {
+		st = (mathnum_t *)realloc(ctx->mstack, depth * sizeof(mathnum_t));
+		if (!st)
+			return num_nomem(ctx);
+
+		ctx->mstack = st;
+		ctx->mstackcap = depth;
+	}
+
+	st = ctx->mstack;
+	for (size_t i = 0; i < len; ++i) {
+		const mathnode *n = &code[i];
+
+		switch (n->op) {
+		case MATHS_NUM:
+			st[sp] = (mathnum_t){0};
+			if (load_num(ctx, n, pool, &st[sp++]) == -1)
+				goto out;
+			break;
+		case LEX_R:
+			st[sp] = (mathnum_t){0};
+			if (load_last(ctx, &st[sp++]) == -1)
+				goto out;
+			break;
+		case LEX_NAME:
+			st[sp] = (mathnum_t){0};
+			if (load_var(ctx, n, &st[sp++]) == -1)
+				goto out;
+			break;
+		default:
+			sp -= n->nargs;
+			if (apply(ctx, n, &st[sp++]) == -1)
+				goto out;
+		}
+	}
+
+	num_move(result, &st[0]);
+	ret = 0;
+out:
+	while (sp)
+		num_free(&st[--sp]);
+	return ret;
+}
+
+/* Fold the node just appended into a number if its operands are numbers */
+static int fold(bcal_ctx *ctx)
+{
+	const mathnode *n = &ctx->node[ctx->nnode - 1];
+	size_t first = ctx->nnode - 1 - n->nargs;
+	int ret;
+
+	/* A subtree that isn't constant ends with something else */
+	for (size_t i = first; i < ctx->nnode - 1; ++i)
+		if (ctx->node[i].op != MATHS_NUM)
+			return 0;
+
+	/* The operands are the last numbers, the first one takes the result */
+	ret = apply(ctx, n, &ctx->cval[ctx->node[first].limb]);
+	ctx->ncval -= n->nargs - 1;
+	ctx->nnode = first + 1;
+	return ret;
+}
+
+/* Move the numbers of the code of ctx to its pool */
+static int seal(bcal_ctx *ctx)
+{
+	size_t need = 0;
+	mathnum_t *v;
+
+	for (size_t i = 0; i < ctx->ncval; ++i)
+		if (ctx->cval[i].exact)
+			need += ctx->cval[i].dec.mag.len;
+
+	if (need > ctx->poolcap) {
+		uint32_t *pool = (uint32_t *)realloc(ctx->pool, need * sizeof(uint32_t));
+
+		if (!pool)
+			return num_nomem(ctx);
+
+		ctx->pool = pool;
+		ctx->poolcap = need;
+	}
+
+	ctx->npool = 0;
+	for (size_t i = 0; i < ctx->nnode; ++i) {
+		mathnode *n = &ctx->node[i];
+
+		if (n->op != MATHS_NUM)
+			continue;
+
+		v = &ctx->cval[n->limb];
+		n->exact = v->exact;
+		if (!v->exact) {
+			n->val = v->val;
+			continue;
+		}
+
+		if (v->dec.mag.len)
+			memcpy(ctx->pool + ctx->npool, v->dec.mag.d, v->dec.mag.len * sizeof(uint32_t));
+		n->limb = ctx->npool;
+		n->len = v->dec.mag.len;
+		n->scale = v->dec.scale;
+		n->negative = v->dec.negative;
+		ctx->npool += n->len;
+	}
+
+	return 0;
+}
+
+/* Forward declarations for recursive descent parser */
+static int parse_expr(bcal_ctx *ctx, size_t *pos);
+static int parse_factor(bcal_ctx *ctx, size_t *pos);
+static int parse_term(bcal_ctx *ctx, size_t *pos);
+
+/* Parse the parenthesized arguments of fn and append the call */
+static int parse_call(bcal_ctx *ctx, size_t *pos, const mathfn *fn)
+{
+	uint32_t n = 0;
+	mathnode *call;
+	char kind;
+
+	if (!accept(ctx, pos, '(')) {
+		log(ERROR, "%s requires parenthesis\n", fn->name);
+		return -1;
+	}
+
+	while (fn->variadic ? (kind = ctx->lex[*pos].kind) != ')' && kind != LEX_END : n < fn->nargs) {
+		if (n && !fn->variadic && !accept(ctx, pos, ',')) {
+			log(ERROR, "%s requires %u arguments\n", fn->name, fn->nargs);
+			return -1;
+		}
+
+		if (parse_expr(ctx, pos) == -1)
+			return -1;
+		++n;
+
+		if (fn->variadic)
+			accept(ctx, pos, ',');
+	}
+
+	if (n < fn->nargs) {
+		log(ERROR, "%s requires at least one argument\n", fn->name);
+		return -1;
+	}
+
+	if (!accept(ctx, pos, ')')) {
+		log(ERROR, "missing closing parenthesis\n");
+		return -1;
+	}
+
+	call = node_push(ctx, MATHS_CALL, n);
+	if (!call)
+		return -1;
+
+	call->fn = (uint8_t)(fn - mathfns);
+	return fold(ctx);
+}
+
+/* Parse primary expression: numbers, parentheses, functions */
+static int parse_factor(bcal_ctx *ctx, size_t *pos)
+{
+	const lexeme *t = &ctx->lex[*pos], *num = t;
+	const mathfn *fn;
+	mathnum_t *v;
+
+	if (accept(ctx, pos, '(')) {
+		if (parse_expr(ctx, pos) == -1)
+			return -1;
+		if (!accept(ctx, pos, ')')) {
+			log(ERROR, "missing closing parenthesis\n");
+			return -1;
+		}
+		return 0;
+	}
+
+	/* Functions, looked up once per name */
+	if (t->kind == LEX_NAME && (fn = mathfn_lookup(ctx->src + t->pos, t->len))) {
+		++*pos;
+		return parse_call(ctx, pos, fn);
+	}
+
+	/* 'r' - reference to last result, read when the code runs */
+	if (accept(ctx, pos, LEX_R))
+		return node_push(ctx, LEX_R, 0) ? 0 : -1;
+
+	/* Variables too, by their span of the source */
+	if (t->kind == LEX_NAME && t[1].kind != '(' && unit_index(ctx->src + t->pos, t->len) == -1) {
+		mathnode *var = node_push(ctx, LEX_NAME, 0);
+
+		if (!var)
+			return -1;
+
+		++*pos;
+		var->limb = t->pos;
+		var->len = t->len;
+		return 0;
+	}
+
+	/* Number (decimal or hex), with a sign right before it */
+	if ((t->kind == '+' || t->kind == '-') && t[1].kind == LEX_NUM && t[1].pos == t->pos + 1) {
+		num = t + 1;
+	} else if (t->kind != LEX_NUM) {
+		log(ERROR, "invalid operand or unit\n");
+		return -1;
+	}
+
+	*pos += (size_t)(num - t) + 1;
+	v = node_num(ctx);
+	if (!v)
+		return -1;
+
+	v->exact = decimal_operand(ctx, t, &v->dec) != NULL;
+	if (!v->exact)
+		num_set_float(v, t->kind == '-' ? -num->val : num->val);
+	return 0;
+}
+
+/* Parse multiplication and division */
+static int parse_term(bcal_ctx *ctx, size_t *pos)
+{
+	char op;
+
+	if (parse_factor(ctx, pos) == -1)
+		return -1;
+
+	while ((op = ctx->lex[*pos].kind) == '*' || op == '/') {
+		++*pos;
+		if (parse_factor(ctx, pos) == -1 || !node_push(ctx, op, 2) || fold(ctx) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Parse addition and subtraction */
+static int parse_expr(bcal_ctx *ctx, size_t *pos)
+{
+	char op;
+
+	if (parse_term(ctx, pos) == -1)
+		return -1;
+
+	while ((op = ctx->lex[*pos].kind) == '+' || op == '-') {
+		++*pos;
+		if (parse_term(ctx, pos) == -1 || !node_push(ctx, op, 2) || fold(ctx) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Compile a maths expression to the code of ctx, constant subtrees are
+ * evaluated as they are parsed. If it all is and value isn't NULL, the
+ * value is moved there and no code is left, else the code is sealed.
+ */
+static int compile_maths(bcal_ctx *ctx, const char *expr, mathnum_t *value)
+{
+	size_t pos = 0;
+	int ret = -1;
+
+	ctx->nnode = ctx->npool = 0;
+	ctx->depth = ctx->maxdepth = 0;
+
+	if (lex_maths(ctx, expr) == -1)
+		return -1;
+
+	if (ctx->lex[0].kind == LEX_END) {
+		log(ERROR, "empty expression\n");
+		return -1;
+	}
+
+	/* A number takes one lexeme at least, unused between compilations */
+	if (ctx->nlex > ctx->cvalcap) {
+		mathnum_t *cval = (mathnum_t *)realloc(ctx->cval, ctx->nlex * sizeof(mathnum_t));
+
+		if (!cval)
+			return num_nomem(ctx);
+
+		ctx->cval = cval;
+		ctx->cvalcap = ctx->nlex;
+	}
+
+	if (parse_expr(ctx, &pos) == -1)
+		goto out;
+
+	if (ctx->lex[pos].kind != LEX_END) {
+		log(ERROR, "unexpected character in expression\n");
+		goto out;
+	}
+
+	if (value && ctx->nnode == 1 && ctx->node[0].op == MATHS_NUM) {
+		num_move(value, &ctx->cval[0]);
+		ctx->nnode = 0;
+		ret = 0;
+	} else
+		ret = seal(ctx);
+out:
+	while (ctx->ncval)
+		num_free(&ctx->cval[--ctx->ncval]);
+	return ret;
+}
+
+/* Format long double with digits after the point, removing trailing zeros */
+static void format_result(maxfloat_t result, int digits, char *buf, size_t buflen)
+{
+	snprintf(buf, buflen, "%.*Lf", digits, result);
+
+	/* Find decimal point */
+	char *dot = strchr(buf, '.');
+	if (!dot)
+		return;
+
+	/* Find last non-zero digit after decimal point */
+	char *end = buf + strlen(buf) - 1;
+	while (end > dot && *end == '0')
+		end--;
+
+	/* If we stopped at the decimal point, remove it too */
+	if (end == dot) {
+		*dot = '\0';
+	} else {
+		*(end + 1) = '\0';
+	}
+}
+
+static int is_integral_result(maxfloat_t value, long long *out)
+{
+	long double intpart;
+
+	if (modfl(value, &intpart) != 0.0L)
+		return 0;
+
+	if (intpart < (long double)LLONG_MIN || intpart > (long double)LLONG_MAX)
+		return 0;
+
+	*out = (long long)intpart;
+	return 1;
+}
+
+/* Write v in decimal backwards from loc, zero padded to width digits */
+static char *getstr_u64(uint64_t v, char *loc, int width)
+{
+	char *end = loc;
+	uint idx;
+
+	/* Two digits per division */
+	while (v >= 100) {
+		idx = (uint)(v % 100) << 1;
+		v /= 100;
+		*--loc = digit_pairs[idx + 1];
+		*--loc = digit_pairs[idx];
+	}
+
+	if (v >= 10) {
+		idx = (uint)v << 1;
+		*--loc = digit_pairs[idx + 1];
+		*--loc = digit_pairs[idx];
+	} else
+		*--loc = (char)('0' + v);
+
+	while (end - loc < width)
+		*--loc = '0';
+
+	return loc;
+}
+
+/*
+ * 128-bit division is a libcall, so split n into 19 digit chunks that
+ * fit in 64 bits. This takes at most 2 128-bit divisions for any n.
+ */
+static char *getstr_u128(maxuint_t n, char *buf)
+{
+	char *loc = buf + UINT_BUF_LEN - 1;
+
+	*loc = '\0';
+
+#ifdef __SIZEOF_INT128__
+	while (n > UINT64_MAX) {
+		maxuint_t q = n / POW10_19;
+
+		loc = getstr_u64((uint64_t)(n - q * POW10_19), loc, 19);
+		n = q;
+	}
+#endif
+
+	return getstr_u64((uint64_t)n, loc, 1);
+}
+
+/* Converts a char to unsigned int according to base */
+static bool ischarvalid(char ch, uint base, uint *val)
+{
+	if (base == 2)
+	{
+		if (ch == '0' || ch == '1') {
+			*val = ch - '0';
+			return true;
+		}
+	} else if (base == 16) {
+		if (ch >= '0' && ch <= '9') {
+			*val = ch - '0';
+			return true;
+		}
+
+		if (ch >= 'a' && ch <= 'f') {
+			*val = (ch - 'a') + 10;
+			return true;
+		}
+
+		if (ch >= 'A' && ch <= 'F') {
+			*val = (ch - 'A') + 10;
+			return true;
+		}
+	} else if (base == 10) {
+		if (ch >= '0' && ch <= '9') {
+			*val = ch - '0';
+			return true;
+		}
+	}
+
+	return false;
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/*
+ * SWAR helpers, v holds 8 chars of a string with the first in the low byte
+ * The high bit of each byte in the result is set if it's in [lo, hi].
+ * All bytes must be 7-bit.
+ */
+static uint64_t swar_between(uint64_t v, uint lo, uint hi)
+{
+	return (v + SWAR_ONES * (0x80 - lo)) & ~(v + SWAR_ONES * (0x7F - hi)) & SWAR_HIGH;
+}
+
+/* Value of 8 decimal digits, false if any char isn't one */
+static bool swar_dec8(uint64_t v, uint64_t *out)
+{
+	if ((v & SWAR_HIGH) || swar_between(v, '0', '9') != SWAR_HIGH)
+		return false;
+
+	v -= SWAR_ONES * '0';
+	v = (v * 10) + (v >> 8); /* pairs of digits */
+	v = (((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+	     (((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+
+	*out = v;
+	return true;
+}
+
+/* Value of 8 hex digits, false if any char isn't one */
+static bool swar_hex8(uint64_t v, uint64_t *out)
+{
+	if ((v & SWAR_HIGH) ||
+	    (swar_between(v, '0', '9') | swar_between(v | 0x2020202020202020ULL, 'a', 'f')) != SWAR_HIGH)
+		return false;
+
+	/* Nibble values, letters have bit 6 set */
+	v = (v & 0x0F0F0F0F0F0F0F0FULL) + 9 * ((v & 0x4040404040404040ULL) >> 6);
+
+	/* Merge neighbours into bytes, then 16-bit and 32-bit values */
+	v = ((v & 0x000F000F000F000FULL) << 4) | ((v >> 8) & 0x000F000F000F000FULL);
+	v = ((v & 0x000000FF000000FFULL) << 8) | ((v >> 16) & 0x000000FF000000FFULL);
+	*out = ((v & 0xFFFF) << 16) | ((v >> 32) & 0xFFFF);
+	return true;
+}
+
+/* Value of 8 binary digits, false if any char isn't one */
+static bool swar_bin8(uint64_t v, uint64_t *out)
+{
+	if ((v & 0xFEFEFEFEFEFEFEFEULL) != SWAR_ONES * '0')
+		return false;
+
+	/* Gather the low bit of each byte into the top byte */
+	*out = ((v & SWAR_ONES) * 0x8040201008040201ULL) >> 56;
+	return true;
+}
+#endif
+
+/*
+ * Accumulate the digits at p in base into *val, 8 at a time while possible
+ * Returns the first char that isn't a digit, NULL on overflow.
+ */
+static const char *scan_uint(const char *p, uint base, maxuint_t *val)
+{
+	const uint bits = sizeof(maxuint_t) << 3;
+	maxuint_t res = 0;
+	uint digit, shift = (base == 2) ? 1 : 4;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	const char *end = p + strlen(p);
+	uint64_t v, chunk;
+
+	if (base == 10) {
+		for (; end - p >= 8; p += 8) {
+			memcpy(&v, p, 8);
+			if (!swar_dec8(v, &chunk))
+				break;
+
+			if (__builtin_mul_overflow(res, 100000000, &res) ||
+			    __builtin_add_overflow(res, chunk, &res))
+				return NULL;
+		}
+	} else {
+		/* 8 digits make 8 bits in binary and 32 bits in hex */
+		for (; end - p >= 8; p += 8) {
+			memcpy(&v, p, 8);
+			if (!((base == 2) ? swar_bin8(v, &chunk) : swar_hex8(v, &chunk)))
+				break;
+
+			if (res >> (bits - (shift << 3)))
+				return NULL;
+			res = (res << (shift << 3)) | chunk;
+		}
+	}
+#endif
+
+	while (ischarvalid(*p, base, &digit)) {
+		if (base == 10) {
+			if (__builtin_mul_overflow(res, 10, &res) ||
+			    __builtin_add_overflow(res, digit, &res))
+				return NULL;
+		} else {
+			if (res >> (bits - shift))
+				return NULL;
+			res = (res << shift) | digit;
+		}
+
+		++p;
+	}
+
+	*val = res;
+	return p;
+}
+
+/*
+ * Scan a decimal "12.34" as m / 10^scale, NULL if there are no digits
+ * or too many for m. Fractions with an exponent are left to strtold(3).
+ * Digits are gathered 19 at a time in 64 bits.
+ */
+static const char *scan_decimal(const char *p, maxuint_t *m, uint *scale)
+{
+	const char *start = p, *dot = NULL;
+	maxuint_t val = 0;
+	uint64_t chunk = 0;
+	uint digit, n = 0;
+
+	for (;; ++p) {
+		digit = (uint)(*p - '0');
+		if (digit > 9) {
+			if (*p != '.' || dot)
+				break;
+			dot = p;
+			continue;
+		}
+
+		chunk = chunk * 10 + digit;
+		if (++n == 19) {
+			if (__builtin_mul_overflow(val, POW10_19, &val) ||
+			    __builtin_add_overflow(val, chunk, &val))
+				return NULL;
+			chunk = 0;
+			n = 0;
+		}
+	}
+
+	if (p - start == (dot ? 1 : 0))
+		return NULL;
+
+	if (__builtin_mul_overflow(val, pow10_u64[n], &val) ||
+	    __builtin_add_overflow(val, chunk, &val))
+		return NULL;
+
+	*m = val;
+	*scale = dot ? (uint)(p - dot - 1) : 0;
+	return p;
+}
+
+/* Closest long double to m / 10^scale */
+static maxfloat_t decimal_value(maxuint_t m, uint scale)
+{
+	maxfloat_t pow = 1;
+
+	while (scale--)
+		pow *= 10;
+
+	return (maxfloat_t)m / pow;
+}
+
+/* Base of a 0b/0B or 0x/0X prefixed number, 10 otherwise */
+static uint prefix_base(const char *token)
+{
+	if (token[0] == '0') {
+		if (token[1] == 'b' || token[1] == 'B') /* binary */
+			return 2;
+		if (token[1] == 'x' || token[1] == 'X') /* hex */
+			return 16;
+	}
+
+	return 10;
+}
+
+/*
+ * Converts a non-floating representing string to maxuint_t
+ * Fails on any invalid char and if the value doesn't fit.
+ */
+static maxuint_t strtouquad(char *token, char **pch)
+{
+	const char *ptr;
+	maxuint_t val = 0;
+	uint base;
+
+	*pch = FAILED;
+
+	if (!token || !*token)
+		return 0;
+
+	base = prefix_base(token);
+	ptr = (base == 10) ? token : token + 2;
+	if (!*ptr)
+		return 0;
+
+	ptr = scan_uint(ptr, base, &val);
+	if (!ptr || *ptr)
+		return 0;
+
+	*pch = PASSED;
+	return val;
+}
+
+/* Parse a binary or hex number followed by anything, e.g. a unit */
+static bool parse_prefixed_uint(const char *token, maxuint_t *val, char **endptr)
+{
+	if (!token || !*token || !val || !endptr)
+		return false;
+
+	uint base = prefix_base(token);
+	if (base == 10)
+		return false;
+
+	const char *ptr = token + 2;
+	if (!*ptr) {
+		*endptr = (char *)ptr;
+		return false;
+	}
+
+	maxuint_t res = 0;
+	const char *end = scan_uint(ptr, base, &res);
+	if (!end || end == ptr)
+		return false;
+
+	*val = res;
+	*endptr = (char *)end;
+	return true;
+}
+
+/* Convert an operand to bytes, *isunit is set if it's in a unit or already 1 */
+static maxuint_t unitconv(bcal_ctx *ctx, const char *numstr, char *isunit, int *out)
+{
+	char *punit = NULL;
+	int  count;
+	maxfloat_t byte_metric = 0;
+	maxuint_t val = 0, bytes;
+	uint scale = 0;
+	bool exact = false, frac = false;
+
+	if (numstr == NULL || *numstr == '\0') {
+		log(ERROR, "invalid token\n");
+		*out = -1;
+		return 0;
+	}
+
+	log(DEBUG, "numstr: %s\n", numstr);
+	*out = 0;
+
+	/* ensure this is not the result of a previous operation */
+	if (*isunit != 1)
+		*isunit = 0;
+
+	if (numstr[0] == '0' &&
+	    (numstr[1] == 'x' || numstr[1] == 'X' ||
+	     numstr[1] == 'b' || numstr[1] == 'B')) {
+		char *pch = NULL;
+
+		if (!parse_prefixed_uint(numstr, &val, &pch)) {
+			log(ERROR, "invalid token\n");
+			*out = -1;
+			return 0;
+		}
+		if (*pch == '\0')
+			return val;
+		if (!isalpha((unsigned char)*pch)) {
+			log(ERROR, "invalid token\n");
+			*out = -1;
+			return 0;
+		}
+		byte_metric = (maxfloat_t)val;
+		punit = pch;
+		exact = true;
+		goto parse_unit;
+	}
+
+	/* Decimals, of a unit or not, are converted exactly */
+	punit = (char *)scan_decimal(numstr, &val, &scale);
+	if (punit && *punit == '\0' && unit_bytes(val, scale, BCAL_B, &bytes, &frac)) {
+		ctx->inexact |= frac;
+		return bytes;
+	}
+
+	if (punit && lookup_unit(punit) != -1) {
+		byte_metric = decimal_value(val, scale);
+		exact = true;
+		goto parse_unit;
+	}
+
+	byte_metric = strtold(numstr, &punit);
+	log(DEBUG, "byte_metric: %Lf\n", byte_metric);
+	if (*numstr != '\0' && *punit == '\0') {
+		ctx->inexact |= (byte_metric != floorl(byte_metric));
+		if (!float_bytes(byte_metric, &bytes)) {
+			too_big(ctx, numstr);
+			*out = -1;
+			return 0;
+		}
+		return bytes;
+	}
+
+parse_unit:
+	log(DEBUG, "punit: %s\n", punit);
+
+	count = lookup_unit(punit);
+	if (count == -1) {
+		log(ERROR, "unknown unit\n");
+		ctx->err = BCAL_EUNIT;
+		*out = -1;
+		return 0;
+	}
+
+	*isunit = 1;
+
+	/* Exact conversions also fail on tiny fractions, those fit as long doubles */
+	if ((!exact || !unit_bytes(val, scale, count, &bytes, &frac)) &&
+	    !unit_bytes_f(byte_metric, count, &bytes, &frac)) {
+		too_big(ctx, numstr);
+		*out = -1;
+		return 0;
+	}
+
+	ctx->inexact |= frac;
+	return bytes;
+}
+
+/* Get the priority of operators.
+ * Higher priority, higher value.
+ */
+static int priority(char sign) /* Get the priority of operators, higher priprity */
+{
+	switch (sign) {
+	case '|': return 1;
+	case '^': return 2;
+	case '&': return 3;
+	case '>':
+	case '<': return 4;
+	case '-':
+	case '+': return 5;
+	case '%':
+	case '/':
+	case '*': return 6;
+	case '~': return 7;
+	default : return 0;
+	}
+
+	return 0;
+}
+
+/* Convert the lexed infix expression to Postfix
+ * Operands are converted to bytes here, the queue holds numbers
+ */
+static int infix2postfix(bcal_ctx *ctx, queue *res)
+{
+	stack *op = &ctx->opstack;  /* Operator Stack */
+	char word[WORD_LEN];
+	Token ct, num = {0, '\0', 0};
+	int balanced = 0, out = 0;
+
+	/* Reserve once so push/enqueue can't fail */
+	emptystack(op);
+	cleanqueue(res);
+	if (!stack_reserve(op, ctx->nlex) || !queue_reserve(res, ctx->nlex)) {
+		log(ERROR, "out of memory\n");
+		ctx->err = BCAL_ENOMEM;
+		return -1;
+	}
+
+	for (const lexeme *t = ctx->lex; t < ctx->lex + ctx->nlex; ++t) {
+		switch (t->kind) {
+		case '(':
+			++balanced;
+			ct.n = 0;
+			ct.op = '(';
+			ct.unit = 0;
+			push(op, ct);
+			break;
+		case ')':
+			while (!isempty(op) && top(op)->op != '(') {
+				pop(op, &ct);
+				enqueue(res, ct);
+			}
+
+			pop(op, &ct);
+			--balanced;
+			break;
+		case LEX_R:
+			/* Resolved by eval() so programs can be rerun with a new r */
+			ct.n = 0;
+			ct.op = 'r';
+			ct.unit = 0;
+			enqueue(res, ct);
+			break;
+		case LEX_NAME:
+			/* Variables too, by their span of the source */
+			if (var_name_ok(ctx->src + t->pos, t->len)) {
+				ct.n = t->pos;
+				ct.op = 'v';
+				ct.unit = (char)t->len;
+				enqueue(res, ct);
+				break;
+			}
+			/* fallthrough */
+		case LEX_NUM:
+			num.unit = (t->unit == LEX_UNIT_B);
+
+			/* eval_wide() converts operands from their lexemes */
+			if (ctx->wide) {
+				num.n = (maxuint_t)(t - ctx->lex);
+				enqueue(res, num);
+				break;
+			}
+
+			/* Convert and enqueue operands */
+			if (!lex_copy(ctx, t, word, WORD_LEN))
+				goto error;
+
+			num.n = unitconv(ctx, word, &num.unit, &out);
+			if (out == -1)
+				goto error;
+
+			enqueue(res, num);
+			break;
+		default:
+			while (!isempty(op) && top(op)->op != '(' &&
+				       ((t->kind == '~' && priority(t->kind) < priority(top(op)->op)) ||
+				        (t->kind != '~' && priority(t->kind) <= priority(top(op)->op)))) {
+				/* Pop from operator stack */
+				pop(op, &ct);
+				/* Insert to Queue */
+				enqueue(res, ct);
+			}
+
+			ct.n = 0;
+			ct.op = t->kind;
+			ct.unit = 0;
+			push(op, ct);
+		}
+	}
+
+	while (!isempty(op)) {
+		/* Put remaining elements into the queue */
+		pop(op, &ct);
+		enqueue(res, ct);
+	}
+
+	if (balanced != 0) {
+		log(ERROR, "unbalanced expression\n");
+		cleanqueue(res);
+		return -1;
+	}
+
+	return 0;
+
+error:
+	emptystack(op);
+	cleanqueue(res);
+	return -1;
+}
+
+/*
+ * a / b and its remainder in *rem. Operands that fit in 64 bits take a
+ * single hardware division for both, wider ones the libgcc call.
+ */
+static inline maxuint_t divrem(maxuint_t a, maxuint_t b, maxuint_t *rem)
+{
+	maxuint_t q;
+
+	if (!((a | b) >> 32 >> 32)) {
+		uint64_t x = (uint64_t)a, y = (uint64_t)b;
+
+		*rem = x % y;
+		return x / y;
+	}
+
+	q = a / b;
+	*rem = a - q * b;
+	return q;
+}
+
+/* Warn about a division that left a remainder */
+static void truncated(bcal_ctx *ctx, maxuint_t dividend, maxuint_t divisor, maxuint_t quotient)
+{
+	ctx->warned = true;
+	log(WARNING, "result truncated\n");
+
+	log(DEBUG, "dividend: %s\n", getstr_u128(dividend, ctx->uint_buf));
+	log(DEBUG, "divisor: %s\n", getstr_u128(divisor, ctx->uint_buf));
+	log(DEBUG, "quotient: %s\n", getstr_u128(quotient, ctx->uint_buf));
+}
+
+/* Fail an operator whose result doesn't fit, as BCAL_EOVERFLOW */
+static void overflow(bcal_ctx *ctx, char op)
+{
+	if (op == '<' || op == '>')
+		log(ERROR, "overflow in %c%c\n", op, op);
+	else
+		log(ERROR, "overflow in %c\n", op);
+	ctx->err = BCAL_EOVERFLOW;
+}
+
+/* Store an integer result, it is used as is by the next r */
+static void store_value(bcal_ctx *ctx, maxuint_t value, int unit)
+{
+	store_result(ctx, getstr_u128(value, ctx->uint_buf), unit);
+	ctx->lastval = value;
+	ctx->lastunit = (char)unit;
+	ctx->lastnum = true;
+}
+
+/* Load the last result as an operand, converted once per result */
+static bool last_value(bcal_ctx *ctx, Token *t)
+{
+	int out = 0;
+
+	if (ctx->lastres.p[0] == '\0') {
+		if (ctx->lastwide)
+			log(ERROR, "r needs %u bits\n", w_bits(&ctx->lastw));
+		else
+			log(ERROR, "no result stored\n");
+		return false;
+	}
+
+	if (!ctx->lastnum) {
+		ctx->lastunit = ctx->lastres.unit;
+		ctx->lastval = unitconv(ctx, last_str(ctx), &ctx->lastunit, &out);
+		if (out == -1)
+			return false;
+
+		ctx->lastnum = true;
+	}
+
+	t->n = ctx->lastval;
+	t->op = '\0';
+	t->unit = ctx->lastunit;
+	return true;
+}
+
+/* Load the variable of token t as an operand, converted once per value */
+static bool var_value(bcal_ctx *ctx, Token *t)
+{
+	variable *v = var_find(ctx, ctx->src + (size_t)t->n, (size_t)t->unit);
+	int out = 0;
+
+	if (!v) {
+		log(ERROR, "unknown variable %.*s\n", (int)t->unit, ctx->src + (size_t)t->n);
+		return false;
+	}
+
+	if (!v->num) {
+		v->val = unitconv(ctx, v->value, &v->unit, &out);
+		if (out == -1)
+			return false;
+
+		v->num = true;
+	}
+
+	t->n = v->val;
+	t->op = '\0';
+	t->unit = v->unit;
+	return true;
+}
+
+/* Evaluates Postfix Expression
+ * Numeric result if out parameter holds 1
+ * Failure if out parameter holds -1
+ */
+static maxuint_t eval(bcal_ctx *ctx, const Token *code, size_t len, int *out)
+{
+	const maxuint_t bits = sizeof(maxuint_t) << 3;
+	stack *est = &ctx->evalstack;
+	Token res, arg, a, b, c;
+	maxuint_t rem;
+	size_t i;
+	*out = 0;
+
+	/* Check if queue is empty */
+	if (len == 0)
+		return 0;
+
+	/* Check if only one element in the queue */
+	if (len == 1) {
+		res = code[0];
+		if ((res.op == 'r' && !last_value(ctx, &res)) || (res.op == 'v' && !var_value(ctx, &res))) {
+			*out = -1;
+			return 0;
+		}
+
+		if (res.op) {
+			log(ERROR, "invalid token\n");
+			*out = -1;
+			return 0;
+		}
+
+		return res.n;
+	}
+
+	/* The stack never grows beyond the number of tokens */
+	emptystack(est);
+	if (!stack_reserve(est, len)) {
+		log(ERROR, "out of memory\n");
+		ctx->err = BCAL_ENOMEM;
+		goto error;
+	}
+
+	for (i = 0; i < len; ++i) {
+		arg = code[i];
+
+		if ((arg.op == 'r' && !last_value(ctx, &arg)) || (arg.op == 'v' && !var_value(ctx, &arg)))
+			goto error;
+
+		/* Operands are pushed as is */
+		if (!arg.op) {
+			log(DEBUG, "pushing (%s %d)\n", getstr_u128(arg.n, ctx->uint_buf), arg.unit);
+			push(est, arg);
+			continue;
+		}
+
+		c.op = '\0';
+
+		if (arg.op == '~') {
+			if (isempty(est)) {
+				log(ERROR, "invalid token\n");
+				goto error;
+			}
+
+			pop(est, &a);
+			c.n = ~a.n;
+			c.unit = a.unit ? 1 : 0;
+			push(est, c);
+			continue;
+		}
+
+		if (isempty(est)) {
+			log(ERROR, "invalid token\n");
+			goto error;
+		}
+		pop(est, &b);
+
+		if (isempty(est)) {
+			log(ERROR, "invalid token\n");
+			goto error;
+		}
+		pop(est, &a);
+
+		log(DEBUG, "(%s, %d) %c ", getstr_u128(a.n, ctx->uint_buf), a.unit, arg.op);
+		log(DEBUG, "(%s, %d)\n", getstr_u128(b.n, ctx->uint_buf), b.unit);
+
+		c.n = 0;
+		c.unit = 0;
+
+		switch (arg.op) {
+		case '>':
+		case '<':
+			if (b.unit) {
+				log(ERROR, "unit mismatch in %c%c\n", arg.op, arg.op);
+				goto error;
+			}
+
+			/* Bits shifted out to the left are an overflow */
+			if (arg.op == '>')
+				c.n = (b.n < bits) ? a.n >> b.n : 0;
+			else if (!a.n)
+				c.n = 0;
+			else if (b.n < bits && !(a.n >> (bits - 1 - b.n) >> 1))
+				c.n = a.n << b.n;
+			else {
+				overflow(ctx, arg.op);
+				goto error;
+			}
+			c.unit = a.unit;
+			break;
+		case '+':
+		case '&':
+		case '|':
+		case '^':
+			/* Check if the units match */
+			if (a.unit == b.unit) {
+				switch (arg.op) {
+				case '+':
+					if (__builtin_add_overflow(a.n, b.n, &c.n)) {
+						overflow(ctx, arg.op);
+						goto error;
+					}
+					break;
+				case '&':
+					c.n = a.n & b.n;
+					break;
+				case '|':
+					c.n = a.n | b.n;
+					break;
+				case '^':
+					c.n = a.n ^ b.n;
+					break;
+				default:
+					break;
+				}
+
+				if (a.unit)
+					c.unit = 1;
+				break;
+			}
+
+			log(ERROR, "unit mismatch in %c\n", arg.op);
+			goto error;
+		case '-':
+			/* Check if the units match */
+			if (a.unit == b.unit) {
+				if (b.n > a.n) {
+					log(ERROR, "negative result\n");
+					goto error;
+				}
+
+				c.n = a.n - b.n;
+				if (a.unit)
+					c.unit = 1;
+				break;
+			}
+
+			log(ERROR, "unit mismatch in -\n");
+			goto error;
+		case '*':
+			/* Check if only one is unit */
+			if (!(a.unit && b.unit)) {
+				if (__builtin_mul_overflow(a.n, b.n, &c.n)) {
+					overflow(ctx, arg.op);
+					goto error;
+				}
+				if (a.unit || b.unit)
+					c.unit = 1;
+				break;
+			}
+
+			log(ERROR, "unit mismatch in *\n");
+			goto error;
+		case '/':
+			if (b.n == 0) {
+				log(ERROR, "division by 0\n");
+				goto error;
+			}
+
+			if (b.unit && !a.unit) {
+				log(ERROR, "unit mismatch in /\n");
+				goto error;
+			}
+
+			/* Bytes by bytes is a plain number */
+			c.n = divrem(a.n, b.n, &rem);
+			c.unit = (a.unit && !b.unit);
+			if (rem)
+				truncated(ctx, a.n, b.n, c.n);
+			break;
+		case '%':
+			if (b.n == 0) {
+				log(ERROR, "division by 0\n");
+				goto error;
+			}
+
+			if (!(a.unit || b.unit)) {
+				c.n = a.n % b.n;
+				break;
+			}
+
+			log(ERROR, "unit mismatch in modulo\n"); // fallthrough
+		default:
+			goto error;
+		}
+
+		log(DEBUG, "c: %s unit: %d\n", getstr_u128(c.n, ctx->uint_buf), c.unit);
+
+		/* Push to stack */
+		push(est, c);
+	}
+
+	/* Stack must hold exactly one number at this point */
+	if (isempty(est)) {
+		log(ERROR, "invalid expression\n");
+		goto error;
+	}
+
+	pop(est, &res);
+	if (!isempty(est)) {
+		log(ERROR, "invalid expression\n");
+		goto error;
+	}
+
+	if (res.unit == 0)
+		*out = 1;
+
+	return res.n;
+
+error:
+	*out = -1;
+	emptystack(est);
+	return 0;
+}
+
+/*
+ * Check for a lowercase unit name that isn't followed by an
+ * alphanumeric char, e.g. "5kib" or "2 b", in a single pass
+ */
+static bool has_units(const char *expr)
+{
+	if (!expr)
+		return false;
+
+	for (const char *p = expr; *p; ++p) {
+		size_t len;
+
+		if (!islower((unsigned char)*p) || isalnum((unsigned char)p[1]))
+			continue;
+
+		/* Try the names ending here, up to the longest one */
+		for (len = 1; len <= UNIT_NAME_MAX && len <= (size_t)(p - expr) + 1 &&
+		     islower((unsigned char)p[1 - len]); ++len)
+			if (unit_index(p + 1 - len, len) != -1)
+				return true;
+	}
+
+	return false;
+}
+
+/* ASCII classes of text scanned for sizes, independent of the locale */
+static inline bool size_digit(char c)
+{
+	return (uint)(c - '0') < 10;
+}
+
+static inline bool size_alpha(char c)
+{
+	return (uint)(LOWER(c) - 'a') < 26;
+}
+
+static inline bool size_xdigit(char c)
+{
+	return size_digit(c) || (uint)(LOWER(c) - 'a') < 6;
+}
+
+/* The char at q, '\0' past the end, noting the furthest one looked at */
+static inline char size_char(const char *q, const char *end, const char **seen)
+{
+	if (q > *seen)
+		*seen = q;
+
+	return q < end ? *q : '\0';
+}
+
+/* Part of a word like "x86_64" or "1.2.3", sizes must start one */
+static inline bool size_word(const char *q, const char *end, const char **seen)
+{
+	char c = size_char(q, end, seen);
+
+	return size_digit(c) || size_alpha(c) || c == '_' ||
+	       (c == '.' && size_digit(size_char(q + 1, end, seen)));
+}
+
+/* First decimal digit in [p, end), end if none */
+static const char *next_digit(const char *p, const char *end)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint64_t v, m;
+
+	for (; end - p >= 8; p += 8) {
+		memcpy(&v, p, 8);
+		/* Bytes with the high bit set are never digits */
+		m = swar_between(v & ~SWAR_HIGH, '0', '9') & ~v;
+		if (m)
+			return p + (__builtin_ctzll(m) >> 3);
+	}
+#endif
+
+	while (p < end && !size_digit(*p))
+		++p;
+
+	return p;
+}
+
+/*
+ * Bytes of the size at [p, q), a decimal or 0x number and unit, false
+ * if they don't fit. Decimals may have commas between the thousands.
+ */
+static bool size_bytes(const char *p, const char *q, int unit, maxuint_t *bytes, bool *frac)
+{
+	const uint bits = sizeof(maxuint_t) << 3;
+	maxuint_t val = 0;
+	uint scale = 0, digit;
+	bool dot = false;
+
+	if (p[1] == 'x' || p[1] == 'X') {
+		for (p += 2; size_xdigit(*p); ++p) {
+			if (val >> (bits - 4))
+				return false;
+			digit = size_digit(*p) ? (uint)(*p - '0') : (uint)(LOWER(*p) - 'a' + 10);
+			val = (val << 4) | digit;
+		}
+	} else
+		for (; p < q; ++p) {
+			if (*p == ',')
+				continue;
+
+			if (*p == '.') {
+				if (dot)
+					break;
+				dot = true;
+				continue;
+			}
+
+			if (!size_digit(*p))
+				break;
+
+			if (__builtin_mul_overflow(val, 10, &val) ||
+			    __builtin_add_overflow(val, (uint)(*p - '0'), &val))
+				return false;
+			scale += dot;
+		}
+
+	return unit_bytes(val, scale, unit, bytes, frac);
+}
+
+/*
+ * Convert a single operand with an optional unit suffix, or in unit
+ * Byte values must be integers, other units may be fractional.
+ */
+static int parse_operand(bcal_ctx *ctx, char *value, const char *unit, bcal_result *res)
+{
+	int count;
+	char *pch;
+
+	res->single = 1;
+
+	strstrip(value);
+	if (value[0] == '\0') {
+		log(ERROR, "invalid value\n");
+		return failure(ctx);
+	}
+
+	if (!unit) {
+		int unitchars = 0, len = (int)strlen(value);
+
+		while (len) {
+			if (!isalpha((int)value[len - 1]))
+				break;
+
+			++unitchars;
+			--len;
+		}
+
+		if (unitchars) {
+			count = lookup_unit(value + len);
+			while (len && isspace((unsigned char)value[len - 1]))
+				--len;
+			value[len] = '\0';
+		} else
+			count = BCAL_B;
+	} else
+		count = lookup_unit(unit);
+
+	if (count == -1) {
+		log(ERROR, "unknown unit\n");
+		ctx->err = BCAL_EUNIT;
+		return failure(ctx);
+	}
+
+	log(DEBUG, "%s %s\n", value, units[count].name);
+
+	if (count == BCAL_B) {
+		/* Bytes cannot be in float */
+		res->value = strtouquad(value, &pch);
+		res->in_val = (maxfloat_t)res->value;
+	} else {
+		maxuint_t n = 0;
+		const char *end;
+		uint scale = 0;
+		bool frac;
+
+		/* Decimals are exact too, strtold(3) takes the rest */
+		if (prefix_base(value) != 10)
+			n = strtouquad(value, &pch);
+		else if ((end = scan_decimal(value, &n, &scale)) && !*end)
+			pch = PASSED;
+		else
+			pch = FAILED;
+
+		if (!*pch && unit_bytes(n, scale, count, &res->value, &frac))
+			res->in_val = decimal_value(n, scale);
+		else {
+			res->in_val = strtold(value, &pch);
+			if (!*pch && !unit_bytes_f(res->in_val, count, &res->value, &frac)) {
+				too_big(ctx, value);
+				return failure(ctx);
+			}
+		}
+
+		res->inexact = frac;
+	}
+
+	if (*pch) {
+		log(ERROR, "malformed input\n");
+		ctx->err = BCAL_EMALFORMED;
+		return failure(ctx);
+	}
+
+	res->unit = 1;
+	res->in_unit = count;
+	return BCAL_OK;
+}
+
+/* A lone variable is evaluated as an expression, not converted as an operand */
+static bool lone_var(const bcal_ctx *ctx)
+{
+	return ctx->nlex == 1 && ctx->lex->kind == LEX_NAME &&
+	       var_name_ok(ctx->src + ctx->lex->pos, ctx->lex->len);
+}
+
+/*
+ * Tokenize an expression to postfix in ctx->postfix,
+ * or convert it in res if it's a single operand
+ */
+static int compile(bcal_ctx *ctx, const char *expr, bcal_result *res)
+{
+	char word[WORD_LEN] = "";
+	bool single;
+
+	memset(res, 0, sizeof(bcal_result));
+	ctx->inexact = false;
+
+	if (lex_storage(ctx, expr, &single) == -1)
+		return failure(ctx);
+
+	if (single && !lone_var(ctx)) {
+		if (ctx->nlex && !lex_copy(ctx, ctx->lex, word, WORD_LEN))
+			return failure(ctx);
+		return parse_operand(ctx, word, NULL, res);
+	}
+
+	if (infix2postfix(ctx, &ctx->postfix) == -1)
+		return failure(ctx);
+
+	res->inexact = ctx->inexact;
+	return BCAL_OK;
+}
+
+/* Evaluate postfix code, the result is stored for r */
+static int run(bcal_ctx *ctx, const Token *code, size_t len, bcal_result *res)
+{
+	int out = 0;
+
+	res->value = eval(ctx, code, len, &out);  /* Evaluate Expression */
+	if (out == -1)
+		return failure(ctx);
+
+	res->unit = (out != 1);
+	store_value(ctx, res->value, res->unit);
+	return BCAL_OK;
+}
+
+/* An operand of eval_wide() */
+typedef struct wide_token {
+	wide_t n;
+	char unit;
+} wide_token;
+
+/*
+ * Convert an operand to bytes like unitconv(), in the wide width.
+ * Digits with an optional fraction and unit are converted exactly,
+ * as m * num / (den * 10^scale). Anything else fits in maxuint_t or
+ * isn't valid, so it's left to unitconv().
+ */
+static bool wide_operand(bcal_ctx *ctx, const char *numstr, char *isunit, wide_t *w)
+{
+	const uint n = ctx->wlimbs, base = prefix_base(numstr);
+	const uint max = (base == 10) ? 19 : (base == 16) ? 15 : 63; /* digits per limb */
+	const char *p = (base == 10) ? numstr : numstr + 2, *start = p, *dot = NULL;
+	uint digit, count = 0, scale = 0, k;
+	uint64_t chunk = 0, rem = 0;
+	bool over = false;
+	maxuint_t val;
+	int unit = BCAL_B, out = 0;
+
+	w->len = 0;
+	for (;; ++p) {
+		if (base == 10 && *p == '.' && !dot) {
+			dot = p;
+			continue;
+		}
+
+		if (!ischarvalid(*p, base, &digit))
+			break;
+
+		chunk = chunk * base + digit;
+		if (++count == max) {
+			over |= w_mul_u64(w, w, (base == 10) ? pow10_u64[count] : 1ULL << (count * (base == 2 ? 1 : 4)), n);
+			over |= w_add_u64(w, chunk, n);
+			chunk = 0;
+			count = 0;
+		}
+	}
+
+	if (p - start == (dot ? 1 : 0) || (*p && (unit = lookup_unit(p)) == -1))
+		goto narrow;
+
+	if (count) {
+		over |= w_mul_u64(w, w, (base == 10) ? pow10_u64[count] : 1ULL << (count * (base == 2 ? 1 : 4)), n);
+		over |= w_add_u64(w, chunk, n);
+	}
+
+	if (*isunit != 1)
+		*isunit = 0;
+	if (*p)
+		*isunit = 1;
+
+	/* The unit's factors, the fraction is divided out 19 digits at a time */
+	if (units[unit].num != 1)
+		over |= w_mul_u64(w, w, (uint64_t)units[unit].num, n);
+	if (over)
+		goto toobig;
+
+	if (units[unit].den != 1)
+		rem |= w_divmod_u64(w, w, units[unit].den);
+
+	for (scale = dot ? (uint)(p - dot - 1) : 0; scale; scale -= k) {
+		k = scale < 19 ? scale : 19;
+		rem |= w_divmod_u64(w, w, pow10_u64[k]);
+	}
+
+	ctx->inexact |= (rem != 0);
+	return true;
+
+narrow:
+	val = unitconv(ctx, numstr, isunit, &out);
+	if (out == -1)
+		return false;
+
+	w_set_uint(w, val);
+	if (w->len <= n)
+		return true;
+
+toobig:
+	log(ERROR, "%s exceeds %u bits\n", numstr, n << 6);
+	ctx->err = BCAL_EOVERFLOW;
+	return false;
+}
+
+/* Load the last result as a wide operand */
+static bool wide_last(bcal_ctx *ctx, wide_token *t)
+{
+	Token last;
+
+	if (ctx->lastwide) {
+		w_copy(&t->n, &ctx->lastw);
+		t->unit = ctx->lastres.unit;
+
+		/* The width may have been lowered since */
+		if (t->n.len > ctx->wlimbs) {
+			t->n.len = ctx->wlimbs;
+			w_norm(&t->n);
+		}
+		return true;
+	}
+
+	if (!last_value(ctx, &last))
+		return false;
+
+	w_set_uint(&t->n, last.n);
+	t->unit = last.unit;
+	return true;
+}
+
+/* Load the variable of token t as a wide operand */
+static bool wide_var(bcal_ctx *ctx, const Token *t, wide_token *w)
+{
+	const variable *v = var_find(ctx, ctx->src + (size_t)t->n, (size_t)t->unit);
+
+	if (!v) {
+		log(ERROR, "unknown variable %.*s\n", (int)t->unit, ctx->src + (size_t)t->n);
+		return false;
+	}
+
+	w->unit = v->unit;
+	return wide_operand(ctx, v->value, &w->unit, &w->n);
+}
+
+/* Store a wide result, narrow results of other calls replace it */
+static void store_wide(bcal_ctx *ctx, const wide_t *w, int unit)
+{
+	maxuint_t val;
+
+	if (w_get_uint(w, &val))
+		store_value(ctx, val, unit);
+	else
+		store_result(ctx, "", unit);
+
+	w_copy(&ctx->lastw, w);
+	ctx->lastwide = true;
+}
+
+/*
+ * Evaluate postfix code from infix2postfix() in wide mode, with the
+ * unit rules and errors of eval(). Results that don't fit in the width
+ * overflow as they do in eval().
+ */
+static int eval_wide(bcal_ctx *ctx, const Token *code, size_t len, wide_token *res)
+{
+	const uint n = ctx->wlimbs;
+	char word[WIDE_WORD_LEN];
+	wide_token *st, *a, *b;
+	size_t sp = 0, i;
+	wide_t q, r;
+	bool big;
+	uint s;
+
+	if (len > ctx->wcap) {
+		st = (wide_token *)realloc(ctx->wstack, len * sizeof(wide_token));
+		if (!st) {
+			log(ERROR, "out of memory\n");
+			ctx->err = BCAL_ENOMEM;
+			return -1;
+		}
+
+		ctx->wstack = st;
+		ctx->wcap = len;
+	}
+
+	st = ctx->wstack;
+	for (i = 0; i < len; ++i) {
+		const Token *arg = &code[i];
+
+		if (arg->op == 'r') {
+			if (!wide_last(ctx, &st[sp]))
+				return -1;
+			++sp;
+			continue;
+		}
+
+		if (arg->op == 'v') {
+			if (!wide_var(ctx, arg, &st[sp]))
+				return -1;
+			++sp;
+			continue;
+		}
+
+		if (!arg->op) {
+			st[sp].unit = arg->unit;
+			if (!lex_copy(ctx, &ctx->lex[arg->n], word, WIDE_WORD_LEN) ||
+			    !wide_operand(ctx, word, &st[sp].unit, &st[sp].n))
+				return -1;
+			++sp;
+			continue;
+		}
+
+		if (arg->op == '~') {
+			if (!sp) {
+				log(ERROR, "invalid token\n");
+				return -1;
+			}
+
+			a = &st[sp - 1];
+			w_not(&a->n, &a->n, n);
+			a->unit = a->unit ? 1 : 0;
+			continue;
+		}
+
+		if (sp < 2) {
+			log(ERROR, "invalid token\n");
+			return -1;
+		}
+
+		/* The result replaces a */
+		b = &st[--sp];
+		a = &st[sp - 1];
+
+		switch (arg->op) {
+		case '>':
+		case '<':
+			if (b->unit) {
+				log(ERROR, "unit mismatch in %c%c\n", arg->op, arg->op);
+				return -1;
+			}
+
+			big = b->n.len > 1 || (b->n.len && b->n.limb[0] >= (n << 6));
+			s = (big || !b->n.len) ? 0 : (uint)b->n.limb[0];
+			if (arg->op == '>') {
+				if (big)
+					a->n.len = 0;
+				else
+					w_shr(&a->n, &a->n, s);
+			} else if (!w_iszero(&a->n)) {
+				if (big || w_bits(&a->n) + s > (n << 6)) {
+					overflow(ctx, arg->op);
+					return -1;
+				}
+				w_shl(&a->n, &a->n, s, n);
+			}
+			break;
+		case '+':
+		case '&':
+		case '|':
+		case '^':
+			if (a->unit != b->unit) {
+				log(ERROR, "unit mismatch in %c\n", arg->op);
+				return -1;
+			}
+
+			if (arg->op == '+') {
+				if (w_add(&a->n, &a->n, &b->n, n)) {
+					overflow(ctx, arg->op);
+					return -1;
+				}
+			} else if (arg->op == '&')
+				w_and(&a->n, &a->n, &b->n);
+			else
+				w_orx(&a->n, &a->n, &b->n, arg->op == '^');
+			a->unit = a->unit ? 1 : 0;
+			break;
+		case '-':
+			if (a->unit != b->unit) {
+				log(ERROR, "unit mismatch in -\n");
+				return -1;
+			}
+
+			if (w_cmp(&b->n, &a->n) > 0) {
+				log(ERROR, "negative result\n");
+				return -1;
+			}
+
+			w_sub(&a->n, &a->n, &b->n);
+			a->unit = a->unit ? 1 : 0;
+			break;
+		case '*':
+			if (a->unit && b->unit) {
+				log(ERROR, "unit mismatch in *\n");
+				return -1;
+			}
+
+			if (w_mul(&q, &a->n, &b->n, n)) {
+				overflow(ctx, arg->op);
+				return -1;
+			}
+			w_copy(&a->n, &q);
+			a->unit = (a->unit || b->unit);
+			break;
+		case '/':
+		case '%':
+			if (w_iszero(&b->n)) {
+				log(ERROR, "division by 0\n");
+				return -1;
+			}
+
+			if (arg->op == '%' && (a->unit || b->unit)) {
+				log(ERROR, "unit mismatch in modulo\n");
+				return -1;
+			}
+
+			if (b->unit && !a->unit) {
+				log(ERROR, "unit mismatch in /\n");
+				return -1;
+			}
+
+			w_divmod(&q, &r, &a->n, &b->n);
+			if (arg->op == '%') {
+				w_copy(&a->n, &r);
+				break;
+			}
+
+			if (!w_iszero(&r))
+				log(WARNING, "result truncated\n");
+			w_copy(&a->n, &q);
+			a->unit = (a->unit && !b->unit);
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	/* Stack must hold exactly one number at this point */
+	if (sp != 1) {
+		log(ERROR, "invalid expression\n");
+		return -1;
+	}
+
+	w_copy(&res->n, &st[0].n);
+	res->unit = st[0].unit;
+	return 0;
+}
+
+bcal_ctx *bcal_ctx_new(void)
+{
+	bcal_ctx *ctx = (bcal_ctx *)calloc(1, sizeof(bcal_ctx));
+
+	if (ctx) {
+		ctx->loglvl = ERROR;
+		ctx->wlimbs = BCAL_WIDE_BITS / 64;
+		ctx->scale = BCAL_SCALE;
+	}
+
+	return ctx;
+}
+
+void bcal_ctx_free(bcal_ctx *ctx)
+{
+	if (!ctx)
+		return;
+
+	freestack(&ctx->opstack);
+	freestack(&ctx->evalstack);
+	freequeue(&ctx->postfix);
+	free(ctx->lex);
+	free(ctx->wstack);
+	free(ctx->longbuf);
+	free(ctx->node);
+	free(ctx->pool);
+	free(ctx->cval);
+	free(ctx->mstack);
+	bcal_clear_vars(ctx);
+	free(ctx->vars);
+	free(ctx->cache.e);
+	free(ctx->cache.bucket);
+	free(ctx);
+}
+
+void bcal_set_log(bcal_ctx *ctx, int level, bcal_log_fn fn, void *arg)
+{
+	ctx->loglvl = level;
+	ctx->logfn = fn;
+	ctx->logarg = arg;
+}
+
+void bcal_set_flags(bcal_ctx *ctx, int flags)
+{
+	ctx->flags = flags;
+}
+
+const char *bcal_errmsg(const bcal_ctx *ctx)
+{
+	return ctx->errmsg;
+}
+
+const char *bcal_strerror(int err)
+{
+	switch (err) {
+	case BCAL_OK: return "success";
+	case BCAL_EINVAL: return "invalid expression";
+	case BCAL_EUNIT: return "unknown unit";
+	case BCAL_EMALFORMED: return "malformed input";
+	case BCAL_ENOMEM: return "out of memory";
+	case BCAL_EOVERFLOW: return "overflow";
+	default: return "unknown error";
+	}
+}
+
+/*
+ * The expression to evaluate in expr, the part after '=' if it's an
+ * assignment, "name = expression". *name is set then, else NULL. Most
+ * expressions don't start with a letter and are returned at once.
+ */
+static const char *assignment(bcal_ctx *ctx, const char *expr, const char **name, size_t *len)
+{
+	const char *p = expr, *start;
+
+	*name = NULL;
+	while (isspace((unsigned char)*p))
+		++p;
+
+	if (!isalpha((unsigned char)*p) && *p != '_')
+		return expr;
+
+	for (start = p; isalnum((unsigned char)*p) || *p == '_'; ++p)
+		;
+
+	*len = (size_t)(p - start);
+	while (isspace((unsigned char)*p))
+		++p;
+
+	if (*p != '=')
+		return expr;
+
+	if (!var_name_ok(start, *len)) {
+		log(ERROR, "invalid variable name %.*s\n", (int)*len, start);
+		return NULL;
+	}
+
+	*name = start;
+	return p + 1;
+}
+
+/* Assign the last result to the variable called name */
+static int assign_last(bcal_ctx *ctx, const char *name, size_t len)
+{
+	char buf[BCAL_WIDE_BUF_LEN];
+	const char *value = last_str(ctx);
+
+	/* Too wide for lastres */
+	if (!*value && ctx->lastwide)
+		value = bcal_wide_str(&ctx->lastw, 10, buf);
+
+	if (!var_set(ctx, name, len, value, ctx->lastres.unit)) {
+		num_nomem(ctx);
+		return failure(ctx);
+	}
+
+	log(DEBUG, "%.*s = %s\n", (int)len, name, value);
+	return BCAL_OK;
+}
+
+/*
+ * The key of expr in the result cache: the chars lex_storage() keeps,
+ * hashed 8 at a time. 0 if expr isn't cached, when it's too long or a
+ * letter starts a word as r and variables do. Units follow a number or
+ * a kept space.
+ */
+static uint32_t cache_key(const char *expr, char *key, uint32_t *hash)
+{
+	const char *p = expr;
+	uint32_t len = 0;
+	uint64_t h = 0, w;
+	bool num = false; /* the last char kept can precede a unit */
+	bool alpha;
+	char c;
+
+	while (isspace((unsigned char)*p))
+		++p;
+
+	for (; (c = *p); ++p) {
+		if (lex_dropped(p))
+			continue;
+
+		alpha = (uint)(LOWER(c) - 'a') < 26 || c == '_';
+		if ((alpha && !num) || len == CACHE_KEY_LEN)
+			return 0;
+
+		num = alpha || (uint)(c - '0') < 10 || c == '.' || c == ' ';
+		key[len++] = c;
+	}
+
+	/* The last word is padded with zeros */
+	if (len % 8)
+		memset(key + len, 0, 8 - len % 8);
+
+	for (uint32_t i = 0; i < len; i += 8) {
+		memcpy(&w, key + i, 8);
+		h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+	}
+
+	*hash = (uint32_t)(h >> 32);
+	return len;
+}
+
+/* Unlink entry i from the LRU list of c */
+static void cache_unlink(result_cache *c, uint32_t i)
+{
+	cache_entry *e = &c->e[i];
+
+	if (e->prev != CACHE_NIL)
+		c->e[e->prev].next = e->next;
+	else
+		c->head = e->next;
+
+	if (e->next != CACHE_NIL)
+		c->e[e->next].prev = e->prev;
+	else
+		c->tail = e->prev;
+}
+
+/* Make entry i the most recently used of c */
+static void cache_push(result_cache *c, uint32_t i)
+{
+	c->e[i].prev = CACHE_NIL;
+	c->e[i].next = c->head;
+	if (c->head != CACHE_NIL)
+		c->e[c->head].prev = i;
+	else
+		c->tail = i;
+	c->head = i;
+}
+
+/* The cached result of a key, NULL if there is none */
+static const bcal_result *cache_get(result_cache *c, const char *key, uint32_t len, uint32_t h)
+{
+	uint32_t i = c->bucket[h & c->mask];
+
+	for (; i != CACHE_NIL; i = c->e[i].chain) {
+		cache_entry *e = &c->e[i];
+
+		if (e->hash == h && e->len == len && !memcmp(e->key, key, len)) {
+			cache_unlink(c, i);
+			cache_push(c, i);
+			return &e->res;
+		}
+	}
+
+	return NULL;
+}
+
+/* Cache the result of a key, in place of the least recently used if full */
+static void cache_put(result_cache *c, const char *key, uint32_t len, uint32_t h, const bcal_result *res)
+{
+	uint32_t i = c->len, *link;
+
+	if (c->len == c->cap) {
+		i = c->tail;
+		cache_unlink(c, i);
+
+		for (link = &c->bucket[c->e[i].hash & c->mask]; *link != i; link = &c->e[*link].chain)
+			;
+		*link = c->e[i].chain;
+	} else
+		++c->len;
+
+	memcpy(c->e[i].key, key, len);
+	c->e[i].len = len;
+	c->e[i].hash = h;
+	c->e[i].res = *res;
+	c->e[i].chain = c->bucket[h & c->mask];
+	c->bucket[h & c->mask] = i;
+	cache_push(c, i);
+}
+
+int bcal_eval(bcal_ctx *ctx, const char *expr, bcal_result *res)
+{
+	result_cache *c = &ctx->cache;
+	char key[CACHE_KEY_LEN];
+	const bcal_result *hit;
+	uint32_t keylen = 0, h;
+	const char *name;
+	size_t len;
+	int ret;
+
+	reset_error(ctx);
+
+	expr = assignment(ctx, expr, &name, &len);
+	if (!expr) {
+		memset(res, 0, sizeof(bcal_result));
+		return failure(ctx);
+	}
+
+	if (c->cap && !name && (keylen = cache_key(expr, key, &h))) {
+		hit = cache_get(c, key, keylen, h);
+		if (hit) {
+			++c->hits;
+			log(DEBUG, "cache hit, %zu hits %zu misses\n", c->hits, c->misses);
+			*res = *hit;
+			store_value(ctx, res->value, res->single ? 1 : res->unit);
+			return BCAL_OK;
+		}
+
+		++c->misses;
+		log(DEBUG, "cache miss, %zu hits %zu misses\n", c->hits, c->misses);
+	}
+
+	ctx->warned = false;
+	ret = compile(ctx, expr, res);
+	if (ret != BCAL_OK)
+		return ret;
+
+	if (res->single)
+		store_value(ctx, res->value, 1);
+	else {
+		ret = run(ctx, ctx->postfix.d + ctx->postfix.head, queuelen(&ctx->postfix), res);
+		cleanqueue(&ctx->postfix);
+	}
+
+	if (ret == BCAL_OK && keylen && !ctx->warned)
+		cache_put(c, key, keylen, h, res);
+
+	return (ret == BCAL_OK && name) ? assign_last(ctx, name, len) : ret;
+}
+
+int bcal_compile(bcal_ctx *ctx, const char *expr, bcal_prog **prog)
+{
+	const Token *code = ctx->postfix.d + ctx->postfix.head;
+	size_t len = 0, depth = 0, srclen, i;
+	bcal_result res;
+	bcal_prog *p;
+	int ret;
+
+	reset_error(ctx);
+	*prog = NULL;
+
+	ret = compile(ctx, expr, &res);
+	if (ret != BCAL_OK)
+		return ret;
+
+	if (!res.single) {
+		len = queuelen(&ctx->postfix);
+		code = ctx->postfix.d + ctx->postfix.head;
+
+		/* Check operands are available to each operator */
+		for (i = 0; i < len; ++i) {
+			if (!code[i].op || code[i].op == 'r' || code[i].op == 'v')
+				++depth;
+			else if (depth < ((code[i].op == '~') ? 1U : 2U)) {
+				log(ERROR, "invalid token\n");
+				goto error;
+			} else if (code[i].op != '~')
+				--depth;
+		}
+
+		if (len > 1 && depth != 1) {
+			log(ERROR, "invalid expression\n");
+			goto error;
+		}
+	}
+
+	/* The expression follows the code */
+	srclen = strlen(expr) + 1;
+	p = (bcal_prog *)malloc(sizeof(bcal_prog) + len * sizeof(Token) + srclen);
+	if (!p) {
+		ctx->err = BCAL_ENOMEM;
+		goto error;
+	}
+
+	p->single = res;
+	p->len = len;
+	p->src = (const char *)(p->code + len);
+	if (len)
+		memcpy(p->code, code, len * sizeof(Token));
+	memcpy((char *)(p->code + len), expr, srclen);
+
+	cleanqueue(&ctx->postfix);
+	*prog = p;
+	return BCAL_OK;
+
+error:
+	cleanqueue(&ctx->postfix);
+	return failure(ctx);
+}
+
+int bcal_run(bcal_ctx *ctx, const bcal_prog *prog, bcal_result *res)
+{
+	reset_error(ctx);
+
+	if (!prog->len) {
+		*res = prog->single;
+		store_value(ctx, res->value, 1);
+		return BCAL_OK;
+	}
+
+	memset(res, 0, sizeof(bcal_result));
+	res->inexact = prog->single.inexact;
+	ctx->src = prog->src;
+	return run(ctx, prog->code, prog->len, res);
+}
+
+void bcal_prog_free(bcal_prog *prog)
+{
+	free(prog);
+}
+
+int bcal_set_cache(bcal_ctx *ctx, unsigned entries)
+{
+	result_cache *c = &ctx->cache;
+	uint32_t nbucket = 1;
+
+	reset_error(ctx);
+
+	if (entries > BCAL_CACHE_MAX) {
+		log(ERROR, "cache must be up to %d entries\n", BCAL_CACHE_MAX);
+		return failure(ctx);
+	}
+
+	free(c->e);
+	free(c->bucket);
+	*c = (result_cache){0};
+	if (!entries)
+		return BCAL_OK;
+
+	/* A bucket per entry at least, chains stay short */
+	while (nbucket < entries)
+		nbucket <<= 1;
+
+	c->e = (cache_entry *)malloc(entries * sizeof(cache_entry));
+	c->bucket = (uint32_t *)malloc(nbucket * sizeof(uint32_t));
+	if (!c->e || !c->bucket) {
+		free(c->e);
+		free(c->bucket);
+		*c = (result_cache){0};
+		num_nomem(ctx);
+		return failure(ctx);
+	}
+
+	memset(c->bucket, 0xff, nbucket * sizeof(uint32_t));
+	c->cap = entries;
+	c->mask = nbucket - 1;
+	c->head = c->tail = CACHE_NIL;
+	return BCAL_OK;
+}
+
+void bcal_cache_stats(const bcal_ctx *ctx, size_t *hits, size_t *misses)
+{
+	*hits = ctx->cache.hits;
+	*misses = ctx->cache.misses;
+}
+
+/* Convert value in unit or a single operand, see bcal_convert() */
+static int convert(bcal_ctx *ctx, const char *value, const char *unit, bcal_result *res)
+{
+	char unitbuf[NUM_LEN], buf[WORD_LEN];
+	size_t len = strlen(value);
+	char *val = buf;
+	int ret;
+
+	memset(res, 0, sizeof(bcal_result));
+
+	if (len >= WORD_LEN) {
+		val = (char *)malloc(len + 1);
+		if (!val) {
+			ctx->err = BCAL_ENOMEM;
+			return failure(ctx);
+		}
+	}
+
+	if (unit) {
+		memcpy(val, value, len + 1);
+		bstrlcpy(unitbuf, unit, NUM_LEN);
+		strstrip(unitbuf);
+		ret = parse_operand(ctx, val, unitbuf, res);
+	} else {
+		char *d = val;
+
+		/* Drop the chars an expression would */
+		for (const char *p = value; *p; ++p)
+			if (!lex_dropped(p))
+				*d++ = *p;
+		*d = '\0';
+		ret = parse_operand(ctx, val, NULL, res);
+	}
+
+	if (val != buf)
+		free(val);
+	return ret;
+}
+
+int bcal_convert(bcal_ctx *ctx, const char *value, const char *unit, bcal_result *res)
+{
+	int ret;
+
+	reset_error(ctx);
+
+	ret = convert(ctx, value, unit, res);
+	if (ret == BCAL_OK)
+		store_value(ctx, res->value, 1);
+
+	return ret;
+}
+
+/* Round an exact result to the scale of ctx and drop the zeros ending it */
+static bool round_result(const bcal_ctx *ctx, decnum_t *x)
+{
+	size_t k = 0;
+
+	if (x->scale > ctx->scale) {
+		if (!dec_round(&x->mag, x->scale - ctx->scale))
+			return false;
+		x->scale = ctx->scale;
+	}
+
+	/* Whole zero limbs first */
+	while (k + DEC_DIGITS <= x->scale && k / DEC_DIGITS < x->mag.len && !x->mag.d[k / DEC_DIGITS])
+		k += DEC_DIGITS;
+	while (k < x->scale && !dec_digit(&x->mag, k))
+		++k;
+
+	/* Only zeros are dropped, so nothing rounds up */
+	dec_round(&x->mag, k);
+	x->scale -= k;
+	if (!x->mag.len)
+		x->negative = false;
+	return true;
+}
+
+/* The string of an evaluated maths expression in buf, or malloc()ed if longer */
+static char *format_maths(bcal_ctx *ctx, mathnum_t *n, char *buf, size_t buflen)
+{
+	long long int_result;
+	uint64_t v;
+
+	if (n->exact) {
+		if (!round_result(ctx, &n->dec)) {
+			num_nomem(ctx);
+			return NULL;
+		}
+
+		if (!(ctx->flags & BCAL_FLAG_HEX) || n->dec.scale || !dec_get_u64(&n->dec.mag, &v) ||
+		    v > LLONG_MAX) {
+			if (!(buf = format_decimal_result(&n->dec.mag, n->dec.scale, n->dec.negative,
+							  buf, buflen)))
+				num_nomem(ctx);
+			return buf;
+		}
+
+		n->val = n->dec.negative ? -(maxfloat_t)v : (maxfloat_t)v;
+	}
+
+	if (!is_integral_result(n->val, &int_result))
+		format_result(n->val, ctx->scale < LDBL_DIG ? (int)ctx->scale : LDBL_DIG, buf, buflen);
+	else if (ctx->flags & BCAL_FLAG_HEX)
+		snprintf(buf, buflen, "0x%llx", (unsigned long long)int_result);
+	else
+		snprintf(buf, buflen, "%lld", int_result);
+
+	return buf;
+}
+
+/* Run maths code, or format value if there is none, and store the result */
+static int eval_maths(bcal_ctx *ctx, const mathnode *code, size_t len, const uint32_t *pool,
+		      size_t depth, mathnum_t *value, char *buf, size_t buflen)
+{
+	char res[UINT_BUF_LEN], *str = NULL;
+	mathnum_t result = {0};
+
+	if (value)
+		str = format_maths(ctx, value, res, UINT_BUF_LEN);
+	else if (run_maths(ctx, code, len, pool, depth, &result) != -1)
+		str = format_maths(ctx, &result, res, UINT_BUF_LEN);
+	num_free(&result);
+	if (!str)
+		return failure(ctx);
+
+	/* Store result for next use */
+	store_result(ctx, str, 0);
+	bstrlcpy(buf, str, buflen);
+	if (str != res)
+		free(str);
+	return BCAL_OK;
+}
+
+int bcal_eval_maths(bcal_ctx *ctx, const char *expr, char *buf, size_t buflen)
+{
+	mathnum_t value = {0};
+	const char *name;
+	size_t len;
+	int ret;
+
+	reset_error(ctx);
+
+	expr = assignment(ctx, expr, &name, &len);
+	if (!expr || compile_maths(ctx, expr, &value) == -1) {
+		num_free(&value);
+		return failure(ctx);
+	}
+
+	if (ctx->nnode)
+		ret = eval_maths(ctx, ctx->node, ctx->nnode, ctx->pool, ctx->maxdepth, NULL, buf, buflen);
+	else
+		ret = eval_maths(ctx, NULL, 0, NULL, 0, &value, buf, buflen);
+	num_free(&value);
+
+	return (ret == BCAL_OK && name) ? assign_last(ctx, name, len) : ret;
+}
+
+int bcal_compile_maths(bcal_ctx *ctx, const char *expr, bcal_maths **prog)
+{
+	bcal_maths *p;
+	size_t srclen;
+
+	reset_error(ctx);
+	*prog = NULL;
+
+	if (compile_maths(ctx, expr, NULL) == -1)
+		return failure(ctx);
+
+	/* The pool and the expression follow the nodes in one block */
+	srclen = strlen(expr) + 1;
+	p = (bcal_maths *)malloc(sizeof(bcal_maths) + ctx->nnode * sizeof(mathnode) +
+				 ctx->npool * sizeof(uint32_t) + srclen);
+	if (!p) {
+		num_nomem(ctx);
+		return failure(ctx);
+	}
+
+	p->len = ctx->nnode;
+	p->depth = ctx->maxdepth;
+	p->pool = (const uint32_t *)(p->node + p->len);
+	p->src = (const char *)(p->pool + ctx->npool);
+	memcpy(p->node, ctx->node, p->len * sizeof(mathnode));
+	if (ctx->npool)
+		memcpy((uint32_t *)p->pool, ctx->pool, ctx->npool * sizeof(uint32_t));
+	memcpy((char *)p->src, expr, srclen);
+
+	*prog = p;
+	return BCAL_OK;
+}
+
+int bcal_run_maths(bcal_ctx *ctx, const bcal_maths *prog, char *buf, size_t buflen)
+{
+	reset_error(ctx);
+	ctx->src = prog->src;
+	return eval_maths(ctx, prog->node, prog->len, prog->pool, prog->depth, NULL, buf, buflen);
+}
+
+void bcal_maths_free(bcal_maths *prog)
+{
+	free(prog);
+}
+
+int bcal_set_scale(bcal_ctx *ctx, unsigned digits)
+{
+	reset_error(ctx);
+
+	if (digits > BCAL_SCALE_MAX) {
+		log(ERROR, "scale must be up to %d digits\n", BCAL_SCALE_MAX);
+		return failure(ctx);
+	}
+
+	ctx->scale = digits;
+	return BCAL_OK;
+}
+
+int bcal_set_width(bcal_ctx *ctx, unsigned bits)
+{
+	reset_error(ctx);
+
+	if (!bits || bits % 64 || bits > BCAL_WIDE_BITS_MAX) {
+		log(ERROR, "width must be a multiple of 64 up to %d\n", BCAL_WIDE_BITS_MAX);
+		return failure(ctx);
+	}
+
+	ctx->wlimbs = bits / 64;
+	return BCAL_OK;
+}
+
+int bcal_eval_wide(bcal_ctx *ctx, const char *expr, bcal_wide *res, int *unit)
+{
+	char word[WIDE_WORD_LEN];
+	wide_token t = {.unit = 1};
+	const char *name;
+	bool single;
+	size_t len;
+	int ret = 0;
+
+	reset_error(ctx);
+	ctx->inexact = false;
+
+	expr = assignment(ctx, expr, &name, &len);
+	if (!expr || lex_storage(ctx, expr, &single) == -1)
+		return failure(ctx);
+
+	if (!ctx->nlex) {
+		log(ERROR, "invalid value\n");
+		return failure(ctx);
+	}
+
+	if (single && !lone_var(ctx)) {
+		/* A lone operand is in bytes */
+		if (ctx->lex->kind == LEX_R)
+			ret = wide_last(ctx, &t) ? 0 : -1;
+		else if (!lex_copy(ctx, ctx->lex, word, WIDE_WORD_LEN) || !wide_operand(ctx, word, &t.unit, &t.n))
+			ret = -1;
+		t.unit = 1;
+	} else {
+		ctx->wide = true;
+		ret = infix2postfix(ctx, &ctx->postfix);
+		ctx->wide = false;
+
+		if (ret != -1)
+			ret = eval_wide(ctx, ctx->postfix.d + ctx->postfix.head,
+					queuelen(&ctx->postfix), &t);
+		cleanqueue(&ctx->postfix);
+	}
+
+	if (ret == -1)
+		return failure(ctx);
+
+	w_copy(res, &t.n);
+	*unit = t.unit ? 1 : 0;
+	store_wide(ctx, res, *unit);
+	return name ? assign_last(ctx, name, len) : BCAL_OK;
+}
+
+const char *bcal_last(const bcal_ctx *ctx, int *unit)
+{
+	if (ctx->lastres.p[0] == '\0')
+		return NULL;
+
+	if (unit)
+		*unit = ctx->lastres.unit;
+
+	return last_str(ctx);
+}
+
+const bcal_wide *bcal_last_wide(const bcal_ctx *ctx, int *unit)
+{
+	if (!ctx->lastwide)
+		return NULL;
+
+	if (unit)
+		*unit = ctx->lastres.unit;
+
+	return &ctx->lastw;
+}
+
+void bcal_set_last(bcal_ctx *ctx, bcal_uint value, int unit)
+{
+	store_value(ctx, value, unit ? 1 : 0);
+}
+
+void bcal_clear_last(bcal_ctx *ctx)
+{
+	ctx->lastres.p[0] = '\0';
+	ctx->lastres.unit = 0;
+	ctx->lastlong = NULL;
+	ctx->lastnum = false;
+	ctx->lastwide = false;
+}
+
+void bcal_clear_vars(bcal_ctx *ctx)
+{
+	for (size_t i = 0; ctx->nvars && i < ctx->varcap; ++i)
+		if (ctx->vars[i].name[0]) {
+			free(ctx->vars[i].value);
+			ctx->vars[i].name[0] = '\0';
+			--ctx->nvars;
+		}
+}
+
+int bcal_parse_size(const char *str, bcal_uint *bytes)
+{
+	bcal_ctx ctx = {0};
+	bcal_result res;
+	int ret = convert(&ctx, str, NULL, &res);
+
+	if (ret == BCAL_OK)
+		*bytes = res.value;
+
+	return ret;
+}
+
+int bcal_parse_uint(const char *str, bcal_uint *val)
+{
+	char *pch;
+
+	*val = strtouquad((char *)str, &pch);
+	return *pch ? BCAL_EMALFORMED : BCAL_OK;
+}
+
+int bcal_scan_size(const char *text, size_t len, size_t *pos, int final, bcal_size *m)
+{
+	const char *end = text + len, *p = text + *pos, *q, *u, *seen;
+	maxuint_t bytes;
+	bool frac;
+	int unit;
+	char c;
+
+	while ((p = next_digit(p, end)) < end) {
+		seen = p;
+
+		/* Digits inside a word, e.g. "x86" or "v1.2", aren't sizes */
+		if (p > text && size_word(p - 1, end, &seen)) {
+			while (p < end && size_word(p, end, &seen))
+				++p;
+			continue;
+		}
+
+		q = p;
+		if (*q == '0' && LOWER(size_char(q + 1, end, &seen)) == 'x' &&
+		    size_xdigit(size_char(q + 2, end, &seen)))
+			for (q += 2; size_xdigit(size_char(q, end, &seen)); ++q)
+				;
+		else {
+			while (size_digit(size_char(q, end, &seen)))
+				++q;
+			/* Thousands separated by commas, "1,500" */
+			if (q - p <= 3)
+				while (size_char(q, end, &seen) == ',' && size_digit(size_char(q + 1, end, &seen)) &&
+				       size_digit(size_char(q + 2, end, &seen)) && size_digit(size_char(q + 3, end, &seen)) &&
+				       !size_digit(size_char(q + 4, end, &seen)))
+					q += 4;
+			if (size_char(q, end, &seen) == '.' && size_digit(size_char(q + 1, end, &seen)))
+				for (++q; size_digit(size_char(q, end, &seen)); ++q)
+					;
+		}
+
+		/* The unit follows directly or after blanks, and ends the word */
+		for (u = q; u - p < SIZE_TOKEN_MAX; ++u) {
+			c = size_char(u, end, &seen);
+			if (c != ' ' && c != '\t')
+				break;
+		}
+		if (u > q && !size_alpha(size_char(u, end, &seen)))
+			u = q;
+		for (q = u; size_alpha(size_char(q, end, &seen)) && q - u <= UNIT_NAME_MAX; ++q)
+			;
+
+		unit = (q == u || size_word(q, end, &seen)) ? -1 : unit_index(u, (size_t)(q - u));
+
+		/* The rest may come with the next chunk */
+		if (!final && seen >= end && seen - p <= SIZE_TOKEN_MAX)
+			break;
+
+		if (unit == -1) {
+			/* Not a size, resume after the number's word */
+			for (p = u; p < end && size_word(p, end, &seen); ++p)
+				;
+			continue;
+		}
+
+		m->pos = (size_t)(p - text);
+		m->len = (size_t)(q - p);
+		m->unit = unit;
+		*pos = (size_t)(q - text);
+
+		if (!size_bytes(p, q, unit, &bytes, &frac))
+			return BCAL_EOVERFLOW;
+
+		m->bytes = bytes;
+		m->inexact = frac;
+		return 1;
+	}
+
+	*pos = (size_t)((p < end ? p : end) - text);
+	return 0;
+}
+
+int bcal_unit_lookup(const char *name)
+{
+	return lookup_unit(name);
+}
+
+const bcal_unit_info *bcal_unit(int unit)
+{
+	return (unit >= 0 && unit < BCAL_UNITS) ? &units[unit] : NULL;
+}
+
+long double bcal_unit_value(const bcal_result *res, int unit)
+{
+	const bcal_unit_info *to = &units[unit], *from;
+
+	if (res->single && res->inexact) {
+		if (unit == res->in_unit)
+			return res->in_val;
+
+		from = &units[res->in_unit];
+		return res->in_val * from->num / from->den * to->den / to->num;
+	}
+
+	return (maxfloat_t)res->value / to->num * to->den;
+}
+
+int bcal_has_units(const char *expr)
+{
+	return has_units(expr);
+}
+
+char *bcal_utoa(bcal_uint n, char *buf)
+{
+	return getstr_u128(n, buf);
+}
+
+char *bcal_wide_str(const bcal_wide *n, int base, char buf[BCAL_WIDE_BUF_LEN])
+{
+	char *loc = buf + BCAL_WIDE_BUF_LEN - 1;
+	uint shift = (base == 2) ? 1 : 4;
+	wide_t q;
+
+	*loc = '\0';
+
+	if (base == 10) {
+		if (n->len > 1) {
+			/* 19 digits per division, as in getstr_u128() */
+			q = *n;
+			while (q.len > 1)
+				loc = getstr_u64(w_divmod_u64(&q, &q, POW10_19), loc, 19);
+			n = &q;
+		}
+
+		return getstr_u64(n->len ? n->limb[0] : 0, loc, 1);
+	}
+
+	if (base != 2 && base != 16)
+		return NULL;
+
+	if (!n->len)
+		*--loc = '0';
+
+	/* Limbs below the top one are zero padded */
+	for (uint i = 0; i < n->len; ++i) {
+		uint64_t v = n->limb[i];
+		uint k = 0;
+
+		do {
+			*--loc = "0123456789abcdef"[v & ((uint64_t)base - 1)];
+			v >>= shift;
+			++k;
+		} while (v || (i + 1 < n->len && k < 64 / shift));
+	}
+
+	return loc;
+}
+
+/* Index of the highest bit set in n, which isn't 0 */
+static uint top_bit(maxuint_t n)
+{
+	uint64_t high = (uint64_t)(n >> 32 >> 32);
+
+	return high ? 127 - (uint)__builtin_clzll(high) : 63 - (uint)__builtin_clzll((uint64_t)n);
+}
+
+/* Bucket of a size, its top STATS_PRECISION + 1 bits */
+static uint stats_bucket(maxuint_t n)
+{
+	uint shift = n >> (STATS_PRECISION + 1) ? top_bit(n) - STATS_PRECISION : 0;
+
+	return (shift << STATS_PRECISION) + (uint)(n >> shift);
+}
+
+/* Smallest size in a bucket */
+static maxuint_t stats_value(uint i)
+{
+	uint shift = (i >> STATS_PRECISION) < 2 ? 0 : (i >> STATS_PRECISION) - 1;
+
+	return (maxuint_t)(i - (shift << STATS_PRECISION)) << shift;
+}
+
+bcal_stats *bcal_stats_new(void)
+{
+	bcal_stats *st = (bcal_stats *)calloc(1, sizeof(bcal_stats));
+
+	if (st)
+		st->sum.min = ~(maxuint_t)0;
+
+	return st;
+}
+
+void bcal_stats_free(bcal_stats *st)
+{
+	free(st);
+}
+
+int bcal_stats_add(bcal_stats *st, bcal_uint bytes)
+{
+	maxuint_t sum;
+
+	if (__builtin_add_overflow(st->sum.sum, bytes, &sum))
+		return BCAL_EOVERFLOW;
+
+	st->sum.sum = sum;
+	++st->sum.count;
+	if (bytes < st->sum.min)
+		st->sum.min = bytes;
+	if (bytes > st->sum.max)
+		st->sum.max = bytes;
+	++st->bucket[stats_bucket(bytes)];
+	return BCAL_OK;
+}
+
+int bcal_stats_merge(bcal_stats *st, const bcal_stats *from)
+{
+	maxuint_t sum;
+
+	if (__builtin_add_overflow(st->sum.sum, from->sum.sum, &sum))
+		return BCAL_EOVERFLOW;
+
+	st->sum.sum = sum;
+	st->sum.count += from->sum.count;
+	if (from->sum.min < st->sum.min)
+		st->sum.min = from->sum.min;
+	if (from->sum.max > st->sum.max)
+		st->sum.max = from->sum.max;
+	for (size_t i = 0; i < STATS_BUCKETS; ++i)
+		st->bucket[i] += from->bucket[i];
+
+	return BCAL_OK;
+}
+
+const bcal_summary *bcal_stats_summary(const bcal_stats *st)
+{
+	return &st->sum;
+}
+
+bcal_uint bcal_stats_quantile(const bcal_stats *st, double q)
+{
+	unsigned long long rank, seen = 0;
+	size_t i;
+
+	if (!st->sum.count)
+		return 0;
+
+	/* Out of range and NaN q are clamped, they can't be converted to a rank */
+	if (!(q > 0))
+		return st->sum.min;
+	if (q >= 1)
+		return st->sum.max;
+
+	/* The nearest rank, the first and last are known exactly */
+	rank = (unsigned long long)ceil(q * (double)st->sum.count);
+	if (rank <= 1)
+		return st->sum.min;
+	if (rank >= st->sum.count)
+		return st->sum.max;
+
+	for (i = 0; i < STATS_BUCKETS - 1; ++i) {
+		seen += st->bucket[i];
+		if (seen >= rank)
+			break;
+	}
+
+	return stats_value((uint)i) < st->sum.min ? st->sum.min : stats_value((uint)i);
+}
@@ -19,6 +19,7 @@ NOTES:
 
 import pytest
 import subprocess
+import ctypes
 import os
 
 # Disable color codes in bit position output
@@ -123,6 +124,31 @@ test = [
     ('./bcal', '-m', "0x0D00000B B + 0x124kib"),                       # 91
     ('./bcal', '-m', "0x0D00000B B + 0x124mib"),                       # 92
     ('./bcal', '-m', "0x0D00000B B + 0x124gib"),                       # 93
+    ('./bcal', '-m', '3', 'PiB'),                                      # 94
+    ('./bcal', '-m', "2 eb + 1 eib"),                                  # 95
+    ('./bcal', '-m', '4096', 'bit'),                                   # 96
+    ('./bcal', '-m', '123456789012345678901', 'kib'),                  # 97
+    ('./bcal', '-m', "1,024 kib * 2"),                                 # 98
+    ('./bcal', '-b', "1,000 + sum(1,500, 2)"),                         # 99
+    ('./bcal', '-m', '0.001 tb'),                                      # 100
+    ('./bcal', '-m', "12345678901.123456789 eib"),                     # 101
+    ('./bcal', '-m', '-w', '256', "1 eib * 1000000000000000000000"),    # 102
+    ('./bcal', '-m', '-w', '256', "(1 << 255) * 2"),                    # 103
+    ('./bcal', '-m', '-w', '64', "~0 + 2"),                             # 104
+    ('./bcal', '-m', '-w', '100', "1"),                                 # 105
+    ('./bcal', '-b', "98765432109876543210987654321.123456789 * 12345678901234567890123456789.5"),  # 106
+    ('./bcal', '-b', "123456789012345678901.25 - 123456789012345678900"),  # 107
+    ('./bcal', '-b', "1/3 * 3 + 0x10"),                                # 108
+    ('./bcal', '-P', '30', '-b', "1/7"),                               # 109
+    ('./bcal', '-P', '0', '-b', "2.5 * 3"),                            # 110
+    ('./bcal', '-b', "max(1,500, 2) - min(3 1.5 2)"),                   # 111
+    ('./bcal', '-b', "avg(1 2 4) + log2(1024)"),                        # 112
+    ('./bcal', '-b', "ceil(-2.5) + floor(2.5) + ceil(0.1)"),            # 113
+    ('./bcal', '-b', "align(4097, 4096) + align(2.00000000000000000001, 1)"),  # 114
+    ('./bcal', '-m', "1e40 b"),                                         # 115
+    ('./bcal', '-m', "99999999999999999999999999999999999999 kib"),     # 116
+    ('./bcal', '-m', "2 * 400000000000000000000 eib"),                  # 117
+    ('./bcal', '-m', "1e40", "kib"),                                    # 118
 ]
 
 res = [
@@ -224,6 +250,31 @@ res = [
     b'218402827 B\n',                                # 91
     b'524288011 B\n',                                # 92
     b'313750716427 B\n',                             # 93
+    b'3377699720527872 B\n',                         # 94
+    b'3152921504606846976 B\n',                      # 95
+    b'512 B\n',                                      # 96
+    b'126419751948641975194624 B\n',                 # 97
+    b'2097152 B\n',                                  # 98
+    b'1503\n',                                       # 99
+    b'1000000000 B\n',                               # 100
+    b'14233598694076260998666663411 B\n',            # 101
+    b'1152921504606846976000000000000000000000 B\n',  # 102
+    b'ERROR: overflow in *\n',                       # 103
+    b'ERROR: overflow in +\n',                       # 104
+    b'ERROR: bits must be a multiple of 64 up to 1024\n',  # 105
+    b'1219326311370217952261850327387136107252484377504123609218.3119189155\n',  # 106
+    b'1.25\n',                                       # 107
+    b'17\n',                                         # 108
+    b'0.142857142857142857142857142857\n',           # 109
+    b'8\n',                                          # 110
+    b'498.5\n',                                      # 111
+    b'12.3333333333\n',                              # 112
+    b'1\n',                                          # 113
+    b'8195\n',                                       # 114
+    b'ERROR: 1e40 exceeds 128 bits\n',               # 115
+    b'ERROR: 99999999999999999999999999999999999999 exceeds 128 bits\n',  # 116
+    b'ERROR: 400000000000000000000eib exceeds 128 bits\n',  # 117
+    b'ERROR: 1e40 exceeds 128 bits\n',               # 118
 ]
 
 
@@ -254,6 +305,14 @@ def test_repl_show_last_result():
     assert b'r = 10000000 B' in output
 
 
+def test_repl_long_exact_result():
+    """Test 'r' keeps all digits of a long exact product"""
+    proc = subprocess.Popen('./bcal', stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, env=os.environ)
+    output, _ = proc.communicate(input=b'b\n123456789012345678901234567890.5 * 98765432109876543210987654321\nr * 2\nq\n')
+    assert b'12193263113702179522618503273411675049278684651716620179850.5\n' in output
+    assert b'24386526227404359045237006546823350098557369303433240359701\n' in output
+
+
 def test_repl_toggle_expression_mode():
     """Test 'b' command to toggle general-purpose mode"""
     proc = subprocess.Popen('./bcal', stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, env=os.environ)
@@ -848,3 +907,554 @@ def test_repl_expr_mode_arithmetic_then_convert():
     # 300 = 0x12c = 0b100101100
     assert b'(h) 0x12c' in output
     # Bit positions for 300
+
+
+def test_repl_wide_result():
+    """Test results wider than 128 bits are kept for r and c"""
+    proc = subprocess.Popen(['./bcal', '-w', '256'], stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, env=os.environ)
+    output, _ = proc.communicate(input=b'0xff << 200 | 1\nr\nc r + 1\nq\n')
+    assert b'(h) 0xff00000000000000000000000000000000000000000000000001\n' in output
+    assert b'r = 409769201286042520263200333546996463643161763414612173001850881\n' in output
+    assert b'(d) 409769201286042520263200333546996463643161763414612173001850882\n' in output
+
+
+def test_repl_variables():
+    """Test variables assigned in storage mode are read in both modes"""
+    proc = subprocess.Popen('./bcal', stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, env=os.environ)
+    output, _ = proc.communicate(input=b'stripe = 4kib * 12\nchunks = 1 gib / stripe\nchunks * stripe + 512 b\nb\nchunks / 3\nkib = 2\nq\n')
+    assert b'49152 B\n' in output
+    assert b'21845\n' in output
+    assert b'1073725952 B\n' in output
+    assert b'7281.6666666667\n' in output
+    assert b'ERROR: invalid variable name kib\n' in output
+
+
+# Batch mode tests
+def test_batch_stdin():
+    """Test batch evaluation of expressions from stdin"""
+    proc = subprocess.Popen(['./bcal', '-B', '-'], stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.PIPE, env=os.environ)
+    output, _ = proc.communicate(input=b'10 mb\n2 kib * 3\n1miB / 4 kib\n5 & 3\n')
+    assert output == b'10000000 B\n6144 B\n256\n1\n'
+    assert proc.returncode == 0
+
+
+def test_batch_errors_keep_line_order():
+    """Test a failed line yields an empty output line without aborting"""
+    proc = subprocess.Popen(['./bcal', '-B', '-'], stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.PIPE, env=os.environ)
+    output, errors = proc.communicate(input=b'10 lb\n\n2mb-3mib\n1 kib\n')
+    assert output == b'\n\n\n1024 B\n'
+    assert errors == b'ERROR: unknown unit\nERROR: negative result\n'
+    assert proc.returncode != 0
+
+
+def test_batch_file_maths_mode():
+    """Test batch evaluation of a file in general-purpose mode"""
+    with open('test_batch.txt', 'w') as f:
+        f.write('3.5 * 2\n(50,000 - 2,000) * 1,500\nr / 2\n')
+    try:
+        out = subprocess.check_output(['./bcal', '-b', '-B', 'test_batch.txt'], stderr=subprocess.STDOUT, env=os.environ)
+    finally:
+        os.remove('test_batch.txt')
+    assert out == b'7\n72000000\n36000000\n'
+
+
+def test_batch_parallel_ordered_output():
+    """Test parallel batch evaluation keeps the input order"""
+    lines = [b'10 mb', b'2 kib * 3', b'10 lb', b'', b'1 << 8 >> 4', b'r + 1'] * 200
+    data = b'\n'.join(lines) + b'\n'
+    proc = subprocess.Popen(['./bcal', '-B', '-', '-j', '4'], stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.PIPE, env=os.environ)
+    output, _ = proc.communicate(input=data)
+    assert output == b'10000000 B\n6144 B\n\n\n16\n\n' * 200
+
+
+def test_batch_parallel_rounds():
+    """Test parallel batch evaluation over several rounds of workers keeps the input order"""
+    data = b''.join(b'%d kib\n' % i for i in range(100000))
+    proc = subprocess.Popen(['./bcal', '-B', '-', '-j', '3'], stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.PIPE, env=os.environ)
+    output, _ = proc.communicate(input=data)
+    assert output == b''.join(b'%d B\n' % (i * 1024) for i in range(100000))
+
+
+def test_batch_threads_limit():
+    """Test -j takes a decimal number of threads up to a few per CPU"""
+    for j in ('100000000', '4294967295', 'abc', '', '-1', '4x'):
+        out = subprocess.run(['./bcal', '-B', '-', '-j', j], input=b'1 kib\n', capture_output=True, env=os.environ)
+        assert out.returncode != 0 and out.stdout == b''
+        assert out.stderr.startswith(b'ERROR: threads must be 0 to ')
+    for j in ('0', '64'):
+        out = subprocess.run(['./bcal', '-B', '-', '-j', j], input=b'1 kib\n2 kib\n', capture_output=True, env=os.environ)
+        assert out.stdout == b'1024 B\n2048 B\n'
+
+
+def test_batch_cached_results_match():
+    """Test cached results and warnings match evaluated ones"""
+    lines = [b'10 mb', b'2 kib * 3', b'2kib*3', b'1 kib / 3', b'10 lb', b'r + 1 b', b'0xd b * 2', b'0xdb * 2'] * 50
+    data = b'\n'.join(lines) + b'\n'
+    outputs = []
+    for args in ([], ['-C', '4'], ['-C', '2']):
+        proc = subprocess.Popen(['./bcal', '-B', '-'] + args, stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.PIPE, env=os.environ)
+        outputs.append(proc.communicate(input=data))
+    assert outputs[0][0].startswith(b'10000000 B\n6144 B\n6144 B\n341 B\n\n342 B\n26 B\n438\n')
+    assert outputs[0][1].count(b'WARNING: result truncated\n') == 50
+    assert outputs[1] == outputs[0] and outputs[2] == outputs[0]
+
+
+def test_batch_program_per_line():
+    """Test a compiled expression is evaluated with r set from each line"""
+    proc = subprocess.Popen(['./bcal', '-e', 'r * 512 + 4 kib', '-j', '2'], stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.PIPE, env=os.environ)
+    output, _ = proc.communicate(input=b'1\n2 kib\n0x10\n')
+    assert output == b'4608 B\n1052672 B\n12288 B\n'
+
+
+def test_batch_maths_program_per_line():
+    """Test a compiled maths expression is evaluated with r set from each line"""
+    proc = subprocess.Popen(['./bcal', '-b', '-e', 'r * 1.5 + 1 / 3', '-j', '2'], stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.PIPE, env=os.environ)
+    output, errors = proc.communicate(input=b'1\n2.5 * 2\n1 / 0\n0x10\n')
+    assert output == b'1.8333333333\n7.8333333333\n\n24.3333333333\n'
+    assert errors == b'ERROR: division by zero\n'
+
+
+def test_extract_sizes_from_text(tmp_path):
+    """Test sizes with units are extracted from a mapped file and a stream alike"""
+    text = (b'Filesystem 1,500 mb used, 12.5GiB free\n/dev/sda1 0x400 kb x86_64 v1.2.3 kb\n'
+            b'4096bit (3 mb) 10 lb 99999999999999999999999999999999999999999 eib\n')
+    path = tmp_path / 'df.txt'
+    path.write_bytes(text)
+    out = subprocess.run(['./bcal', '-x', str(path)], capture_output=True, env=os.environ)
+    assert out.stdout == b'1500000000\n13421772800\n1024000\n512\n3000000\n'
+    assert out.stderr == b'WARNING: 99999999999999999999999999999999999999999 eib: too big, skipped\n'
+    out = subprocess.run(['./bcal', '-x', '-', '-t'], input=text, capture_output=True, env=os.environ)
+    assert out.stdout == b'1500000000\n14921772800\n14922796800\n14922797312\n14925797312\n'
+
+
+def test_serve_line_too_long(tmp_path):
+    """Test a line over the limit gets an error reply and the next line is answered"""
+    import socket
+    import time
+    path = str(tmp_path / 'bcal.sock')
+    proc = subprocess.Popen(['./bcal', '--serve', path], stdout=subprocess.PIPE, stderr=subprocess.PIPE, env=os.environ)
+    try:
+        for _ in range(100):
+            if os.path.exists(path):
+                break
+            time.sleep(0.01)
+        sock = socket.socket(socket.AF_UNIX)
+        sock.connect(path)
+        sock.sendall(b'1 kib + ' * 20000 + b'1 kib\n2 kib\n')
+        sock.shutdown(socket.SHUT_WR)
+        replies = b''
+        while True:
+            data = sock.recv(4096)
+            if not data:
+                break
+            replies += data
+        assert replies == b'ERROR: line too long\n2048 B\n'
+        sock.close()
+    finally:
+        proc.terminate()
+        proc.communicate()
+    assert proc.returncode == 0
+
+
+def test_aggregate_sizes(tmp_path):
+    """Test statistics of a size per line from a mapped file and a stream alike"""
+    text = b'1 kib\n2 kib\n\n 0x400 kb \n10 lb\n1.5 b\n3 kib\r\n1,000 b\n1025 kib\n'
+    path = tmp_path / 'sizes.txt'
+    path.write_bytes(text)
+    expected = (b'count 6\nsum 2080744 B\nmin 1000 B\nmax 1049600 B\nmean 346790 B\n'
+                b'p50 2048 B\np90 1049600 B\np99 1049600 B\np99.9 1049600 B\n')
+    for args, data in ((['-a', str(path)], None), (['-a', '-'], text)):
+        out = subprocess.run(['./bcal', '-m'] + args, input=data, capture_output=True, env=os.environ)
+        assert out.stdout == expected
+        assert out.stderr == b'ERROR: line 5: unknown unit\nERROR: line 6: malformed input\n'
+        assert out.returncode != 0
+
+
+def test_aggregate_parallel_matches(tmp_path):
+    """Test statistics and errors of a file split across threads match one thread"""
+    lines = [b'%d kib' % i for i in range(1, 50000)] + [b'10 lb', b'', b'0x%x mb' % (1 << 70), b'1.5 b']
+    path = tmp_path / 'sizes.txt'
+    path.write_bytes(b'\n'.join(lines * 8))
+    outs = [subprocess.run(['./bcal', '-m', '-a', str(path), '-j', j], capture_output=True, env=os.environ)
+            for j in ('1', '3', '8')]
+    total = 8 * (1024 * 49999 * 50000 // 2 + (1 << 70) * 1000000)
+    assert outs[0].stdout.startswith(b'count 400000\nsum %d B\nmin 1024 B\n' % total)
+    assert outs[0].stderr.count(b'\n') == 16 and outs[0].stderr.startswith(b'ERROR: line 50000: unknown unit\n')
+    assert outs[1].stdout == outs[2].stdout == outs[0].stdout
+    assert outs[1].stderr == outs[2].stderr == outs[0].stderr
+
+
+def test_serve_pipelined_per_connection(tmp_path):
+    """Test pipelined requests over the socket, with r kept per connection"""
+    import socket
+    import time
+    path = str(tmp_path / 'bcal.sock')
+    proc = subprocess.Popen(['./bcal', '--serve', path], stdout=subprocess.PIPE, stderr=subprocess.PIPE, env=os.environ)
+    try:
+        for _ in range(100):
+            if os.path.exists(path):
+                break
+            time.sleep(0.01)
+        a, b = socket.socket(socket.AF_UNIX), socket.socket(socket.AF_UNIX)
+        a.connect(path)
+        b.connect(path)
+        a.sendall(b'2 kib * 3\nr + 1 b\n\n10 lb\n(1 << 127) * 2\nx = 4 kib\nx / 2')
+        b.sendall(b'r + 1\n5 kib\n')
+        a.shutdown(socket.SHUT_WR)
+        replies = b''
+        while True:
+            data = a.recv(4096)
+            if not data:
+                break
+            replies += data
+        assert replies == b'6144 B\n6145 B\n\nERROR: unknown unit\nERROR: overflow in *\n4096 B\n2048 B\n'
+        assert b.makefile('rb').readline() == b'ERROR: no result stored\n'
+        a.close()
+        b.close()
+    finally:
+        proc.terminate()
+        _, errors = proc.communicate()
+    assert proc.returncode == 0 and errors == b''
+    assert not os.path.exists(path)
+
+
+# Library tests
+class BcalResult(ctypes.Structure):
+    _fields_ = [('value', ctypes.c_ubyte * 16), ('unit', ctypes.c_int), ('single', ctypes.c_int),
+                ('in_unit', ctypes.c_int), ('in_val', ctypes.c_longdouble), ('inexact', ctypes.c_int)]
+
+
+class BcalSize(ctypes.Structure):
+    _fields_ = [('bytes', ctypes.c_ubyte * 16), ('pos', ctypes.c_size_t), ('len', ctypes.c_size_t),
+                ('unit', ctypes.c_int), ('inexact', ctypes.c_int)]
+
+
+class BcalSummary(ctypes.Structure):
+    _fields_ = [('sum', ctypes.c_ubyte * 16), ('min', ctypes.c_ubyte * 16), ('max', ctypes.c_ubyte * 16),
+                ('count', ctypes.c_ulonglong)]
+
+
+class BcalUint(ctypes.Structure):
+    """A bcal_uint passed by value, which goes like a pair of 64-bit integers"""
+    _fields_ = [('low', ctypes.c_ulonglong), ('high', ctypes.c_ulonglong)]
+
+    def value(self):
+        return self.low | self.high << 64
+
+
+class BcalWide(ctypes.Structure):
+    _fields_ = [('len', ctypes.c_uint), ('limb', ctypes.c_ulonglong * 16)]
+
+    def value(self):
+        return sum(self.limb[i] << (64 * i) for i in range(self.len))
+
+
+def load_libbcal():
+    lib = ctypes.CDLL(os.path.abspath('libbcal.so'))
+    lib.bcal_ctx_new.restype = ctypes.c_void_p
+    lib.bcal_ctx_free.argtypes = [ctypes.c_void_p]
+    lib.bcal_eval.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.POINTER(BcalResult)]
+    lib.bcal_errmsg.argtypes = [ctypes.c_void_p]
+    lib.bcal_errmsg.restype = ctypes.c_char_p
+    lib.bcal_strerror.restype = ctypes.c_char_p
+    lib.bcal_parse_size.argtypes = [ctypes.c_char_p, ctypes.c_ubyte * 16]
+    lib.bcal_set_width.argtypes = [ctypes.c_void_p, ctypes.c_uint]
+    lib.bcal_eval_wide.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.POINTER(BcalWide), ctypes.POINTER(ctypes.c_int)]
+    lib.bcal_wide_str.argtypes = [ctypes.POINTER(BcalWide), ctypes.c_int, ctypes.c_char_p]
+    lib.bcal_wide_str.restype = ctypes.c_char_p
+    lib.bcal_eval_maths.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_size_t]
+    lib.bcal_set_scale.argtypes = [ctypes.c_void_p, ctypes.c_uint]
+    lib.bcal_last.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_int)]
+    lib.bcal_last.restype = ctypes.c_char_p
+    lib.bcal_compile_maths.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.POINTER(ctypes.c_void_p)]
+    lib.bcal_run_maths.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t]
+    lib.bcal_maths_free.argtypes = [ctypes.c_void_p]
+    lib.bcal_compile.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.POINTER(ctypes.c_void_p)]
+    lib.bcal_run.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.POINTER(BcalResult)]
+    lib.bcal_prog_free.argtypes = [ctypes.c_void_p]
+    lib.bcal_clear_vars.argtypes = [ctypes.c_void_p]
+    lib.bcal_set_cache.argtypes = [ctypes.c_void_p, ctypes.c_uint]
+    lib.bcal_cache_stats.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_size_t), ctypes.POINTER(ctypes.c_size_t)]
+    lib.bcal_stats_new.restype = ctypes.c_void_p
+    lib.bcal_stats_free.argtypes = [ctypes.c_void_p]
+    lib.bcal_stats_add.argtypes = [ctypes.c_void_p, BcalUint]
+    lib.bcal_stats_merge.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+    lib.bcal_stats_summary.argtypes = [ctypes.c_void_p]
+    lib.bcal_stats_summary.restype = ctypes.POINTER(BcalSummary)
+    lib.bcal_stats_quantile.argtypes = [ctypes.c_void_p, ctypes.c_double]
+    lib.bcal_stats_quantile.restype = BcalUint
+    lib.bcal_scan_size.argtypes = [ctypes.c_char_p, ctypes.c_size_t, ctypes.POINTER(ctypes.c_size_t), ctypes.c_int, ctypes.POINTER(BcalSize)]
+    return lib
+
+
+def test_lib_parse_size():
+    """Test parsing sizes with the library"""
+    lib = load_libbcal()
+    val = (ctypes.c_ubyte * 16)()
+    assert lib.bcal_parse_size(b'10 MiB', val) == 0
+    assert int.from_bytes(bytes(val), 'little') == 10485760
+    assert lib.bcal_parse_size(b'0x18mb', val) == 0
+    assert int.from_bytes(bytes(val), 'little') == 24000000
+    assert lib.bcal_parse_size(b'10 lb', val) == -2
+    assert lib.bcal_parse_size(b'1.5 b', val) == -3
+
+
+def test_lib_convert_fraction_exactly():
+    """Test fractions of a unit convert to exact bytes and flag a dropped fraction"""
+    lib = load_libbcal()
+    ctx = lib.bcal_ctx_new()
+    res = BcalResult()
+    try:
+        assert lib.bcal_eval(ctx, b'0.1 tib', ctypes.byref(res)) == 0
+        assert int.from_bytes(bytes(res.value), 'little') == 109951162777 and res.inexact == 1
+        assert lib.bcal_eval(ctx, b'1.5 kib + 0.25 mb', ctypes.byref(res)) == 0
+        assert int.from_bytes(bytes(res.value), 'little') == 251536 and res.inexact == 0
+        assert lib.bcal_eval(ctx, b'3 bit', ctypes.byref(res)) == 0
+        assert int.from_bytes(bytes(res.value), 'little') == 0 and res.inexact == 1
+    finally:
+        lib.bcal_ctx_free(ctx)
+
+
+def test_lib_eval_keeps_state_per_context():
+    """Test expressions and the last result with library contexts"""
+    lib = load_libbcal()
+    a, b = lib.bcal_ctx_new(), lib.bcal_ctx_new()
+    res = BcalResult()
+    try:
+        assert lib.bcal_eval(a, b'2 kib * 3', ctypes.byref(res)) == 0
+        assert int.from_bytes(bytes(res.value), 'little') == 6144 and res.unit == 1
+        assert lib.bcal_eval(a, b'r / 2 kib', ctypes.byref(res)) == 0
+        assert int.from_bytes(bytes(res.value), 'little') == 3 and res.unit == 0
+        assert lib.bcal_eval(b, b'r + 1', ctypes.byref(res)) == -1
+        assert lib.bcal_errmsg(b) == b'no result stored'
+        assert lib.bcal_errmsg(a) == b''
+    finally:
+        lib.bcal_ctx_free(a)
+        lib.bcal_ctx_free(b)
+
+
+def test_lib_eval_overflow():
+    """Test results that don't fit fail as overflow instead of wrapping"""
+    lib = load_libbcal()
+    ctx = lib.bcal_ctx_new()
+    res, wide, unit = BcalResult(), BcalWide(), ctypes.c_int()
+    try:
+        assert lib.bcal_eval(ctx, b'1 kib * (1 << 117) + 1 kib', ctypes.byref(res)) == 0
+        assert int.from_bytes(bytes(res.value), 'little') == (1 << 127) + 1024
+        for expr, op in ((b'r * 2', b'*'), (b'r + r', b'+'), (b'(1 << 100) << 28', b'<<'), (b'1 << 128', b'<<')):
+            assert lib.bcal_eval(ctx, expr, ctypes.byref(res)) == -5
+            assert lib.bcal_errmsg(ctx) == b'overflow in ' + op
+        assert lib.bcal_strerror(-5) == b'overflow'
+        assert lib.bcal_eval(ctx, b'(r - 1 kib) >> 200', ctypes.byref(res)) == 0
+        assert int.from_bytes(bytes(res.value), 'little') == 0
+        assert lib.bcal_eval(ctx, b'(1 << 100) / 3', ctypes.byref(res)) == 0
+        assert int.from_bytes(bytes(res.value), 'little') == (1 << 100) // 3
+        for expr in (b'1e40 b', b'99999999999999999999999999999999999999 kib', b'1 + 400000000000000000000 eib',
+                     b'0x1000000000000000000000000000000 kib'):
+            assert lib.bcal_eval(ctx, expr, ctypes.byref(res)) == -5
+            assert lib.bcal_errmsg(ctx).endswith(b' exceeds 128 bits')
+        assert lib.bcal_eval(ctx, b'0.000000000000000000000000000000000000001 b', ctypes.byref(res)) == 0
+        assert lib.bcal_parse_size(b'1e40 kib', (ctypes.c_ubyte * 16)()) == -5
+        assert lib.bcal_set_width(ctx, 64) == 0
+        assert lib.bcal_eval_wide(ctx, b'(1 << 63) * 2', ctypes.byref(wide), ctypes.byref(unit)) == -5
+        assert lib.bcal_eval_wide(ctx, b'3 << 63', ctypes.byref(wide), ctypes.byref(unit)) == -5
+        assert lib.bcal_eval_wide(ctx, b'0 << 1000', ctypes.byref(wide), ctypes.byref(unit)) == 0
+        assert lib.bcal_eval_wide(ctx, b'~0 - 1 + 1', ctypes.byref(wide), ctypes.byref(unit)) == 0
+        assert wide.value() == (1 << 64) - 1
+    finally:
+        lib.bcal_ctx_free(ctx)
+
+
+def test_lib_eval_wide():
+    """Test wide integers against python integers at different widths"""
+    lib = load_libbcal()
+    ctx = lib.bcal_ctx_new()
+    res, unit = BcalWide(), ctypes.c_int()
+    buf = ctypes.create_string_buffer(1025)
+    try:
+        assert lib.bcal_eval_wide(ctx, b'(1 << 200) / 3 + 0.5 kib', ctypes.byref(res), ctypes.byref(unit)) == -1
+        assert lib.bcal_errmsg(ctx) == b'unit mismatch in +'
+        assert lib.bcal_eval_wide(ctx, b'(1 << 200) / 3 kib', ctypes.byref(res), ctypes.byref(unit)) == -1
+        assert lib.bcal_eval_wide(ctx, b'(1 << 200) kib / 3', ctypes.byref(res), ctypes.byref(unit)) == -1
+        assert lib.bcal_eval_wide(ctx, b'0x3 << 200 kib', ctypes.byref(res), ctypes.byref(unit)) == -1
+        assert lib.bcal_eval_wide(ctx, b'2.5 kib * (1 << 190)', ctypes.byref(res), ctypes.byref(unit)) == 0
+        assert res.value() == 2560 << 190 and unit.value == 1
+        assert lib.bcal_eval_wide(ctx, b'r / 7 % 1000003', ctypes.byref(res), ctypes.byref(unit)) == -1
+        assert lib.bcal_eval_wide(ctx, b'r / 7 b', ctypes.byref(res), ctypes.byref(unit)) == 0
+        assert res.value() == (2560 << 190) // 7 and unit.value == 0
+        assert lib.bcal_wide_str(ctypes.byref(res), 16, buf) == b'%x' % ((2560 << 190) // 7)
+        assert lib.bcal_set_width(ctx, 1024) == 0
+        assert lib.bcal_eval_wide(ctx, b'~0 - (1 << 1000)', ctypes.byref(res), ctypes.byref(unit)) == 0
+        assert res.value() == (1 << 1024) - 1 - (1 << 1000)
+        assert lib.bcal_wide_str(ctypes.byref(res), 10, buf) == b'%d' % res.value()
+        assert lib.bcal_set_width(ctx, 96) == -1
+    finally:
+        lib.bcal_ctx_free(ctx)
+
+
+def test_lib_eval_maths_exact():
+    """Test exact decimal maths against python decimals at different scales"""
+    lib = load_libbcal()
+    ctx = lib.bcal_ctx_new()
+    buf = ctypes.create_string_buffer(40)
+    try:
+        assert lib.bcal_eval_maths(ctx, b'0.1 + 0.2 - 0.3', buf, 40) == 0
+        assert buf.value == b'0'
+        assert lib.bcal_set_scale(ctx, 50) == 0
+        assert lib.bcal_eval_maths(ctx, b'(2 - 0.000001) / 3 * 1,000', buf, 40) == 0
+        assert lib.bcal_last(ctx, None) == b'666.66633333333333333333333333333333333333333333333333'
+        assert lib.bcal_eval_maths(ctx, b'r / 0', buf, 40) == -1
+        assert lib.bcal_errmsg(ctx) == b'division by zero'
+        assert lib.bcal_set_scale(ctx, 1001) == -1
+    finally:
+        lib.bcal_ctx_free(ctx)
+
+
+def test_lib_compiled_maths_reused():
+    """Test a compiled maths expression runs with the r of each context"""
+    lib = load_libbcal()
+    a, b = lib.bcal_ctx_new(), lib.bcal_ctx_new()
+    prog = ctypes.c_void_p()
+    buf = ctypes.create_string_buffer(40)
+    try:
+        assert lib.bcal_compile_maths(a, b'(r + 1) * 2 / 3 + sum(1 2 3)', ctypes.byref(prog)) == 0
+        assert lib.bcal_run_maths(a, prog, buf, 40) == -1
+        assert lib.bcal_errmsg(a) == b'no result stored'
+        for ctx, val, res in ((a, b'2', b'8'), (b, b'0.5', b'7'), (a, b'r + 0.5', b'12.3333333333')):
+            assert lib.bcal_eval_maths(ctx, val, buf, 40) == 0
+            assert lib.bcal_run_maths(ctx, prog, buf, 40) == 0
+            assert buf.value == res
+        lib.bcal_maths_free(prog)
+        assert lib.bcal_compile_maths(a, b'r / (2 - 2)', ctypes.byref(prog)) == 0
+        assert lib.bcal_run_maths(a, prog, buf, 40) == -1
+        assert lib.bcal_errmsg(a) == b'division by zero'
+        lib.bcal_maths_free(prog)
+        assert lib.bcal_compile_maths(a, b'r + 1 / 0', ctypes.byref(prog)) == -1
+    finally:
+        lib.bcal_maths_free(prog)
+        lib.bcal_ctx_free(a)
+        lib.bcal_ctx_free(b)
+
+
+def test_lib_variables_read_at_run():
+    """Test compiled programs read the variables of the context running them"""
+    lib = load_libbcal()
+    ctx = lib.bcal_ctx_new()
+    prog, mprog = ctypes.c_void_p(), ctypes.c_void_p()
+    res, unit = BcalResult(), ctypes.c_int()
+    wide = BcalWide()
+    buf = ctypes.create_string_buffer(40)
+    try:
+        assert lib.bcal_compile(ctx, b'width * 2 + 1 kib', ctypes.byref(prog)) == 0
+        assert lib.bcal_compile_maths(ctx, b'width / 3 + 1 / 3', ctypes.byref(mprog)) == 0
+        assert lib.bcal_run(ctx, prog, ctypes.byref(res)) == -1
+        assert lib.bcal_errmsg(ctx) == b'unknown variable width'
+        for expr, val, mval in ((b'width = 4 kib', 9216, b'1365.6666666667'), (b' width=0x10 ', 1056, b'5.6666666667')):
+            assert lib.bcal_eval(ctx, expr, ctypes.byref(res)) == 0
+            assert lib.bcal_run(ctx, prog, ctypes.byref(res)) == 0
+            assert int.from_bytes(bytes(res.value), 'little') == val and res.unit == 1
+            assert lib.bcal_run_maths(ctx, mprog, buf, 40) == 0
+            assert buf.value == mval
+        assert lib.bcal_eval_maths(ctx, b'frac_1 = width / 3', buf, 40) == 0
+        assert lib.bcal_eval_maths(ctx, b'frac_1 + 1', buf, 40) == 0 and buf.value == b'6.3333333333'
+        assert lib.bcal_eval_wide(ctx, b'big = (1 << 200) * width', ctypes.byref(wide), ctypes.byref(unit)) == 0
+        assert lib.bcal_eval_wide(ctx, b'big / (1 << 200)', ctypes.byref(wide), ctypes.byref(unit)) == 0
+        assert wide.value() == 16 and unit.value == 1
+        assert lib.bcal_eval(ctx, b'sum = 1', ctypes.byref(res)) == -1
+        assert lib.bcal_errmsg(ctx) == b'invalid variable name sum'
+        lib.bcal_clear_vars(ctx)
+        assert lib.bcal_eval(ctx, b'width', ctypes.byref(res)) == -1
+    finally:
+        lib.bcal_prog_free(prog)
+        lib.bcal_maths_free(mprog)
+        lib.bcal_ctx_free(ctx)
+
+
+def test_lib_cache_least_recently_used():
+    """Test the result cache evicts the least recently used and skips r and variables"""
+    lib = load_libbcal()
+    ctx = lib.bcal_ctx_new()
+    res = BcalResult()
+    hits, misses = ctypes.c_size_t(), ctypes.c_size_t()
+    last = ctypes.c_int()
+    try:
+        assert lib.bcal_set_cache(ctx, 2) == 0
+        for expr in (b'1 kib', b'2 kib + 1 b', b'1,024 b', b'3 kib', b'2 kib+1b', b'r + 1 b', b'x = 5 b', b'x * 2'):
+            assert lib.bcal_eval(ctx, expr, ctypes.byref(res)) == 0
+        lib.bcal_cache_stats(ctx, ctypes.byref(hits), ctypes.byref(misses))
+        assert (hits.value, misses.value) == (0, 5)
+        assert lib.bcal_eval(ctx, b' 3kib ', ctypes.byref(res)) == 0
+        assert res.single == 1 and res.in_unit == 1 and int.from_bytes(bytes(res.value), 'little') == 3072
+        assert lib.bcal_last(ctx, ctypes.byref(last)) == b'3072' and last.value == 1
+        assert lib.bcal_eval(ctx, b'2kib + 1b', ctypes.byref(res)) == 0
+        lib.bcal_cache_stats(ctx, ctypes.byref(hits), ctypes.byref(misses))
+        assert (hits.value, misses.value) == (2, 5)
+        assert lib.bcal_set_cache(ctx, (1 << 20) + 1) == -1
+    finally:
+        lib.bcal_ctx_free(ctx)
+
+
+def test_lib_scan_size_in_chunks():
+    """Test scanning text in chunks finds the sizes scanning it whole does"""
+    lib = load_libbcal()
+    text = b'du: 1,2,3 kb 12,345,678.5kb 0x1fGB\tcopied 512 MiB/s, 7.25 tib. x3kb v1.5kb 10 B'
+
+    def scan(chunk):
+        found, buf, pos, m = [], b'', ctypes.c_size_t(0), BcalSize()
+        for i in range(0, len(text), chunk):
+            buf += text[i:i + chunk]
+            while True:
+                ret = lib.bcal_scan_size(buf, len(buf), ctypes.byref(pos), i + chunk >= len(text), ctypes.byref(m))
+                if not ret:
+                    break
+                found.append((ret, int.from_bytes(bytes(m.bytes), 'little'), buf[m.pos:m.pos + m.len]))
+            keep = pos.value - 1 if pos.value else 0
+            buf, pos.value = buf[keep:], pos.value - keep
+        return found
+
+    whole = scan(len(text))
+    assert whole == [(1, 3000, b'3 kb'), (1, 12345678500, b'12,345,678.5kb'), (1, 31000000000, b'0x1fGB'),
+                     (1, 536870912, b'512 MiB'), (1, 7971459301376, b'7.25 tib'), (1, 10, b'10 B')]
+    for chunk in range(1, 20):
+        assert scan(chunk) == whole
+
+
+def test_lib_stats_merge_and_quantiles():
+    """Test aggregates merge exactly and quantiles keep the top 8 bits of a size"""
+    import math
+    import random
+    lib = load_libbcal()
+    whole, parts = lib.bcal_stats_new(), [lib.bcal_stats_new() for _ in range(3)]
+    rand = random.Random(7)
+    sizes = [rand.randrange(1 << rand.randrange(1, 100)) for _ in range(5000)]
+
+    def u128(n):
+        return BcalUint(n & ((1 << 64) - 1), n >> 64)
+
+    def quantile(st, q):
+        return lib.bcal_stats_quantile(st, q).value()
+
+    try:
+        assert quantile(whole, 0.5) == 0 and lib.bcal_stats_summary(whole).contents.count == 0
+        for i, n in enumerate(sizes):
+            assert lib.bcal_stats_add(whole, u128(n)) == 0
+            assert lib.bcal_stats_add(parts[i % 3], u128(n)) == 0
+        for part in parts[1:]:
+            assert lib.bcal_stats_merge(parts[0], part) == 0
+        a, b = lib.bcal_stats_summary(whole).contents, lib.bcal_stats_summary(parts[0]).contents
+        assert bytes(a) == bytes(b) and a.count == 5000
+        assert int.from_bytes(bytes(a.sum), 'little') == sum(sizes)
+        ranked = sorted(sizes)
+        assert quantile(whole, 0) == ranked[0] and quantile(whole, 1) == ranked[-1]
+        assert quantile(whole, -1) == ranked[0] and quantile(whole, 2) == ranked[-1]
+        assert quantile(whole, float('nan')) == ranked[0]
+        for q in (0.01, 0.25, 0.5, 0.9, 0.999):
+            exact = ranked[math.ceil(q * 5000) - 1]
+            assert quantile(whole, q) == quantile(parts[0], q)
+            assert exact - exact // 128 <= quantile(whole, q) <= exact
+        assert lib.bcal_stats_add(whole, u128((1 << 128) - 1)) == -5
+        assert int.from_bytes(bytes(lib.bcal_stats_summary(whole).contents.sum), 'little') == sum(sizes)
+    finally:
+        lib.bcal_stats_free(whole)
+        for part in parts:
+            lib.bcal_stats_free(part)